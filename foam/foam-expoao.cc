@@ -40,8 +40,10 @@ using namespace std;
 
 // Global device list for easier access
 AndorCam *ixoncam;
+Camera::cursor_t *ixoncam_wfs; //!< Frame cursor of the loop on ixoncam
 Shwfs *ixonwfs;
 AlpaoDM *alpao_dm97;
+Shwfs::rechandle_t dm97rec;    //!< Reconstructor handle for alpao_dm97, resolved once
 WHT *wht_track;
 
 FOAM_ExpoAO::FOAM_ExpoAO(int argc, char *argv[]): FOAM(argc, argv) {
@@ -49,6 +51,8 @@ FOAM_ExpoAO::FOAM_ExpoAO(int argc, char *argv[]): FOAM(argc, argv) {
 	// Register calibration modes
 	calib_modes["zero"] = calib_mode("zero", "Set current WFS data as reference", "", false);
 	calib_modes["influence"] = calib_mode("influence", "Measure wfs-wfc influence, cutoff at singv", "[singv]", false);
+	calib_modes["hadamard"] = calib_mode("hadamard", "Measure wfs-wfc influence with Hadamard patterns on all actuators, cutoff at singv", "[amp] [singv]", false);
+	calib_modes["dither"] = calib_mode("dither", "Recalibrate wfs-wfc influence in closed loop with a dither, or stop", "[amp] [singv] | stop", true);
 	calib_modes["offsetvec"] = calib_mode("offsetvec", "Add offset vector to correction", "[x] [y]", false);
 	calib_modes["svd"] = calib_mode("svd", "Recalculate SVD wfs-wfc influence, cutoff at singv.", "[singv]", true);
 }
@@ -72,12 +76,15 @@ int FOAM_ExpoAO::load_modules() {
 		io.msg(IO_INFO, "Init Andor Ixon Camera...");
 		ixoncam = new AndorCam(io, ptc, "ixoncam", ptc->listenport, ptc->conffile);
 		devices->add((foam::Device *) ixoncam);
+		ixoncam_wfs = ixoncam->add_cursor("wfs");
 		
 		io.msg(IO_INFO, "Andor camera initialized, printing capabilities");
 		ixoncam->print_andor_caps();
 		
 		// Init WFS (using ixoncam)
 		ixonwfs = new Shwfs(io, ptc, "ixonwfs", ptc->listenport, ptc->conffile, *ixoncam);
+		ixonwfs->set_actmap(alpao_dm97->getname(), alpao_dm97->get_actmap());
+		dm97rec = ixonwfs->get_rec_handle(alpao_dm97->getname());
 		devices->add((foam::Device *) ixonwfs);
 		
 	} catch (std::runtime_error &e) {
@@ -113,11 +120,12 @@ int FOAM_ExpoAO::open_loop() {
 	string vec_str;
 	
 	// Get next frame from ixoncam
-	Camera::frame_t *frame = ixoncam->get_next_frame(true);
-	openperf_addlog("cam->get_next_frame");
+	Camera::frame_t *frame = ixoncam->acquire_next_frame(ixoncam_wfs);
+	openperf_addlog("cam->acquire_next_frame");
 	
 	// Analyze frame with shack-hartmann routines
 	Shwfs::wf_info_t *wf_meas = ixonwfs->measure(frame);
+	ixoncam->release_frame(frame);
 	openperf_addlog("wfs->measure");
 	
 	// Print analysis
@@ -126,7 +134,7 @@ int FOAM_ExpoAO::open_loop() {
 		vec_str += format("%.3g ", gsl_vector_float_get(wf_meas->wfamp, i));
 	io.msg(IO_DEB1, "FOAM_ExpoAO::wfs_m: %s", vec_str.c_str());
 	
-	ixonwfs->comp_ctrlcmd(alpao_dm97->getname(), wf_meas->wfamp, alpao_dm97->ctrlparams.err);
+	ixonwfs->comp_ctrlcmd(dm97rec, wf_meas->wfamp, alpao_dm97->ctrlparams.err);
 	openperf_addlog("wfs->comp_ctrlcmd");
 	
 	vec_str = "";
@@ -180,19 +188,29 @@ int FOAM_ExpoAO::closed_loop() {
 	string vec_str;
 
 	// Get next frame from ixoncam
-	Camera::frame_t *frame = ixoncam->get_next_frame(true);
-	closedperf_addlog("cam->get_next_frame()");
-
-	// Analyze frame with shack-hartmann routines
-	Shwfs::wf_info_t *wf_meas = ixonwfs->measure(frame);
-	closedperf_addlog("wfs->measure()");
+	Camera::frame_t *frame = ixoncam->acquire_next_frame(ixoncam_wfs);
+	closedperf_addlog("cam->acquire_next_frame()");
+
+	// Analyze frame with shack-hartmann routines and calculate control 
+	// command for DM (in one pass if recon_fused is set, directly in DM 
+	// actuator space if fold_actmap is set)
+	const bool fold = ixonwfs->have_fold(dm97rec);
+	Shwfs::wf_info_t *wf_meas;
+	if (fold)
+		wf_meas = ixonwfs->measure_ctrlcmd_fold(frame, dm97rec, alpao_dm97->ctrlparams.fold);
+	else
+		wf_meas = ixonwfs->measure_ctrlcmd(frame, dm97rec, alpao_dm97->ctrlparams.err);
+	ixoncam->release_frame(frame);
+	closedperf_addlog("wfs->measure_ctrlcmd()");
 	
-	// Calculate control command for DM
-	ixonwfs->comp_ctrlcmd(alpao_dm97->getname(), wf_meas->wfamp, alpao_dm97->ctrlparams.err);
-	closedperf_addlog("wfc->comp_ctrlcmd()");
+	// Online influence recalibration, if started (see \ref shwfs_dither)
+	ixonwfs->dither_step(alpao_dm97, wf_meas->wfamp, fold);
 	
 	// Apply control to DM to correct shifts
-	alpao_dm97->update_control(alpao_dm97->ctrlparams.err);
+	if (fold)
+		alpao_dm97->update_control_fold(alpao_dm97->ctrlparams.fold);
+	else
+		alpao_dm97->update_control(alpao_dm97->ctrlparams.err);
 	alpao_dm97->actuate();
 	closedperf_addlog("wfc->update_control()");
 	
@@ -212,6 +230,9 @@ int FOAM_ExpoAO::closed_loop() {
 int FOAM_ExpoAO::closed_finish() {
 	io.msg(IO_DEB2, "FOAM_ExpoAO::closed_finish()");
 	
+	// Remove the dither, if any
+	ixonwfs->dither_finish(alpao_dm97);
+	
 	ixoncam->set_mode(Camera::WAITING);
 
 	return 0;
@@ -270,6 +291,46 @@ int FOAM_ExpoAO::calib(const string &calib_mode, const string &calib_opts) {
 															 ixonwfs->get_svd_modeuse(alpao_dm97->getname())
 															 ));
 	} 
+	else if (calib_mode == "hadamard") {		// Calibrate influence function, all actuators at once
+		// calib hadamard [actuation amplitude] [singval cutoff], as 'influence'
+		double act_amp = popdouble(this_opts);
+		if (act_amp == 0.0) act_amp = 0.08;
+		double sval_cutoff = popdouble(this_opts);
+		if (sval_cutoff == 0.0) sval_cutoff = 0.7;
+		io.msg(IO_INFO, "FOAM_ExpoAO::calib() hadamard calibration, amp=%g, sval=%g", act_amp, sval_cutoff);
+		
+		calret = ixonwfs->calib_hadamard(alpao_dm97, ixoncam, act_amp, sval_cutoff);
+		
+		if (calret)
+			return -1;
+		
+		protocol->broadcast(format("ok calib svd singvals :%s", 
+															 ixonwfs->get_singval_str(alpao_dm97->getname()).c_str() ));
+		protocol->broadcast(format("ok calib svd condition :%g", ixonwfs->get_svd_cond(alpao_dm97->getname())));
+		protocol->broadcast(format("ok calib svd usage :%g %d", 
+															 ixonwfs->get_svd_singuse(alpao_dm97->getname()),
+															 ixonwfs->get_svd_modeuse(alpao_dm97->getname())
+															 ));
+	} 
+	else if (calib_mode == "dither") {			// Recalibrate influence function in closed loop
+		// calib dither [dither amplitude] [singval cutoff] -- start, runs in
+		// closed loop and publishes a new reconstructor when converged
+		// calib dither stop -- abort
+		if (this_opts.find("stop") != string::npos) {
+			ixonwfs->dither_stop();
+			return 0;
+		}
+		double act_amp = popdouble(this_opts);
+		if (act_amp == 0.0) act_amp = 0.01;
+		double sval_cutoff = popdouble(this_opts);
+		if (sval_cutoff == 0.0) sval_cutoff = 0.7;
+		io.msg(IO_INFO, "FOAM_ExpoAO::calib() dither calibration, amp=%g, sval=%g", act_amp, sval_cutoff);
+		
+		if (ixonwfs->dither_start(alpao_dm97, act_amp, sval_cutoff))
+			return -1;
+		if (ptc->mode != AO_MODE_CLOSED)
+			io.msg(IO_INFO, "FOAM_ExpoAO::calib() dither starts when the loop is closed");
+	}
 	else if (calib_mode == "offsetvec") {	// Add offset vector to correction 
 		double xoff = popdouble(this_opts);
 		double yoff = popdouble(this_opts);
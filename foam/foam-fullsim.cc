@@ -41,7 +41,9 @@ using namespace std;
 SimulWfc *simwfc;
 SimulWfc *simwfcerr;
 SimulCam *simcam;
+Camera::cursor_t *simcam_wfs;  //!< Frame cursor of the loop on simcam
 Shwfs *simwfs;
+Shwfs::rechandle_t simrec;     //!< Reconstructor handle for simwfc, resolved once
 Telescope *simtel;
 
 FOAM_FullSim::FOAM_FullSim(int argc, char *argv[]): FOAM(argc, argv) {
@@ -50,6 +52,8 @@ FOAM_FullSim::FOAM_FullSim(int argc, char *argv[]): FOAM(argc, argv) {
 	// Register calibration modes
 	calib_modes["zero"] = calib_mode("zero", "Set current WFS data as reference", "", false);
 	calib_modes["influence"] = calib_mode("influence", "Measure wfs-wfc influence, cutoff at singv", "[singv]", false);
+	calib_modes["hadamard"] = calib_mode("hadamard", "Measure wfs-wfc influence with Hadamard patterns on all actuators, cutoff at singv", "[amp] [singv]", false);
+	calib_modes["dither"] = calib_mode("dither", "Recalibrate wfs-wfc influence in closed loop with a dither, or stop", "[amp] [singv] | stop", true);
 	calib_modes["offsetvec"] = calib_mode("offsetvec", "Add offset vector to correction", "[x] [y]", false);
 	calib_modes["svd"] = calib_mode("svd", "Recalculate SVD wfs-wfc influence, cutoff at singv.", "[singv]", true);
 }
@@ -69,10 +73,13 @@ int FOAM_FullSim::load_modules() {
 	// Init camera simulation (using simwfcerr and simwfc)
 	simcam = new SimulCam(io, ptc, "simcam", ptc->listenport, ptc->conffile, *simwfc, *simwfcerr);
 	devices->add((foam::Device *) simcam);
+	simcam_wfs = simcam->add_cursor("wfs");
 	
 	// Init WFS simulation (using camera)
 	simwfs = new Shwfs(io, ptc, "simshwfs", ptc->listenport, ptc->conffile, *simcam);
 	devices->add((foam::Device *) simwfs);
+	simwfs->set_actmap(simwfc->getname(), simwfc->get_actmap());
+	simrec = simwfs->get_rec_handle(simwfc->getname());
 
 	// Init Telescope simulation
 	simtel = new Telescope(io, ptc, "simtel", "simtel_t", ptc->listenport, ptc->conffile);
@@ -104,11 +111,12 @@ int FOAM_FullSim::open_loop() {
 	
 	// Get next frame, simulcam takes care of all simulation
 	//!< @bug This call blocks and if the camera is stopped before it returns, it will hang
-	Camera::frame_t *frame = simcam->get_next_frame(true);
-	openperf_addlog("cam->get_next_frame");
+	Camera::frame_t *frame = simcam->acquire_next_frame(simcam_wfs);
+	openperf_addlog("cam->acquire_next_frame");
 	
 	// Propagate simulated frame through system (WFS, algorithms, WFC)
 	Shwfs::wf_info_t *wf_meas = simwfs->measure(frame);
+	simcam->release_frame(frame);
 	openperf_addlog("wfs->measure");
 	
 	vec_str = "";
@@ -116,7 +124,7 @@ int FOAM_FullSim::open_loop() {
 		vec_str += format("%.3g ", gsl_vector_float_get(wf_meas->wfamp, i));
 	io.msg(IO_XNFO, "FOAM_FullSim::wfs_m: %s", vec_str.c_str());
 
-	simwfs->comp_ctrlcmd(simwfc->getname(), wf_meas->wfamp, simwfc->ctrlparams.err);
+	simwfs->comp_ctrlcmd(simrec, wf_meas->wfamp, simwfc->ctrlparams.err);
 	closedperf_addlog("wfs->comp_ctrlcmd");
 
 	vec_str = "";
@@ -171,21 +179,35 @@ int FOAM_FullSim::closed_loop() {
 	string vec_str;
 	
 	// Get new frame from SimulCamera
-	Camera::frame_t *frame = simcam->get_next_frame(true);
-	closedperf_addlog("cam->get_next_frame");
-
-	// Measure wavefront error with SHWFS
-	Shwfs::wf_info_t *wf_meas = simwfs->measure(frame);
-	closedperf_addlog("wfs->measure");
+	Camera::frame_t *frame = simcam->acquire_next_frame(simcam_wfs);
+	closedperf_addlog("cam->acquire_next_frame");
+
+	// Measure wavefront error with SHWFS and reconstruct (in one pass if 
+	// recon_fused is set, directly in WFC actuator space if fold_actmap is set)
+	const bool fold = simwfs->have_fold(simrec);
+	Shwfs::wf_info_t *wf_meas;
+	if (fold)
+		wf_meas = simwfs->measure_ctrlcmd_fold(frame, simrec, simwfc->ctrlparams.fold);
+	else
+		wf_meas = simwfs->measure_ctrlcmd(frame, simrec, simwfc->ctrlparams.err);
+	simcam->release_frame(frame);
+	if (!wf_meas) {
+		io.msg(IO_WARN, "FOAM_FullSim:: measure_ctrlcmd() error!");
+		return -1;
+	}
+	closedperf_addlog("wfs->measure_ctrlcmd");
+	
+	// Online influence recalibration, if started (see \ref shwfs_dither)
+	simwfs->dither_step(simwfc, wf_meas->wfamp, fold);
+	
+	// The folded update stores the modal commands in ctrlparams.err
+	if (fold)
+		simwfc->update_control_fold(simwfc->ctrlparams.fold);
 	
 	vec_str = "";
 	for (size_t i=0; i<wf_meas->wfamp->size; i++)
 		vec_str += format("%.3g ", gsl_vector_float_get(wf_meas->wfamp, i));
 	io.msg(IO_INFO, "FOAM_FullSim::wfs_m: %s", vec_str.c_str());
-	
-	if (simwfs->comp_ctrlcmd(simwfc->getname(), wf_meas->wfamp, simwfc->ctrlparams.err))
-		io.msg(IO_WARN, "FOAM_FullSim:: comp_ctrlcmd() error!");
-	closedperf_addlog("wfs->comp_ctrlcmd");
 
 	vec_str = "";
 	for (size_t i=0; i<simwfc->ctrlparams.err->size; i++)
@@ -201,7 +223,8 @@ int FOAM_FullSim::closed_loop() {
 		vec_str += format("%.3g ", gsl_vector_float_get(wf_meas->wf_full, i));
 	io.msg(IO_INFO, "FOAM_FullSim::wfs_r: %s", vec_str.c_str());
 	
-	simwfc->update_control(simwfc->ctrlparams.err);
+	if (!fold)
+		simwfc->update_control(simwfc->ctrlparams.err);
 	simwfc->actuate(true);
 	closedperf_addlog("wfc->update_control");
 	
@@ -218,6 +241,9 @@ int FOAM_FullSim::closed_loop() {
 int FOAM_FullSim::closed_finish() {
 	io.msg(IO_DEB2, "FOAM_FullSim::closed_finish()");
 	
+	// Remove the dither, if any
+	simwfs->dither_finish(simwfc);
+	
 	simcam->set_mode(Camera::WAITING);
 
 	return 0;
@@ -272,6 +298,54 @@ int FOAM_FullSim::calib(const string &calib_mode, const string &calib_opts) {
 															 simwfs->get_svd_modeuse(simwfc->getname())
 															 ));
 	} 
+	else if (calib_mode == "hadamard") {		// Calibrate influence function, all actuators at once
+		// calib hadamard [actuation amplitude] [singval cutoff], as 'influence'
+		double act_amp = popdouble(ptc->calib_opt);
+		if (act_amp == 0.0) act_amp = 1.0;
+		double sval_cutoff = popdouble(ptc->calib_opt);
+		if (sval_cutoff == 0.0) sval_cutoff = 0.7;
+		io.msg(IO_INFO, "FOAM_FullSim::calib() hadamard calibration, amp=%g, sval=%g", act_amp, sval_cutoff);
+
+		// Disable seeing during calibration
+		double old_seeingfac = simcam->get_seeingfac(); simcam->set_seeingfac(0.0);
+		bool old_do_wfcerr = simcam->do_simwfcerr; simcam->do_simwfcerr = false;
+		
+		calret = simwfs->calib_hadamard(simwfc, simcam, act_amp, sval_cutoff);
+		
+		// Reset seeing settings
+		simcam->set_seeingfac(old_seeingfac);
+		simcam->do_simwfcerr = old_do_wfcerr;
+		
+		if (calret)
+			return -1;
+		
+		protocol->broadcast(format("ok calib svd singvals :%s", 
+															 simwfs->get_singval_str(simwfc->getname()).c_str() ));
+		protocol->broadcast(format("ok calib svd condition :%g", simwfs->get_svd_cond(simwfc->getname())));
+		protocol->broadcast(format("ok calib svd usage :%g %d", 
+															 simwfs->get_svd_singuse(simwfc->getname()),
+															 simwfs->get_svd_modeuse(simwfc->getname())
+															 ));
+	} 
+	else if (calib_mode == "dither") {			// Recalibrate influence function in closed loop
+		// calib dither [dither amplitude] [singval cutoff] -- start, runs in
+		// closed loop and publishes a new reconstructor when converged
+		// calib dither stop -- abort
+		if (ptc->calib_opt.find("stop") != string::npos) {
+			simwfs->dither_stop();
+			return 0;
+		}
+		double act_amp = popdouble(ptc->calib_opt);
+		if (act_amp == 0.0) act_amp = 0.1;
+		double sval_cutoff = popdouble(ptc->calib_opt);
+		if (sval_cutoff == 0.0) sval_cutoff = 0.7;
+		io.msg(IO_INFO, "FOAM_FullSim::calib() dither calibration, amp=%g, sval=%g", act_amp, sval_cutoff);
+		
+		if (simwfs->dither_start(simwfc, act_amp, sval_cutoff))
+			return -1;
+		if (ptc->mode != AO_MODE_CLOSED)
+			io.msg(IO_INFO, "FOAM_FullSim::calib() dither starts when the loop is closed");
+	}
 	else if (ptc->calib == "zero") {	// Calibrate reference/'flat' wavefront
 		io.msg(IO_INFO, "FOAM_FullSim::calib() Zero calibration");
 		// Disable seeing & wfc during calibration
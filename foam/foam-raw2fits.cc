@@ -0,0 +1,159 @@
+/*
+ foam-raw2fits.cc -- Convert raw frame recordings to FITS
+
+ This file is part of FOAM.
+
+ FOAM is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ FOAM is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FOAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*!
+ @file foam-raw2fits.cc
+ @brief Convert a raw recording made with 'store raw' (see rawrec.h) to FITS
+
+ Usage: foam-raw2fits <base>.idx [out.fits]
+
+ Writes the frames as a 3-D cube (width x height x frames) with the header
+ cards of the recording, followed by a binary table 'FRAMES' with the id
+ (FRAMEID) and timestamp (TIMESTAMP, seconds since 1970) of every frame,
+ the same layout as Camera writes itself. The output defaults to <base>.fits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fitsio.h>
+
+#include "autoconfig.h"
+#include "rawrec.h"
+
+using namespace std;
+
+static int usage(const char *prog) {
+	fprintf(stderr, "Usage: %s <recording.idx> [output.fits]\n", prog);
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2 || argc > 3)
+		return usage(argv[0]);
+
+	// <base>.idx -> <base>.raw and <base>.fits
+	const string idxname = argv[1];
+	if (idxname.size() < 4 || idxname.compare(idxname.size() - 4, 4, ".idx"))
+		return usage(argv[0]);
+	const string base = idxname.substr(0, idxname.size() - 4);
+	const string rawname = base + ".raw";
+	const string outname = argc > 2 ? argv[2] : base + ".fits";
+
+	FILE *idx = fopen(idxname.c_str(), "rb");
+	if (!idx) {
+		perror(idxname.c_str());
+		return 1;
+	}
+	rawrec_hdr_t hdr;
+	if (fread(&hdr, sizeof(hdr), 1, idx) != 1 || memcmp(hdr.magic, RAWREC_MAGIC, sizeof(hdr.magic)) ||
+			hdr.version != RAWREC_VERSION) {
+		fprintf(stderr, "%s: not a raw recording index\n", idxname.c_str());
+		fclose(idx);
+		return 1;
+	}
+	hdr.devname[sizeof(hdr.devname) - 1] = 0;
+
+	// The index is complete even if the recording was not closed
+	vector<LONGLONG> ids;
+	vector<double> times;
+	rawrec_idx_t rec;
+	while (fread(&rec, sizeof(rec), 1, idx) == 1) {
+		ids.push_back(rec.id);
+		times.push_back(rec.tv_sec + rec.tv_usec * 1E-6);
+	}
+	fclose(idx);
+	if (hdr.nframes && hdr.nframes != ids.size())
+		fprintf(stderr, "%s: header says %llu frames, index has %zu\n", idxname.c_str(),
+						(unsigned long long) hdr.nframes, ids.size());
+
+	int ftype, dtype;
+	if (hdr.depth == 8) {
+		ftype = BYTE_IMG; dtype = TBYTE;
+	} else if (hdr.depth == 16) {
+		ftype = USHORT_IMG; dtype = TUSHORT;
+	} else if (hdr.depth == 32) {
+		ftype = ULONG_IMG; dtype = TUINT;
+	} else {
+		fprintf(stderr, "%s: unsupported depth %u\n", idxname.c_str(), hdr.depth);
+		return 1;
+	}
+	const long npixels = (long) hdr.width * hdr.height;
+	if (hdr.framesize != (uint64_t) npixels * hdr.depth / 8) {
+		fprintf(stderr, "%s: frame size %llu does not match %ux%ux%u\n", idxname.c_str(),
+						(unsigned long long) hdr.framesize, hdr.width, hdr.height, hdr.depth);
+		return 1;
+	}
+
+	FILE *raw = fopen(rawname.c_str(), "rb");
+	if (!raw) {
+		perror(rawname.c_str());
+		return 1;
+	}
+
+	int status = 0;
+	fitsfile *fptr;
+	// '!' overwrites an existing file
+	fits_create_file(&fptr, ("!" + outname).c_str(), &status);
+	long naxes[3] = {(long) hdr.width, (long) hdr.height, (long) ids.size()};
+	fits_create_img(fptr, ftype, 3, naxes, &status);
+	fits_write_date(fptr, &status);
+	fits_update_key(fptr, TSTRING, "ORIGIN", (void *) (PACKAGE_NAME " -- " PACKAGE_VERSION), NULL, &status);
+	fits_update_key(fptr, TSTRING, "DEVNAME", hdr.devname, "FOAM device name", &status);
+	fits_update_key(fptr, TDOUBLE, "EXPTIME", &hdr.exposure, "[s] Exposure time", &status);
+	fits_update_key(fptr, TDOUBLE, "INTERVAL", &hdr.interval, "[s] Frame cadence", &status);
+	fits_update_key(fptr, TDOUBLE, "GAIN", &hdr.gain, NULL, &status);
+	fits_update_key(fptr, TDOUBLE, "OFFSET", &hdr.offset, NULL, &status);
+
+	// Copy frame by frame, the recording may not fit in memory
+	vector<unsigned char> frame(hdr.framesize);
+	size_t n;
+	for (n=0; n<ids.size() && !status; n++) {
+		if (fread(&frame[0], hdr.framesize, 1, raw) != 1) {
+			fprintf(stderr, "%s: truncated after %zu frames\n", rawname.c_str(), n);
+			break;
+		}
+		fits_write_img(fptr, dtype, 1 + (LONGLONG) n * npixels, npixels, &frame[0], &status);
+	}
+	fclose(raw);
+
+	// Drop frames missing from a truncated .raw file
+	if (!status && n < ids.size()) {
+		naxes[2] = n;
+		fits_resize_img(fptr, ftype, 3, naxes, &status);
+	}
+
+	char *ttype[] = {(char *) "FRAMEID", (char *) "TIMESTAMP"};
+	char *tform[] = {(char *) "1K", (char *) "1D"};
+	char *tunit[] = {(char *) "", (char *) "s"};
+	fits_create_tbl(fptr, BINARY_TBL, 0, 2, ttype, tform, tunit, "FRAMES", &status);
+	if (n) {
+		fits_write_col(fptr, TLONGLONG, 1, 1, 1, n, &ids[0], &status);
+		fits_write_col(fptr, TDOUBLE, 2, 1, 1, n, &times[0], &status);
+	}
+	fits_close_file(fptr, &status);
+
+	if (status) {
+		fits_report_error(stderr, status);
+		return 1;
+	}
+	printf("%s: %zu frames of %ux%ux%u\n", outname.c_str(), n, hdr.width, hdr.height, hdr.depth);
+	return 0;
+}
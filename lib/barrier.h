@@ -0,0 +1,211 @@
+/*
+ barrier.h -- Spin-then-block thread synchronisation
+
+ This file is part of FOAM.
+
+ FOAM is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ FOAM is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FOAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HAVE_BARRIER_H
+#define HAVE_BARRIER_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "pthread++.h"
+
+/*! @brief Hint to the CPU that we are in a spin-wait loop */
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__sync_synchronize();
+#endif
+}
+
+/*! @brief Monotonic time in nanoseconds, used to bound spin-waits */
+static inline int64_t mono_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*!
+ @brief Futex-style wait/wake on a 32 bit word
+
+ On Linux this maps directly to the futex(2) syscall. Elsewhere a
+ mutex/cond pair is used, which gives the same semantics at a higher cost.
+ */
+class Futex {
+#ifndef __linux__
+	pthread::mutex mutex;
+	pthread::cond cond;
+#endif
+public:
+	/*! @brief Sleep while *addr == val (may return spuriously) */
+	void wait(volatile int *addr, const int val) {
+#ifdef __linux__
+		syscall(SYS_futex, (int *) addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+		pthread::mutexholder h(&mutex);
+		if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val)
+			cond.wait(mutex);
+#endif
+	}
+	/*! @brief Wake all threads sleeping on addr */
+	void wake(volatile int *addr) {
+#ifdef __linux__
+		syscall(SYS_futex, (int *) addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+		(void) addr;
+		pthread::mutexholder h(&mutex);
+		cond.broadcast();
+#endif
+	}
+};
+
+/*!
+ @brief Sense-reversing barrier which spins before parking on a futex
+
+ Each participating thread keeps its own sense flag (initialized to 0) and
+ passes it to wait(). The last thread to arrive resets the counter and flips
+ the global sense, releasing all others. Waiting threads first spin for at
+ most spin_ns nanoseconds (cheap when the barrier opens quickly, as in a
+ high-rate control loop), then sleep on a futex. The futex is only woken if
+ there are sleeping threads, such that the fast path never enters the kernel.
+ */
+class SpinBarrier {
+	const int n;												//!< Number of participating threads
+	volatile int count;									//!< Number of threads still to arrive
+	volatile int sense;									//!< Global sense, flipped on release (futex word)
+	volatile int nsleep;								//!< Number of threads parked on the futex
+	volatile int64_t spin_ns;						//!< Spin this long before parking
+	Futex futex;
+
+public:
+	SpinBarrier(const int n, const int64_t spin_ns=50000):
+	n(n), count(n), sense(0), nsleep(0), spin_ns(spin_ns) { }
+
+	void set_spin(const int64_t ns) { spin_ns = ns; }
+	int64_t get_spin() const { return spin_ns; }
+	int get_n() const { return n; }
+
+	/*! @brief Wait until all n threads have called wait()
+
+	 @param [in,out] local_sense Per-thread sense flag, flipped on each call
+	 @return true for exactly one thread (the last to arrive)
+	 */
+	bool wait(int &local_sense) {
+		local_sense = !local_sense;
+
+		if (__atomic_sub_fetch(&count, 1, __ATOMIC_ACQ_REL) == 0) {
+			// Last to arrive: reset and release the others
+			__atomic_store_n(&count, n, __ATOMIC_RELAXED);
+			__atomic_store_n(&sense, local_sense, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&nsleep, __ATOMIC_SEQ_CST) > 0)
+				futex.wake(&sense);
+			return true;
+		}
+
+		// Spin phase, check the clock only every few iterations
+		const int64_t until = mono_ns() + spin_ns;
+		while (true) {
+			for (int i=0; i<64; i++) {
+				if (__atomic_load_n(&sense, __ATOMIC_ACQUIRE) == local_sense)
+					return false;
+				cpu_relax();
+			}
+			if (mono_ns() > until)
+				break;
+		}
+
+		// Park phase
+		__atomic_add_fetch(&nsleep, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&sense, __ATOMIC_SEQ_CST) != local_sense)
+			futex.wait(&sense, !local_sense);
+		__atomic_sub_fetch(&nsleep, 1, __ATOMIC_SEQ_CST);
+		return false;
+	}
+};
+
+/*!
+ @brief Monotonic counter which threads can wait on, spinning before parking on a futex
+ 
+ Used to publish sequence numbers (e.g. 'job N was submitted' or 'job N is 
+ done') from one thread to others. Comparisons are done modulo 2^32, such 
+ that the counter can wrap around safely as long as waiters are less than 
+ 2^31 behind.
+ */
+class SpinCounter {
+	volatile int value;									//!< Counter value (futex word)
+	volatile int nsleep;								//!< Number of threads parked on the futex
+	Futex futex;
+	
+	static bool geq(const int a, const int b) { return (int) ((unsigned int) a - (unsigned int) b) >= 0; }
+
+public:
+	SpinCounter(const int init=0): value(init), nsleep(0) { }
+	
+	int get() const { return __atomic_load_n(&value, __ATOMIC_ACQUIRE); }
+	/*! @brief Is the counter at least target (modulo 2^32)? */
+	bool reached(const int target) const { return geq(get(), target); }
+	
+	/*! @brief Add n to the counter, wake waiting threads (release semantics) */
+	void add(const int n=1) {
+		__atomic_add_fetch(&value, n, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&nsleep, __ATOMIC_SEQ_CST) > 0)
+			futex.wake(&value);
+	}
+	/*! @brief Set the counter, wake waiting threads (release semantics) */
+	void set(const int v) {
+		__atomic_store_n(&value, v, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&nsleep, __ATOMIC_SEQ_CST) > 0)
+			futex.wake(&value);
+	}
+	
+	/*! @brief Wait until the counter is at least target (modulo 2^32)
+	 
+	 @param [in] target Value to wait for
+	 @param [in] spin_ns Spin this long before parking on the futex
+	 */
+	void wait(const int target, const int64_t spin_ns) {
+		if (reached(target))
+			return;
+		
+		const int64_t until = mono_ns() + spin_ns;
+		while (true) {
+			for (int i=0; i<64; i++) {
+				if (reached(target))
+					return;
+				cpu_relax();
+			}
+			if (mono_ns() > until)
+				break;
+		}
+		
+		__atomic_add_fetch(&nsleep, 1, __ATOMIC_SEQ_CST);
+		int v;
+		while (!geq(v = __atomic_load_n(&value, __ATOMIC_SEQ_CST), target))
+			futex.wait(&value, v);
+		__atomic_sub_fetch(&nsleep, 1, __ATOMIC_SEQ_CST);
+	}
+};
+
+#endif // HAVE_BARRIER_H
@@ -0,0 +1,749 @@
+/*
+ mvm.cc -- Multi-threaded matrix-vector multiplication for reconstruction
+
+ This file is part of FOAM.
+
+ FOAM is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ FOAM is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FOAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <string.h>
+#include <pthread.h>
+#include <algorithm>
+#include <cmath>
+#include <new>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+#include "io.h"
+#include "format.h"
+
+#include "mvm.h"
+
+/*
+ * Matrix storage
+ */
+
+static float *mvm_alloc(const size_t n) {
+	void *p = NULL;
+	if (posix_memalign(&p, 64, std::max(n, (size_t) 1) * sizeof(float)))
+		throw std::bad_alloc();
+	memset(p, 0, n * sizeof(float));
+	return (float *) p;
+}
+
+void Mvm::matrix::_alloc(const size_t r, const size_t c, const prec_t p) {
+	rows = r;
+	cols = c;
+	prec = p;
+	prows = (r + NROW - 1) / NROW * NROW;
+	stride = (c + ALIGN - 1) / ALIGN * ALIGN;
+	data = NULL;
+	data16 = NULL;
+	rscale = NULL;
+	if (prec == PREC_F32) {
+		data = mvm_alloc(prows * stride);
+	}
+	else {
+		// Half the floats, rows stay 32-byte aligned
+		data16 = (uint16_t *) mvm_alloc((prows * stride + 1) / 2);
+		rscale = mvm_alloc(prows);
+	}
+}
+
+Mvm::matrix::matrix(const gsl_matrix_float *m, const double scale, const bool trans, const prec_t p) {
+	_alloc(trans ? m->size2 : m->size1, trans ? m->size1 : m->size2, p);
+
+	std::vector<float> tmp(cols);
+	for (size_t i=0; i<rows; i++) {
+		float maxabs = 0;
+		for (size_t j=0; j<cols; j++) {
+			tmp[j] = (float) (scale * (trans ? gsl_matrix_float_get(m, j, i) : gsl_matrix_float_get(m, i, j)));
+			maxabs = std::max(maxabs, fabsf(tmp[j]));
+		}
+
+		switch (prec) {
+			case PREC_F16:
+				// Normalise rows to [-1, 1], away from half precision over- and underflow
+				rscale[i] = maxabs;
+				for (size_t j=0; j<cols && maxabs > 0; j++)
+					data16[i*stride + j] = float2half(tmp[j] / maxabs);
+				break;
+			case PREC_I16:
+				rscale[i] = maxabs / 32767.0f;
+				for (size_t j=0; j<cols && maxabs > 0; j++)
+					data16[i*stride + j] = (uint16_t) (int16_t) lrintf(tmp[j] / rscale[i]);
+				break;
+			case PREC_F32:
+			default:
+				memcpy(data + i*stride, &tmp[0], cols * sizeof(float));
+				break;
+		}
+	}
+}
+
+Mvm::matrix::matrix(const size_t r, const size_t c, const prec_t p) {
+	_alloc(r, c, p);
+}
+
+Mvm::matrix::~matrix() {
+	free(data);
+	free(data16);
+	free(rscale);
+}
+
+Mvm::sparse::sparse(const gsl_matrix_float *m, const double th, const double scale):
+rows(m->size1), cols(m->size2), stride((m->size2 + ALIGN - 1) / ALIGN * ALIGN), nblk(0), thresh(th)
+{
+	const size_t nb = (cols + SBLK - 1) / SBLK;
+	std::vector<char> keep(rows * nb, 0);
+	rowptr = (uint32_t *) mvm_alloc(rows + 1);
+	
+	// Select blocks relative to the maximum of each row, count per row
+	for (size_t i=0; i<rows; i++) {
+		float maxabs = 0;
+		for (size_t j=0; j<cols; j++)
+			maxabs = std::max(maxabs, fabsf(gsl_matrix_float_get(m, i, j)));
+		for (size_t j=0; j<cols && maxabs > 0; j++) {
+			const float a = fabsf(gsl_matrix_float_get(m, i, j));
+			if (a > 0 && a >= thresh * maxabs)
+				keep[i*nb + j/SBLK] = 1;
+		}
+		for (size_t b=0; b<nb; b++)
+			nblk += keep[i*nb + b];
+		rowptr[i+1] = (uint32_t) nblk;
+	}
+	
+	colidx = (uint32_t *) mvm_alloc(nblk);
+	val = mvm_alloc(nblk * SBLK);
+	size_t k=0;
+	for (size_t i=0; i<rows; i++) {
+		for (size_t b=0; b<nb; b++) {
+			if (!keep[i*nb + b])
+				continue;
+			colidx[k] = (uint32_t) (b * SBLK);
+			// Padding beyond cols stays zero
+			for (size_t j=b*SBLK; j<std::min((b+1)*SBLK, cols); j++)
+				val[k*SBLK + j - b*SBLK] = (float) (scale * gsl_matrix_float_get(m, i, j));
+			k++;
+		}
+	}
+}
+
+Mvm::sparse::~sparse() {
+	free(rowptr);
+	free(colidx);
+	free(val);
+}
+
+float Mvm::sparse::get(const size_t i, const size_t j) const {
+	for (uint32_t k=rowptr[i]; k<rowptr[i+1]; k++)
+		if (j >= colidx[k] && j < colidx[k] + SBLK)
+			return val[k*SBLK + j - colidx[k]];
+	return 0;
+}
+
+float Mvm::matrix::get(const size_t i, const size_t j) const {
+	switch (prec) {
+		case PREC_F16: return rscale[i] * half2float(data16[i*stride + j]);
+		case PREC_I16: return rscale[i] * (int16_t) data16[i*stride + j];
+		case PREC_F32:
+		default: return data[i*stride + j];
+	}
+}
+
+const char *Mvm::prec_str(const prec_t p) {
+	switch (p) {
+		case PREC_F32: return "f32";
+		case PREC_F16: return "f16";
+		case PREC_I16: return "i16";
+		default: return "unknown";
+	}
+}
+
+float Mvm::half2float(const uint16_t h) {
+	const uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+	const uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff;
+	uint32_t bits;
+	if (e == 0) {
+		// Zero or subnormal: m * 2^-24
+		const float v = ldexpf((float) m, -24);
+		return sign ? -v : v;
+	}
+	else if (e == 31)
+		bits = sign | 0x7f800000 | (m << 13);
+	else
+		bits = sign | ((e + 112) << 23) | (m << 13);
+
+	float f;
+	memcpy(&f, &bits, sizeof f);
+	return f;
+}
+
+uint16_t Mvm::float2half(const float f) {
+	uint32_t x;
+	memcpy(&x, &f, sizeof x);
+	const uint16_t sign = (x >> 16) & 0x8000;
+	x &= 0x7fffffff;
+
+	if (x >= 0x7f800000)								// Inf or NaN
+		return sign | 0x7c00 | (x > 0x7f800000 ? 0x200 : 0);
+	if (x >= 0x477ff000)								// Rounds to >= 65520: overflow
+		return sign | 0x7c00;
+	if (x < 0x33000000)									// Below half the smallest subnormal
+		return sign;
+
+	const int e = (int) (x >> 23) - 127;
+	if (e < -14) {
+		// Subnormal: round m * 2^(e+1) to nearest even
+		const uint32_t m = (x & 0x7fffff) | 0x800000;
+		const int sh = -(e + 1);
+		uint32_t r = m >> sh;
+		const uint32_t rem = m & ((1u << sh) - 1), half = 1u << (sh - 1);
+		if (rem > half || (rem == half && (r & 1)))
+			r++;
+		return sign | (uint16_t) r;
+	}
+
+	// Normal: drop 13 mantissa bits, rounding to nearest even (may carry into the exponent)
+	uint32_t h = ((uint32_t) (e + 15) << 10) | ((x & 0x7fffff) >> 13);
+	const uint32_t rem = x & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+		h++;
+	return sign | (uint16_t) h;
+}
+
+/*
+ * Engine
+ */
+
+Mvm::Mvm(Io &io, const int nthr):
+io(io), running(true), nthread(nthr), workid(0), spin_ns(50000),
+cur_A(NULL), cur_S(NULL), xbuf(NULL), ybuf(NULL), xcap(0), ycap(0), simd(SIMD_NONE)
+{
+	io.msg(IO_DEB2, "Mvm::Mvm()");
+
+	if (nthread <= 0) {
+		nthread = 0;
+#ifdef __linux__
+		cpu_set_t set;
+		if (sched_getaffinity(0, sizeof set, &set) == 0)
+			nthread = CPU_COUNT(&set);
+#endif
+		if (nthread <= 0)
+			nthread = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		nthread = std::max(nthread, 1);
+	}
+
+	set_simd(SIMD_AUTO);
+
+	// Start workers, the calling thread is the remaining one
+	workertid.resize(nthread-1);
+	sigc::slot<void> funcslot = sigc::mem_fun(this, &Mvm::_worker_func);
+	for (int w=0; w<nthread-1; w++) {
+		pthread::thread tmp = pthread::thread();
+		tmp.create(funcslot);
+		workers.push_back(tmp);
+	}
+
+	started.wait(nthread-1, spin_ns);
+	io.msg(IO_XNFO, "Mvm::Mvm() using %d threads", nthread);
+}
+
+Mvm::~Mvm() {
+	io.msg(IO_DEB2, "Mvm::~Mvm()");
+
+	__atomic_store_n(&running, false, __ATOMIC_SEQ_CST);
+	submitted.add(1);
+	for (size_t w=0; w<workers.size(); w++)
+		workers[w].join();
+
+	free(xbuf);
+	free(ybuf);
+}
+
+void Mvm::_worker_func() {
+	const int id = _worker_getid();
+	int next = 0;
+	io.msg(IO_XNFO, "Mvm::_worker_func() new worker (id=%d n=%d)", id, nthread-1);
+	workertid[id] = pthread_self();
+	started.add(1);
+
+	while (true) {
+		submitted.wait(next+1, spin_ns);
+		if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+			break;
+
+		// Thread 0 is the caller, worker id does block id+1
+		const int t = id + 1;
+		if (t + 1 < (int) cur_part.size())
+			_block(t);
+
+		finished.add(1);
+		next++;
+	}
+}
+
+bool Mvm::_apply_affinity(const int wid) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (cpus.empty())
+		sched_getaffinity(0, sizeof set, &set);
+	else
+		CPU_SET(cpus[wid % cpus.size()], &set);
+
+	const int rc = pthread_setaffinity_np(workertid[wid], sizeof set, &set);
+	if (rc) {
+		io.msg(IO_WARN, "Mvm::_apply_affinity() could not pin worker %d: %s", wid, strerror(rc));
+		return false;
+	}
+	return true;
+#else
+	if (!cpus.empty())
+		io.msg(IO_WARN, "Mvm::_apply_affinity() CPU pinning not supported on this platform");
+	return cpus.empty();
+#endif
+}
+
+bool Mvm::set_affinity(const std::vector<int> &newcpus) {
+	cpus = newcpus;
+	bool ret = true;
+	for (int w=0; w<nthread-1; w++)
+		ret &= _apply_affinity(w);
+
+	std::string cpustr;
+	for (size_t c=0; c<cpus.size(); c++)
+		cpustr += format("%d ", cpus[c]);
+	io.msg(IO_XNFO, "Mvm::set_affinity() workers pinned to: %s", cpus.empty() ? "(any)" : cpustr.c_str());
+	return ret;
+}
+
+void Mvm::_reserve(const size_t nx, const size_t ny) {
+	if (xcap < nx) {
+		free(xbuf);
+		xbuf = mvm_alloc(xcap = nx);
+	}
+	if (ycap < ny) {
+		free(ybuf);
+		ybuf = mvm_alloc(ycap = ny);
+	}
+}
+
+void Mvm::_block(const int t) {
+	if (cur_S)
+		sp_kernel(*cur_S, xbuf, ybuf, cur_part[t], cur_part[t+1]);
+	else
+		kernel[cur_A->prec](*cur_A, xbuf, ybuf, cur_part[t], cur_part[t+1]);
+}
+
+void Mvm::_run(const int nt) {
+	if (nt > 1) {
+		const int gen = submitted.get() + 1;
+		submitted.add(1);
+		_block(0);
+		finished.wait(gen * (nthread-1), spin_ns);
+	}
+	else {
+		_block(0);
+	}
+}
+
+bool Mvm::apply(const matrix_t &A, const gsl_vector_float *x, gsl_vector_float *y) {
+	if (x->size != A.cols || y->size != A.rows) {
+		io.msg(IO_ERR, "Mvm::apply() size mismatch: (%zu x %zu) . %zu -> %zu", A.rows, A.cols, x->size, y->size);
+		return false;
+	}
+
+	// Padded copy of x, the padding must be zero (the matrix padding is too)
+	_reserve(A.stride, A.prows);
+	for (size_t j=0; j<A.cols; j++)
+		xbuf[j] = gsl_vector_float_get(x, j);
+	memset(xbuf + A.cols, 0, (A.stride - A.cols) * sizeof(float));
+
+	// Split rows over threads in blocks of NROW, small products on this thread only
+	const int nt = (A.prows * A.stride >= (size_t) MINPAR) ? nthread : 1;
+	const size_t ngroup = A.prows / NROW;
+	cur_part.resize(nt+1);
+	for (int t=0; t<=nt; t++)
+		cur_part[t] = ngroup * t / nt * NROW;
+	cur_A = &A;
+	cur_S = NULL;
+	_run(nt);
+
+	for (size_t i=0; i<A.rows; i++)
+		gsl_vector_float_set(y, i, ybuf[i]);
+	return true;
+}
+
+bool Mvm::apply(const sparse_t &A, const gsl_vector_float *x, gsl_vector_float *y) {
+	if (x->size != A.cols || y->size != A.rows) {
+		io.msg(IO_ERR, "Mvm::apply() size mismatch: sparse (%zu x %zu) . %zu -> %zu", A.rows, A.cols, x->size, y->size);
+		return false;
+	}
+
+	_reserve(A.stride, A.rows);
+	for (size_t j=0; j<A.cols; j++)
+		xbuf[j] = gsl_vector_float_get(x, j);
+	memset(xbuf + A.cols, 0, (A.stride - A.cols) * sizeof(float));
+
+	// Split rows such that each thread gets about the same number of blocks
+	const int nt = (A.nblk * SBLK >= (size_t) MINPAR) ? nthread : 1;
+	cur_part.resize(nt+1);
+	for (int t=0; t<=nt; t++)
+		cur_part[t] = std::lower_bound(A.rowptr, A.rowptr + A.rows, (uint32_t) (A.nblk * t / nt)) - A.rowptr;
+	cur_part[nt] = A.rows;
+	cur_A = NULL;
+	cur_S = &A;
+	_run(nt);
+
+	for (size_t i=0; i<A.rows; i++)
+		gsl_vector_float_set(y, i, ybuf[i]);
+	return true;
+}
+
+/*
+ * Kernels
+ *
+ * Each kernel computes NROW (4) dot products at once, over column blocks of
+ * COLBLOCK elements, accumulating the partial sums per block in y. Rows are
+ * padded to ALIGN (16) elements such that the vector loops need no tail.
+ *
+ * The kernels are templates over the storage precision P: elements are 
+ * converted to float when loaded (mvm_ld*()), and for the 16-bit formats the
+ * row scale is applied once per row and block (mvm_rscale()). For PREC_F32 
+ * this compiles to the plain float kernel.
+ */
+
+#define MVM_FILL(ktab, atab, K, A) \
+	(ktab)[Mvm::PREC_F32] = K<Mvm::PREC_F32>; \
+	(ktab)[Mvm::PREC_F16] = K<Mvm::PREC_F16>; \
+	(ktab)[Mvm::PREC_I16] = K<Mvm::PREC_I16>; \
+	(atab)[Mvm::PREC_F32] = A<Mvm::PREC_F32>; \
+	(atab)[Mvm::PREC_F16] = A<Mvm::PREC_F16>; \
+	(atab)[Mvm::PREC_I16] = A<Mvm::PREC_I16>
+
+template <int P> static inline float mvm_rscale(const Mvm::matrix_t &A, const size_t r) {
+	return P == Mvm::PREC_F32 ? 1.0f : A.rscale[r];
+}
+
+template <int P> static inline float mvm_ld(const void *row, const size_t c) {
+	if (P == Mvm::PREC_F32)
+		return ((const float *) row)[c];
+	if (P == Mvm::PREC_F16)
+		return Mvm::half2float(((const uint16_t *) row)[c]);
+	return ((const int16_t *) row)[c];
+}
+
+template <int P> static void mvm_scalar(const Mvm::matrix_t &A, const float *x, float *y, const size_t r0, const size_t r1) {
+	for (size_t r=r0; r<r1; r++)
+		y[r] = 0;
+	
+	for (size_t c0=0; c0<A.stride; c0 += Mvm::COLBLOCK) {
+		const size_t c1 = std::min(c0 + Mvm::COLBLOCK, A.stride);
+		for (size_t r=r0; r<r1; r += Mvm::NROW) {
+			const void *a0 = A.rowp(r), *a1 = A.rowp(r+1), *a2 = A.rowp(r+2), *a3 = A.rowp(r+3);
+			float s0=0, s1=0, s2=0, s3=0;
+			for (size_t c=c0; c<c1; c++) {
+				const float xv = x[c];
+				s0 += mvm_ld<P>(a0, c) * xv;
+				s1 += mvm_ld<P>(a1, c) * xv;
+				s2 += mvm_ld<P>(a2, c) * xv;
+				s3 += mvm_ld<P>(a3, c) * xv;
+			}
+			if (P == Mvm::PREC_F32) {
+				y[r] += s0; y[r+1] += s1; y[r+2] += s2; y[r+3] += s3;
+			}
+			else {
+				y[r] += s0 * mvm_rscale<P>(A, r); y[r+1] += s1 * mvm_rscale<P>(A, r+1);
+				y[r+2] += s2 * mvm_rscale<P>(A, r+2); y[r+3] += s3 * mvm_rscale<P>(A, r+3);
+			}
+		}
+	}
+}
+
+/*
+ * Accumulation kernels
+ *
+ * y += A.row(r0..r1-1)^T x[r0..r1-1], i.e. a slab of rows of a transposed 
+ * matrix, used for partial products (see Mvm::accumulate()). Rows are added 
+ * NROW at a time such that y is loaded and stored once per NROW rows. The 
+ * row scale is folded into x.
+ */
+
+template <int P> static void acc_scalar(const Mvm::matrix_t &A, const float *x, float *y, const size_t r0, const size_t r1) {
+	size_t r=r0;
+	for (; r+Mvm::NROW<=r1; r += Mvm::NROW) {
+		const void *a0 = A.rowp(r), *a1 = A.rowp(r+1), *a2 = A.rowp(r+2), *a3 = A.rowp(r+3);
+		const float x0 = x[r] * mvm_rscale<P>(A, r), x1 = x[r+1] * mvm_rscale<P>(A, r+1);
+		const float x2 = x[r+2] * mvm_rscale<P>(A, r+2), x3 = x[r+3] * mvm_rscale<P>(A, r+3);
+		for (size_t c=0; c<A.stride; c++)
+			y[c] += mvm_ld<P>(a0, c) * x0 + mvm_ld<P>(a1, c) * x1 + mvm_ld<P>(a2, c) * x2 + mvm_ld<P>(a3, c) * x3;
+	}
+	for (; r<r1; r++) {
+		const void *a0 = A.rowp(r);
+		const float x0 = x[r] * mvm_rscale<P>(A, r);
+		for (size_t c=0; c<A.stride; c++)
+			y[c] += mvm_ld<P>(a0, c) * x0;
+	}
+}
+
+/*
+ * Sparse kernels
+ *
+ * One dot product per row over its blocks. Blocks start at a multiple of 
+ * SBLK (8) columns, such that x and the values are loaded aligned.
+ */
+
+static void sp_scalar(const Mvm::sparse_t &A, const float *x, float *y, const size_t r0, const size_t r1) {
+	for (size_t r=r0; r<r1; r++) {
+		float s = 0;
+		for (uint32_t k=A.rowptr[r]; k<A.rowptr[r+1]; k++) {
+			const float *a = A.val + k * Mvm::SBLK, *xb = x + A.colidx[k];
+			for (int c=0; c<Mvm::SBLK; c++)
+				s += a[c] * xb[c];
+		}
+		y[r] = s;
+	}
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_MVM_X86SIMD
+
+__attribute__((target("avx2,fma"))) static inline float hsum_avx2(const __m256 v) {
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma"))) static void sp_avx2(const Mvm::sparse_t &A, const float *x, float *y, const size_t r0, const size_t r1) {
+	for (size_t r=r0; r<r1; r++) {
+		// Two accumulators to hide the FMA latency
+		__m256 s = _mm256_setzero_ps(), t = _mm256_setzero_ps();
+		uint32_t k=A.rowptr[r];
+		for (; k+2<=A.rowptr[r+1]; k += 2) {
+			s = _mm256_fmadd_ps(_mm256_load_ps(A.val + k * Mvm::SBLK), _mm256_load_ps(x + A.colidx[k]), s);
+			t = _mm256_fmadd_ps(_mm256_load_ps(A.val + (k+1) * Mvm::SBLK), _mm256_load_ps(x + A.colidx[k+1]), t);
+		}
+		if (k < A.rowptr[r+1])
+			s = _mm256_fmadd_ps(_mm256_load_ps(A.val + k * Mvm::SBLK), _mm256_load_ps(x + A.colidx[k]), s);
+		y[r] = hsum_avx2(_mm256_add_ps(s, t));
+	}
+}
+
+//! Load 8 elements at row[c] as floats (row 32-byte aligned, c multiple of 8)
+template <int P> __attribute__((target("avx2,fma,f16c"), always_inline)) static inline __m256 mvm_ld_avx2(const void *row, const size_t c) {
+	if (P == Mvm::PREC_F32)
+		return _mm256_load_ps((const float *) row + c);
+	const __m128i h = _mm_load_si128((const __m128i *) ((const uint16_t *) row + c));
+	if (P == Mvm::PREC_F16)
+		return _mm256_cvtph_ps(h);
+	return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(h));
+}
+
+template <int P> __attribute__((target("avx2,fma,f16c"))) static void mvm_avx2(const Mvm::matrix_t &A, const float *x, float *y, const size_t r0, const size_t r1) {
+	for (size_t r=r0; r<r1; r++)
+		y[r] = 0;
+	
+	for (size_t c0=0; c0<A.stride; c0 += Mvm::COLBLOCK) {
+		const size_t c1 = std::min(c0 + Mvm::COLBLOCK, A.stride);
+		for (size_t r=r0; r<r1; r += Mvm::NROW) {
+			const void *a0 = A.rowp(r), *a1 = A.rowp(r+1), *a2 = A.rowp(r+2), *a3 = A.rowp(r+3);
+			// Two accumulators per row to hide the FMA latency
+			__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(), s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+			__m256 t0 = _mm256_setzero_ps(), t1 = _mm256_setzero_ps(), t2 = _mm256_setzero_ps(), t3 = _mm256_setzero_ps();
+			for (size_t c=c0; c<c1; c += 16) {
+				const __m256 xa = _mm256_load_ps(x + c), xb = _mm256_load_ps(x + c + 8);
+				s0 = _mm256_fmadd_ps(mvm_ld_avx2<P>(a0, c), xa, s0);
+				s1 = _mm256_fmadd_ps(mvm_ld_avx2<P>(a1, c), xa, s1);
+				s2 = _mm256_fmadd_ps(mvm_ld_avx2<P>(a2, c), xa, s2);
+				s3 = _mm256_fmadd_ps(mvm_ld_avx2<P>(a3, c), xa, s3);
+				t0 = _mm256_fmadd_ps(mvm_ld_avx2<P>(a0, c + 8), xb, t0);
+				t1 = _mm256_fmadd_ps(mvm_ld_avx2<P>(a1, c + 8), xb, t1);
+				t2 = _mm256_fmadd_ps(mvm_ld_avx2<P>(a2, c + 8), xb, t2);
+				t3 = _mm256_fmadd_ps(mvm_ld_avx2<P>(a3, c + 8), xb, t3);
+			}
+			if (P == Mvm::PREC_F32) {
+				y[r] += hsum_avx2(_mm256_add_ps(s0, t0));
+				y[r+1] += hsum_avx2(_mm256_add_ps(s1, t1));
+				y[r+2] += hsum_avx2(_mm256_add_ps(s2, t2));
+				y[r+3] += hsum_avx2(_mm256_add_ps(s3, t3));
+			}
+			else {
+				y[r] += hsum_avx2(_mm256_add_ps(s0, t0)) * mvm_rscale<P>(A, r);
+				y[r+1] += hsum_avx2(_mm256_add_ps(s1, t1)) * mvm_rscale<P>(A, r+1);
+				y[r+2] += hsum_avx2(_mm256_add_ps(s2, t2)) * mvm_rscale<P>(A, r+2);
+				y[r+3] += hsum_avx2(_mm256_add_ps(s3, t3)) * mvm_rscale<P>(A, r+3);
+			}
+		}
+	}
+}
+
+template <int P> __attribute__((target("avx2,fma,f16c"))) static void acc_avx2(const Mvm::matrix_t &A, const float *x, float *y, const size_t r0, const size_t r1) {
+	size_t r=r0;
+	for (; r+Mvm::NROW<=r1; r += Mvm::NROW) {
+		const void *a0 = A.rowp(r), *a1 = A.rowp(r+1), *a2 = A.rowp(r+2), *a3 = A.rowp(r+3);
+		const __m256 x0 = _mm256_set1_ps(x[r] * mvm_rscale<P>(A, r)), x1 = _mm256_set1_ps(x[r+1] * mvm_rscale<P>(A, r+1));
+		const __m256 x2 = _mm256_set1_ps(x[r+2] * mvm_rscale<P>(A, r+2)), x3 = _mm256_set1_ps(x[r+3] * mvm_rscale<P>(A, r+3));
+		for (size_t c=0; c<A.stride; c += 8) {
+			__m256 s = _mm256_loadu_ps(y + c);
+			s = _mm256_fmadd_ps(mvm_ld_avx2<P>(a0, c), x0, s);
+			s = _mm256_fmadd_ps(mvm_ld_avx2<P>(a1, c), x1, s);
+			s = _mm256_fmadd_ps(mvm_ld_avx2<P>(a2, c), x2, s);
+			s = _mm256_fmadd_ps(mvm_ld_avx2<P>(a3, c), x3, s);
+			_mm256_storeu_ps(y + c, s);
+		}
+	}
+	for (; r<r1; r++) {
+		const void *a0 = A.rowp(r);
+		const __m256 x0 = _mm256_set1_ps(x[r] * mvm_rscale<P>(A, r));
+		for (size_t c=0; c<A.stride; c += 8)
+			_mm256_storeu_ps(y + c, _mm256_fmadd_ps(mvm_ld_avx2<P>(a0, c), x0, _mm256_loadu_ps(y + c)));
+	}
+}
+
+//! Load 16 elements at row[c] as floats (row 32-byte aligned, c multiple of 16)
+template <int P> __attribute__((target("avx512f"), always_inline)) static inline __m512 mvm_ld_avx512(const void *row, const size_t c) {
+	if (P == Mvm::PREC_F32)
+		return _mm512_load_ps((const float *) row + c);
+	const __m256i h = _mm256_load_si256((const __m256i *) ((const uint16_t *) row + c));
+	if (P == Mvm::PREC_F16)
+		return _mm512_cvtph_ps(h);
+	return _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(h));
+}
+
+template <int P> __attribute__((target("avx512f"))) static void mvm_avx512(const Mvm::matrix_t &A, const float *x, float *y, const size_t r0, const size_t r1) {
+	for (size_t r=r0; r<r1; r++)
+		y[r] = 0;
+	
+	for (size_t c0=0; c0<A.stride; c0 += Mvm::COLBLOCK) {
+		const size_t c1 = std::min(c0 + Mvm::COLBLOCK, A.stride);
+		for (size_t r=r0; r<r1; r += Mvm::NROW) {
+			const void *a0 = A.rowp(r), *a1 = A.rowp(r+1), *a2 = A.rowp(r+2), *a3 = A.rowp(r+3);
+			__m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps(), s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+			__m512 t0 = _mm512_setzero_ps(), t1 = _mm512_setzero_ps(), t2 = _mm512_setzero_ps(), t3 = _mm512_setzero_ps();
+			size_t c=c0;
+			for (; c+32<=c1; c += 32) {
+				const __m512 xa = _mm512_load_ps(x + c), xb = _mm512_load_ps(x + c + 16);
+				s0 = _mm512_fmadd_ps(mvm_ld_avx512<P>(a0, c), xa, s0);
+				s1 = _mm512_fmadd_ps(mvm_ld_avx512<P>(a1, c), xa, s1);
+				s2 = _mm512_fmadd_ps(mvm_ld_avx512<P>(a2, c), xa, s2);
+				s3 = _mm512_fmadd_ps(mvm_ld_avx512<P>(a3, c), xa, s3);
+				t0 = _mm512_fmadd_ps(mvm_ld_avx512<P>(a0, c + 16), xb, t0);
+				t1 = _mm512_fmadd_ps(mvm_ld_avx512<P>(a1, c + 16), xb, t1);
+				t2 = _mm512_fmadd_ps(mvm_ld_avx512<P>(a2, c + 16), xb, t2);
+				t3 = _mm512_fmadd_ps(mvm_ld_avx512<P>(a3, c + 16), xb, t3);
+			}
+			// Rows are padded to 16 elements, at most one vector remains
+			if (c < c1) {
+				const __m512 xa = _mm512_load_ps(x + c);
+				s0 = _mm512_fmadd_ps(mvm_ld_avx512<P>(a0, c), xa, s0);
+				s1 = _mm512_fmadd_ps(mvm_ld_avx512<P>(a1, c), xa, s1);
+				s2 = _mm512_fmadd_ps(mvm_ld_avx512<P>(a2, c), xa, s2);
+				s3 = _mm512_fmadd_ps(mvm_ld_avx512<P>(a3, c), xa, s3);
+			}
+			if (P == Mvm::PREC_F32) {
+				y[r] += _mm512_reduce_add_ps(_mm512_add_ps(s0, t0));
+				y[r+1] += _mm512_reduce_add_ps(_mm512_add_ps(s1, t1));
+				y[r+2] += _mm512_reduce_add_ps(_mm512_add_ps(s2, t2));
+				y[r+3] += _mm512_reduce_add_ps(_mm512_add_ps(s3, t3));
+			}
+			else {
+				y[r] += _mm512_reduce_add_ps(_mm512_add_ps(s0, t0)) * mvm_rscale<P>(A, r);
+				y[r+1] += _mm512_reduce_add_ps(_mm512_add_ps(s1, t1)) * mvm_rscale<P>(A, r+1);
+				y[r+2] += _mm512_reduce_add_ps(_mm512_add_ps(s2, t2)) * mvm_rscale<P>(A, r+2);
+				y[r+3] += _mm512_reduce_add_ps(_mm512_add_ps(s3, t3)) * mvm_rscale<P>(A, r+3);
+			}
+		}
+	}
+}
+
+template <int P> __attribute__((target("avx512f"))) static void acc_avx512(const Mvm::matrix_t &A, const float *x, float *y, const size_t r0, const size_t r1) {
+	size_t r=r0;
+	for (; r+Mvm::NROW<=r1; r += Mvm::NROW) {
+		const void *a0 = A.rowp(r), *a1 = A.rowp(r+1), *a2 = A.rowp(r+2), *a3 = A.rowp(r+3);
+		const __m512 x0 = _mm512_set1_ps(x[r] * mvm_rscale<P>(A, r)), x1 = _mm512_set1_ps(x[r+1] * mvm_rscale<P>(A, r+1));
+		const __m512 x2 = _mm512_set1_ps(x[r+2] * mvm_rscale<P>(A, r+2)), x3 = _mm512_set1_ps(x[r+3] * mvm_rscale<P>(A, r+3));
+		for (size_t c=0; c<A.stride; c += 16) {
+			__m512 s = _mm512_loadu_ps(y + c);
+			s = _mm512_fmadd_ps(mvm_ld_avx512<P>(a0, c), x0, s);
+			s = _mm512_fmadd_ps(mvm_ld_avx512<P>(a1, c), x1, s);
+			s = _mm512_fmadd_ps(mvm_ld_avx512<P>(a2, c), x2, s);
+			s = _mm512_fmadd_ps(mvm_ld_avx512<P>(a3, c), x3, s);
+			_mm512_storeu_ps(y + c, s);
+		}
+	}
+	for (; r<r1; r++) {
+		const void *a0 = A.rowp(r);
+		const __m512 x0 = _mm512_set1_ps(x[r] * mvm_rscale<P>(A, r));
+		for (size_t c=0; c<A.stride; c += 16)
+			_mm512_storeu_ps(y + c, _mm512_fmadd_ps(mvm_ld_avx512<P>(a0, c), x0, _mm512_loadu_ps(y + c)));
+	}
+}
+
+#endif // x86 && GNUC
+
+Mvm::simd_t Mvm::detect_simd() {
+#ifdef HAVE_MVM_X86SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c"))
+		return SIMD_AVX2;
+#endif
+	return SIMD_NONE;
+}
+
+const char *Mvm::simd_str(const simd_t s) {
+	switch (s) {
+		case SIMD_AUTO: return "auto";
+		case SIMD_NONE: return "none";
+		case SIMD_AVX2: return "avx2";
+		case SIMD_AVX512: return "avx512";
+	}
+	return "unknown";
+}
+
+bool Mvm::set_simd(const simd_t s) {
+	simd_t use = (s == SIMD_AUTO) ? detect_simd() : s;
+
+	if (use > detect_simd()) {
+		io.msg(IO_WARN, "Mvm::set_simd() %s not supported by this CPU, keeping %s", simd_str(use), simd_str(simd));
+		return false;
+	}
+
+	switch (use) {
+#ifdef HAVE_MVM_X86SIMD
+		case SIMD_AVX512:
+			MVM_FILL(kernel, acc, mvm_avx512, acc_avx512);
+			sp_kernel = sp_avx2; break;
+		case SIMD_AVX2:
+			MVM_FILL(kernel, acc, mvm_avx2, acc_avx2);
+			sp_kernel = sp_avx2; break;
+#endif
+		default:
+			use = SIMD_NONE;
+			MVM_FILL(kernel, acc, mvm_scalar, acc_scalar);
+			sp_kernel = sp_scalar; break;
+	}
+	simd = use;
+	io.msg(IO_XNFO, "Mvm::set_simd() using %s MVM kernel", simd_str(simd));
+	return true;
+}
@@ -0,0 +1,291 @@
+/*
+ mvm.h -- Multi-threaded matrix-vector multiplication for reconstruction
+
+ This file is part of FOAM.
+
+ FOAM is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ FOAM is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FOAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef HAVE_MVM_H
+#define HAVE_MVM_H
+
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+#include "io.h"
+#include "pthread++.h"
+#include "barrier.h"
+
+/*!
+ @brief Multi-threaded, cache-blocked matrix-vector multiplication engine
+
+ Mvm computes y = A x for dense reconstruction matrices, e.g. the actuation
+ matrix in Shwfs::comp_ctrlcmd(). At 1000+ actuators this product dominates
+ the loop latency, and the reference CBLAS gsl_blas_sgemv() is neither
+ vectorized nor threaded.
+
+ \section mvm_layout Matrix layout
+
+ Mvm::matrix stores A row-major in 64-byte aligned memory. Rows are padded
+ with zeros to a multiple of Mvm::ALIGN floats, and the number of rows to a
+ multiple of Mvm::NROW, such that the kernels need no tail handling. Convert
+ a GSL matrix once (e.g. after calibration), then call apply() every frame.
+
+ \section mvm_prec Reduced precision storage
+
+ For large systems the product is bound by memory bandwidth, as every 
+ matrix element is used once per frame. A matrix can therefore be stored in 
+ 16 bits per element (PREC_F16, IEEE half precision, or PREC_I16, fixed 
+ point), halving the footprint such that e.g. a 1000x4000 reconstructor 
+ fits in L2/L3 cache. Each row is stored relative to its own scale factor 
+ (its maximum absolute value), which keeps small rows precise and avoids 
+ half precision overflow. The kernels convert the elements to float on the
+ fly and accumulate in float; the row scale is applied once per row. The 
+ relative error per element is about 5e-4 for PREC_F16 and 1.5e-5 of the 
+ row maximum for PREC_I16.
+ 
+ \section mvm_sparse Sparse matrices
+ 
+ For localized-influence DMs most elements of the reconstructor are close to
+ zero. Mvm::sparse stores a matrix in blocked CSR format: each row is a list 
+ of blocks of Mvm::SBLK consecutive columns (starting at a multiple of 
+ SBLK), and only blocks holding an element of at least thresh times the 
+ maximum absolute value of their row are kept. Kept blocks are stored in 
+ full, such that the kernels use aligned vector loads of x and of the 
+ values without gathers. The product with a sparse matrix approximates the
+ dense product; fill() reports the fraction of elements stored. Sparse 
+ matrices are stored in float and do not support accumulate(). The AVX2
+ kernel is also used for SIMD_AVX512, as the blocks are 8 wide.
+
+ \section mvm_threads Threads
+
+ The rows are split in contiguous blocks (multiples of Mvm::NROW rows) over
+ the calling thread and nthr-1 worker threads, which are woken through a
+ SpinCounter as in Shift, such that no syscalls are involved at high rates.
+ Products smaller than Mvm::MINPAR matrix elements are computed by the
+ calling thread only, as waking the workers would cost more than it saves.
+ Workers can be pinned to CPUs with set_affinity().
+
+ \section mvm_simd Kernels
+
+ Scalar, AVX2+FMA and AVX-512F kernels are available, selected at
+ construction with CPU feature detection (see set_simd()). Kernels process
+ Mvm::NROW rows at once, such that every load of x is used NROW times, and
+ the columns in blocks of Mvm::COLBLOCK such that the block of x stays in L1
+ cache while all rows pass over it. The summation order differs from
+ gsl_blas_sgemv(), results agree to float rounding.
+ 
+ \section mvm_partial Partial products
+ 
+ accumulate() adds the contribution of a range of elements of x to y, 
+ using the transpose of the matrix (see matrix::matrix()) such that each 
+ element of x scales one contiguous row. This allows threads that produce 
+ parts of x (e.g. the Shift workers, see Shift::recon_t) to reconstruct 
+ their part right away into a private y, which are summed at the end. 
+ accumulate() does not use the Mvm threads and can be called from any 
+ thread concurrently.
+ */
+class Mvm {
+public:
+	typedef enum {
+		SIMD_AUTO=-1,											//!< Detect best instruction set at runtime
+		SIMD_NONE=0,											//!< Scalar kernel
+		SIMD_AVX2,												//!< AVX2 + FMA kernel (8 lanes)
+		SIMD_AVX512,											//!< AVX-512F kernel (16 lanes)
+	} simd_t;														//!< SIMD instruction sets for MVM kernels
+
+	enum {
+		ALIGN=16,													//!< Row padding in elements (64 bytes of float)
+		NROW=4,														//!< Rows processed at once by the kernels
+		COLBLOCK=2048,										//!< Columns per cache block (8 KiB of x)
+		MINPAR=32768,											//!< Minimum matrix size (elements) to use the worker threads
+		SBLK=8,														//!< Columns per block in sparse matrices
+	};
+
+	typedef enum {
+		PREC_F32=0,												//!< 32-bit float
+		PREC_F16,													//!< 16-bit IEEE half precision float with per-row scale
+		PREC_I16,													//!< 16-bit fixed point with per-row scale
+		NPREC,														//!< Number of storage precisions
+	} prec_t;														//!< Matrix storage precision, see \ref mvm_prec
+
+	static const char *prec_str(const prec_t p); //!< Name of storage precision ("f32", "f16" or "i16")
+	static float half2float(const uint16_t h); //!< Convert IEEE half precision to float
+	static uint16_t float2half(const float f); //!< Convert float to IEEE half precision, rounding to nearest even
+
+	/*! @brief Dense row-major matrix with aligned, zero-padded rows */
+	class matrix {
+	public:
+		/*! @brief Copy m (or its transpose if trans), scaled by scale, to Mvm layout with precision prec */
+		matrix(const gsl_matrix_float *m, const double scale=1.0, const bool trans=false, const prec_t prec=PREC_F32);
+		/*! @brief Zero matrix of rows x cols */
+		matrix(const size_t rows, const size_t cols, const prec_t prec=PREC_F32);
+		~matrix();
+
+		size_t rows;											//!< Number of rows
+		size_t cols;											//!< Number of columns
+		size_t prows;											//!< Number of rows allocated (multiple of NROW)
+		size_t stride;										//!< Elements per row (multiple of ALIGN)
+		prec_t prec;											//!< Storage precision
+		float *data;											//!< Matrix data (prows x stride) for PREC_F32, else NULL
+		uint16_t *data16;									//!< Matrix data (prows x stride) for PREC_F16 and PREC_I16, else NULL
+		float *rscale;										//!< Scale of each row (prows) for PREC_F16 and PREC_I16, else NULL
+
+		float *row(const size_t i) const { return data + i * stride; } //!< Row i (PREC_F32 only)
+		const void *rowp(const size_t i) const { return data ? (const void *) (data + i * stride) : (const void *) (data16 + i * stride); } //!< Row i in storage format
+		float get(const size_t i, const size_t j) const; //!< Element (i,j) as float (any precision)
+		void set(const size_t i, const size_t j, const float v) { data[i * stride + j] = v; } //!< Set element (i,j) (PREC_F32 only)
+		size_t bytes() const { return prows * stride * (prec == PREC_F32 ? sizeof(float) : sizeof(uint16_t)); } //!< Storage size of the elements
+
+	private:
+		void _alloc(const size_t rows, const size_t cols, const prec_t prec);
+		matrix(const matrix &);							//!< Not copyable
+		matrix &operator=(const matrix &);	//!< Not copyable
+	};
+	typedef matrix matrix_t;
+
+	/*! @brief Blocked CSR sparse matrix, see \ref mvm_sparse */
+	class sparse {
+	public:
+		/*! @brief Copy blocks of m scaled by scale, dropping blocks with all |elements| < thresh * (maximum |element| of their row) */
+		sparse(const gsl_matrix_float *m, const double thresh, const double scale=1.0);
+		~sparse();
+
+		size_t rows;											//!< Number of rows
+		size_t cols;											//!< Number of columns
+		size_t stride;										//!< Size of padded x (multiple of ALIGN)
+		size_t nblk;											//!< Number of blocks stored
+		double thresh;										//!< Relative threshold used to drop blocks
+		uint32_t *rowptr;									//!< Blocks of row i are rowptr[i] to rowptr[i+1]-1 (rows+1)
+		uint32_t *colidx;									//!< First column of each block (nblk, multiple of SBLK)
+		float *val;												//!< Values of each block (nblk x SBLK, 32-byte aligned)
+
+		float get(const size_t i, const size_t j) const; //!< Element (i,j), 0 if not stored
+		double fill() const { return (rows && cols) ? (double) nblk * SBLK / (rows * cols) : 0.0; } //!< Fraction of elements stored (including zeros in kept blocks)
+		size_t bytes() const { return nblk * (SBLK * sizeof(float) + sizeof(uint32_t)) + (rows+1) * sizeof(uint32_t); } //!< Storage size
+
+	private:
+		sparse(const sparse &);							//!< Not copyable
+		sparse &operator=(const sparse &);	//!< Not copyable
+	};
+	typedef sparse sparse_t;
+
+	/*! @brief Kernel: y[r] = A.row(r) . x for rows r0 to r1-1 (multiples of NROW), x padded to A.stride */
+	typedef void (*kernel_t)(const matrix_t &A, const float *x, float *y, const size_t r0, const size_t r1);
+	/*! @brief Accumulation kernel: y += sum of x[r] A.row(r) for rows r0 to r1-1, y of size A.stride */
+	typedef void (*acc_kernel_t)(const matrix_t &A, const float *x, float *y, const size_t r0, const size_t r1);
+	/*! @brief Sparse kernel: y[r] = A row r . x for rows r0 to r1-1, x padded to A.stride */
+	typedef void (*sp_kernel_t)(const sparse_t &A, const float *x, float *y, const size_t r0, const size_t r1);
+
+private:
+	Io &io;															//!< Message IO
+	bool running;												//!< Are we running?
+
+	int nthread;												//!< Number of threads, including the caller
+	int workid;													//!< Worker counter
+	std::vector<pthread::thread> workers; //!< Worker threads (nthread-1)
+	std::vector<pthread_t> workertid;		//!< Thread ID of each worker
+	std::vector<int> cpus;							//!< CPUs to pin workers to (empty for no pinning)
+	SpinCounter started;								//!< Number of workers that registered their thread ID
+	SpinCounter submitted;							//!< Number of products submitted to the workers
+	SpinCounter finished;								//!< Number of blocks finished by workers (nthread-1 per product)
+	int64_t spin_ns;										//!< Spin time before parking on a futex
+
+	const matrix_t *cur_A;							//!< Matrix of current product (NULL for sparse)
+	const sparse_t *cur_S;							//!< Sparse matrix of current product (NULL for dense)
+	std::vector<size_t> cur_part;				//!< Row blocks of current product, thread t does cur_part[t] to cur_part[t+1]-1
+	float *xbuf;												//!< Padded copy of x (64-byte aligned)
+	float *ybuf;												//!< Output rows (64-byte aligned)
+	size_t xcap;												//!< Capacity of xbuf
+	size_t ycap;												//!< Capacity of ybuf
+
+	simd_t simd;												//!< SIMD instruction set in use
+	kernel_t kernel[NPREC];							//!< Kernel in use, per storage precision
+	acc_kernel_t acc[NPREC];						//!< Accumulation kernel in use, per storage precision
+	sp_kernel_t sp_kernel;							//!< Sparse kernel in use
+
+	void _worker_func();								//!< Worker function
+	int _worker_getid() { return __sync_fetch_and_add(&workid, 1); }
+	bool _apply_affinity(const int wid); //!< Pin worker wid according to Mvm::cpus
+	void _reserve(const size_t nx, const size_t ny); //!< Grow xbuf to nx and ybuf to ny elements
+	void _block(const int t);						//!< Compute block t of the current product (cur_A or cur_S)
+	void _run(const int nt);						//!< Run the current product on nt threads, split as in cur_part
+
+public:
+	/*! @brief Start MVM workers
+
+	 @param [in] io Message IO
+	 @param [in] nthr Number of threads including the calling thread, 0 for all available CPUs
+	 */
+	Mvm(Io &io, const int nthr=1);
+	~Mvm();
+
+	int get_nthread() const { return nthread; }
+
+	static simd_t detect_simd();				//!< Best SIMD instruction set supported by this CPU
+	static const char *simd_str(const simd_t s); //!< Name of SIMD instruction set
+	/*! @brief Select kernel, SIMD_AUTO uses detect_simd()
+
+	 @return false if the requested instruction set is not available (the kernel is not changed)
+	 */
+	bool set_simd(const simd_t s=SIMD_AUTO);
+	simd_t get_simd() const { return simd; }
+
+	/*! @brief Pin workers to CPUs, worker w to cpus[w % cpus.size()], empty list to unpin
+
+	 @return false if pinning failed for any worker
+	 */
+	bool set_affinity(const std::vector<int> &cpus);
+	const std::vector<int> &get_affinity() const { return cpus; }
+
+	void set_spin(const int usec) { spin_ns = (int64_t) usec * 1000; } //!< Spin time before sleeping while waiting
+	int get_spin() const { return (int) (spin_ns / 1000); }
+
+	/*! @brief Calculate y = A x
+
+	 Blocks until done. Not reentrant: call from one thread at a time.
+
+	 @param [in] A Matrix in Mvm layout
+	 @param [in] *x Input vector (size A.cols)
+	 @param [out] *y Output vector (size A.rows)
+	 @return false if the sizes do not match
+	 */
+	bool apply(const matrix_t &A, const gsl_vector_float *x, gsl_vector_float *y);
+	
+	/*! @brief Calculate y = A x for a sparse matrix
+	 
+	 As apply() for dense matrices. Rows are split over the threads such that
+	 each gets about the same number of blocks.
+	 */
+	bool apply(const sparse_t &A, const gsl_vector_float *x, gsl_vector_float *y);
+	
+	/*! @brief Accumulate partial product y += A^T x over rows r0 to r1-1 of A
+	 
+	 For a matrix stored transposed (A = B^T, see matrix::matrix()), this adds
+	 columns r0 to r1-1 of B times the same elements of x to y. Thread-safe.
+	 
+	 @param [in] A Transposed matrix in Mvm layout
+	 @param [in] *x Input vector (size A.rows, only r0 to r1-1 are used)
+	 @param [in,out] *y Output vector (size A.stride, padding is written)
+	 @param [in] r0 First row of A
+	 @param [in] r1 Last row of A plus one
+	 */
+	void accumulate(const matrix_t &A, const float *x, float *y, const size_t r0, const size_t r1) const { acc[A.prec](A, x, y, r0, r1); }
+};
+
+#endif // HAVE_MVM_H
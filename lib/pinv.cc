@@ -0,0 +1,549 @@
+/*
+ pinv.cc -- Multi-threaded SVD and pseudo-inverse for reconstructor calibration
+
+ This file is part of FOAM.
+
+ FOAM is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ FOAM is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FOAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <string.h>
+#include <float.h>
+#include <pthread.h>
+#include <algorithm>
+#include <cmath>
+#include <new>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+#include "io.h"
+#include "format.h"
+
+#include "pinv.h"
+
+//! Spin time of the Pinv threads before parking, short as jobs take long
+static const int64_t PINV_SPIN_NS = 20000;
+
+static double *pinv_alloc(const size_t n) {
+	void *p = NULL;
+	if (posix_memalign(&p, 64, std::max(n, (size_t) 1) * sizeof(double)))
+		throw std::bad_alloc();
+	memset(p, 0, n * sizeof(double));
+	return (double *) p;
+}
+
+static int pinv_ncpu() {
+	int n = 0;
+#ifdef __linux__
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof set, &set) == 0)
+		n = CPU_COUNT(&set);
+#endif
+	if (n <= 0)
+		n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	return std::max(n, 1);
+}
+
+/*
+ * Kernels on contiguous columns
+ */
+
+static double dot_scalar(const double *x, const double *y, const size_t n) {
+	double s0=0, s1=0, s2=0, s3=0;
+	size_t i=0;
+	for (; i+4<=n; i += 4) {
+		s0 += x[i] * y[i];
+		s1 += x[i+1] * y[i+1];
+		s2 += x[i+2] * y[i+2];
+		s3 += x[i+3] * y[i+3];
+	}
+	for (; i<n; i++)
+		s0 += x[i] * y[i];
+	return (s0 + s1) + (s2 + s3);
+}
+
+//! a = x.x, b = y.y, g = x.y in one pass
+static void dot3_scalar(const double *x, const double *y, const size_t n, double &a, double &b, double &g) {
+	double a0=0, a1=0, b0=0, b1=0, g0=0, g1=0;
+	size_t i=0;
+	for (; i+2<=n; i += 2) {
+		a0 += x[i] * x[i]; a1 += x[i+1] * x[i+1];
+		b0 += y[i] * y[i]; b1 += y[i+1] * y[i+1];
+		g0 += x[i] * y[i]; g1 += x[i+1] * y[i+1];
+	}
+	for (; i<n; i++) {
+		a0 += x[i] * x[i];
+		b0 += y[i] * y[i];
+		g0 += x[i] * y[i];
+	}
+	a = a0 + a1; b = b0 + b1; g = g0 + g1;
+}
+
+//! x, y = c x - s y, s x + c y
+static void rot_scalar(double *x, double *y, const size_t n, const double c, const double s) {
+	for (size_t i=0; i<n; i++) {
+		const double xi = x[i], yi = y[i];
+		x[i] = c * xi - s * yi;
+		y[i] = s * xi + c * yi;
+	}
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_PINV_X86SIMD
+
+__attribute__((target("avx2,fma"))) static inline double hsum_avx2(const __m256d v) {
+	__m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+	return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+__attribute__((target("avx2,fma"))) static double dot_avx2(const double *x, const double *y, const size_t n) {
+	__m256d s = _mm256_setzero_pd(), t = _mm256_setzero_pd();
+	size_t i=0;
+	for (; i+8<=n; i += 8) {
+		s = _mm256_fmadd_pd(_mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i), s);
+		t = _mm256_fmadd_pd(_mm256_loadu_pd(x+i+4), _mm256_loadu_pd(y+i+4), t);
+	}
+	double r = hsum_avx2(_mm256_add_pd(s, t));
+	for (; i<n; i++)
+		r += x[i] * y[i];
+	return r;
+}
+
+__attribute__((target("avx2,fma"))) static void dot3_avx2(const double *x, const double *y, const size_t n, double &a, double &b, double &g) {
+	__m256d va = _mm256_setzero_pd(), vb = _mm256_setzero_pd(), vg = _mm256_setzero_pd();
+	size_t i=0;
+	for (; i+4<=n; i += 4) {
+		const __m256d xv = _mm256_loadu_pd(x+i), yv = _mm256_loadu_pd(y+i);
+		va = _mm256_fmadd_pd(xv, xv, va);
+		vb = _mm256_fmadd_pd(yv, yv, vb);
+		vg = _mm256_fmadd_pd(xv, yv, vg);
+	}
+	a = hsum_avx2(va); b = hsum_avx2(vb); g = hsum_avx2(vg);
+	for (; i<n; i++) {
+		a += x[i] * x[i];
+		b += y[i] * y[i];
+		g += x[i] * y[i];
+	}
+}
+
+__attribute__((target("avx2,fma"))) static void rot_avx2(double *x, double *y, const size_t n, const double c, const double s) {
+	const __m256d vc = _mm256_set1_pd(c), vs = _mm256_set1_pd(s);
+	size_t i=0;
+	for (; i+4<=n; i += 4) {
+		const __m256d xv = _mm256_loadu_pd(x+i), yv = _mm256_loadu_pd(y+i);
+		_mm256_storeu_pd(x+i, _mm256_fmsub_pd(vc, xv, _mm256_mul_pd(vs, yv)));
+		_mm256_storeu_pd(y+i, _mm256_fmadd_pd(vs, xv, _mm256_mul_pd(vc, yv)));
+	}
+	for (; i<n; i++) {
+		const double xi = x[i], yi = y[i];
+		x[i] = c * xi - s * yi;
+		y[i] = s * xi + c * yi;
+	}
+}
+
+#endif // x86 && GNUC
+
+typedef struct {
+	double (*dot)(const double *x, const double *y, const size_t n);
+	void (*dot3)(const double *x, const double *y, const size_t n, double &a, double &b, double &g);
+	void (*rot)(double *x, double *y, const size_t n, const double c, const double s);
+} pinv_kernels_t;
+
+static const pinv_kernels_t &pinv_kernels() {
+	static const pinv_kernels_t k_scalar = { dot_scalar, dot3_scalar, rot_scalar };
+#ifdef HAVE_PINV_X86SIMD
+	static const pinv_kernels_t k_avx2 = { dot_avx2, dot3_avx2, rot_avx2 };
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return k_avx2;
+#endif
+	return k_scalar;
+}
+
+//! c[0:len] -= tau (v . c) v, with v[0] = 1 implicitly
+static inline void house_apply(const pinv_kernels_t &k, const double *v, const double tau, double *c, const size_t len) {
+	if (tau == 0 || len == 0)
+		return;
+	const double w = tau * (c[0] + k.dot(v+1, c+1, len-1));
+	c[0] -= w;
+	for (size_t i=1; i<len; i++)
+		c[i] -= w * v[i];
+}
+
+//! Position of player p in round r of a round-robin tournament of N (even) players
+static inline size_t rr_pos(const size_t p, const size_t r, const size_t N) {
+	return p == 0 ? 0 : (p - 1 + r) % (N - 1) + 1;
+}
+
+/*
+ * Threads
+ */
+
+Pinv::Pinv(Io &io, const int nthr):
+io(io), running(true), nthread(nthr > 0 ? nthr : pinv_ncpu()), workid(0),
+barrier(nthread, PINV_SPIN_NS), sense(nthread, 0), cur_job(NULL),
+m(0), n(0), ldw(0), ldr(0), W(NULL), tau(NULL), R(NULL), Vw(NULL), tol(0),
+sweeps(0), converged(false), nrot(nthread, 0), offmax(nthread, 0.0), cur_U(NULL),
+Ut(NULL), Vs(NULL), nmodes(0), cur_X(NULL), prog_off0(0)
+{
+	io.msg(IO_DEB2, "Pinv::Pinv()");
+
+	sigc::slot<void> funcslot = sigc::mem_fun(this, &Pinv::_worker_func);
+	for (int w=0; w<nthread-1; w++) {
+		pthread::thread tmp = pthread::thread();
+		tmp.create(funcslot);
+		workers.push_back(tmp);
+	}
+
+	started.wait(nthread-1, PINV_SPIN_NS);
+	io.msg(IO_XNFO, "Pinv::Pinv() using %d threads", nthread);
+}
+
+Pinv::~Pinv() {
+	io.msg(IO_DEB2, "Pinv::~Pinv()");
+
+	__atomic_store_n(&running, false, __ATOMIC_SEQ_CST);
+	submitted.add(1);
+	for (size_t w=0; w<workers.size(); w++)
+		workers[w].join();
+}
+
+void Pinv::_worker_func() {
+	const int id = _worker_getid();
+	int next = 0;
+	started.add(1);
+
+	while (true) {
+		submitted.wait(next+1, PINV_SPIN_NS);
+		if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+			break;
+
+		// Thread 0 is the caller
+		(this->*cur_job)(id + 1);
+
+		finished.add(1);
+		next++;
+	}
+}
+
+void Pinv::_run(const job_t job) {
+	cur_job = job;
+	if (nthread > 1) {
+		const int gen = submitted.get() + 1;
+		submitted.add(1);
+		(this->*job)(0);
+		finished.wait(gen * (nthread-1), PINV_SPIN_NS);
+	}
+	else {
+		(this->*job)(0);
+	}
+}
+
+void Pinv::_report(const char *stage, const double frac) {
+	io.msg(IO_DEB1, "Pinv::_report() %s: %.0f%%", stage, 100.0 * frac);
+	if (!progress.empty())
+		progress(stage, frac);
+}
+
+/*
+ * Jobs
+ */
+
+void Pinv::_qr(const int t) {
+	const pinv_kernels_t &k = pinv_kernels();
+
+	for (size_t k0=0; k0<n; k0 += NB) {
+		const size_t kb = std::min((size_t) NB, n - k0);
+
+		// Factor panel k0 to k0+kb-1 on one thread (LAPACK dlarfg convention)
+		if (t == 0) {
+			for (size_t j=k0; j<k0+kb; j++) {
+				double *x = W + j * ldw + j;
+				const size_t len = m - j;
+				const double alpha = x[0];
+				const double xnorm = len > 1 ? sqrt(k.dot(x+1, x+1, len-1)) : 0.0;
+				if (xnorm == 0) {
+					tau[j] = 0;
+					continue;
+				}
+				const double beta = -copysign(hypot(alpha, xnorm), alpha);
+				tau[j] = (beta - alpha) / beta;
+				const double scale = 1.0 / (alpha - beta);
+				for (size_t i=1; i<len; i++)
+					x[i] *= scale;
+				x[0] = beta;
+
+				for (size_t c=j+1; c<k0+kb; c++)
+					house_apply(k, x, tau[j], W + c * ldw + j, len);
+			}
+		}
+		_sync(t);
+
+		// Apply the panel to our part of the remaining columns, one column at a
+		// time such that it stays in cache for all kb reflectors
+		const size_t ntrail = n - k0 - kb;
+		const size_t c0 = k0 + kb + ntrail * t / nthread;
+		const size_t c1 = k0 + kb + ntrail * (t+1) / nthread;
+		for (size_t c=c0; c<c1; c++)
+			for (size_t j=k0; j<k0+kb; j++)
+				house_apply(k, W + j * ldw + j, tau[j], W + c * ldw + j, m - j);
+		_sync(t);
+
+		if (t == 0) {
+			// Work of the remaining panels scales as (columns left)^2
+			const double left = (double) (n - k0 - kb) / n;
+			_report("qr", 1.0 - left * left);
+		}
+	}
+}
+
+void Pinv::_jacobi(const int t) {
+	const pinv_kernels_t &k = pinv_kernels();
+	const size_t N = n + (n & 1);				// Odd n: the extra player sits out
+	const size_t npair = N / 2;
+	const size_t p0 = npair * t / nthread, p1 = npair * (t+1) / nthread;
+
+	while (true) {
+		int rot = 0;
+		double off = 0;
+		for (size_t r=0; r<N-1; r++) {
+			for (size_t p=p0; p<p1; p++) {
+				const size_t i = rr_pos(p, r, N), j = rr_pos(N-1-p, r, N);
+				if (i >= n || j >= n)
+					continue;
+				double *ri = R + i * ldr, *rj = R + j * ldr;
+				double a, b, g;
+				k.dot3(ri, rj, n, a, b, g);
+				if (a == 0 || b == 0)
+					continue;
+				const double corr = fabs(g) / sqrt(a * b);
+				off = std::max(off, corr);
+				if (corr <= tol)
+					continue;
+
+				// Rotate columns i and j to be orthogonal, smallest angle
+				const double zeta = (b - a) / (2 * g);
+				const double tn = copysign(1.0, zeta) / (fabs(zeta) + sqrt(1 + zeta * zeta));
+				const double c = 1.0 / sqrt(1 + tn * tn);
+				const double s = c * tn;
+				k.rot(ri, rj, n, c, s);
+				k.rot(Vw + i * ldr, Vw + j * ldr, n, c, s);
+				rot++;
+			}
+			_sync(t);
+		}
+		nrot[t] = rot;
+		offmax[t] = off;
+		_sync(t);
+
+		if (t == 0) {
+			int totrot = 0;
+			double totoff = 0;
+			for (int w=0; w<nthread; w++) {
+				totrot += nrot[w];
+				totoff = std::max(totoff, offmax[w]);
+			}
+			sweeps++;
+			converged = (totrot == 0);
+			io.msg(IO_DEB1, "Pinv::_jacobi() sweep %d: %d rotations, max. correlation %g", sweeps, totrot, totoff);
+
+			// Correlation goes from prog_off0 to tol, roughly geometrically
+			if (sweeps == 1)
+				prog_off0 = std::max(totoff, tol * 10);
+			double frac = converged ? 1.0 : log(prog_off0 / std::max(totoff, tol)) / log(prog_off0 / tol);
+			_report("jacobi", std::min(std::max(frac, 0.0), 1.0));
+		}
+		_sync(t);
+		if (converged || sweeps >= MAXSWEEP)
+			break;
+	}
+}
+
+void Pinv::_form_u(const int t) {
+	const pinv_kernels_t &k = pinv_kernels();
+	const size_t ngroup = (n + UB - 1) / UB;
+	const size_t g0 = ngroup * t / nthread, g1 = ngroup * (t+1) / nthread;
+	double *buf = pinv_alloc(UB * ldw);
+
+	for (size_t grp=g0; grp<g1; grp++) {
+		const size_t q0 = grp * UB, q1 = std::min(q0 + UB, n);
+
+		// Columns of [Vw; 0], in the order of descending singular value
+		for (size_t q=q0; q<q1; q++) {
+			double *col = buf + (q - q0) * ldw;
+			memset(col, 0, m * sizeof(double));
+			memcpy(col, Vw + order[q] * ldr, n * sizeof(double));
+		}
+
+		// Q = H_0 H_1 ... H_n-1, apply the last one first
+		for (size_t j=n; j-- > 0; )
+			for (size_t q=q0; q<q1; q++)
+				house_apply(k, W + j * ldw + j, tau[j], buf + (q - q0) * ldw + j, m - j);
+
+		for (size_t q=q0; q<q1; q++) {
+			const double *col = buf + (q - q0) * ldw;
+			for (size_t i=0; i<m; i++)
+				gsl_matrix_set(cur_U, i, q, col[i]);
+		}
+	}
+
+	free(buf);
+}
+
+void Pinv::_form_x(const int t) {
+	const size_t cols = cur_X->size2;
+	const size_t nblk = (cols + XB - 1) / XB;
+	const size_t b0 = nblk * t / nthread, b1 = nblk * (t+1) / nthread;
+	double acc[XB];
+
+	// Row i of X is sum_k Vs[i][k] Ut[k], per block of XB columns such that
+	// that block of Ut stays in cache for all rows
+	for (size_t blk=b0; blk<b1; blk++) {
+		const size_t j0 = blk * XB, nj = std::min((size_t) XB, cols - j0);
+		for (size_t i=0; i<cur_X->size1; i++) {
+			memset(acc, 0, sizeof acc);
+			for (size_t q=0; q<nmodes; q++) {
+				const double w = Vs[i * nmodes + q];
+				if (w == 0)
+					continue;
+				const double *u = Ut + q * cols + j0;
+				for (size_t j=0; j<nj; j++)
+					acc[j] += w * u[j];
+			}
+			for (size_t j=0; j<nj; j++)
+				gsl_matrix_set(cur_X, i, j0 + j, acc[j]);
+		}
+	}
+}
+
+/*
+ * Public API
+ */
+
+struct pinv_norm_desc {
+	const std::vector<double> &norms;
+	pinv_norm_desc(const std::vector<double> &norms): norms(norms) { }
+	bool operator()(const size_t a, const size_t b) const { return norms[a] > norms[b]; }
+};
+
+int Pinv::svd(const gsl_matrix *A, gsl_matrix *U, gsl_vector *s, gsl_matrix *V) {
+	if (A->size1 < A->size2 || U->size1 != A->size1 || U->size2 != A->size2 ||
+			s->size != A->size2 || V->size1 != A->size2 || V->size2 != A->size2) {
+		io.msg(IO_ERR, "Pinv::svd() size mismatch: A %zu x %zu, U %zu x %zu, s %zu, V %zu x %zu",
+					 A->size1, A->size2, U->size1, U->size2, s->size, V->size1, V->size2);
+		return -1;
+	}
+	const double t0 = mono_ns() * 1e-9;
+
+	m = A->size1;
+	n = A->size2;
+	ldw = (m + 3) / 4 * 4;
+	ldr = (n + 3) / 4 * 4;
+	W = pinv_alloc(ldw * n);
+	tau = pinv_alloc(n);
+	R = pinv_alloc(ldr * n);
+	Vw = pinv_alloc(ldr * n);
+	cur_U = U;
+
+	for (size_t i=0; i<m; i++)
+		for (size_t j=0; j<n; j++)
+			W[j * ldw + i] = gsl_matrix_get(A, i, j);
+
+	_run(&Pinv::_qr);
+	const double t1 = mono_ns() * 1e-9;
+
+	// Jacobi on R^T, starting from Vw = I. R^T Vw = V S gives R = Vw S V^T, 
+	// and A = (Q Vw) S V^T
+	for (size_t j=0; j<n; j++) {
+		for (size_t i=0; i<=j; i++)
+			R[i * ldr + j] = W[j * ldw + i];
+		Vw[j * ldr + j] = 1.0;
+	}
+	tol = n * DBL_EPSILON;
+	sweeps = 0;
+	converged = false;
+	_run(&Pinv::_jacobi);
+	const double t2 = mono_ns() * 1e-9;
+
+	// Singular values are the column norms, sort descending
+	norms.resize(n);
+	order.resize(n);
+	for (size_t j=0; j<n; j++) {
+		norms[j] = sqrt(pinv_kernels().dot(R + j * ldr, R + j * ldr, n));
+		order[j] = j;
+	}
+	std::stable_sort(order.begin(), order.end(), pinv_norm_desc(norms));
+	for (size_t q=0; q<n; q++) {
+		const double sv = norms[order[q]];
+		gsl_vector_set(s, q, sv);
+		for (size_t i=0; i<n; i++)
+			gsl_matrix_set(V, i, q, sv > 0 ? R[order[q] * ldr + i] / sv : 0.0);
+	}
+
+	_report("u", 0.0);
+	_run(&Pinv::_form_u);
+	const double t3 = mono_ns() * 1e-9;
+	_report("done", 1.0);
+
+	free(W); W = NULL;
+	free(tau); tau = NULL;
+	free(R); R = NULL;
+	free(Vw); Vw = NULL;
+	cur_U = NULL;
+
+	if (!converged)
+		io.msg(IO_WARN, "Pinv::svd() Jacobi did not converge in %d sweeps", sweeps);
+	io.msg(IO_XNFO, "Pinv::svd() %zu x %zu: qr %.3fs, jacobi %.3fs (%d sweeps), u %.3fs on %d threads",
+				 m, n, t1-t0, t2-t1, sweeps, t3-t2, nthread);
+
+	return converged ? 0 : 1;
+}
+
+int Pinv::pinv(const gsl_matrix *U, const gsl_vector *s, const gsl_matrix *V, const size_t nm, gsl_matrix *X) {
+	if (s->size != U->size2 || V->size1 != U->size2 || V->size2 != U->size2 ||
+			X->size1 != U->size2 || X->size2 != U->size1 || nm > s->size) {
+		io.msg(IO_ERR, "Pinv::pinv() size mismatch: U %zu x %zu, s %zu, V %zu x %zu, X %zu x %zu, %zu modes",
+					 U->size1, U->size2, s->size, V->size1, V->size2, X->size1, X->size2, nm);
+		return -1;
+	}
+	const double t0 = mono_ns() * 1e-9;
+
+	nmodes = nm;
+	cur_X = X;
+	Ut = pinv_alloc(nmodes * U->size1);
+	Vs = pinv_alloc(V->size1 * nmodes);
+	for (size_t q=0; q<nmodes; q++) {
+		const double sv = gsl_vector_get(s, q);
+		const double inv = (sv != 0) ? 1.0/sv : 0.0;
+		for (size_t i=0; i<U->size1; i++)
+			Ut[q * U->size1 + i] = gsl_matrix_get(U, i, q);
+		for (size_t i=0; i<V->size1; i++)
+			Vs[i * nmodes + q] = gsl_matrix_get(V, i, q) * inv;
+	}
+
+	_run(&Pinv::_form_x);
+
+	free(Ut); Ut = NULL;
+	free(Vs); Vs = NULL;
+	cur_X = NULL;
+
+	io.msg(IO_XNFO, "Pinv::pinv() %zu x %zu with %zu modes: %.3fs on %d threads",
+				 X->size1, X->size2, nmodes, mono_ns() * 1e-9 - t0, nthread);
+	return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ pinv.h -- Multi-threaded SVD and pseudo-inverse for reconstructor calibration
+
+ This file is part of FOAM.
+
+ FOAM is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ FOAM is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FOAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef HAVE_PINV_H
+#define HAVE_PINV_H
+
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+#include "io.h"
+#include "pthread++.h"
+#include "barrier.h"
+
+/*!
+ @brief Multi-threaded singular value decomposition and pseudo-inverse
+
+ Pinv computes the SVD A = U S V^T of an influence matrix, and the
+ truncated pseudo-inverse V S^-1 U^T from it, as used in
+ Shwfs::calc_actmat() and Shwfs::update_actmat(). It replaces
+ gsl_linalg_SV_decomp() and gsl_blas_dgemm(), which are single-threaded and
+ unblocked, and take minutes for 1000 actuators and 4000 slopes.
+
+ \section pinv_algo Algorithm
+
+ svd() first computes a Householder QR decomposition A = Q R, and then the
+ SVD of the n x n triangle R with the one-sided Jacobi (Hestenes) method:
+ pairs of columns of R^T are rotated until all columns are orthogonal. The
+ column norms are the singular values and the normalized columns give V.
+ The accumulated rotations are the left singular vectors of R, which give
+ U after multiplication with Q. Working on R^T instead of A or R takes far
+ fewer sweeps (Drmac and Veselic, 2008). One-sided Jacobi computes small 
+ singular values to high relative accuracy, and unlike Golub-Kahan 
+ bidiagonalization all pairs in a round are independent.
+
+ The QR decomposition is blocked: a panel of Pinv::NB columns is factored
+ by one thread, after which all threads apply its reflectors to their own
+ part of the remaining columns. Every column is loaded once per panel
+ instead of once per reflector. Q is applied to U the same way.
+
+ \section pinv_threads Threads
+
+ The work is split over the calling thread and nthr-1 worker threads,
+ which are started once and woken through a SpinCounter as in Mvm. Pairs
+ of columns are distributed in round-robin (tournament) order, such that
+ every round rotates n/2 disjoint pairs in parallel, with a SpinBarrier
+ between rounds. The threads are independent of the Mvm and Shift workers
+ of the control loop: a reconstructor can be recomputed while the loop
+ runs, and published with Shwfs::publish_rec() when done.
+
+ \section pinv_progress Progress
+
+ A slot set with set_progress() is called from the calling thread after
+ every QR panel and every Jacobi sweep, with the stage ("qr", "jacobi",
+ "u" or "done") and the estimated fraction of that stage done. For Jacobi
+ this is estimated from the largest remaining correlation between two
+ columns, which decreases roughly geometrically per sweep.
+ */
+class Pinv {
+public:
+	enum {
+		NB=32,														//!< Columns per QR panel
+		UB=8,															//!< Columns of U updated at once when applying Q
+		XB=256,														//!< Columns of the pseudo-inverse per cache block
+		MAXSWEEP=40,											//!< Maximum number of Jacobi sweeps
+	};
+
+	typedef sigc::slot<void, const char *, double> progress_slot; //!< Progress callback (stage, fraction 0-1)
+
+private:
+	Io &io;															//!< Message IO
+	bool running;												//!< Are we running?
+
+	int nthread;												//!< Number of threads, including the caller
+	int workid;													//!< Worker counter
+	std::vector<pthread::thread> workers; //!< Worker threads (nthread-1)
+	SpinCounter started;								//!< Number of workers that started
+	SpinCounter submitted;							//!< Number of jobs submitted to the workers
+	SpinCounter finished;								//!< Number of jobs finished by workers (nthread-1 per job)
+	SpinBarrier barrier;								//!< Barrier between steps within a job
+	std::vector<int> sense;							//!< Barrier sense of each thread
+
+	typedef void (Pinv::*job_t)(const int t);
+	job_t cur_job;											//!< Job run by all threads
+
+	// State of the current decomposition, see svd()
+	size_t m;														//!< Rows of A
+	size_t n;														//!< Columns of A
+	size_t ldw;													//!< Leading dimension of W (>= m)
+	size_t ldr;													//!< Leading dimension of R and V (>= n)
+	double *W;													//!< A, then Householder vectors and R, column-major (ldw x n)
+	double *tau;												//!< Householder coefficients (n)
+	double *R;													//!< Transpose of triangle R, then rotated to V S, column-major (ldr x n)
+	double *Vw;													//!< Accumulated rotations (left singular vectors of R), column-major (ldr x n)
+	double tol;													//!< Jacobi rotation threshold (relative correlation)
+	int sweeps;													//!< Jacobi sweeps done
+	bool converged;											//!< Did the last Jacobi sweep rotate nothing?
+	std::vector<int> nrot;							//!< Rotations done by each thread in the current sweep
+	std::vector<double> offmax;					//!< Largest relative correlation seen by each thread in the current sweep
+	std::vector<size_t> order;					//!< Columns of R sorted by descending norm
+	std::vector<double> norms;					//!< Norm of each column of R
+	gsl_matrix *cur_U;									//!< Output U of svd()
+
+	// State of the current pseudo-inverse, see pinv()
+	double *Ut;													//!< First nmodes columns of U, transposed (nmodes x m, row-major)
+	double *Vs;													//!< First nmodes columns of V, scaled by 1/s (n x nmodes, row-major)
+	size_t nmodes;											//!< Modes used in pseudo-inverse
+	gsl_matrix *cur_X;									//!< Output of pinv()
+
+	progress_slot progress;							//!< Progress callback
+	double prog_off0;										//!< Off-diagonal correlation after the first sweep (for progress)
+
+	void _worker_func();								//!< Worker function
+	int _worker_getid() { return __sync_fetch_and_add(&workid, 1); }
+	void _run(const job_t job);					//!< Run job on all threads, blocks until done
+	void _sync(const int t) { barrier.wait(sense[t]); } //!< Barrier between steps within a job
+	void _report(const char *stage, const double frac); //!< Report progress (calling thread only)
+
+	void _qr(const int t);							//!< Job: blocked Householder QR of W
+	void _jacobi(const int t);					//!< Job: one-sided Jacobi sweeps over R^T
+	void _form_u(const int t);					//!< Job: U = Q [Vw; 0], in the order of Pinv::order
+	void _form_x(const int t);					//!< Job: X = Vs Ut
+
+public:
+	/*! @brief Start worker threads
+
+	 @param [in] io Message IO
+	 @param [in] nthr Number of threads including the calling thread, 0 for all available CPUs
+	 */
+	Pinv(Io &io, const int nthr=0);
+	~Pinv();
+
+	int get_nthread() const { return nthread; }
+	int get_sweeps() const { return sweeps; } //!< Jacobi sweeps used by the last svd()
+
+	void set_progress(const progress_slot &slot) { progress = slot; }
+
+	/*! @brief Singular value decomposition A = U S V^T
+
+	 Same contract as gsl_linalg_SV_decomp(): A is m x n with m >= n, U is m x n
+	 with orthonormal columns, s holds the n singular values in descending
+	 order, V is n x n orthogonal. Columns of V for zero singular values are
+	 zero. Blocks until done. Not reentrant.
+
+	 @param [in] *A Matrix to decompose (not changed)
+	 @param [out] *U Left singular vectors (m x n)
+	 @param [out] *s Singular values (n)
+	 @param [out] *V Right singular vectors (n x n)
+	 @return 0 on success, 1 if Jacobi did not converge in Pinv::MAXSWEEP sweeps (results are approximate), -1 on size mismatch
+	 */
+	int svd(const gsl_matrix *A, gsl_matrix *U, gsl_vector *s, gsl_matrix *V);
+
+	/*! @brief Truncated pseudo-inverse X = V S^-1 U^T using the first nmodes singular values
+
+	 Modes with a zero singular value contribute nothing.
+
+	 @param [in] *U Left singular vectors (m x n)
+	 @param [in] *s Singular values (n)
+	 @param [in] *V Right singular vectors (n x n)
+	 @param [in] nmodes Number of modes to use (at most n)
+	 @param [out] *X Pseudo-inverse (n x m)
+	 @return 0 on success, -1 on size mismatch
+	 */
+	int pinv(const gsl_matrix *U, const gsl_vector *s, const gsl_matrix *V, const size_t nmodes, gsl_matrix *X);
+};
+
+#endif // HAVE_PINV_H
@@ -0,0 +1,64 @@
+/*
+ rawrec.h -- File format of raw frame recordings
+
+ This file is part of FOAM.
+
+ FOAM is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ FOAM is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FOAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HAVE_RAWREC_H
+#define HAVE_RAWREC_H
+
+#include <stdint.h>
+
+/*!
+ @brief Raw frame recordings, as written by Camera with 'store raw'
+
+ A recording consists of two files with the same base name:
+
+ \li <base>.raw: the frames, back to back, rawrec_hdr_t::framesize bytes
+		each, in native byte order
+ \li <base>.idx: a rawrec_hdr_t, followed by one rawrec_idx_t per frame
+
+ rawrec_hdr_t::nframes is written when the recording is closed. If it is
+ zero (e.g. after a crash), the number of index records gives the number of
+ frames. foam-raw2fits converts a recording into a FITS cube.
+ */
+
+#define RAWREC_MAGIC "FOAMRAW1"						//!< rawrec_hdr_t::magic
+#define RAWREC_VERSION 1									//!< rawrec_hdr_t::version
+
+typedef struct rawrec_hdr {
+	char magic[8];													//!< RAWREC_MAGIC (not terminated)
+	uint32_t version;												//!< RAWREC_VERSION
+	uint32_t width;													//!< Frame width [pixels]
+	uint32_t height;												//!< Frame height [pixels]
+	uint32_t depth;													//!< Bits per pixel in the file (8, 16 or 32)
+	uint64_t framesize;											//!< Bytes per frame in the .raw file
+	uint64_t nframes;												//!< Number of frames recorded (0 if not closed)
+	double exposure;												//!< Exposure time [s]
+	double interval;												//!< Frame cadence [s]
+	double gain;														//!< Camera gain
+	double offset;													//!< Camera offset
+	char devname[64];												//!< FOAM device name (terminated)
+} rawrec_hdr_t;
+
+typedef struct rawrec_idx {
+	uint64_t id;														//!< Camera frame id (Camera::frame_t::id)
+	int64_t tv_sec;													//!< Frame timestamp, seconds (Camera::frame_t::tv)
+	int32_t tv_usec;												//!< Frame timestamp, microseconds
+	int32_t depth;													//!< Frame depth [bits] (Camera::frame_t::depth)
+} rawrec_idx_t;
+
+#endif // HAVE_RAWREC_H
@@ -26,6 +26,18 @@
 #define _BSD_SOURCE
 #endif
 #include <unistd.h>
+#include <sched.h>
+#include <string.h>
+#include <pthread.h>
+#include <algorithm>
+#include <new>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+#include <cmath>
+#ifdef HAVE_FFTW
+#include <fftw3.h>
+#endif
 
 #include "io.h"
 #include "types.h"
@@ -34,14 +46,47 @@
 
 #include "shift.h"
 
+//! Cross-correlation data, kept out of shift.h such that it does not depend on FFTW
+struct Shift::corrdata {
+	corrdata(): refsel(-1), interp(INTERP_PARABOLIC), ref_valid(false), plans_valid(false) { }
+	volatile int refsel;								//!< Reference subimage, or -1 for the mean of all subimages
+	volatile interp_t interp;						//!< Subpixel interpolation method
+	volatile bool ref_valid;						//!< Reference image is up to date
+	bool plans_valid;										//!< Plans are up to date with the layout and reference
+	coord_t refsize;										//!< Size of reference image
+	std::vector<double> ref;						//!< Reference image, mean subtracted (refsize.y rows of refsize.x)
+	std::vector<int> planidx;						//!< Plan (index in plans) for each subimage in the layout
+#ifdef HAVE_FFTW
+	typedef struct plan {
+		coord_t size;											//!< Subimage size for this plan
+		fftw_plan fwd;										//!< Forward (r2c) plan
+		fftw_plan inv;										//!< Inverse (c2r) plan
+		fftw_complex *reffft;							//!< Complex conjugate of reference spectrum at this size
+	} plan_t;
+	typedef struct buf {
+		double *in;												//!< Real input (subimage)
+		fftw_complex *fft;								//!< Complex spectrum
+		double *out;											//!< Real output (correlation)
+	} buf_t;
+	std::vector<plan_t> plans;					//!< FFTW plans, one per distinct subimage size
+	std::vector<buf_t> bufs;						//!< Scratch buffers, one set per worker (and one for the main thread)
+#endif
+};
+
 Shift::Shift(Io &io, const int nthr): 
-io(io), running(true), nworker(nthr), workid(0) 
+io(io), running(true), spin_ns(50000), nworker(nthr > 0 ? nthr : auto_workers()), workid(0), prio(0), jobchunk(0),
+simd(SIMD_NONE), cogsigma(0), cogwin(8), cogniter(3), satlevel(0)
 {
+	corr = new corrdata;
 	io.msg(IO_DEB2, "Shift::Shift()");
 	
+	// Select fastest CoG kernel for this CPU
+	set_simd(SIMD_AUTO);
+	// Empty layout until set_layout() is called
+	_partition();
+	
 	// Startup workers
-	//! @todo Worker (workers) threads neet attr for scheduling etc (?)
-	//workers = new pthread::thread[nworker];
+	workertid.resize(nworker);
 
 	// Use this slot to point to a member function of this class (only used at start)
 	sigc::slot<void> funcslot = sigc::mem_fun(this, &Shift::_worker_func);
@@ -50,210 +95,1398 @@ io(io), running(true), nworker(nthr), workid(0)
 		tmp.create(funcslot);
 		workers.push_back(tmp);
 	}	
+	
+	// Wait until all workers registered, such that they can be pinned
+	started.wait(nworker, spin_ns);
+	io.msg(IO_XNFO, "Shift::Shift() started %d workers", nworker);
+}
+
+int Shift::auto_workers() {
+	int ncpu = 0;
+#ifdef __linux__
+	// CPUs we may run on, this respects taskset and cpusets
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof set, &set) == 0)
+		ncpu = CPU_COUNT(&set);
+#endif
+	if (ncpu <= 0)
+		ncpu = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	// Leave one CPU for the calling thread
+	return std::max(ncpu - 1, 1);
+}
+
+std::vector<int> Shift::parse_cpus(const std::string &str) {
+	std::vector<int> list;
+	const char *p = str.c_str();
+	char *end;
+	
+	while (*p) {
+		if (*p == ',' || *p == ' ') {
+			p++;
+			continue;
+		}
+		long lo = strtol(p, &end, 10), hi = lo;
+		if (end == p || lo < 0)
+			return std::vector<int>();
+		p = end;
+		if (*p == '-') {
+			hi = strtol(++p, &end, 10);
+			if (end == p || hi < lo)
+				return std::vector<int>();
+			p = end;
+		}
+		for (long c=lo; c<=hi; c++)
+			list.push_back((int) c);
+	}
+	return list;
+}
+
+bool Shift::_apply_affinity(const int wid) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (cpus.empty())
+		sched_getaffinity(0, sizeof set, &set);
+	else
+		CPU_SET(cpus[wid % cpus.size()], &set);
+	
+	const int rc = pthread_setaffinity_np(workertid[wid], sizeof set, &set);
+	if (rc) {
+		io.msg(IO_WARN, "Shift::_apply_affinity() could not pin worker %d: %s", wid, strerror(rc));
+		return false;
+	}
+	return true;
+#else
+	if (!cpus.empty())
+		io.msg(IO_WARN, "Shift::_apply_affinity() CPU pinning not supported on this platform");
+	return cpus.empty();
+#endif
+}
+
+bool Shift::_apply_priority(const int wid) {
+	struct sched_param param;
+	memset(&param, 0, sizeof param);
+	param.sched_priority = prio;
+	
+	const int rc = pthread_setschedparam(workertid[wid], prio > 0 ? SCHED_FIFO : SCHED_OTHER, &param);
+	if (rc) {
+		io.msg(IO_WARN, "Shift::_apply_priority() could not set priority %d for worker %d: %s", prio, wid, strerror(rc));
+		return false;
+	}
+	return true;
+}
+
+bool Shift::set_affinity(const std::vector<int> &newcpus) {
+	cpus = newcpus;
+	bool ret = true;
+	for (int w=0; w<nworker; w++)
+		ret &= _apply_affinity(w);
+	
+	std::string cpustr;
+	for (size_t c=0; c<cpus.size(); c++)
+		cpustr += format("%d ", cpus[c]);
+	io.msg(IO_XNFO, "Shift::set_affinity() workers pinned to: %s", cpus.empty() ? "(any)" : cpustr.c_str());
+	return ret;
+}
+
+bool Shift::set_priority(const int newprio) {
+	prio = newprio > 0 ? clamp(newprio, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO)) : 0;
+	bool ret = true;
+	for (int w=0; w<nworker; w++)
+		ret &= _apply_priority(w);
+	
+	io.msg(IO_XNFO, "Shift::set_priority() workers use %s", prio > 0 ? format("SCHED_FIFO priority %d", prio).c_str() : "default scheduling");
+	return ret;
+}
+
+void Shift::first_touch(gsl_vector_float *shifts, gsl_vector_float *stats) {
+	// Only workers should touch the data, so don't help out as in wait()
+	const handle_t h = _submit(COG, 8, NULL, fcoord_t(0, 0), shifts, 0, stats, NULL, true);
+	jobs[h % NSLOT].done.wait(h + 1, spin_ns);
 }
 
 Shift::~Shift() {
 	io.msg(IO_DEB2, "Shift::~Shift()");
-	// Set running to false, broadcast to workers that they can stop
-	running = false;
-	work_cond.broadcast();
+	wait();
+	
+	// Set running to false and wake the workers, they will see !running and quit.
+	__atomic_store_n(&running, false, __ATOMIC_SEQ_CST);
+	submitted.add(1);
+	for (size_t w=0; w<workers.size(); w++)
+		workers[w].join();
+	
+	for (int s=0; s<NSLOT; s++)
+		for (size_t w=0; w<jobs[s].partial.size(); w++)
+			free(jobs[s].partial[w]);
+	
+	_corr_free();
+	delete corr;
 }
 
 void Shift::_worker_func() {
+	int id = _worker_getid();
+	int next = 0;
+	io.msg(IO_XNFO, "Shift::_worker_func() new worker (id=%d n=%d)", id, nworker);
+	workertid[id] = pthread_self();
+	started.add(1);
+	
+	while (true) {
+		// Wait for job 'next' to be submitted
+		submitted.wait(next+1, spin_ns);
+		if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+			break;
+		
+		job_t &job = jobs[next % NSLOT];
+		_run_job(job, id);
+		
+		// Done with this slot, it can be reused
+		job.left.add(1);
+		next++;
+	}
+}
+
+void Shift::_run_job(job_t &job, const int wid) {
+	const int njobs = job.njobs;
+	
+	// Workers start at their home partition and go up, the calling thread 
+	// starts at the last partition and goes down
+	const bool worker = wid < nworker;
+	const int home = worker ? (int) ((int64_t) wid * njobs / nworker) : njobs-1;
+	
+	// Claim partitions (chunks of crop fields) until all are claimed
+	for (int i=0; i<njobs && __atomic_load_n(&job.jobnext, __ATOMIC_RELAXED) < njobs; i++) {
+		const int part = worker ? (home + i) % njobs : home - i;
+		if (__atomic_load_n(&job.claimed[part], __ATOMIC_RELAXED) || __atomic_exchange_n(&job.claimed[part], 1, __ATOMIC_ACQ_REL))
+			continue;
+		__sync_fetch_and_add(&job.jobnext, 1);
+		
+		_process(job, part, wid);
+		// The last partition to finish completes the job
+		if (__sync_add_and_fetch(&job.jobdone, 1) == njobs) {
+			if (job.recon.rec)
+				_recon_reduce(job);
+			job.done.set(job.ticket + 1);
+		}
+	}
+}
+
+void Shift::_process(job_t &job, const int jobidx, const int wid) {
+	// Batch jobs have nparts partitions per frame
+	const int frame = jobidx / job.nparts, part = jobidx % job.nparts;
+	
+	if (job.touch) {
+		for (int idx=layout.part[part]; idx<layout.part[part+1]; idx++) {
+			gsl_vector_float_set(job.shifts, idx*2+0, 0.0);
+			gsl_vector_float_set(job.shifts, idx*2+1, 0.0);
+			for (int k=0; job.stats && k<NSTAT; k++)
+				gsl_vector_float_set(job.stats, idx*NSTAT + k, 0.0);
+		}
+		return;
+	}
+	
+	const void *img = job.img;
+	gsl_vector_float *shifts = job.shifts, *stats = job.stats;
+	gsl_vector_float_view shiftrow, statrow;
+	if (job.bshifts) {
+		img = job.frames[frame];
+		shiftrow = gsl_matrix_float_row(job.bshifts, frame);
+		shifts = &shiftrow.vector;
+		if (job.bstats) {
+			statrow = gsl_matrix_float_row(job.bstats, frame);
+			stats = &statrow.vector;
+		}
+	}
+	
+	// Select pixel type once per partition, not per subimage
+	switch (job.bpp) {
+		case 8:
+			_process_t(job, (const uint8_t *) img, part, wid, shifts, stats); break;
+		case 16:
+			_process_t(job, (const uint16_t *) img, part, wid, shifts, stats); break;
+		case 32:
+			_process_t(job, (const uint32_t *) img, part, wid, shifts, stats); break;
+		default:
+			throw format("Shift::_process(): bitdepth %d unsupported!", job.bpp);
+	}
+	
+	// Reconstruct these shifts while they are still in cache
+	if (job.recon.rec)
+		_recon_accumulate(job, part, wid);
+}
+
+void Shift::_recon_accumulate(job_t &job, const int part, const int wid) {
+	const size_t r0 = layout.part[part] * 2, r1 = layout.part[part+1] * 2;
+	float *x = &job.reconx[0];
+	for (size_t r=r0; r<r1; r++)
+		x[r] = gsl_vector_float_get(job.shifts, r) - (job.recon.ref ? gsl_vector_float_get(job.recon.ref, r) : 0.0f);
+	
+	// The first partition this thread processes in this job starts from zero
+	if (!job.pused[wid]) {
+		memset(job.partial[wid], 0, job.partcap * sizeof(float));
+		job.pused[wid] = 1;
+	}
+	job.recon.mvm->accumulate(*job.recon.rec, x, job.partial[wid], r0, r1);
+}
+
+void Shift::_recon_reduce(job_t &job) {
+	// All other partitions are done (jobdone), so the partial vectors are final
+	gsl_vector_float *act = job.recon.act;
+	gsl_vector_float_set_zero(act);
+	for (int w=0; w<=nworker; w++) {
+		if (!job.pused[w])
+			continue;
+		const float *p = job.partial[w];
+		for (size_t c=0; c<act->size; c++)
+			*gsl_vector_float_ptr(act, c) += p[c];
+	}
+}
+
+template <typename T> void Shift::_process_t(const job_t &job, const T *img, const int part, const int wid, gsl_vector_float *shifts, gsl_vector_float *stats) {
+	const T mini = (T) job.mini;
 	float shift[2];
-	int id=0;
-	{
-		pthread::mutexholder h(&work_mutex);
-		id = _worker_getid();
-		io.msg(IO_XNFO, "Shift::_worker_func() new worker (id=%d n=%d)", id, nworker);
-	}
-	
-
-	while (running) {
-		{
-			pthread::mutexholder h1(&work_mutex);
-			{
-				//! @todo This check is also performed the first time that _worker_func() runs, while this is not necessary. Move this code to the end of this loop?
-				pthread::mutexholder h2(&workpool.mutex);
-				// Increment thread done counter, broadcast signal if we are the last thread
-				if (++(workpool.done) == nworker) {
-					// Lock the work_done_mutex, then broadcast the signal. The 
-					// mutexholder will go out of scope and unlock automatically
-					pthread::mutexholder h3(&work_done_mutex);
-					work_done_cond.broadcast();
-				}
-			}		
-			work_cond.wait(work_mutex);
+	
+	for (int idx=layout.part[part]; idx<layout.part[part+1]; idx++) {
+		switch (job.method) {
+			case CORR:
+				_calc_corr(img, idx, wid, job.maxshift, shift);
+				break;
+			case COG_WEIGHT:
+				_calc_cog_weight(img, idx, job.maxshift, shift, mini);
+				break;
+			case COG_WINDOW:
+			case COG_ITER:
+				_calc_cog_window(img, idx, job.maxshift, shift, mini, job.method == COG_ITER);
+				break;
+			case COG:
+			default:
+				// Fused shift and spot metrics
+				if (stats)
+					_calc_stats(img, idx, job.maxshift, shift, mini, stats);
+				else
+					_calc_cog(img, idx, job.maxshift, shift, mini);
+				break;
 		}
 		
-		while (running) {
-			int myjob=0;
-			{
-				pthread::mutexholder h(&workpool.mutex);
-				myjob = workpool.jobid--;
+		if (stats && job.method != COG)
+			_calc_stats(img, idx, job.maxshift, (float *) NULL, mini, stats);
+		
+		//! @todo might give problems with 64 bit systems? Better to reserve a block per thread?
+		gsl_vector_float_set(shifts, idx*2+0, shift[0]);
+		gsl_vector_float_set(shifts, idx*2+1, shift[1]);
+	}
+}
+
+Shift::job_t &Shift::_next_slot() {
+	const handle_t h = submitted.get();
+	job_t &job = jobs[h % NSLOT];
+	
+	// Slot is free once all workers have left it, which implies the previous 
+	// job in this slot is done
+	job.left.wait(job.uses * nworker, spin_ns);
+	
+	job.ticket = h;
+	job.img = job.refimg = NULL;
+	job.frames.clear();
+	job.shifts = job.stats = NULL;
+	job.bshifts = job.bstats = NULL;
+	job.recon = recon_t();
+	job.touch = false;
+	return job;
+}
+
+Shift::handle_t Shift::_publish(job_t &job, const int nframes) {
+	job.nparts = layout.part.size() - 1;
+	job.njobs = job.nparts * nframes;
+	job.claimed.assign(job.njobs, 0);
+	job.jobnext = 0;
+	job.jobdone = 0;
+	job.uses++;
+	if (job.njobs == 0) {
+		if (job.recon.rec)
+			gsl_vector_float_set_zero(job.recon.act);
+		job.done.set(job.ticket + 1);
+	}
+	
+	// Publish the job to the workers
+	submitted.add(1);
+	return job.ticket;
+}
+
+Shift::handle_t Shift::_submit(const method_t method, const int bpp, const void *img, const fcoord_t maxshift, gsl_vector_float *shifts, const uint32_t mini, gsl_vector_float *stats, const recon_t *recon, const bool touch) {
+	job_t &job = _next_slot();
+	job.method = method;
+	job.bpp = bpp;
+	job.img = (void *) img;
+	job.mini = mini;
+	job.maxshift = maxshift;
+	job.shifts = shifts;
+	job.stats = stats;
+	job.touch = touch;
+	
+	if (recon) {
+		job.recon = *recon;
+		// Private command vectors, one per worker plus one for the caller (in wait())
+		const size_t n = recon->rec->stride;
+		if (job.partcap < n) {
+			for (size_t w=0; w<job.partial.size(); w++)
+				free(job.partial[w]);
+			job.partial.assign(nworker+1, (float *) NULL);
+			for (int w=0; w<=nworker; w++) {
+				void *p = NULL;
+				if (posix_memalign(&p, 64, n * sizeof(float)))
+					throw std::bad_alloc();
+				job.partial[w] = (float *) p;
 			}
-			if (myjob < 0)
-				break;
-			
-			if (workpool.bpp == 8)
-				_calc_cog((uint8_t *)workpool.img, workpool.res, workpool.crops[myjob], workpool.maxshift, shift, (uint8_t)workpool.mini);
-			else if (workpool.bpp == 16)
-				_calc_cog((uint16_t *)workpool.img, workpool.res, workpool.crops[myjob], workpool.maxshift, shift, (uint16_t)workpool.mini);
-			else
-				throw format("Shift::_worker_func(): bitdepth %d unsupported!", workpool.bpp);
-			
-			//workpool.shifts->data[workpool.shifts->stride * myjob * 2 + 0]
-			//workpool.shifts->data[workpool.shifts->stride * myjob * 2 + 1]
+			job.partcap = n;
+		}
+		job.pused.assign(nworker+1, 0);
+		job.reconx.resize(recon->rec->rows);
+	}
+	return _publish(job, 1);
+}
+
+bool Shift::done(const handle_t h) const {
+	return h < 0 || jobs[h % NSLOT].done.reached(h + 1);
+}
+
+void Shift::wait(const handle_t h) {
+	if (h < 0)
+		return;
+	job_t &job = jobs[h % NSLOT];
+	if (job.done.reached(h + 1))
+		return;
+	
+	// Help out instead of idling, we use the scratch buffers after the workers'
+	if (job.ticket == h)
+		_run_job(job, nworker);
+	job.done.wait(h + 1, spin_ns);
+}
 
-			//! @todo might give problems with 64 bit systems? Better to reserve a block per thread?
-			gsl_vector_float_set(workpool.shifts, myjob*2+0, shift[0]);
-			gsl_vector_float_set(workpool.shifts, myjob*2+1, shift[1]);
+void Shift::wait() {
+	for (int s=0; s<NSLOT; s++)
+		if (jobs[s].uses > 0)
+			wait(jobs[s].ticket);
+}
+
+int Shift::set_layout(const std::vector<vector_t> &crops, const coord_t res) {
+	// Keep the old layout if any crop field is outside the image
+	for (size_t i=0; i<crops.size(); i++) {
+		const vector_t &crop = crops[i];
+		if (crop.lx < 0 || crop.ly < 0 || crop.tx > res.x || crop.ty > res.y) {
+			io.msg(IO_ERR, "Shift::set_layout() crop field %zu (%d,%d)-(%d,%d) outside %dx%d image", 
+						 i, crop.lx, crop.ly, crop.tx, crop.ty, res.x, res.y);
+			return -1;
 		}
 	}
+	
+	// Workers might still be using the old layout
+	wait();
+	
+	layout.res = res;
+	layout.n = crops.size();
+	layout.offset.resize(layout.n);
+	layout.width.resize(layout.n);
+	layout.height.resize(layout.n);
+	layout.cx.resize(layout.n);
+	layout.cy.resize(layout.n);
+	layout.wclass.resize(layout.n);
+	
+	for (int i=0; i<layout.n; i++) {
+		const vector_t &crop = crops[i];
+		layout.offset[i] = (size_t) crop.ly * res.x + crop.lx;
+		layout.width[i] = std::max(crop.tx - crop.lx, 0);
+		layout.height[i] = std::max(crop.ty - crop.ly, 0);
+		// Same convention as before: integer division
+		layout.cx[i] = (crop.tx - crop.lx)/2;
+		layout.cy[i] = (crop.ty - crop.ly)/2;
+		layout.wclass[i] = cog_class(layout.width[i]);
+	}
+	
+	// Correlation plans depend on the subimage sizes
+	corr->plans_valid = false;
+	
+	// Windows start at the subimage centre
+	layout.lastpos.assign(layout.n * 2, 0.0);
+	
+	_build_weights();
+	_partition();
+	return layout.n;
+}
+
+void Shift::set_chunk(const int n) {
+	wait();
+	jobchunk = n < 0 ? 0 : n;
+	_partition();
+}
+
+void Shift::_build_weights() {
+	layout.wmaskoff.resize(layout.n);
+	size_t npix = 0;
+	for (int i=0; i<layout.n; i++) {
+		layout.wmaskoff[i] = npix;
+		npix += (size_t) layout.width[i] * layout.height[i];
+	}
+	layout.wmask.resize(npix);
+	
+	// Gaussian centered on the subimage centre, i.e. where CoG gives zero shift
+	for (int i=0; i<layout.n; i++) {
+		const int w = layout.width[i], h = layout.height[i];
+		const double sigma = cogsigma > 0 ? cogsigma : std::max(std::min(w, h) / 4.0, 1.0);
+		float *m = &layout.wmask[layout.wmaskoff[i]];
+		for (int y=0; y<h; y++)
+			for (int x=0; x<w; x++)
+				m[y*w + x] = (float) exp(-(pow(x - layout.cx[i], 2) + pow(y - layout.cy[i], 2)) / (2 * sigma * sigma));
+	}
+}
+
+void Shift::set_cog_sigma(const double sigma) {
+	wait();
+	cogsigma = sigma < 0 ? 0 : sigma;
+	_build_weights();
+}
+
+void Shift::set_cog_window(const int n) {
+	wait();
+	cogwin = std::max(n, 1);
+}
+
+void Shift::set_cog_niter(const int n) {
+	wait();
+	cogniter = std::max(n, 1);
+}
+
+void Shift::_partition() {
+	layout.part.clear();
+	layout.part.push_back(0);
+	if (layout.n == 0)
+		return;
+	
+	// Number of jobs: jobchunk subimages per job, or ~4 jobs per worker
+	int njobs = jobchunk > 0 ? (layout.n + jobchunk - 1) / jobchunk : 4 * nworker;
+	njobs = clamp(njobs, 1, layout.n);
+	
+	size_t npix = 0;
+	for (int i=0; i<layout.n; i++)
+		npix += (size_t) layout.width[i] * layout.height[i];
+	
+	// Cut whenever the cumulative pixel count passes the next 1/njobs fraction
+	size_t cum = 0;
+	for (int i=0; i<layout.n; i++) {
+		cum += (size_t) layout.width[i] * layout.height[i];
+		if (i == layout.n-1 || cum * njobs >= npix * layout.part.size())
+			layout.part.push_back(i+1);
+	}
+	
+	io.msg(IO_DEB1, "Shift::_partition() %d subimages, %zu pixels in %zu jobs", layout.n, npix, layout.part.size()-1);
+}
+
+/*
+ * CoG kernels
+ *
+ * Each kernel sums (p-mini)*x, (p-mini)*y and (p-mini) over all pixels p >= 
+ * mini in a crop field, with x, y relative to the crop origin. The SIMD 
+ * kernels use saturating subtraction for the threshold (p < mini gives 0, 
+ * identical to skipping the pixel), widen pixels to 32 bit lanes and process 
+ * rows in blocks of COG_BLOCK pixels such that the 32 bit lane sums cannot 
+ * overflow (65535 * sum(0..255) < 2^32). Row sums are flushed to 64 bit, such 
+ * that all kernels give exactly the same result. 32 bit pixels are 
+ * accumulated in 64 bit directly (see cog_acc).
+ */
+
+#define COG_BLOCK 256
+
+//! Accumulator type for a block of COG_BLOCK pixels of type T
+template <typename T> struct cog_acc { typedef uint32_t type; };
+template <> struct cog_acc<uint32_t> { typedef uint64_t type; };
+
+template <typename T, typename A> static inline void cog_row_scalar(const T *p, const int n, const T mini, A *rsum, A *rx) {
+	A s=0, x=0;
+	for (int i=0; i<n; i++) {
+		// Skip pixels with too low an intensity
+		if (p[i] < mini)
+			continue;
+		// We subtract the constant background as it introduces an offset shift 
+		// in the CoG tracking
+		const A f = p[i]-mini;
+		s += f;
+		x += f * i;
+	}
+	*rsum = s;
+	*rx = x;
 }
 
-void Shift::_calc_cog(const uint8_t *img, const coord_t &res, const vector_t &crop, const fcoord_t maxshift, float *v, const uint8_t mini) {
-	uint8_t *p;
-	float sum;
+template <typename A> static inline void cog_flush(const int i0, const int j, const A rsum, const A rx, uint64_t *sums) {
+	sums[0] += rx + (uint64_t) rsum * i0;
+	sums[1] += (uint64_t) rsum * j;
+	sums[2] += rsum;
+}
 
-	sum = v[0] = v[1] = 0.0;
+template <typename T> static void cog_scalar(const T *img, const int stride, const int w, const int h, const T mini, uint64_t *sums) {
+	typename cog_acc<T>::type rsum, rx;
+	sums[0] = sums[1] = sums[2] = 0;
 	
 	// i,j loop over the pixels inside the crop field for *img
-	for (int j=crop.ly; j<crop.ty; j++) {
-		// j is the vertical counter, store the beginning of the current row here:
-		p = (uint8_t *) img;
-		p += (j*res.x) + crop.lx;
-		// img = data origin, j * res.x skips a few rows, crop.llpos.x gives the 
-		// offset for the current row.
-		for (int i=crop.lx; i<crop.tx; i++) {
-			// Skip pixels with too low an intensity
-			if (*p < mini) {
-				p++;
-				continue;
+	for (int j=0; j<h; j++) {
+		// img = crop field origin, j * stride skips a few rows
+		const T *p = img + (size_t) j * stride;
+		for (int i0=0; i0<w; i0 += COG_BLOCK) {
+			int n = std::min(COG_BLOCK, w-i0);
+			cog_row_scalar(p + i0, n, mini, &rsum, &rx);
+			cog_flush(i0, j, rsum, rx, sums);
+		}
+	}
+}
+
+/*! @brief CoG sums for a crop field of fixed width W
+ 
+ Accumulates flux and y-weighted flux per column over blocks of COG_BLOCK 
+ rows, and reduces the columns once per block. With W known at compile time 
+ the column loop is unrolled and vectorized without a tail, and there is no 
+ horizontal reduction per row as in the generic kernels. The sums are the 
+ same integers as cog_scalar() gives. Always inlined in the cog_fixed 
+ variants below, such that it is compiled for each instruction set.
+ */
+template <typename T, int W> static inline __attribute__((always_inline)) void cog_fixed_body(const T *img, const int stride, const int h, const T mini, uint64_t *sums) {
+	typedef typename cog_acc<T>::type A;
+	A cs[W], cy[W];
+	sums[0] = sums[1] = sums[2] = 0;
+	
+	for (int j0=0; j0<h; j0 += COG_BLOCK) {
+		const int n = std::min(COG_BLOCK, h-j0);
+		for (int i=0; i<W; i++)
+			cs[i] = cy[i] = 0;
+		for (int j=0; j<n; j++) {
+			const T *p = img + (size_t) (j0+j) * stride;
+			for (int i=0; i<W; i++) {
+				// Branchless threshold, identical to skipping pixels below mini
+				const A f = p[i] >= mini ? (A) (p[i]-mini) : 0;
+				cs[i] += f;
+				cy[i] += f * (A) j;
 			}
-			// We subtract the constant background as it introduces an offset shift 
-			// in the CoG tracking
-			v[0] += ((*p)-mini) * i;
-			v[1] += ((*p)-mini) * j;
-			sum += ((*p)-mini);
-			p++;
+		}
+		for (int i=0; i<W; i++) {
+			sums[0] += (uint64_t) cs[i] * i;
+			sums[1] += cy[i] + (uint64_t) cs[i] * j0;
+			sums[2] += cs[i];
+		}
+	}
+}
+
+template <typename T, int W> static void cog_fixed(const T *img, const int stride, const int, const int h, const T mini, uint64_t *sums) {
+	cog_fixed_body<T, W>(img, stride, h, mini, sums);
+}
+
+//! Set the fixed-width entries of kernel table tab to the instantiations of F for pixel type T
+#define COG_FILL_FIXED(tab, F, T) do { \
+	(tab).f[Shift::COGSIZE_8] = F<T, 8>; \
+	(tab).f[Shift::COGSIZE_16] = F<T, 16>; \
+	(tab).f[Shift::COGSIZE_24] = F<T, 24>; \
+	(tab).f[Shift::COGSIZE_32] = F<T, 32>; \
+} while (0)
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_SHIFT_X86SIMD
+
+template <typename T, int W> __attribute__((target("sse4.1"))) static void cog_fixed_sse4(const T *img, const int stride, const int, const int h, const T mini, uint64_t *sums) {
+	cog_fixed_body<T, W>(img, stride, h, mini, sums);
+}
+
+template <typename T, int W> __attribute__((target("avx2"))) static void cog_fixed_avx2(const T *img, const int stride, const int, const int h, const T mini, uint64_t *sums) {
+	cog_fixed_body<T, W>(img, stride, h, mini, sums);
+}
+
+template <typename T, int W> __attribute__((target("avx512f"))) static void cog_fixed_avx512(const T *img, const int stride, const int, const int h, const T mini, uint64_t *sums) {
+	cog_fixed_body<T, W>(img, stride, h, mini, sums);
+}
+
+__attribute__((target("sse4.1"))) static inline uint32_t hsum_sse4(__m128i v) {
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+	return (uint32_t) _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse4.1"))) static void cog_sse4_8(const uint8_t *img, const int stride, const int w, const int h, const uint8_t mini, uint64_t *sums) {
+	const __m128i vmini = _mm_set1_epi8((char) mini);
+	const __m128i four = _mm_set1_epi32(4);
+	uint32_t rsum, rx;
+	sums[0] = sums[1] = sums[2] = 0;
+	
+	for (int j=0; j<h; j++) {
+		const uint8_t *p = img + (size_t) j * stride;
+		for (int i0=0; i0<w; i0 += COG_BLOCK) {
+			const int n = std::min(COG_BLOCK, w-i0);
+			__m128i acc_s = _mm_setzero_si128(), acc_x = _mm_setzero_si128();
+			__m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+			int i=0;
+			for (; i+16<=n; i+=16) {
+				__m128i v = _mm_subs_epu8(_mm_loadu_si128((const __m128i *) (p+i0+i)), vmini);
+				for (int k=0; k<4; k++) {
+					__m128i w = _mm_cvtepu8_epi32(v);
+					acc_s = _mm_add_epi32(acc_s, w);
+					acc_x = _mm_add_epi32(acc_x, _mm_mullo_epi32(w, idx));
+					idx = _mm_add_epi32(idx, four);
+					v = _mm_srli_si128(v, 4);
+				}
+			}
+			rsum = hsum_sse4(acc_s);
+			rx = hsum_sse4(acc_x);
+			// Scalar tail
+			uint32_t ts, tx;
+			cog_row_scalar(p+i0+i, n-i, mini, &ts, &tx);
+			rsum += ts;
+			rx += tx + ts * i;
+			cog_flush(i0, j, rsum, rx, sums);
 		}
 	}
+}
+
+__attribute__((target("sse4.1"))) static void cog_sse4_16(const uint16_t *img, const int stride, const int w, const int h, const uint16_t mini, uint64_t *sums) {
+	const __m128i vmini = _mm_set1_epi16((short) mini);
+	const __m128i four = _mm_set1_epi32(4);
+	uint32_t rsum, rx;
+	sums[0] = sums[1] = sums[2] = 0;
 	
-	// Sum 0? Then we skip this subimage
-	if (sum <= 0) { 
-		v[0] = v[1] = 0.0;
-		return;
+	for (int j=0; j<h; j++) {
+		const uint16_t *p = img + (size_t) j * stride;
+		for (int i0=0; i0<w; i0 += COG_BLOCK) {
+			const int n = std::min(COG_BLOCK, w-i0);
+			__m128i acc_s = _mm_setzero_si128(), acc_x = _mm_setzero_si128();
+			__m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+			int i=0;
+			for (; i+8<=n; i+=8) {
+				__m128i v = _mm_subs_epu16(_mm_loadu_si128((const __m128i *) (p+i0+i)), vmini);
+				__m128i lo = _mm_cvtepu16_epi32(v);
+				__m128i hi = _mm_cvtepu16_epi32(_mm_srli_si128(v, 8));
+				acc_s = _mm_add_epi32(acc_s, _mm_add_epi32(lo, hi));
+				acc_x = _mm_add_epi32(acc_x, _mm_mullo_epi32(lo, idx));
+				idx = _mm_add_epi32(idx, four);
+				acc_x = _mm_add_epi32(acc_x, _mm_mullo_epi32(hi, idx));
+				idx = _mm_add_epi32(idx, four);
+			}
+			rsum = hsum_sse4(acc_s);
+			rx = hsum_sse4(acc_x);
+			uint32_t ts, tx;
+			cog_row_scalar(p+i0+i, n-i, mini, &ts, &tx);
+			rsum += ts;
+			rx += tx + ts * i;
+			cog_flush(i0, j, rsum, rx, sums);
+		}
 	}
+}
 
-	v[0] = clamp(v[0]/sum - crop.lx - (crop.tx - crop.lx)/2, -maxshift.x, maxshift.x);
-	v[1] = clamp(v[1]/sum - crop.ly - (crop.ty - crop.ly)/2, -maxshift.y, maxshift.y);
+__attribute__((target("avx2"))) static inline uint32_t hsum_avx2(__m256i v) {
+	__m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1,0,3,2)));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2,3,0,1)));
+	return (uint32_t) _mm_cvtsi128_si32(s);
 }
 
-void Shift::_calc_cog(const uint16_t *img, const coord_t &res, const vector_t &crop, const fcoord_t maxshift, float *v, const uint16_t mini) {
-	uint16_t *p;
-	float sum;
+__attribute__((target("avx2"))) static void cog_avx2_8(const uint8_t *img, const int stride, const int w, const int h, const uint8_t mini, uint64_t *sums) {
+	const __m128i vmini = _mm_set1_epi8((char) mini);
+	const __m256i eight = _mm256_set1_epi32(8);
+	uint32_t rsum, rx;
+	sums[0] = sums[1] = sums[2] = 0;
 	
-	sum = v[0] = v[1] = 0.0;
+	for (int j=0; j<h; j++) {
+		const uint8_t *p = img + (size_t) j * stride;
+		for (int i0=0; i0<w; i0 += COG_BLOCK) {
+			const int n = std::min(COG_BLOCK, w-i0);
+			__m256i acc_s = _mm256_setzero_si256(), acc_x = _mm256_setzero_si256();
+			__m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+			int i=0;
+			for (; i+16<=n; i+=16) {
+				__m128i v = _mm_subs_epu8(_mm_loadu_si128((const __m128i *) (p+i0+i)), vmini);
+				__m256i lo = _mm256_cvtepu8_epi32(v);
+				__m256i hi = _mm256_cvtepu8_epi32(_mm_srli_si128(v, 8));
+				acc_s = _mm256_add_epi32(acc_s, _mm256_add_epi32(lo, hi));
+				acc_x = _mm256_add_epi32(acc_x, _mm256_mullo_epi32(lo, idx));
+				idx = _mm256_add_epi32(idx, eight);
+				acc_x = _mm256_add_epi32(acc_x, _mm256_mullo_epi32(hi, idx));
+				idx = _mm256_add_epi32(idx, eight);
+			}
+			rsum = hsum_avx2(acc_s);
+			rx = hsum_avx2(acc_x);
+			uint32_t ts, tx;
+			cog_row_scalar(p+i0+i, n-i, mini, &ts, &tx);
+			rsum += ts;
+			rx += tx + ts * i;
+			cog_flush(i0, j, rsum, rx, sums);
+		}
+	}
+}
+
+__attribute__((target("avx2"))) static void cog_avx2_16(const uint16_t *img, const int stride, const int w, const int h, const uint16_t mini, uint64_t *sums) {
+	const __m256i vmini = _mm256_set1_epi16((short) mini);
+	const __m256i eight = _mm256_set1_epi32(8);
+	uint32_t rsum, rx;
+	sums[0] = sums[1] = sums[2] = 0;
 	
-	// i,j loop over the pixels inside the crop field for *img
-	for (int j=crop.ly; j<crop.ty; j++) {
-		// j is the vertical counter, store the beginning of the current row here:
-		p = (uint16_t *) img;
-		p += (j*res.x) + crop.lx;
-		// img = data origin, j * res.x skips a few rows, crop.llpos.x gives the 
-		// offset for the current row.
-		for (int i=crop.lx; i<crop.tx; i++) {
-			// Skip pixels with too low an intensity
-			if (*p < mini) {
-				p++;
-				continue;
+	for (int j=0; j<h; j++) {
+		const uint16_t *p = img + (size_t) j * stride;
+		for (int i0=0; i0<w; i0 += COG_BLOCK) {
+			const int n = std::min(COG_BLOCK, w-i0);
+			__m256i acc_s = _mm256_setzero_si256(), acc_x = _mm256_setzero_si256();
+			__m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+			int i=0;
+			for (; i+16<=n; i+=16) {
+				__m256i v = _mm256_subs_epu16(_mm256_loadu_si256((const __m256i *) (p+i0+i)), vmini);
+				__m256i lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+				__m256i hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+				acc_s = _mm256_add_epi32(acc_s, _mm256_add_epi32(lo, hi));
+				acc_x = _mm256_add_epi32(acc_x, _mm256_mullo_epi32(lo, idx));
+				idx = _mm256_add_epi32(idx, eight);
+				acc_x = _mm256_add_epi32(acc_x, _mm256_mullo_epi32(hi, idx));
+				idx = _mm256_add_epi32(idx, eight);
 			}
-			// We subtract the constant background as it introduces an offset shift 
-			// in the CoG tracking
-			v[0] += ((*p)-mini) * i;
-			v[1] += ((*p)-mini) * j;
-			sum += ((*p)-mini);
-			p++;
+			rsum = hsum_avx2(acc_s);
+			rx = hsum_avx2(acc_x);
+			uint32_t ts, tx;
+			cog_row_scalar(p+i0+i, n-i, mini, &ts, &tx);
+			rsum += ts;
+			rx += tx + ts * i;
+			cog_flush(i0, j, rsum, rx, sums);
+		}
+	}
+}
+
+__attribute__((target("avx512f"))) static void cog_avx512_8(const uint8_t *img, const int stride, const int w, const int h, const uint8_t mini, uint64_t *sums) {
+	const __m128i vmini = _mm_set1_epi8((char) mini);
+	const __m512i sixteen = _mm512_set1_epi32(16);
+	uint32_t rsum, rx;
+	sums[0] = sums[1] = sums[2] = 0;
+	
+	for (int j=0; j<h; j++) {
+		const uint8_t *p = img + (size_t) j * stride;
+		for (int i0=0; i0<w; i0 += COG_BLOCK) {
+			const int n = std::min(COG_BLOCK, w-i0);
+			__m512i acc_s = _mm512_setzero_si512(), acc_x = _mm512_setzero_si512();
+			__m512i idx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+			int i=0;
+			for (; i+16<=n; i+=16) {
+				__m512i v = _mm512_cvtepu8_epi32(_mm_subs_epu8(_mm_loadu_si128((const __m128i *) (p+i0+i)), vmini));
+				acc_s = _mm512_add_epi32(acc_s, v);
+				acc_x = _mm512_add_epi32(acc_x, _mm512_mullo_epi32(v, idx));
+				idx = _mm512_add_epi32(idx, sixteen);
+			}
+			rsum = (uint32_t) _mm512_reduce_add_epi32(acc_s);
+			rx = (uint32_t) _mm512_reduce_add_epi32(acc_x);
+			uint32_t ts, tx;
+			cog_row_scalar(p+i0+i, n-i, mini, &ts, &tx);
+			rsum += ts;
+			rx += tx + ts * i;
+			cog_flush(i0, j, rsum, rx, sums);
+		}
+	}
+}
+
+__attribute__((target("avx512f"))) static void cog_avx512_16(const uint16_t *img, const int stride, const int w, const int h, const uint16_t mini, uint64_t *sums) {
+	const __m256i vmini = _mm256_set1_epi16((short) mini);
+	const __m512i sixteen = _mm512_set1_epi32(16);
+	uint32_t rsum, rx;
+	sums[0] = sums[1] = sums[2] = 0;
+	
+	for (int j=0; j<h; j++) {
+		const uint16_t *p = img + (size_t) j * stride;
+		for (int i0=0; i0<w; i0 += COG_BLOCK) {
+			const int n = std::min(COG_BLOCK, w-i0);
+			__m512i acc_s = _mm512_setzero_si512(), acc_x = _mm512_setzero_si512();
+			__m512i idx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+			int i=0;
+			for (; i+16<=n; i+=16) {
+				__m512i v = _mm512_cvtepu16_epi32(_mm256_subs_epu16(_mm256_loadu_si256((const __m256i *) (p+i0+i)), vmini));
+				acc_s = _mm512_add_epi32(acc_s, v);
+				acc_x = _mm512_add_epi32(acc_x, _mm512_mullo_epi32(v, idx));
+				idx = _mm512_add_epi32(idx, sixteen);
+			}
+			rsum = (uint32_t) _mm512_reduce_add_epi32(acc_s);
+			rx = (uint32_t) _mm512_reduce_add_epi32(acc_x);
+			uint32_t ts, tx;
+			cog_row_scalar(p+i0+i, n-i, mini, &ts, &tx);
+			rsum += ts;
+			rx += tx + ts * i;
+			cog_flush(i0, j, rsum, rx, sums);
 		}
 	}
+}
+
+#endif // x86 && GNUC
+
+Shift::simd_t Shift::detect_simd() {
+#ifdef HAVE_SHIFT_X86SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2"))
+		return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return SIMD_SSE4;
+#endif
+	return SIMD_NONE;
+}
+
+const char *Shift::simd_str(const simd_t s) {
+	switch (s) {
+		case SIMD_AUTO: return "auto";
+		case SIMD_NONE: return "none";
+		case SIMD_SSE4: return "sse4.1";
+		case SIMD_AVX2: return "avx2";
+		case SIMD_AVX512: return "avx512";
+	}
+	return "unknown";
+}
+
+bool Shift::set_simd(const simd_t s) {
+	// Queued jobs might be using the current kernel
+	wait();
 	
+	simd_t use = (s == SIMD_AUTO) ? detect_simd() : s;
+	
+	if (use > detect_simd()) {
+		io.msg(IO_WARN, "Shift::set_simd() %s not supported by this CPU, keeping %s", simd_str(use), simd_str(simd));
+		return false;
+	}
+
+	// There are no hand-written SIMD kernels for 32 bit pixels, the generic 
+	// kernel is scalar for every instruction set
+	cog32.f[COGSIZE_ANY] = cog_scalar<uint32_t>;
+	switch (use) {
+#ifdef HAVE_SHIFT_X86SIMD
+		case SIMD_AVX512:
+			cog8.f[COGSIZE_ANY] = cog_avx512_8; cog16.f[COGSIZE_ANY] = cog_avx512_16;
+			COG_FILL_FIXED(cog8, cog_fixed_avx512, uint8_t);
+			COG_FILL_FIXED(cog16, cog_fixed_avx512, uint16_t);
+			COG_FILL_FIXED(cog32, cog_fixed_avx512, uint32_t);
+			break;
+		case SIMD_AVX2:
+			cog8.f[COGSIZE_ANY] = cog_avx2_8; cog16.f[COGSIZE_ANY] = cog_avx2_16;
+			COG_FILL_FIXED(cog8, cog_fixed_avx2, uint8_t);
+			COG_FILL_FIXED(cog16, cog_fixed_avx2, uint16_t);
+			COG_FILL_FIXED(cog32, cog_fixed_avx2, uint32_t);
+			break;
+		case SIMD_SSE4:
+			cog8.f[COGSIZE_ANY] = cog_sse4_8; cog16.f[COGSIZE_ANY] = cog_sse4_16;
+			COG_FILL_FIXED(cog8, cog_fixed_sse4, uint8_t);
+			COG_FILL_FIXED(cog16, cog_fixed_sse4, uint16_t);
+			COG_FILL_FIXED(cog32, cog_fixed_sse4, uint32_t);
+			break;
+#endif
+		default:
+			use = SIMD_NONE;
+			cog8.f[COGSIZE_ANY] = cog_scalar<uint8_t>; cog16.f[COGSIZE_ANY] = cog_scalar<uint16_t>;
+			COG_FILL_FIXED(cog8, cog_fixed, uint8_t);
+			COG_FILL_FIXED(cog16, cog_fixed, uint16_t);
+			COG_FILL_FIXED(cog32, cog_fixed, uint32_t);
+			break;
+	}
+	simd = use;
+	io.msg(IO_XNFO, "Shift::set_simd() using %s CoG kernel", simd_str(simd));
+	return true;
+}
+
+/*! @brief Convert CoG sums to a shift relative to the crop field center (cx, cy) */
+static inline void cog_finish(const uint64_t *sums, const float cx, const float cy, const fcoord_t maxshift, float *v) {
 	// Sum 0? Then we skip this subimage
-	if (sum <= 0) { 
+	if (sums[2] == 0) { 
 		v[0] = v[1] = 0.0;
 		return;
 	}
 	
 	// We limit the shift vector to a maximum allowed shift
-	v[0] = clamp(v[0]/sum - crop.lx - (crop.tx - crop.lx)/2, -maxshift.x, maxshift.x);
-	v[1] = clamp(v[1]/sum - crop.ly - (crop.ty - crop.ly)/2, -maxshift.y, maxshift.y);
+	v[0] = clamp((float) ((double) sums[0]/sums[2] - cx), -maxshift.x, maxshift.x);
+	v[1] = clamp((float) ((double) sums[1]/sums[2] - cy), -maxshift.y, maxshift.y);
 }
 
-bool Shift::calc_shifts(const uint8_t *img, const coord_t res, const std::vector<vector_t> &crops, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const bool wait, const uint8_t mini) {
-//	io.msg(IO_DEB2, "Shift::calc_shifts(uint8_t)");
+template <typename T> void Shift::_calc_cog(const T *img, const int idx, const fcoord_t maxshift, float *v, const T mini) {
+	uint64_t sums[3];
+	_cogtab(img).f[layout.wclass[idx]](img + layout.offset[idx], layout.res.x, layout.width[idx], layout.height[idx], mini, sums);
+	cog_finish(sums, layout.cx[idx], layout.cy[idx], maxshift, v);
+}
+
+/*! @brief Sum CoG terms as cog_scalar(), and second moments, peak and saturated pixels
+ 
+ @param [out] *sums Sum of x-weighted, y-weighted, total flux (identical to the CoG kernels), x^2- and y^2-weighted flux
+ @param [out] *peak Maximum pixel value
+ @param [out] *nsat Number of pixels >= sat
+ */
+template <typename T> static void spot_stats(const T *img, const int stride, const int w, const int h, const T mini, const T sat, uint64_t *sums, T *peak, uint32_t *nsat) {
+	T pk=0;
+	uint32_t ns=0;
+	sums[0] = sums[1] = sums[2] = sums[3] = sums[4] = 0;
 	
-	// Setup work parameters
-	workpool.method = method;
-	workpool.bpp = (sizeof *img) * 8;
-	workpool.img = (void *) img;
-	workpool.res = res;
-	workpool.refimg = (void *) NULL;
-	workpool.mini = mini;
-	workpool.crops = crops;
-	workpool.maxshift = maxshift;
-	workpool.shifts = shifts;
-	workpool.jobid = crops.size()-1;
-	workpool.done = 0;
-	
-	{ 
-		// lock work_done_mutex, then broadcast work to all workers.
-		pthread::mutexholder h1(&work_done_mutex);
-		
-		{
-			pthread::mutexholder h2(&work_mutex);
-			work_cond.broadcast();
+	for (int j=0; j<h; j++) {
+		const T *p = img + (size_t) j * stride;
+		uint64_t s=0, x=0, xx=0;
+		for (int i=0; i<w; i++) {
+			pk = std::max(pk, p[i]);
+			ns += (p[i] >= sat);
+			const uint64_t f = p[i] >= mini ? p[i] - mini : 0;
+			s += f;
+			x += f * i;
+			xx += f * i * i;
 		}
-		
-		// Wait until the work is completed, with the mutex locked. The associated
-		// mutex will unlock automatically when mutexholder goes out of scope
-		if (wait)
-			work_done_cond.wait(work_done_mutex);
+		sums[0] += x;
+		sums[1] += s * j;
+		sums[2] += s;
+		sums[3] += xx;
+		sums[4] += s * j * j;
+	}
+	*peak = pk;
+	*nsat = ns;
+}
+
+template <typename T> void Shift::_calc_stats(const T *img, const int idx, const fcoord_t maxshift, float *v, const T mini, gsl_vector_float *stats) {
+	uint64_t sums[5];
+	T peak;
+	uint32_t nsat;
+	const T sat = (satlevel == 0 || satlevel > (T) ~0) ? (T) ~0 : (T) satlevel;
+	spot_stats(img + layout.offset[idx], layout.res.x, layout.width[idx], layout.height[idx], mini, sat, sums, &peak, &nsat);
+	
+	if (v)
+		cog_finish(sums, layout.cx[idx], layout.cy[idx], maxshift, v);
+	
+	double width = 0;
+	if (sums[2] > 0) {
+		const double mx = (double) sums[0]/sums[2], my = (double) sums[1]/sums[2];
+		const double var = 0.5 * ((double) sums[3]/sums[2] - mx*mx + (double) sums[4]/sums[2] - my*my);
+		width = var > 0 ? sqrt(var) : 0;
+	}
+	
+	gsl_vector_float_set(stats, idx*NSTAT + STAT_FLUX, (float) sums[2]);
+	gsl_vector_float_set(stats, idx*NSTAT + STAT_PEAK, (float) peak);
+	gsl_vector_float_set(stats, idx*NSTAT + STAT_NSAT, (float) nsat);
+	gsl_vector_float_set(stats, idx*NSTAT + STAT_WIDTH, (float) width);
+}
+
+template <typename T> void Shift::_calc_cog_weight(const T *img, const int idx, const fcoord_t maxshift, float *v, const T mini) {
+	const int w = layout.width[idx], h = layout.height[idx];
+	const T *p = img + layout.offset[idx];
+	const float *m = &layout.wmask[layout.wmaskoff[idx]];
+	
+	// Weights are not integer, accumulate rows in float and flush to double
+	double sx=0, sy=0, sum=0;
+	for (int y=0; y<h; y++) {
+		const T *row = p + (size_t) y * layout.res.x;
+		const float *mrow = m + y*w;
+		float rs=0, rx=0;
+		for (int x=0; x<w; x++) {
+			if (row[x] < mini)
+				continue;
+			const float f = (row[x] - mini) * mrow[x];
+			rs += f;
+			rx += f * x;
+		}
+		sx += rx;
+		sy += (double) rs * y;
+		sum += rs;
+	}
+	
+	if (sum <= 0) {
+		v[0] = v[1] = 0.0;
+		return;
+	}
+	v[0] = clamp((float) (sx/sum - layout.cx[idx]), -maxshift.x, maxshift.x);
+	v[1] = clamp((float) (sy/sum - layout.cy[idx]), -maxshift.y, maxshift.y);
+}
+
+template <typename T> void Shift::_calc_cog_window(const T *img, const int idx, const fcoord_t maxshift, float *v, const T mini, const bool iter) {
+	const int w = layout.width[idx], h = layout.height[idx];
+	const T *p = img + layout.offset[idx];
+	float *last = &layout.lastpos[idx*2];
+	uint64_t sums[3];
+	
+	// Spot position (relative to the subimage origin) to center the window on
+	double px = layout.cx[idx], py = layout.cy[idx];
+	if (!iter) {
+		px += last[0];
+		py += last[1];
 	}
+	
+	const int npass = iter ? cogniter : 1;
+	const int full = std::max(w, h);
+	bool found = false;
+	for (int pass=0; pass<npass; pass++) {
+		// COG_ITER: shrink linearly from the full subimage to cogwin
+		int size = cogwin;
+		if (iter && npass > 1)
+			size = full - (full - std::min(cogwin, full)) * pass / (npass-1);
+		
+		// Window [wx, wx+size) centered on (px, py) as well as possible
+		const int wx = (int) floor(px - (size-1)/2.0 + 0.5), wy = (int) floor(py - (size-1)/2.0 + 0.5);
+		const int x0 = std::max(wx, 0), x1 = std::min(wx + size, w);
+		const int y0 = std::max(wy, 0), y1 = std::min(wy + size, h);
+		if (x1 <= x0 || y1 <= y0)
+			break;
 		
+		_cog_sums(p + (size_t) y0 * layout.res.x + x0, x1-x0, y1-y0, mini, sums);
+		if (sums[2] == 0)
+			break;
+		px = x0 + (double) sums[0]/sums[2];
+		py = y0 + (double) sums[1]/sums[2];
+		found = true;
+	}
+	
+	if (!found) {
+		// Lost the spot, restart at the centre next frame
+		v[0] = v[1] = last[0] = last[1] = 0.0;
+		return;
+	}
+	v[0] = last[0] = clamp((float) (px - layout.cx[idx]), -maxshift.x, maxshift.x);
+	v[1] = last[1] = clamp((float) (py - layout.cy[idx]), -maxshift.y, maxshift.y);
+}
+
+/*
+ * Cross-correlation
+ */
+
+bool Shift::have_corr() {
+#ifdef HAVE_FFTW
 	return true;
+#else
+	return false;
+#endif
 }
 
-bool Shift::calc_shifts(const uint16_t *img, const coord_t res, const std::vector<vector_t> &crops, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const bool wait, const uint16_t mini) {
-//	io.msg(IO_DEB2, "Shift::calc_shifts(uint16_t)");
+void Shift::set_corr_ref(const int idx) {
+	corr->refsel = idx < 0 ? -1 : idx;
+	corr->ref_valid = false;
+}
+
+int Shift::get_corr_ref() const {
+	return corr->refsel;
+}
+
+void Shift::set_corr_interp(const interp_t i) {
+	corr->interp = i;
+}
+
+Shift::interp_t Shift::get_corr_interp() const {
+	return corr->interp;
+}
+
+void Shift::_corr_free() {
+#ifdef HAVE_FFTW
+	for (size_t p=0; p<corr->plans.size(); p++) {
+		fftw_destroy_plan(corr->plans[p].fwd);
+		fftw_destroy_plan(corr->plans[p].inv);
+		fftw_free(corr->plans[p].reffft);
+	}
+	corr->plans.clear();
+	for (size_t b=0; b<corr->bufs.size(); b++) {
+		fftw_free(corr->bufs[b].in);
+		fftw_free(corr->bufs[b].fft);
+		fftw_free(corr->bufs[b].out);
+	}
+	corr->bufs.clear();
+#endif
+	corr->plans_valid = false;
+}
+
+template <typename T> bool Shift::_corr_prepare(const T *img) {
+#ifdef HAVE_FFTW
+	if (layout.n == 0)
+		return true;
 	
-	// Setup work parameters
-	workpool.method = method;
-	workpool.bpp = (sizeof *img) * 8;
-	workpool.img = (void *) img;
-	workpool.res = res;
-	workpool.refimg = (void *) NULL;
-	workpool.mini = mini;
-	workpool.crops = crops;
-	workpool.maxshift = maxshift;
-	workpool.shifts = shifts;
-	workpool.jobid = crops.size()-1;
-	workpool.done = 0;
-	
-	{ 
-		// lock work_done_mutex, then broadcast work to all workers.
-		pthread::mutexholder h1(&work_done_mutex);
+	if (corr->ref_valid && corr->plans_valid)
+		return true;
+	
+	// Queued CORR jobs might still be using the reference and plans
+	wait();
+	
+	// (Re-)capture the reference from this frame
+	if (!corr->ref_valid) {
+		int sel = corr->refsel;
+		if (sel >= layout.n) {
+			io.msg(IO_WARN, "Shift::_corr_prepare() reference subimage %d does not exist, using mean.", sel);
+			sel = corr->refsel = -1;
+		}
 		
-		{
-			pthread::mutexholder h2(&work_mutex);
-			work_cond.broadcast();
+		// The mean reference uses all subimages with the same size as the first
+		const int r = (sel < 0) ? 0 : sel;
+		corr->refsize = coord_t(layout.width[r], layout.height[r]);
+		corr->ref.assign(corr->refsize.x * corr->refsize.y, 0.0);
+		
+		int nref=0;
+		for (int i=0; i<layout.n; i++) {
+			if ((sel >= 0 && i != sel) || layout.width[i] != corr->refsize.x || layout.height[i] != corr->refsize.y)
+				continue;
+			for (int y=0; y<corr->refsize.y; y++)
+				for (int x=0; x<corr->refsize.x; x++)
+					corr->ref[y*corr->refsize.x + x] += img[layout.offset[i] + (size_t) y*layout.res.x + x];
+			nref++;
 		}
 		
-		// Wait until the work is completed, with the mutex locked. The associated
-		// mutex will unlock automatically when mutexholder goes out of scope
-		if (wait)
-			work_done_cond.wait(work_done_mutex);
+		// Normalize and subtract mean (removes the DC peak from the correlation)
+		double mean=0;
+		for (size_t p=0; p<corr->ref.size(); p++)
+			mean += (corr->ref[p] /= nref);
+		mean /= corr->ref.size();
+		for (size_t p=0; p<corr->ref.size(); p++)
+			corr->ref[p] -= mean;
+		
+		io.msg(IO_INFO, "Shift::_corr_prepare() captured %dx%d reference from %s.", 
+					 corr->refsize.x, corr->refsize.y, sel < 0 ? format("mean of %d subimages", nref).c_str() : format("subimage %d", sel).c_str());
+		corr->ref_valid = true;
+		corr->plans_valid = false;
+	}
+	
+	if (corr->plans_valid)
+		return true;
+	
+	// (Re-)build plans, one per distinct subimage size
+	_corr_free();
+	
+	corr->planidx.resize(layout.n);
+	size_t maxpix=0, maxcpl=0;
+	for (int i=0; i<layout.n; i++) {
+		const coord_t size(layout.width[i], layout.height[i]);
+		size_t p;
+		for (p=0; p<corr->plans.size(); p++)
+			if (corr->plans[p].size.x == size.x && corr->plans[p].size.y == size.y)
+				break;
+		
+		if (p == corr->plans.size()) {
+			corrdata::plan_t plan;
+			plan.size = size;
+			const size_t npix = size.x * size.y, ncpl = size.y * (size.x/2 + 1);
+			double *in = (double *) fftw_malloc(npix * sizeof(double));
+			double *out = (double *) fftw_malloc(npix * sizeof(double));
+			plan.reffft = (fftw_complex *) fftw_malloc(ncpl * sizeof(fftw_complex));
+			// Planning overwrites the arrays, so do this before filling them
+			plan.fwd = fftw_plan_dft_r2c_2d(size.y, size.x, in, plan.reffft, FFTW_MEASURE);
+			plan.inv = fftw_plan_dft_c2r_2d(size.y, size.x, plan.reffft, out, FFTW_MEASURE);
+			
+			// Reference cropped or zero-padded to this size, keeping it centered
+			const int ox = (corr->refsize.x - size.x)/2, oy = (corr->refsize.y - size.y)/2;
+			for (int y=0; y<size.y; y++) {
+				for (int x=0; x<size.x; x++) {
+					const int rx = x + ox, ry = y + oy;
+					in[y*size.x + x] = (rx >= 0 && rx < corr->refsize.x && ry >= 0 && ry < corr->refsize.y) ? corr->ref[ry*corr->refsize.x + rx] : 0.0;
+				}
+			}
+			fftw_execute(plan.fwd);
+			// Store complex conjugate, such that the correlation is a product
+			for (size_t k=0; k<ncpl; k++)
+				plan.reffft[k][1] = -plan.reffft[k][1];
+			
+			fftw_free(in);
+			fftw_free(out);
+			corr->plans.push_back(plan);
+			maxpix = std::max(maxpix, npix);
+			maxcpl = std::max(maxcpl, ncpl);
+		}
+		corr->planidx[i] = p;
+	}
+	
+	// Scratch buffers per worker and for the calling thread (see wait()), 
+	// large enough for every plan. fftw_malloc guarantees the same alignment 
+	// as the planning arrays, as required by fftw_execute_dft_*()
+	for (int w=0; w<=nworker; w++) {
+		corrdata::buf_t buf;
+		buf.in = (double *) fftw_malloc(maxpix * sizeof(double));
+		buf.fft = (fftw_complex *) fftw_malloc(maxcpl * sizeof(fftw_complex));
+		buf.out = (double *) fftw_malloc(maxpix * sizeof(double));
+		corr->bufs.push_back(buf);
 	}
 	
+	io.msg(IO_XNFO, "Shift::_corr_prepare() built %zu correlation plan(s) for %d subimages.", corr->plans.size(), layout.n);
+	corr->plans_valid = true;
 	return true;
+#else
+	(void) img;
+	return false;
+#endif
+}
+
+/*! @brief Subpixel offset of a peak from three samples around it */
+static inline double corr_interp(double m, double c, double p, const Shift::interp_t interp) {
+	if (interp == Shift::INTERP_GAUSSIAN && m > 0 && c > 0 && p > 0) {
+		m = log(m); c = log(c); p = log(p);
+	}
+	const double denom = m - 2*c + p;
+	if (denom >= 0)
+		return 0.0;
+	return clamp(0.5 * (m - p) / denom, -0.5, 0.5);
+}
+
+template <typename T> void Shift::_calc_corr(const T *img, const int idx, const int wid, const fcoord_t maxshift, float *v) {
+#ifdef HAVE_FFTW
+	const corrdata::plan_t &plan = corr->plans[corr->planidx[idx]];
+	const corrdata::buf_t &buf = corr->bufs[wid];
+	const int w = plan.size.x, h = plan.size.y;
+	
+	v[0] = v[1] = 0.0;
+	if (w < 3 || h < 3)
+		return;
+	
+	// Copy subimage, subtract mean
+	const T *p = img + layout.offset[idx];
+	double mean=0;
+	for (int y=0; y<h; y++) {
+		for (int x=0; x<w; x++)
+			mean += (buf.in[y*w + x] = p[(size_t) y*layout.res.x + x]);
+	}
+	mean /= w*h;
+	for (int i=0; i<w*h; i++)
+		buf.in[i] -= mean;
+	
+	// Correlation = IFFT(FFT(img) . conj(FFT(ref)))
+	fftw_execute_dft_r2c(plan.fwd, buf.in, buf.fft);
+	const int ncpl = h * (w/2 + 1);
+	for (int k=0; k<ncpl; k++) {
+		const double re = buf.fft[k][0] * plan.reffft[k][0] - buf.fft[k][1] * plan.reffft[k][1];
+		const double im = buf.fft[k][0] * plan.reffft[k][1] + buf.fft[k][1] * plan.reffft[k][0];
+		buf.fft[k][0] = re;
+		buf.fft[k][1] = im;
+	}
+	fftw_execute_dft_c2r(plan.inv, buf.fft, buf.out);
+	
+	// Find peak, the correlation is circular
+	int px=0, py=0;
+	for (int i=1; i<w*h; i++) {
+		if (buf.out[i] > buf.out[py*w + px]) {
+			px = i % w;
+			py = i / w;
+		}
+	}
+	const double *c = buf.out;
+	const double dx = corr_interp(c[py*w + (px+w-1)%w], c[py*w + px], c[py*w + (px+1)%w], corr->interp);
+	const double dy = corr_interp(c[((py+h-1)%h)*w + px], c[py*w + px], c[((py+1)%h)*w + px], corr->interp);
+	
+	// Peak at (px, py) means img is shifted by (px, py) w.r.t. the reference
+	v[0] = clamp((float) ((px > w/2 ? px - w : px) + dx), -maxshift.x, maxshift.x);
+	v[1] = clamp((float) ((py > h/2 ? py - h : py) + dy), -maxshift.y, maxshift.y);
+#else
+	(void) img; (void) idx; (void) wid; (void) maxshift;
+	v[0] = v[1] = 0.0;
+#endif
+}
+
+template <typename T> Shift::handle_t Shift::_submit_t(const T *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const T mini, gsl_vector_float *stats, const recon_t *recon) {
+	if (recon && (!recon->mvm || !recon->rec || !recon->act || 
+			recon->rec->rows != (size_t) layout.n * 2 || recon->act->size != recon->rec->cols || 
+			(recon->ref && recon->ref->size != recon->rec->rows))) {
+		io.msg(IO_ERR, "Shift::submit() reconstructor does not match the layout of %d subimages.", layout.n);
+		return -1;
+	}
+	
+	method_t use = method;
+	if (method == CORR && !_corr_prepare(img)) {
+		io.msg(IO_ERR, "Shift::submit() method CORR unavailable (no FFTW), using COG.");
+		use = COG;
+	}
+	return _submit(use, (sizeof *img) * 8, img, maxshift, shifts, mini, stats, recon);
+}
+
+Shift::handle_t Shift::submit(const uint8_t *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const uint8_t mini, gsl_vector_float *stats, const recon_t *recon) {
+	return _submit_t(img, maxshift, shifts, method, mini, stats, recon);
+}
+
+Shift::handle_t Shift::submit(const uint16_t *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const uint16_t mini, gsl_vector_float *stats, const recon_t *recon) {
+	return _submit_t(img, maxshift, shifts, method, mini, stats, recon);
+}
+
+Shift::handle_t Shift::submit(const uint32_t *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const uint32_t mini, gsl_vector_float *stats, const recon_t *recon) {
+	return _submit_t(img, maxshift, shifts, method, mini, stats, recon);
+}
+
+template <typename T> Shift::handle_t Shift::_submit_batch_t(const T *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method, const T mini, gsl_matrix_float *stats) {
+	if (nframes < 0 || shifts->size1 < (size_t) nframes || shifts->size2 < (size_t) layout.n * 2) {
+		io.msg(IO_ERR, "Shift::submit_batch() shift matrix %zux%zu too small for %d frames of %d subimages.", shifts->size1, shifts->size2, nframes, layout.n);
+		return -1;
+	}
+	if (stats && (stats->size1 < (size_t) nframes || stats->size2 < (size_t) layout.n * NSTAT)) {
+		io.msg(IO_ERR, "Shift::submit_batch() stats matrix %zux%zu too small for %d frames of %d subimages.", stats->size1, stats->size2, nframes, layout.n);
+		return -1;
+	}
+	
+	method_t use = method;
+	if (method == COG_WINDOW) {
+		io.msg(IO_WARN, "Shift::submit_batch() method COG_WINDOW unavailable for batches, using COG_ITER.");
+		use = COG_ITER;
+	}
+	if (method == CORR && nframes > 0 && !_corr_prepare(frames[0])) {
+		io.msg(IO_ERR, "Shift::submit_batch() method CORR unavailable (no FFTW), using COG.");
+		use = COG;
+	}
+	
+	job_t &job = _next_slot();
+	job.method = use;
+	job.bpp = (sizeof **frames) * 8;
+	job.frames.assign(frames, frames + nframes);
+	job.mini = mini;
+	job.maxshift = maxshift;
+	job.bshifts = shifts;
+	job.bstats = stats;
+	return _publish(job, nframes);
+}
+
+Shift::handle_t Shift::submit_batch(const uint8_t *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method, const uint8_t mini, gsl_matrix_float *stats) {
+	return _submit_batch_t(frames, nframes, maxshift, shifts, method, mini, stats);
+}
+
+Shift::handle_t Shift::submit_batch(const uint16_t *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method, const uint16_t mini, gsl_matrix_float *stats) {
+	return _submit_batch_t(frames, nframes, maxshift, shifts, method, mini, stats);
+}
+
+Shift::handle_t Shift::submit_batch(const uint32_t *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method, const uint32_t mini, gsl_matrix_float *stats) {
+	return _submit_batch_t(frames, nframes, maxshift, shifts, method, mini, stats);
+}
+
+bool Shift::calc_shifts_batch(const uint8_t *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method, const uint8_t mini, gsl_matrix_float *stats) {
+	const handle_t h = submit_batch(frames, nframes, maxshift, shifts, method, mini, stats);
+	wait(h);
+	return h >= 0;
+}
+
+bool Shift::calc_shifts_batch(const uint16_t *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method, const uint16_t mini, gsl_matrix_float *stats) {
+	const handle_t h = submit_batch(frames, nframes, maxshift, shifts, method, mini, stats);
+	wait(h);
+	return h >= 0;
+}
+
+bool Shift::calc_shifts_batch(const uint32_t *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method, const uint32_t mini, gsl_matrix_float *stats) {
+	const handle_t h = submit_batch(frames, nframes, maxshift, shifts, method, mini, stats);
+	wait(h);
+	return h >= 0;
+}
+
+bool Shift::calc_shifts(const uint8_t *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const bool wait, const uint8_t mini, gsl_vector_float *stats) {
+	const handle_t h = submit(img, maxshift, shifts, method, mini, stats);
+	if (wait && h >= 0)
+		Shift::wait(h);
+	return h >= 0;
+}
+
+bool Shift::calc_shifts(const uint16_t *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const bool wait, const uint16_t mini, gsl_vector_float *stats) {
+	const handle_t h = submit(img, maxshift, shifts, method, mini, stats);
+	if (wait && h >= 0)
+		Shift::wait(h);
+	return h >= 0;
 }
 
+bool Shift::calc_shifts(const uint32_t *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const bool wait, const uint32_t mini, gsl_vector_float *stats) {
+	const handle_t h = submit(img, maxshift, shifts, method, mini, stats);
+	if (wait && h >= 0)
+		Shift::wait(h);
+	return h >= 0;
+}
+
+bool Shift::calc_shifts(const uint8_t *img, const coord_t res, const std::vector<vector_t> &crops, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const bool wait, const uint8_t mini) {
+//	io.msg(IO_DEB2, "Shift::calc_shifts(uint8_t)");
+	if (set_layout(crops, res) < 0)
+		return false;
+	return calc_shifts(img, maxshift, shifts, method, wait, mini);
+}
+
+bool Shift::calc_shifts(const uint16_t *img, const coord_t res, const std::vector<vector_t> &crops, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const bool wait, const uint16_t mini) {
+//	io.msg(IO_DEB2, "Shift::calc_shifts(uint16_t)");
+	if (set_layout(crops, res) < 0)
+		return false;
+	return calc_shifts(img, maxshift, shifts, method, wait, mini);
+}
+
+bool Shift::calc_shifts(const uint32_t *img, const coord_t res, const std::vector<vector_t> &crops, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const bool wait, const uint32_t mini) {
+	if (set_layout(crops, res) < 0)
+		return false;
+	return calc_shifts(img, maxshift, shifts, method, wait, mini);
+}
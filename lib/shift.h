@@ -23,11 +23,16 @@
 #define HAVE_SHIFT_H
 
 #include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <pthread.h>
 #include <vector>
+#include <string>
 
 #include "io.h"
 #include "pthread++.h"
 #include "types.h"
+#include "barrier.h"
+#include "mvm.h"
 
 /*!
  @brief Image shift calculation class
@@ -38,91 +43,548 @@
  
  \section shift_usage Shift usage
  
- calc_shifts() is the public method to be used for calculating image shifts.
- This method fills Shift::workpool with the relevant information and then
- signals the worker threads using 
+ Register the subimages with set_layout(), then call calc_shifts() for every
+ frame. For asynchronous operation, submit() queues a frame and returns a 
+ completion handle, which can be polled with done() or waited for with 
+ wait(). Up to Shift::NSLOT jobs can be in flight at once, each with its own 
+ output buffers. For example, to centroid frame N+1 while frame N is being 
+ reconstructed:
+ 
+ \code
+ Shift::handle_t h1 = shifts.submit(img1, maxshift, vec1);
+ shifts.wait(h0);
+ reconstruct(vec0);
+ \endcode
+ 
+ The image data and output vectors must remain valid until the job is done.
+ submit() and wait() should be called from one thread only.
+ 
+ \section shift_batch Batches of frames
+ 
+ For offline reduction and calibration bursts, submit_batch() and 
+ calc_shifts_batch() process K frames in one job, storing the shifts of 
+ frame k in row k of a K x 2*nsubap matrix. The job is partitioned by frame 
+ and by subimage partition (K * layout_t::part jobs), such that the workers 
+ are woken once per batch instead of once per frame, and each worker streams
+ through a contiguous range of frames. Method COG_WINDOW depends on the 
+ previous frame and cannot be used in a batch, COG_ITER is used instead.
+ 
+ \section shift_recon Fused reconstruction
+ 
+ Normally the shifts of a frame are reconstructed (multiplied by the 
+ reconstruction matrix) after all subimages are done. With a recon_t given 
+ to submit(), each worker instead subtracts the reference from the shifts of
+ the partition it just processed, and immediately adds their contribution 
+ to a private command vector, using the matching rows of the transposed 
+ reconstructor (Mvm::accumulate()). The thread completing the last 
+ partition sums the private vectors into recon_t::act. The reconstruction 
+ thereby overlaps with the pixel processing, and the barrier between 
+ centroiding and reconstruction disappears. The summation order depends on
+ which worker processed which partition, such that results can differ from
+ a separate Mvm::apply() by float rounding.
  
  \section shift_threads Shift thread model
  
  When a Shift instance is created, several worker threads are started 
- (stored in Shift::workers). These threads each call _worker_getid() in turn,
- which is guarded by Shift::work_mutex. Once each thread has its unique ID,
- they wait on Shift::work_cond.
+ (stored in Shift::workers). Jobs are stored in a ring of Shift::NSLOT slots
+ (Shift::jobs) and published to the workers by incrementing 
+ Shift::submitted. All workers visit all jobs in order: for each job they 
+ claim partitions of subimages (see layout_t::part) by atomically 
+ incrementing job_t::jobnext, until all partitions are claimed, and then
+ move on to the next job. The worker that completes the last partition of a
+ job marks it done (job_t::done). A slot is reused only after all workers
+ have left it (job_t::left).
+ 
+ Each worker starts claiming at its own 'home' partition (a fixed fraction 
+ of the partitions), such that the same subimages are processed by the same
+ worker in consecutive frames as long as the load is balanced. This keeps
+ per-subimage data in the cache (and NUMA node) of that worker, see also 
+ first_touch().
+ 
+ wait() also lets the calling thread claim partitions of the job waited 
+ for (starting from the last partition), such that it does not idle while 
+ work remains. Waiting threads (both
+ idle workers and the caller in wait()) spin for a configurable time 
+ (set_spin()) before parking on a futex, such that at high frame rates no 
+ mutexes or syscalls are involved in handing off work.
  
- When calc_shifts() is called, Shift::workpool is filled with the job info. 
- Then Shift::work_mutex is locked and Shift::work_cond is broadcasted, but 
- before the broadcast is sent Shift::work_done_mutex is locked by 
- calc_shifts().
+ \section shift_topo Worker sizing, pinning and scheduling
  
- As the workers are woken up, they fetch work from Shift::workpool (guarded by 
- Shift::workpool.mutex). When a worker is done and there is no more work in 
- the pool, it increments Shift::workpool.done. If the current thread is the 
- last thread to finish, it broadcasts Shift::work_done_cond to signal the
- main thread that the work is done.
+ The number of workers is given at construction, where 0 selects 
+ auto_workers(): the number of CPUs available to the process (i.e. 
+ respecting taskset/cgroup restrictions) minus one for the calling thread.
+ Workers can be pinned to CPUs with set_affinity(), where worker w is pinned
+ to CPU cpus[w % cpus.size()], and run with real-time (SCHED_FIFO) priority 
+ with set_priority(). The latter usually requires CAP_SYS_NICE or an 
+ appropriate RLIMIT_RTPRIO. Pinning is only supported on Linux.
  
- Since calc_shifts() locked Shift::work_done_mutex before broadcasting the 
- work, this ensures that the workers don't signal the main thread before it 
- is ready for it (which might happen when the work is processed very quickly).
+ first_touch() lets every worker write the part of an output vector that it
+ will write during processing first, such that on NUMA systems the memory 
+ pages are allocated on that worker's node. Use this after allocating new 
+ output buffers, and after set_affinity().
+ 
+ \section shift_corr Cross-correlation
+ 
+ For extended sources (where CoG does not work), method CORR cross-correlates
+ each subimage with a reference subimage using FFTs. The reference is either 
+ one selected subimage or the mean of all subimages (set_corr_ref()), and is
+ captured from the first frame processed with CORR after set_corr_ref(). 
+ FFTW plans and the reference spectrum are cached per subimage size, and 
+ rebuilt when the layout changes. The correlation peak is refined to 
+ subpixel precision using a parabolic or Gaussian fit (set_corr_interp()).
+ The shift found is relative to the reference, use a reference shift vector
+ to make it absolute.
+ 
+ CORR is only available if FOAM is built with FFTW (HAVE_FFTW), otherwise 
+ COG is used instead.
+ 
+ \section shift_cogmodes CoG variants
+ 
+ Next to plain thresholded CoG, three variants are available which are less
+ sensitive to noise in the outer parts of the subimages (faint sources):
+ 
+ - COG_WEIGHT: each thresholded pixel is multiplied by a Gaussian weight 
+   centered on the subimage (width set_cog_sigma()). The masks are 
+   precomputed for each subimage in set_layout(). Note that weighting biases
+   the shifts towards zero, this is absorbed by calibration.
+ - COG_WINDOW: only an NxN window (set_cog_window()) around the spot 
+   position found in the previous frame is integrated. If the window contains
+   no flux, the window is reset to the subimage centre. With several jobs in
+   flight, the last position found for a subimage by any job is used.
+ - COG_ITER: the first pass uses the full subimage, subsequent passes shrink
+   the window linearly to NxN around the previous result, in 
+   set_cog_niter() passes. This does not depend on the previous frame.
+ 
+ The windowed variants use the same (SIMD) kernels as COG on a smaller box,
+ and therefore touch only N*N pixels per subimage and pass.
+
+ \section shift_stats Spot metrics
+ 
+ If calc_shifts() is given a stats vector, NSTAT metrics are stored for each
+ subimage (see stat_t): thresholded flux, peak value, number of saturated 
+ pixels (set_satlevel()) and the second-moment spot width. For method COG 
+ these are accumulated in the same pixel pass as the shift (using a scalar
+ kernel which gives identical shifts), for other methods an extra pass over
+ each subimage is made by the same worker while the data is still in cache.
+ 
+ \section shift_simd Shift SIMD kernels
+ 
+ The CoG sums (flux and x/y-weighted flux) are calculated by a kernel which is
+ selected at construction time using CPU feature detection (see detect_simd()).
+ Next to the scalar reference kernel, SSE4.1, AVX2 and AVX-512 kernels are 
+ available on x86. The kernel can be overridden with set_simd().
+ 
+ For each pixel type (8, 16 and 32 bit) there is a table of kernels 
+ (Shift::cogtab) indexed by subimage width: widths of 8, 16, 24 and 32 pixels
+ use kernels compiled for that fixed width (cog_class()), all other widths use
+ the generic kernel. The fixed-width kernels accumulate per column over all 
+ rows, which the compiler fully unrolls and vectorizes for the selected 
+ instruction set, and reduce only once per subimage. The size class of each 
+ subimage is stored in the layout, such that the per-frame dispatch is a 
+ table lookup.
+ 
+ All kernels accumulate the thresholded pixel values in exact integer 
+ arithmetic, such that the SIMD kernels give bit-identical results to the 
+ scalar kernel. The division to get the final shift is done in double 
+ precision. Compared to the old float accumulation, results can differ by
+ float rounding only (typically <1e-5 pixel).
  
  */
 class Shift {
 public:
 	typedef enum {
 		COG=0,														//!< Center of Gravity method
+		CORR,															//!< FFT cross-correlation with a reference subimage (needs FFTW)
+		COG_WEIGHT,												//!< CoG weighted with a Gaussian mask around the subimage centre
+		COG_WINDOW,												//!< CoG in an NxN window around the previous spot position
+		COG_ITER,													//!< CoG with a window shrinking to NxN over several passes
 	} method_t;													//!< Different image shift calculation methods
 	
+	typedef enum {
+		INTERP_PARABOLIC=0,								//!< Parabolic fit through correlation peak
+		INTERP_GAUSSIAN,									//!< Gaussian fit through correlation peak
+	} interp_t;													//!< Subpixel peak interpolation for method=CORR
+	
+	typedef enum {
+		STAT_FLUX=0,											//!< Total thresholded flux
+		STAT_PEAK,												//!< Peak pixel value
+		STAT_NSAT,												//!< Number of pixels at or above the saturation level
+		STAT_WIDTH,												//!< Second-moment spot width (rms radius per axis) in pixels
+		NSTAT,														//!< Number of metrics per subimage
+	} stat_t;														//!< Per-subimage spot metrics, see calc_shifts()
+	
+	typedef enum {
+		SIMD_AUTO=-1,											//!< Detect best instruction set at runtime
+		SIMD_NONE=0,											//!< Scalar reference kernel
+		SIMD_SSE4,												//!< SSE4.1 kernel (4 lanes)
+		SIMD_AVX2,												//!< AVX2 kernel (8 lanes)
+		SIMD_AVX512,											//!< AVX-512F kernel (16 lanes)
+	} simd_t;														//!< SIMD instruction sets for CoG kernels
+	
+	typedef int handle_t;								//!< Completion handle for jobs queued with submit()
+	
+	/*! @brief Fused reconstruction parameters for submit(), see \ref shift_recon */
+	typedef struct recon {
+		recon(): mvm(NULL), rec(NULL), ref(NULL), act(NULL) { }
+		const Mvm *mvm;										//!< Engine providing the accumulation kernel (Mvm::accumulate())
+		const Mvm::matrix_t *rec;					//!< Transposed reconstructor, 2 * number of subimages rows by nact columns
+		const gsl_vector_float *ref;			//!< Reference shifts subtracted before reconstruction (or NULL)
+		gsl_vector_float *act;						//!< Output command vector (size rec->cols)
+	} recon_t;
+	
+	enum {
+		NSLOT=4,													//!< Maximum number of jobs in flight
+	};
+	
+	enum {
+		COGSIZE_ANY=0,										//!< Generic kernel, any width
+		COGSIZE_8,												//!< Kernel for 8 pixel wide subimages
+		COGSIZE_16,												//!< Kernel for 16 pixel wide subimages
+		COGSIZE_24,												//!< Kernel for 24 pixel wide subimages
+		COGSIZE_32,												//!< Kernel for 32 pixel wide subimages
+		NCOGSIZE,													//!< Number of CoG kernel size classes
+	};
+	
+	/*! @brief CoG kernel table for pixel type T, indexed by size class (see cog_class())
+	 
+	 A kernel sums thresholded flux and x,y-weighted flux in a crop field. 
+	 Coordinates are relative to the lower-left corner of the crop field. 
+	 Kernel parameters:
+	 - img: pointer to first pixel of the crop field
+	 - stride: image data stride (i.e. image width)
+	 - w, h: width and height of crop field
+	 - mini: minimum intensity to consider (subtracted from each pixel)
+	 - sums: (output) sum of x-weighted, y-weighted and total flux
+	 */
+	template <typename T> struct cogtab {
+		typedef void (*func_t)(const T *img, const int stride, const int w, const int h, const T mini, uint64_t *sums);
+		func_t f[NCOGSIZE];
+	};
+	
+	/*! @brief CoG kernel size class for a crop field of width w */
+	static int cog_class(const int w) {
+		switch (w) {
+			case 8: return COGSIZE_8;
+			case 16: return COGSIZE_16;
+			case 24: return COGSIZE_24;
+			case 32: return COGSIZE_32;
+			default: return COGSIZE_ANY;
+		}
+	}
+	
+	/*! @brief Precomputed subimage layout, structure-of-arrays
+	 
+	 Built once by set_layout() from a list of crop fields, used for every 
+	 frame until the layout changes.
+	 */
+	typedef struct layout {
+		layout(): n(0) { }
+		coord_t res;											//!< Image resolution the layout was built for
+		int n;														//!< Number of subimages
+		std::vector<size_t> offset;				//!< Offset of first pixel of each subimage (ly*res.x + lx)
+		std::vector<int> width;						//!< Width of each subimage
+		std::vector<int> height;					//!< Height of each subimage
+		std::vector<float> cx;						//!< Centre offset (x) of each subimage, (tx-lx)/2
+		std::vector<float> cy;						//!< Centre offset (y) of each subimage, (ty-ly)/2
+		std::vector<int> wclass;					//!< CoG kernel size class of each subimage (see cog_class())
+		std::vector<int> part;						//!< Job partition: job k processes subimages part[k] to part[k+1]-1, balanced by pixel count
+		std::vector<size_t> wmaskoff;			//!< Offset of each subimage's weight mask in wmask (for COG_WEIGHT)
+		std::vector<float> wmask;					//!< Gaussian weight masks for all subimages (for COG_WEIGHT)
+		std::vector<float> lastpos;				//!< Spot position found in the previous frame, relative to the centre (x,y per subimage, for COG_WINDOW)
+	} layout_t;
+	
 private:
 	Io &io;															//!< Message IO
 	bool running;												//!< Are we running?
 	
 	typedef struct jobinfo {
-		jobinfo() : bpp(-1), img(NULL), refimg(NULL), shifts(NULL), jobid(-1), done(-1) { }
+		jobinfo() : bpp(-1), img(NULL), refimg(NULL), shifts(NULL), stats(NULL), bshifts(NULL), bstats(NULL), partcap(0), ticket(0), nparts(0), njobs(0), jobnext(0), jobdone(0), touch(false), uses(0) { }
 		method_t method;
-		int bpp;													//!< Image bitdepth (8 for uint8_t, 16 for uint16_t)
+		int bpp;													//!< Image bitdepth (8 for uint8_t, 16 for uint16_t, 32 for uint32_t)
 		void *img;												//!< Image data to process
-		coord_t res;											//!< Image size (width x height)
 		void *refimg;											//!< Reference image (for method=CORR)
 		uint32_t mini;										//!< Minimum intensity to consider (for method=COG)
-		std::vector<vector_t> crops;			//!< Crop fields within the bigger image
 		fcoord_t maxshift;								//!< Clamp the calculated shifts with this range
 		gsl_vector_float *shifts;					//!< Pre-allocated output vector
-		pthread::mutex mutex;							//!< Lock for jobid and done
-		int jobid;												//!< Next crop field to process
-		int done;													//!< Number of worker threads done
+		gsl_vector_float *stats;					//!< Pre-allocated output vector for spot metrics (or NULL)
+		std::vector<const void *> frames;	//!< Image data for batch jobs (empty for single frames, see submit_batch())
+		gsl_matrix_float *bshifts;				//!< Output matrix for batch jobs, one row per frame
+		gsl_matrix_float *bstats;					//!< Output matrix for spot metrics of batch jobs (or NULL)
+		recon_t recon;										//!< Fused reconstruction (recon.rec is NULL if not used)
+		std::vector<float> reconx;				//!< Reference-subtracted shifts for fused reconstruction
+		std::vector<float *> partial;			//!< Private command vector of each thread (nworker+1) for fused reconstruction
+		std::vector<int> pused;						//!< Did thread contribute to partial in this job (atomic)
+		size_t partcap;										//!< Capacity of each partial vector
+		int ticket;												//!< Handle of the job in this slot
+		int nparts;												//!< Number of partitions per frame (chunks of crop fields, see layout_t::part)
+		int njobs;												//!< Number of partitions, nparts per frame
+		volatile int jobnext;							//!< Number of partitions claimed (atomic)
+		volatile int jobdone;							//!< Number of partitions completed (atomic)
+		std::vector<int> claimed;					//!< Claim flag for each partition (atomic)
+		bool touch;												//!< Only zero the output vectors (see first_touch())
+		SpinCounter done;									//!< Ticket+1 of the last completed job in this slot
+		SpinCounter left;									//!< Number of times a worker left this slot
+		int uses;													//!< Number of jobs submitted to this slot
 	} job_t;
 	
-	job_t workpool;											//!< Work pool, used by different threads to get work from
-
-	pthread::mutex work_mutex;					//!< Mutex used to limit access to frame data
-	pthread::cond work_cond;						//!< Cond used to signal threads about new frames
+	job_t jobs[NSLOT];									//!< Ring of job slots, job with handle h is in slot h % NSLOT
+	SpinCounter submitted;							//!< Number of jobs submitted, workers wait on this
+	int64_t spin_ns;										//!< Spin time before parking on a futex
+	layout_t layout;										//!< Current subimage layout
 	
-	pthread::mutex work_done_mutex;			//!< Signal for work completed
-	pthread::cond work_done_cond;				//!< Cond used for work completed
+	struct corrdata;										//!< Cross-correlation data (FFTW plans, reference etc.)
+	corrdata *corr;											//!< Cross-correlation data, see shift.cc
 
 	int nworker;												//!< Number of workers requested
 	int workid;													//!< Worker counter
 	std::vector<pthread::thread> workers; //!< Worker threads
+	std::vector<pthread_t> workertid;		//!< Thread ID of each worker (by worker id)
+	SpinCounter started;								//!< Number of workers that registered their thread ID
+	std::vector<int> cpus;							//!< CPUs to pin workers to (empty for no pinning)
+	int prio;														//!< SCHED_FIFO priority of workers (0 for default scheduling)
+	
+	bool _apply_affinity(const int wid); //!< Pin worker wid according to Shift::cpus
+	bool _apply_priority(const int wid); //!< Set scheduling of worker wid according to Shift::prio
+	
+	int jobchunk;												//!< Crop fields per job (0 for automatic)
 
 	void _worker_func();								//!< Worker function
-	int _worker_getid() { return workid++; }
+	int _worker_getid() { return __sync_fetch_and_add(&workid, 1); }
+	/*! @brief Queue a job in the next slot, wait for the slot to be free if necessary
+	 
+	 @return Handle of the job
+	 */
+	handle_t _submit(const method_t method, const int bpp, const void *img, const fcoord_t maxshift, gsl_vector_float *shifts, const uint32_t mini, gsl_vector_float *stats, const recon_t *recon=NULL, const bool touch=false);
+	template <typename T> handle_t _submit_t(const T *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method, const T mini, gsl_vector_float *stats, const recon_t *recon); //!< submit() for pixel type T
+	template <typename T> handle_t _submit_batch_t(const T *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method, const T mini, gsl_matrix_float *stats); //!< submit_batch() for pixel type T
+	job_t &_next_slot();								//!< Wait until the slot for the next job is free, and return it
+	handle_t _publish(job_t &job, const int nframes); //!< Partition job over nframes frames and publish it to the workers
+	void _run_job(job_t &job, const int wid); //!< Claim and process partitions of job until all are claimed (as worker wid, or nworker for the calling thread)
+	void _process(job_t &job, const int jobidx, const int wid); //!< Process partition jobidx of job (by worker wid)
+	void _recon_accumulate(job_t &job, const int part, const int wid); //!< Add reconstruction of partition part to the private command vector of wid
+	void _recon_reduce(job_t &job);			//!< Sum private command vectors into job.recon.act
+	void _partition();									//!< (Re-)build Shift::layout job partition
+	void _build_weights();							//!< (Re-)build Shift::layout weight masks
+	template <typename T> void _process_t(const job_t &job, const T *img, const int part, const int wid, gsl_vector_float *shifts, gsl_vector_float *stats); //!< _process() for pixel type T, output to shifts and stats
+	
+	simd_t simd;												//!< SIMD instruction set in use
+	cogtab<uint8_t> cog8;								//!< CoG kernels for 8 bit images
+	cogtab<uint16_t> cog16;							//!< CoG kernels for 16 bit images
+	cogtab<uint32_t> cog32;							//!< CoG kernels for 32 bit images
+	const cogtab<uint8_t> &_cogtab(const uint8_t *) const { return cog8; }
+	const cogtab<uint16_t> &_cogtab(const uint16_t *) const { return cog16; }
+	const cogtab<uint32_t> &_cogtab(const uint32_t *) const { return cog32; }
+	
+	double cogsigma;										//!< Width of Gaussian weight for COG_WEIGHT in pixels (0 for a quarter of the subimage size)
+	int cogwin;													//!< Window size for COG_WINDOW and final window size for COG_ITER
+	int cogniter;												//!< Number of passes for COG_ITER
+	uint32_t satlevel;									//!< Saturation level for STAT_NSAT (0 for the maximum of the pixel type)
+	
+	/*! @brief Run CoG kernel for width w on a w x h box starting at p */
+	template <typename T> void _cog_sums(const T *p, const int w, const int h, const T mini, uint64_t *sums) const { _cogtab(p).f[cog_class(w)](p, layout.res.x, w, h, mini, sums); }
 	
 	/*! @brief Calculate CoG in a crop field of img
 	 
 	 @param [in] img Pointer to image data.
-	 @param [in] res Resolution of image data (i.e. data stride)
-	 @param [in] crop Crop field to process
+	 @param [in] idx Crop field to process (index in Shift::layout)
+	 @param [in] maxshift Clamp the calculated shift with this range
 	 @param [out] *vec Shift found within crop field in img
 	 @param [in] mini Minimum intensity to consider
 	 */
-	void _calc_cog(const uint8_t *img, const coord_t &res, const vector_t &crop, const fcoord_t maxshift, float *vec, const uint8_t mini=0);
-	void _calc_cog(const uint16_t *img, const coord_t &res, const vector_t &crop, const fcoord_t maxshift, float *vec, const uint16_t mini=0);
+	template <typename T> void _calc_cog(const T *img, const int idx, const fcoord_t maxshift, float *vec, const T mini);
+	
+	/*! @brief Calculate Gaussian-weighted CoG in a crop field of img (method COG_WEIGHT)
+	 
+	 Parameters as for _calc_cog().
+	 */
+	template <typename T> void _calc_cog_weight(const T *img, const int idx, const fcoord_t maxshift, float *vec, const T mini);
+	
+	/*! @brief Calculate windowed CoG in a crop field of img (methods COG_WINDOW and COG_ITER)
+	 
+	 Parameters as for _calc_cog(), iter selects COG_ITER.
+	 */
+	template <typename T> void _calc_cog_window(const T *img, const int idx, const fcoord_t maxshift, float *vec, const T mini, const bool iter);
+	
+	/*! @brief Calculate spot metrics in a crop field of img, and the CoG shift in the same pass
+	 
+	 Stores metrics in stats. Other parameters as for _calc_cog(), vec can be
+	 NULL if only the metrics are needed.
+	 */
+	template <typename T> void _calc_stats(const T *img, const int idx, const fcoord_t maxshift, float *vec, const T mini, gsl_vector_float *stats);
+	
+	/*! @brief Calculate shift in a crop field of img by cross-correlation with the reference
+	 
+	 @param [in] img Pointer to image data.
+	 @param [in] idx Crop field to process (index in Shift::layout)
+	 @param [in] wid Worker ID (selects scratch buffers)
+	 @param [in] maxshift Clamp the calculated shift with this range
+	 @param [out] *vec Shift found within crop field in img
+	 */
+	template <typename T> void _calc_corr(const T *img, const int idx, const int wid, const fcoord_t maxshift, float *vec);
+	
+	/*! @brief Prepare cross-correlation: (re-)capture reference, build plans if necessary
+	 
+	 @return false if CORR cannot be used (i.e. no FFTW)
+	 */
+	template <typename T> bool _corr_prepare(const T *img);
+	void _corr_free();									//!< Free FFTW plans and buffers
 	
 public:
+	/*! @brief Start shift calculation workers
+	 
+	 @param [in] io Message IO
+	 @param [in] nthr Number of worker threads, 0 for auto_workers()
+	 */
 	Shift(Io &io, const int nthr=1);
 	~Shift();
 	
+	static int auto_workers();					//!< Number of CPUs available to this process minus one (at least 1)
+	/*! @brief Parse a CPU list like "0,2,4-7" 
+	 
+	 @return CPUs in the order given, empty on parse error
+	 */
+	static std::vector<int> parse_cpus(const std::string &str);
+	int get_nworker() const { return nworker; }
+	
+	/*! @brief Pin workers to CPUs, worker w to cpus[w % cpus.size()], empty list to unpin
+	 
+	 @return false if pinning failed for any worker
+	 */
+	bool set_affinity(const std::vector<int> &cpus);
+	const std::vector<int> &get_affinity() const { return cpus; }
+	/*! @brief Run workers with SCHED_FIFO priority prio, or default scheduling if 0
+	 
+	 @return false if setting the scheduling failed for any worker (e.g. no permission)
+	 */
+	bool set_priority(const int prio);
+	int get_priority() const { return prio; }
+	/*! @brief Zero output vectors such that each part is first touched by the worker that will write it
+	 
+	 @param [out] *shifts Shift vector to use with submit() or calc_shifts()
+	 @param [out] *stats Spot metrics vector to use, or NULL
+	 */
+	void first_touch(gsl_vector_float *shifts, gsl_vector_float *stats=NULL);
+	
+	static simd_t detect_simd();				//!< Best SIMD instruction set supported by this CPU
+	static const char *simd_str(const simd_t s); //!< Name of SIMD instruction set
+	/*! @brief Select CoG kernel, SIMD_AUTO uses detect_simd()
+	 
+	 @return false if the requested instruction set is not available (the kernel is not changed)
+	 */
+	bool set_simd(const simd_t s=SIMD_AUTO);
+	simd_t get_simd() const { return simd; }
+	
+	void set_spin(const int usec) { spin_ns = (int64_t) usec * 1000; } //!< Spin time before sleeping while waiting for work or completion
+	int get_spin() const { return (int) (spin_ns / 1000); }
+	void set_chunk(const int n);				//!< Crop fields per job (0 for automatic)
+	int get_chunk() const { return jobchunk; }
+	
+	/*! @brief Set width of the Gaussian weight for COG_WEIGHT
+	 
+	 @param [in] sigma Standard deviation in pixels, or 0 for a quarter of the subimage size
+	 */
+	void set_cog_sigma(const double sigma);
+	double get_cog_sigma() const { return cogsigma; }
+	void set_cog_window(const int n);		//!< Set window size for COG_WINDOW and final window size for COG_ITER
+	int get_cog_window() const { return cogwin; }
+	void set_cog_niter(const int n);		//!< Set number of passes for COG_ITER
+	int get_cog_niter() const { return cogniter; }
+	
+	void set_satlevel(const uint32_t level) { satlevel = level; } //!< Saturation level for spot metrics (0 for the maximum of the pixel type)
+	uint32_t get_satlevel() const { return satlevel; }
+	
+	static bool have_corr();						//!< Is method CORR available (i.e. built with FFTW)?
+	/*! @brief Select reference for method CORR, captured from the next frame
+	 
+	 @param [in] idx Subimage to use as reference, or -1 for the mean of all subimages
+	 */
+	void set_corr_ref(const int idx=-1);
+	int get_corr_ref() const;
+	void set_corr_interp(const interp_t i);	//!< Set subpixel interpolation for method CORR
+	interp_t get_corr_interp() const;
+	
+	/*! @brief Wait for all queued jobs to complete */
+	void wait();
+	/*! @brief Wait for job h to complete, helping to process it meanwhile */
+	void wait(const handle_t h);
+	/*! @brief Check if job h is complete (does not block) */
+	bool done(const handle_t h) const;
+	
+	/*! @brief Queue shift calculation of img, return immediately
+	 
+	 Parameters as for calc_shifts(). If all Shift::NSLOT slots are in use, 
+	 this blocks until the oldest job is done.
+	 
+	 If recon is given, the shifts are also reconstructed into recon->act 
+	 while they are calculated (see \ref shift_recon). The contents of *recon
+	 are copied, the matrix and vectors it points to must remain valid until 
+	 the job is done.
+	 
+	 @return Completion handle for done() and wait(), or -1 on error
+	 */
+	handle_t submit(const uint8_t *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method=COG, const uint8_t mini=0, gsl_vector_float *stats=NULL, const recon_t *recon=NULL);
+	handle_t submit(const uint16_t *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method=COG, const uint16_t mini=0, gsl_vector_float *stats=NULL, const recon_t *recon=NULL);
+	handle_t submit(const uint32_t *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method=COG, const uint32_t mini=0, gsl_vector_float *stats=NULL, const recon_t *recon=NULL);
+	
+	/*! @brief Queue shift calculation of a batch of frames, return immediately
+	 
+	 The job is done when all frames are processed. Parameters as for 
+	 calc_shifts_batch().
+	 
+	 @return Completion handle for done() and wait(), or -1 on error
+	 */
+	handle_t submit_batch(const uint8_t *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method=COG, const uint8_t mini=0, gsl_matrix_float *stats=NULL);
+	handle_t submit_batch(const uint16_t *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method=COG, const uint16_t mini=0, gsl_matrix_float *stats=NULL);
+	handle_t submit_batch(const uint32_t *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method=COG, const uint32_t mini=0, gsl_matrix_float *stats=NULL);
+	
+	/*! @brief Calculate shifts in the crop fields registered with set_layout() for a batch of frames
+	 
+	 @param [in] frames Pointers to nframes images, with resolution as given to set_layout()
+	 @param [in] nframes Number of frames
+	 @param [in] maxshift Maximum shift to allow, if higher: clamp at +- this value
+	 @param [out] *shifts Matrix to hold results (at least nframes rows of 2 * number of subimages), row k for frame k
+	 @param [in] method Tracking method (see method_t, COG_WINDOW is not available)
+	 @param [in] mini Minimum intensity to consider (for COG)
+	 @param [out] *stats Matrix for spot metrics (at least nframes rows of NSTAT * number of subimages), or NULL to skip
+	 @return false if the output matrices do not match the layout
+	 */
+	bool calc_shifts_batch(const uint8_t *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method=COG, const uint8_t mini=0, gsl_matrix_float *stats=NULL);
+	bool calc_shifts_batch(const uint16_t *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method=COG, const uint16_t mini=0, gsl_matrix_float *stats=NULL);
+	bool calc_shifts_batch(const uint32_t *const *frames, const int nframes, const fcoord_t maxshift, gsl_matrix_float *shifts, const method_t method=COG, const uint32_t mini=0, gsl_matrix_float *stats=NULL);
+	
+	/*! @brief Register a subimage layout to be used by subsequent calc_shifts() calls
+	 
+	 This precomputes pixel offsets, sizes and centres of all crop fields, and 
+	 partitions them over jobs with roughly equal pixel counts. Call this 
+	 whenever the crop fields or the image resolution change.
+	 
+	 @param [in] crops Crop fields to process
+	 @param [in] res Resolution of image data (i.e. data stride)
+	 @return Number of subimages in the layout, or -1 if a crop field lies outside the image (the layout is not changed)
+	 */
+	int set_layout(const std::vector<vector_t> &crops, const coord_t res);
+	const layout_t &get_layout() const { return layout; }
+	
+	/*! @brief Calculate shifts in the crop fields registered with set_layout()
+	 
+	 @param [in] img Pointer to image data, with resolution as given to set_layout()
+	 @param [in] maxshift Maximum shift to allow, if higher: clamp at +- this value
+	 @param [out] *shifts Buffer to hold results (pre-allocated, size 2 * number of subimages)
+	 @param [in] method Tracking method (see method_t)
+	 @param [in] wait Block until complete, or return asap (see submit())
+	 @param [in] mini Minimum intensity to consider (for COG)
+	 @param [out] *stats Buffer for spot metrics (pre-allocated, size NSTAT * number of subimages, see stat_t), or NULL to skip
+	 @return false if the job could not be submitted (see submit()), shifts is not changed then
+	 */
+	bool calc_shifts(const uint8_t *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method=COG, const bool wait=true, const uint8_t mini=0, gsl_vector_float *stats=NULL);
+	bool calc_shifts(const uint16_t *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method=COG, const bool wait=true, const uint16_t mini=0, gsl_vector_float *stats=NULL);
+	bool calc_shifts(const uint32_t *img, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method=COG, const bool wait=true, const uint32_t mini=0, gsl_vector_float *stats=NULL);
+	
 	/*! @brief Calculate shifts in a series of crop fields within an image
 	 
+	 Convenience wrapper which registers the layout (set_layout()) on every 
+	 call. Use set_layout() and the calc_shifts() above in loops.
+	 
 	 @param [in] img Pointer to image data.
 	 @param [in] res Resolution of image data (i.e. data stride)
 	 @param [in] *crops Array of crop field to process
@@ -131,9 +593,11 @@ public:
 	 @param [in] method Tracking method (see method_t)
 	 @param [in] wait Block until complete, or return asap
 	 @param [in] mini Minimum intensity to consider (for COG)
+	 @return false if the layout or the job is invalid, shifts is not changed then
 	 */
 	bool calc_shifts(const uint8_t *img, const coord_t res, const std::vector<vector_t> &crops, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method=COG, const bool wait=true, const uint8_t mini=0);
 	bool calc_shifts(const uint16_t *img, const coord_t res, const std::vector<vector_t> &crops, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method=COG, const bool wait=true, const uint16_t mini=0);
+	bool calc_shifts(const uint32_t *img, const coord_t res, const std::vector<vector_t> &crops, const fcoord_t maxshift, gsl_vector_float *shifts, const method_t method=COG, const bool wait=true, const uint32_t mini=0);
 };
 
 #endif // HAVE_SHIFT_H
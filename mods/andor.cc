@@ -120,11 +120,6 @@ andordir("/")
 	cam_set_exposure(exposure);
 	cam_set_interval(interval);
 		
-	// Setup image buffers
-	img_buffer.resize(nframes);
-	for (size_t i=0; i<nframes; i++)
-		img_buffer.at(i) = new unsigned short[res.x * res.y];
-	
 	// Set filename prefix for saved frames
 	set_filename("andor-");
 	
@@ -170,11 +165,6 @@ AndorCam::~AndorCam() {
 	io.msg(IO_INFO, "AndorCam::~AndorCam() Shutting down");
 	ShutDown();
 	
-	io.msg(IO_INFO, "AndorCam::~AndorCam() Releasing memory (%zu items)", img_buffer.size());
-	// Delete frames in buffer if necessary
-	for (size_t i=0; i < img_buffer.size(); i++)
-		delete[] img_buffer.at(i);
-	
 	io.msg(IO_INFO, "AndorCam::~AndorCam() done.");
 }
 
@@ -464,15 +454,13 @@ void AndorCam::cam_handler() {
 					ret = WaitForAcquisitionTimeOut(waitacq);
 					
 					if (ret == DRV_SUCCESS) {
-						// Try to get new frame data						
-						ret = GetMostRecentImage16(img_buffer.at(count % nframes), (unsigned long) (res.x * res.y));
+						// Try to get new frame data in a free buffer (see \ref cam_pool)
+						unsigned short *img = (unsigned short *) cam_get_buf();
+						ret = GetMostRecentImage16(img, (unsigned long) (res.x * res.y));
 						if (ret == DRV_SUCCESS) {
-							void *queue_ret = cam_queue(img_buffer.at(count % nframes), img_buffer.at(count % nframes));
-							
-							//if (queue_ret != NULL)
-							//	io.msg(IO_XNFO, "AndorCam::cam_handler(R) cam_queue returned old frame");
-							//! @todo handle returned data?
+							cam_queue_buf(img);
 						} else {
+							cam_put_buf(img);
 							io.msg(IO_WARN, "AndorCam::cam_handler(R) GetMostRecentImage16 error %s", error_desc[ret].c_str());
 						}
 					} else {
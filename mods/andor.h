@@ -59,7 +59,6 @@ class AndorCam: public Camera {
 private:
 	std::map< int, std::string > error_desc; //!< Error descriptions (from Andor SDK)
 	
-	std::vector< unsigned short* > img_buffer; //!< Local image buffer
 	
 	AndorCapabilities caps;							//!< Andor camera capabilities
 	std::vector< string > caps_vec;			//!< Andor camera capabilities, human readable
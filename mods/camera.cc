@@ -23,7 +23,9 @@
 #include <stdint.h>
 #include <math.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #ifdef LINUX
 #define _XOPEN_SOURCE 600	// for posix_fadvise()
 #endif
@@ -42,7 +44,10 @@ using namespace std;
 
 Camera::Camera(Io &io, foamctrl *const ptc, const string name, const string type, const string port, Path const &conffile, const bool online):
 Device(io, ptc, name, cam_type + "." + type, port, conffile, online),
-do_proc(false), nframes(-1), count(0), timeouts(0), ndark(10), nflat(10), 
+spin_ns(0), proc_stop(false), proc_cursor(NULL), 
+store_cursor(NULL), store_fptr(NULL), store_depth(0), store_nmax(0), store_maxsize(1024), store_compress(false),
+store_raw(false), raw_fd(-1), raw_map(NULL), raw_mapsize(0), raw_n(0), raw_nmax(0), raw_synced(0), raw_idx(NULL), raw_maxsize(4096),
+gui_cursor(NULL), do_proc(false), frames(NULL), ring(NULL), nframes(-1), nspare(4), npool(0), count(0), ndropped(0), timeouts(0), ndark(10), nflat(10), 
 dark_exposure(1.0), flat_exposure(1.0),
 shutstat(SHUTTER_CLOSED), interval(1.0), exposure(1.0), gain(1.0), offset(0.0), 
 res(0,0), depth(-1),
@@ -71,6 +76,9 @@ fits_telescope("undef"), fits_observer("undef"), fits_instrument("undef"), fits_
 	add_cmd("get height");
 	add_cmd("get depth");
 	add_cmd("get resolution");
+	add_cmd("get dropped");
+	add_cmd("get cursors");
+	add_cmd("set cursor");
 	add_cmd("get filename");
 	add_cmd("get fits");
 	add_cmd("get shutter");
@@ -81,9 +89,30 @@ fits_telescope("undef"), fits_observer("undef"), fits_instrument("undef"), fits_
 	add_cmd("flat");
 //	add_cmd("statistics");
 	
-	// Set buffer size (default 32 frames)
+	// Set buffer size (default 32 frames), plus spare records for frames 
+	// held by consumers (default 4)
 	nframes = cfg.getint("nframes", 32);
-	frames = new frame_t[nframes];
+	nspare = cfg.getint("nspare", 4);
+	npool = nframes + nspare;
+	frames = new frame_t[npool];
+	ring = new size_t[nframes];
+	for (size_t i=0; i<nframes; i++) {
+		ring[i] = i;
+		frames[i].inring = true;
+	}
+	
+	// Spin this long before sleeping when waiting for a frame (default 0)
+	spin_ns = (int64_t) (cfg.getdouble("spin", 0) * 1000);
+	
+	proc_cursor = add_cursor("proc");
+	store_cursor = add_cursor("store", CURSOR_EVERY);
+	gui_cursor = add_cursor("gui");
+	
+	// Storage file size (default 1 GB) and compression
+	store_maxsize = cfg.getdouble("store_maxsize", 1024);
+	store_compress = cfg.getbool("store_compress", false);
+	// Raw recording size (default 4 GB)
+	raw_maxsize = cfg.getdouble("raw_maxsize", 4096);
 	
 	// Set number of darks & flats to take (default 10)
 	ndark = cfg.getint("ndark", 10);
@@ -107,18 +136,29 @@ fits_telescope("undef"), fits_observer("undef"), fits_instrument("undef"), fits_
 	set_outputdir("");
 
 	proc_thr.create(sigc::mem_fun(*this, &Camera::cam_proc));
+	store_thr.create(sigc::mem_fun(*this, &Camera::store_proc));
 }
 
 Camera::~Camera() {
 	io.msg(IO_DEB2, "Camera::~Camera()");
-	proc_thr.cancel();
+	// Wake the processing and storage threads, they check proc_stop after 
+	// every frame
+	proc_stop = true;
+	published.add(1);
 	proc_thr.join();
+	store_thr.join();
 	
 	// Delete the camera ringbuffer here. The only memory we free here is the
-	// array of *references* to frames. The image data
-	// itself (frames.data and frames.image) should be free'd by the derived 
-	// classes because we don't know what kind of object it is here.
+	// array of *references* to frames and the buffers from cam_get_buf(). The
+	// other image data itself (frames.data and frames.image) should be free'd
+	// by the derived classes because we don't know what kind of object it is 
+	// here.
 	delete[] frames;
+	delete[] ring;
+	for (std::map<void *, size_t>::iterator it = bufs.begin(); it != bufs.end(); ++it)
+		free(it->first);
+	for (std::map<string, cursor_t *>::iterator it = cursors.begin(); it != cursors.end(); ++it)
+		delete it->second;
 }
 
 void Camera::cam_proc() {
@@ -126,107 +166,349 @@ void Camera::cam_proc() {
 	frame_t *frame;
 	
 	while (true) {
-		// Always wait for proc_cond broadcasts
-		{
-			pthread::mutexholder h(&proc_mutex);
-			proc_cond.wait(proc_mutex);
-		}
+		// Wait for any frame newer than the last one processed. The frame is 
+		// published to all consumers at the same time, the loop does not wait
+		// for us (see \ref cam_ring).
+		published.wait((int) (proc_cursor->next + 1), 0);
+		if (proc_stop)
+			break;
 		
-		// Lock cam_mutex before handling the data
-		pthread::mutexholder h(&cam_mutex);
-		
-		// There is a new frame ready now, process it
-		frame = get_last_frame();
+		// Hold the frame while processing, the camera keeps running in the 
+		// meantime (see \ref cam_pool).
+		frame = acquire_next_frame(proc_cursor, false);
+		if (!frame)
+			continue;
 		if (do_proc)
 			calculate_stats(frame);
-		 
-		if (nstore == -1 || nstore > 0) {
-//			io.msg(IO_DEB2, "Camera::cam_proc() nstore=%d", nstore);
-			int status=store_frame(frame);
-			if (!status) {
-				nstore--;
-				net_broadcast(format("ok store %d", nstore), "store");
-//				io.msg(IO_DEB2, "Camera::cam_proc() nstore--", nstore);
-			} else {
-				net_broadcast(format("error storing frame: %d", status), "store");
-				io.msg(IO_ERR, "Camera::cam_proc() fits store error: %d", status);
-			}
-		}
 
-		// Flag frame as processed
-		frame->proc = true;
-
-		// Notify all threads waiting for new frames now
-		cam_cond.broadcast();
+		// Flag frame as processed, publishes the statistics to grab()
+		__atomic_store_n(&frame->proc, true, __ATOMIC_RELEASE);
+		release_frame(frame);
 	}
 }
 
-int Camera::fits_add_card(fitsfile *fptr, string key, string value, string comment) const {
-	int status=0;
-	char hdr_val[FLEN_CARD], hdr_comm[FLEN_CARD];
-	snprintf(hdr_val, FLEN_CARD, "%s", value.c_str());
-	snprintf(hdr_comm, FLEN_CARD, "%s", comment.c_str());
-	
-//	fits_update_key(fptr, TSTRING, "MAXVAL", hdr_str, "Maximum data value", &status);
-	fits_update_key(fptr, TSTRING, key.c_str(), hdr_val, hdr_comm, &status);
-	return status;
-}
-
-int Camera::store_frame(const frame_t *const frame) const {
-//	if (depth != 8 && depth != 16) {
-//		io.msg(IO_WARN, "Camera::store_frame() Only 8 and 16 bit images supported!");
-//		return false;
-//	}
+void Camera::store_proc() {
+	io.msg(IO_DEB2, "Camera::store_proc()");
+	frame_t *frame;
 	
-	// Generate path to store file to, based on filenamebase
-	Path filename = makename();
-	io.msg(IO_DEB1, "Camera::store_frame(%p) to %s", frame, filename.c_str());
+	while (true) {
+		published.wait((int) (store_cursor->next + 1), 0);
+		if (proc_stop)
+			break;
+		
+		// Not storing: finish the last file and skip all frames
+		if (nstore == 0) {
+			if (store_fptr && store_close())
+				io.msg(IO_ERR, "Camera::store_proc() could not close %s", store_path.c_str());
+			if (raw_fd >= 0 && raw_close())
+				io.msg(IO_ERR, "Camera::store_proc() could not close %s", raw_path.c_str());
+			store_cursor->next = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+			continue;
+		}
+		
+		// Finish the file of the other format when switching
+		const bool raw = store_raw;
+		if (raw && store_fptr)
+			store_close();
+		else if (!raw && raw_fd >= 0)
+			raw_close();
+		
+		frame = acquire_next_frame(store_cursor, false);
+		if (!frame)
+			continue;
+		const int status = raw ? raw_append(frame) : store_append(frame);
+		release_frame(frame);
+		
+		if (status) {
+			net_broadcast(format("error storing frame: %d", status), "store");
+			io.msg(IO_ERR, "Camera::store_proc() %s store error: %d", raw ? "raw" : "fits", status);
+			raw ? raw_close() : store_close();
+			nstore = 0;
+		} else if (nstore > 0 && __sync_sub_and_fetch(&nstore, 1) == 0) {
+			raw ? raw_close() : store_close();
+			net_broadcast(format("ok store %d", nstore), "store");
+		}
+	}
 	
-	fitsfile *fptr;
-  int status = 0, naxis = 2;
-  long fpixel = 1, nelements = -1;
-  long naxes[naxis];
-	nelements = frame->npixels;
-  naxes[0] = frame->res.x; naxes[1] = frame->res.y;
+	if (store_fptr)
+		store_close();
+	if (raw_fd >= 0)
+		raw_close();
+}
 
-	// Open file
-	fits_create_file(&fptr, filename.c_str(), &status);
-	if (status) return status;
-	
-	// Get filedatatype parameters
-	int ftype=0, dtype=0;
-	if (frame->depth <= 8) {
+// FITS image and data type for frames of depth bits, false if not supported
+static bool fits_types(const int depth, int &ftype, int &dtype) {
+	if (depth <= 8) {
 		ftype = BYTE_IMG; dtype = TBYTE;
-		io.msg(IO_DEB1, "Camera::store_frame() BYTE_IMG TBYTE");
-	} else if (frame->depth <= 16) {
+	} else if (depth <= 16) {
 		ftype = USHORT_IMG; dtype = TUSHORT;
-		io.msg(IO_DEB1, "Camera::store_frame() SHORT_IMG TUSHORT");
-	} else if (frame->depth <= 32) {
+	} else if (depth <= 32) {
 		ftype = ULONG_IMG; dtype = TUINT;
-		io.msg(IO_DEB1, "Camera::store_frame() LONG_IMG TUINT");
 	} else {
-		io.msg(IO_ERR, "Camera::store_frame() saving 32+ bit data not supported");
+		return false;
+	}
+	return true;
+}
+
+int Camera::store_open(const frame_t *const frame) {
+	int status = 0, ftype, dtype;
+	if (!fits_types(frame->depth, ftype, dtype)) {
+		io.msg(IO_ERR, "Camera::store_open() saving 32+ bit data not supported");
 		return OVERFLOW_ERR;
 	}
 	
-	// Create image 
-	fits_create_img(fptr, ftype, naxis, naxes, &status);
-	if (status) return status;
+	// Frames per file, such that the file stays below store_maxsize
+	store_nmax = (size_t) (store_maxsize * 1024 * 1024 / frame->size);
+	if (store_nmax < 1)
+		store_nmax = 1;
 	
-	// Write header: http://heasarc.gsfc.nasa.gov/docs/software/fitsio/c/c_user/node39.html
+	store_path = makename();
+	fits_create_file(&store_fptr, store_path.c_str(), &status);
+	if (status) {
+		store_fptr = NULL;
+		return status;
+	}
 	
-	// Write a keyword; must pass the ADDRESS of the value
-	fits_write_date(fptr, &status);
+	if (store_compress) {
+		// Header in an empty primary HDU, every frame is one compressed tile
+		long tile[2] = {frame->res.x, frame->res.y};
+		fits_create_img(store_fptr, ftype, 0, NULL, &status);
+		fits_set_compression_type(store_fptr, RICE_1, &status);
+		fits_set_tile_dim(store_fptr, 2, tile, &status);
+	} else {
+		// Cube for store_nmax frames, shrunk in store_close() if necessary
+		long naxes[3] = {frame->res.x, frame->res.y, (long) store_nmax};
+		fits_create_img(store_fptr, ftype, 3, naxes, &status);
+	}
+	fits_write_date(store_fptr, &status);
+	if (!status)
+		status = fits_add_header(store_fptr);
+	if (status) {
+		int s = 0;
+		fits_close_file(store_fptr, &s);
+		store_fptr = NULL;
+		return status;
+	}
+	
+	store_res = frame->res;
+	store_depth = frame->depth;
+	store_ids.clear();
+	store_times.clear();
+	io.msg(IO_XNFO, "Camera::store_open() %s for up to %zu frames", store_path.c_str(), store_nmax);
+	return 0;
+}
+
+int Camera::store_append(const frame_t *const frame) {
+	int status = 0, ftype, dtype;
+	
+	// Start a new file if the current one is full, or for a different format
+	if (store_fptr && (store_ids.size() >= store_nmax || frame->depth != store_depth ||
+										 frame->res.x != store_res.x || frame->res.y != store_res.y)) {
+		// The frames in the finished file may be lost, report before moving on
+		if ((status = store_close())) {
+			io.msg(IO_ERR, "Camera::store_append() could not close %s: %d", store_path.c_str(), status);
+			return status;
+		}
+	}
+	if (!store_fptr)
+		status = store_open(frame);
+	if (status)
+		return status;
+	
+	fits_types(frame->depth, ftype, dtype);
+	if (store_compress) {
+		long naxes[2] = {frame->res.x, frame->res.y};
+		fits_create_img(store_fptr, ftype, 2, naxes, &status);
+		fits_write_img(store_fptr, dtype, 1, frame->npixels, frame->image, &status);
+	} else {
+		const LONGLONG first = 1 + (LONGLONG) store_ids.size() * frame->npixels;
+		fits_write_img(store_fptr, dtype, first, frame->npixels, frame->image, &status);
+	}
+	if (status)
+		return status;
+	
+	store_ids.push_back(frame->id);
+	store_times.push_back(frame->tv.tv_sec + frame->tv.tv_usec * 1E-6);
+	return 0;
+}
+
+int Camera::store_close() {
+	if (!store_fptr)
+		return 0;
+	
+	int status = 0, ftype, dtype;
+	const long n = store_ids.size();
+	fits_types(store_depth, ftype, dtype);
+	
+	// Shrink the cube to the frames actually written
+	if (!store_compress && (size_t) n < store_nmax) {
+		long naxes[3] = {store_res.x, store_res.y, n};
+		fits_movabs_hdu(store_fptr, 1, NULL, &status);
+		fits_resize_img(store_fptr, ftype, 3, naxes, &status);
+	}
+	
+	// Frame ids and timestamps
+	char *ttype[] = {(char *) "FRAMEID", (char *) "TIMESTAMP"};
+	char *tform[] = {(char *) "1K", (char *) "1D"};
+	char *tunit[] = {(char *) "", (char *) "s"};
+	fits_create_tbl(store_fptr, BINARY_TBL, 0, 2, ttype, tform, tunit, "FRAMES", &status);
+	if (n) {
+		fits_write_col(store_fptr, TLONGLONG, 1, 1, 1, n, &store_ids[0], &status);
+		fits_write_col(store_fptr, TDOUBLE, 2, 1, 1, n, &store_times[0], &status);
+	}
+	fits_close_file(store_fptr, &status);
+	store_fptr = NULL;
+	
+	io.msg(IO_XNFO, "Camera::store_close() %s: %ld frames, status %d", store_path.c_str(), n, status);
+	return status;
+}
+
+int Camera::raw_open(const frame_t *const frame) {
+	// Frames per recording, at least one
+	raw_nmax = (size_t) (raw_maxsize * 1024 * 1024 / frame->size);
+	if (raw_nmax < 1)
+		raw_nmax = 1;
+	raw_mapsize = raw_nmax * frame->size;
+	
+	// <base>.raw and <base>.idx, see rawrec.h
+	const string base = makename(filenamebase, "").str();
+	raw_path = base + ".raw";
+	raw_fd = open(raw_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (raw_fd < 0) {
+		const int err = errno;
+		io.msg(IO_ERR, "Camera::raw_open() could not open %s: %s", raw_path.c_str(), strerror(err));
+		return err;
+	}
+	
+	// Reserve the blocks now, such that the disk is not full halfway and 
+	// writeback does not need to allocate: a store to a page the disk cannot
+	// back raises SIGBUS. Fall back to a sparse file only if the filesystem 
+	// cannot preallocate, fail on anything else (e.g. ENOSPC).
+	int status = posix_fallocate(raw_fd, 0, (off_t) raw_mapsize);
+	if (status == EOPNOTSUPP || status == EINVAL)
+		status = ftruncate(raw_fd, (off_t) raw_mapsize) ? errno : 0;
+	if (!status) {
+		void *map = mmap(NULL, raw_mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, raw_fd, 0);
+		if (map == MAP_FAILED)
+			status = errno;
+		else
+			raw_map = (uint8_t *) map;
+	}
+	if (!status && !(raw_idx = fopen((base + ".idx").c_str(), "w")))
+		status = errno;
+	if (status) {
+		io.msg(IO_ERR, "Camera::raw_open() could not set up %s: %s", raw_path.c_str(), strerror(status));
+		if (raw_map)
+			munmap(raw_map, raw_mapsize);
+		raw_map = NULL;
+		close(raw_fd);
+		unlink(raw_path.c_str());
+		raw_fd = -1;
+		return status;
+	}
+	posix_madvise(raw_map, raw_mapsize, POSIX_MADV_SEQUENTIAL);
+	
+	// Header with nframes = 0, rewritten in raw_close()
+	memset(&raw_hdr, 0, sizeof(raw_hdr));
+	memcpy(raw_hdr.magic, RAWREC_MAGIC, sizeof(raw_hdr.magic));
+	raw_hdr.version = RAWREC_VERSION;
+	raw_hdr.width = frame->res.x;
+	raw_hdr.height = frame->res.y;
+	raw_hdr.depth = 8 * frame->size / frame->npixels;
+	raw_hdr.framesize = frame->size;
+	raw_hdr.exposure = exposure;
+	raw_hdr.interval = interval;
+	raw_hdr.gain = gain;
+	raw_hdr.offset = offset;
+	snprintf(raw_hdr.devname, sizeof(raw_hdr.devname), "%s", name.c_str());
+	fwrite(&raw_hdr, sizeof(raw_hdr), 1, raw_idx);
+	
+	raw_n = 0;
+	raw_synced = 0;
+	io.msg(IO_XNFO, "Camera::raw_open() %s for up to %zu frames", raw_path.c_str(), raw_nmax);
+	return 0;
+}
 
-	if (frame->min < frame->max) {
-		fits_add_card(fptr, "MAXVAL", format("%d", frame->max), "Max data value");
-		fits_add_card(fptr, "MINVAL", format("%d", frame->min), "Min data value");
+int Camera::raw_append(const frame_t *const frame) {
+	int status = 0;
+	
+	// Start a new recording if the current one is full, or for a different format
+	if (raw_fd >= 0 && (raw_n >= raw_nmax || frame->size != raw_hdr.framesize ||
+											(uint32_t) frame->res.x != raw_hdr.width || (uint32_t) frame->res.y != raw_hdr.height)) {
+		if ((status = raw_close())) {
+			io.msg(IO_ERR, "Camera::raw_append() could not close %s: %d", raw_path.c_str(), status);
+			return status;
+		}
 	}
-	if (frame->avg != frame->rms) {
-		fits_add_card(fptr, "AVG", format("%lf", frame->avg), "Average data value");
-		fits_add_card(fptr, "RMS", format("%lf", frame->rms), "Data root mean square");
+	if (raw_fd < 0)
+		status = raw_open(frame);
+	if (status)
+		return status;
+	
+	memcpy(raw_map + raw_n * frame->size, frame->image, frame->size);
+	raw_n++;
+	
+	rawrec_idx_t idx;
+	idx.id = frame->id;
+	idx.tv_sec = frame->tv.tv_sec;
+	idx.tv_usec = frame->tv.tv_usec;
+	idx.depth = frame->depth;
+	if (fwrite(&idx, sizeof(idx), 1, raw_idx) != 1)
+		return errno ? errno : EIO;
+	
+	// Start writeback of every completed chunk, such that dirty pages do not
+	// pile up until the kernel flushes them all at once
+	const size_t written = raw_n * frame->size;
+	if (written - raw_synced >= RAW_SYNC) {
+		const size_t start = raw_synced & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+		msync(raw_map + start, written - start, MS_ASYNC);
+		raw_synced = written;
 	}
+	return 0;
+}
+
+int Camera::raw_close() {
+	if (raw_fd < 0)
+		return 0;
 	
+	int status = 0;
+	const size_t written = raw_n * raw_hdr.framesize;
+	if (msync(raw_map, raw_mapsize, MS_SYNC))
+		status = errno;
+	munmap(raw_map, raw_mapsize);
+	raw_map = NULL;
+	// Drop the preallocated space that was not used
+	if (ftruncate(raw_fd, (off_t) written) && !status)
+		status = errno;
+	if (close(raw_fd) && !status)
+		status = errno;
+	raw_fd = -1;
+	
+	// Final number of frames in the header
+	raw_hdr.nframes = raw_n;
+	if (fflush(raw_idx) || fseek(raw_idx, 0, SEEK_SET) || fwrite(&raw_hdr, sizeof(raw_hdr), 1, raw_idx) != 1)
+		status = status ? status : errno;
+	if (fclose(raw_idx) && !status)
+		status = errno;
+	raw_idx = NULL;
+	
+	io.msg(IO_XNFO, "Camera::raw_close() %s: %zu frames, status %d", raw_path.c_str(), raw_n, status);
+	return status;
+}
+
+int Camera::fits_add_card(fitsfile *fptr, string key, string value, string comment) const {
+	int status=0;
+	char hdr_val[FLEN_CARD], hdr_comm[FLEN_CARD];
+	snprintf(hdr_val, FLEN_CARD, "%s", value.c_str());
+	snprintf(hdr_comm, FLEN_CARD, "%s", comment.c_str());
+	
+//	fits_update_key(fptr, TSTRING, "MAXVAL", hdr_str, "Maximum data value", &status);
+	fits_update_key(fptr, TSTRING, key.c_str(), hdr_val, hdr_comm, &status);
+	return status;
+}
+
+int Camera::fits_add_header(fitsfile *fptr) const {
+	int status = 0;
 	fits_add_card(fptr, "ORIGIN", PACKAGE_NAME " -- " PACKAGE_VERSION);
 	fits_add_card(fptr, "DEVNAME", name, "FOAM device name");
 	fits_add_card(fptr, "DEVTYPE", type, "FOAM device type");
@@ -238,28 +520,9 @@ int Camera::store_frame(const frame_t *const frame) const {
 	fits_add_card(fptr, "INTERVAL", format("%lf", interval), "[s] Frame cadence");
 	fits_add_card(fptr, "GAIN", format("%lf", gain));
 	fits_add_card(fptr, "OFFSET", format("%lf", offset));
-	if (status) return status;
 	
 	fits_write_comment(fptr, fits_comments.c_str(), &status);
-	if (status) return status;
-
-	// Write the array of integers to the image
-	if (frame->depth <= 8) {
-		fits_write_img(fptr, dtype, fpixel, nelements, (uint8_t *) frame->image, &status);
-	} else if (frame->depth <= 16) {
-		fits_write_img(fptr, dtype, fpixel, nelements, (uint16_t *) frame->image, &status);
-	} else if (frame->depth <= 32) {
-		fits_write_img(fptr, dtype, fpixel, nelements, (uint32_t *) frame->image, &status);
-	} else if (frame->depth <= 64) {
-		fits_write_img(fptr, dtype, fpixel, nelements, (uint64_t *) frame->image, &status);
-	}
-	if (status) return status;
-	
-	// Close file
-	fits_close_file(fptr, &status);
-	if (status) return status;
-	
-	return 0;
+	return status;
 }
 
 void Camera::calculate_stats(frame_t *const frame) const {
@@ -312,16 +575,47 @@ void Camera::calculate_stats(frame_t *const frame) const {
 	frame->rms = sqrt((sumsquared/npix));
 }
 
+bool Camera::frame_claim(const size_t r) {
+	frame_t *frame = &frames[r];
+	const size_t seq = frame->seq;
+	// Mark the record busy *before* checking refs. A consumer increments refs
+	// before checking seq, so either we see its reference, or it sees that
+	// the record no longer holds its frame (see acquire_frame()).
+	__atomic_store_n(&frame->seq, FRAME_BUSY, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&frame->refs, __ATOMIC_SEQ_CST) > 0) {
+		__atomic_store_n(&frame->seq, seq, __ATOMIC_SEQ_CST);
+		return false;
+	}
+	return true;
+}
+
 void *Camera::cam_queue(void * const data, void * const image, struct timeval *const tv) {
-	pthread::mutexholder h(&cam_mutex);
+	const size_t id = count, pos = id % nframes;
+	size_t r = ring[pos];
+	// The oldest frame is still held by a consumer: move it out of the ring 
+	// and use a free spare record instead. Drop the new frame if there is none.
+	if (!frame_claim(r)) {
+		size_t s;
+		for (s=0; s<npool; s++)
+			if (!frames[s].inring && frame_claim(s))
+				break;
+		if (s == npool) {
+			if (ndropped++ % 100 == 0)
+				io.msg(IO_WARN, "Camera::cam_queue() all %zu spare frames held, dropped %zu frames.", nspare, ndropped);
+			return data;
+		}
+		frames[r].inring = false;
+		frames[s].inring = true;
+		r = s;
+	}
+	frame_t *frame = &frames[r];
 	
-	frame_t *frame = &frames[count % nframes];
 	// Store the old data
 	void *old = frame->data;
 	// (over)write with new data
 	frame->data = data;
 	frame->image = image;
-	frame->id = count++;
+	frame->id = id;
 
 	frame->res = res;
 	frame->depth = conv_depth(depth);
@@ -344,49 +638,191 @@ void *Camera::cam_queue(void * const data, void * const image, struct timeval *c
 	else
 		gettimeofday(&frame->tv, 0);
 	
-	{
-		pthread::mutexholder h(&proc_mutex);
-		proc_cond.signal();			// Signal one waiting thread about the new frame
-	}
+	// Publish the frame, then wake all threads waiting for it
+	__atomic_store_n(&frame->seq, id, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring[pos], r, __ATOMIC_RELEASE);
+	__atomic_store_n(&count, id + 1, __ATOMIC_RELEASE);
+	published.add(1);
 	
 	return old;
 }
 
+void *Camera::cam_get_buf() {
+	const size_t size = res.x * res.y * conv_depth(depth)/8;
+	
+	// Re-use a free buffer, unless the resolution changed since
+	while (!buf_free.empty()) {
+		void *buf = buf_free.back();
+		buf_free.pop_back();
+		if (bufs[buf] == size)
+			return buf;
+		bufs.erase(buf);
+		free(buf);
+	}
+	
+	void *buf = malloc(size);
+	if (!buf)
+		throw exception(format("Camera::cam_get_buf() Could not allocate memory (size=%zu)!", size));
+	bufs[buf] = size;
+	return buf;
+}
+
+void Camera::cam_queue_buf(void *const buf, struct timeval *const tv) {
+	void *old = cam_queue(buf, buf, tv);
+	if (old)
+		cam_put_buf(old);
+}
+
+void Camera::cam_put_buf(void *const buf) {
+	buf_free.push_back(buf);
+}
+
 Camera::frame_t *Camera::get_last_frame() const {
-	if(count)
-		return &frames[(count - 1) % nframes];
+	const size_t n = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+	if(n)
+		return &frames[__atomic_load_n(&ring[(n - 1) % nframes], __ATOMIC_ACQUIRE)];
 	else
 		return 0;
 }
 
 Camera::frame_t *Camera::get_next_frame(const bool wait) {
-	static size_t frameid = 0;
-	
-	// Get a newest frame every call, but never get the same frame
-	if (frameid == count)
-		frameid++;
-	else
-		frameid = count;
-	
-	pthread::mutexholder h(&cam_mutex);
-	return get_frame(frameid, wait);
+	// Never the same frame: wait for one that was not published yet
+	return get_frame(__atomic_load_n(&count, __ATOMIC_ACQUIRE), wait);
 }
 
-Camera::frame_t *Camera::get_frame(const size_t id, const bool wait) {	
-	if(id >= count) {
-		if(wait) {
-			while(id >= count) {
-				cam_cond.wait(cam_mutex);		// This mutex must be locked elsewhere before calling get_frame()!!
-			}
-		} else {
-			return 0;
+Camera::frame_t *Camera::acquire_next_frame(const bool wait) {
+	return acquire_frame(__atomic_load_n(&count, __ATOMIC_ACQUIRE), wait);
+}
+
+Camera::frame_t *Camera::acquire_next_frame(cursor_t *const cur, const bool wait) {
+	while (true) {
+		size_t n = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+		if (cur->next >= n) {
+			if (!wait)
+				return 0;
+			published.wait((int) (cur->next + 1), spin_ns);
+			n = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+			if (cur->next >= n)
+				continue;
 		}
+		
+		// The newest frame, or the next one if it is still in the ring
+		size_t id;
+		if (cur->policy == CURSOR_LATEST)
+			id = n - 1;
+		else if (cur->next + nframes > n)
+			id = cur->next;
+		else
+			id = n - nframes + 1;		// Oldest frame not about to be overwritten
+		
+		frame_t *frame = acquire_frame(id, false);
+		if (!frame)
+			continue;						// Overwritten in the meantime, try again
+		
+		if (cur->policy == CURSOR_EVERY)
+			cur->overrun += id - cur->next;
+		else
+			cur->skipped += id - cur->next;
+		cur->lag = __atomic_load_n(&count, __ATOMIC_ACQUIRE) - 1 - id;
+		if (cur->lag > cur->maxlag)
+			cur->maxlag = cur->lag;
+		cur->nframes++;
+		cur->next = id + 1;
+		return frame;
+	}
+}
+
+Camera::cursor_t *Camera::add_cursor(const string &name, const cursor_policy_t policy) {
+	pthread::mutexholder h(&cursor_mutex);
+	std::map<string, cursor_t *>::iterator it = cursors.find(name);
+	if (it != cursors.end())
+		return it->second;
+	
+	const string p = cfg.getstring("cursor_" + name, policy2str(policy));
+	cursor_t *cur = new cursor_t(name, p == "every" ? CURSOR_EVERY : CURSOR_LATEST, __atomic_load_n(&count, __ATOMIC_ACQUIRE));
+	cursors[name] = cur;
+	io.msg(IO_DEB1, "Camera::add_cursor() %s (%s)", name.c_str(), policy2str(cur->policy).c_str());
+	return cur;
+}
+
+void Camera::sync_cursor(cursor_t *const cur) {
+	const size_t n = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+	if (n > cur->next) {
+		cur->skipped += n - cur->next;
+		cur->next = n;
 	}
+}
 
-	if(id + nframes < count || id >= count)
+int Camera::set_cursor(const string &name, const string &policy) {
+	if (policy != "latest" && policy != "every")
+		return io.msg(IO_ERR, "Camera::set_cursor() unknown policy '%s'", policy.c_str());
+	
+	pthread::mutexholder h(&cursor_mutex);
+	std::map<string, cursor_t *>::iterator it = cursors.find(name);
+	if (it == cursors.end())
+		return io.msg(IO_ERR, "Camera::set_cursor() no cursor '%s'", name.c_str());
+	it->second->policy = (policy == "every") ? CURSOR_EVERY : CURSOR_LATEST;
+	return 0;
+}
+
+string Camera::get_cursors() {
+	pthread::mutexholder h(&cursor_mutex);
+	string ret = format("%zu", cursors.size());
+	for (std::map<string, cursor_t *>::iterator it = cursors.begin(); it != cursors.end(); ++it) {
+		const cursor_t *cur = it->second;
+		ret += format(" %s %s %zu %zu %zu %zu %zu", cur->name.c_str(), policy2str(cur->policy).c_str(), 
+									cur->nframes, cur->skipped, cur->overrun, cur->lag, cur->maxlag);
+	}
+	return ret;
+}
+
+Camera::frame_t *Camera::acquire_last_frame() {
+	const size_t n = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+	if (!n)
 		return 0;
+	return acquire_frame(n - 1, false);
+}
+
+bool Camera::wait_frame(const size_t id, const bool wait) {
+	if(id >= __atomic_load_n(&count, __ATOMIC_ACQUIRE)) {
+		if(!wait)
+			return false;
+		published.wait((int) (id + 1), spin_ns);
+	}
 	
-	return &frames[id % nframes];
+	const size_t n = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+	return (id < n && id + nframes >= n);
+}
+
+Camera::frame_t *Camera::acquire_frame(const size_t id, const bool wait) {
+	if (!wait_frame(id, wait))
+		return 0;
+	
+	frame_t *frame = &frames[__atomic_load_n(&ring[id % nframes], __ATOMIC_ACQUIRE)];
+	__atomic_add_fetch(&frame->refs, 1, __ATOMIC_SEQ_CST);
+	// With our reference counted, the record either still holds frame 'id' 
+	// and cannot be recycled, or cam_queue() got there first (see 
+	// frame_claim()). FRAME_BUSY is only set for a few instructions.
+	size_t seq;
+	while ((seq = __atomic_load_n(&frame->seq, __ATOMIC_SEQ_CST)) == FRAME_BUSY)
+		cpu_relax();
+	if (seq == id)
+		return frame;
+	
+	__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+void Camera::release_frame(frame_t *const frame) {
+	if (frame)
+		__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_RELEASE);
+}
+
+Camera::frame_t *Camera::get_frame(const size_t id, const bool wait) {	
+	if (!wait_frame(id, wait))
+		return 0;
+	
+	return &frames[__atomic_load_n(&ring[id % nframes], __ATOMIC_ACQUIRE)];
 }
 
 // Network IO starts here
@@ -429,6 +865,13 @@ void Camera::on_message(Connection *const conn, string line) {
 		} else if(what == "fits") {
 			set_fits(line);
 			get_fits(conn);
+		} else if(what == "cursor") {
+			conn->addtag("cursors");
+			string cname = popword(line);
+			if (set_cursor(cname, popword(line)))
+				conn->write("error :Could not set cursor " + cname);
+			else
+				net_broadcast("ok cursors " + get_cursors(), "cursors");
 		} else {
 			parsed = false;
 			//conn->write("error :Unknown argument " + what);
@@ -462,6 +905,11 @@ void Camera::on_message(Connection *const conn, string line) {
 			conn->write(format("ok depth %d", depth));
 		} else if(what == "resolution") {
 			conn->write(format("ok resolution %d %d %d", res.x, res.y, depth));
+		} else if(what == "dropped") {
+			conn->write(format("ok dropped %zu", ndropped));
+		} else if(what == "cursors") {
+			conn->addtag("cursors");
+			conn->write("ok cursors " + get_cursors());
 		} else if(what == "filename") {
 			conn->addtag("filename");
 			conn->write("ok filename :" + filenamebase);
@@ -488,7 +936,11 @@ void Camera::on_message(Connection *const conn, string line) {
 		grab(conn, x1, y1, x2, y2, scale, do_df);
 	} else if(command == "store") {
 		conn->addtag("store");
-		set_store(popint(line));
+		string what = popword(line);
+		if (what == "raw")
+			set_store(popint(line), true);
+		else
+			set_store(strtol(what.c_str(), NULL, 0));
 	} else if(command == "dark") {
 		if (darkburst(popint(line)) )
 			conn->write("error :Error during dark burst");
@@ -542,9 +994,11 @@ Camera::mode_t Camera::set_mode(const mode_t value) {
 	return mode;
 }
 
-int Camera::set_store(const int n) {
+int Camera::set_store(const int n, const bool raw) {
+	// Set the format first, store_thr reads it once nstore is nonzero
+	store_raw = raw;
 	nstore = n;
-	net_broadcast(format("ok store %d", nstore), "store");
+	net_broadcast(format("ok store %d%s", nstore, raw ? " raw" : ""), "store");
 	return nstore;	
 }
 
@@ -580,13 +1034,13 @@ string Camera::set_filename(const string value) {
 	return filenamebase;
 }
 
-Path Camera::makename(const string &base) const {
+Path Camera::makename(const string &base, const string &ext) const {
 	struct timeval tv;
 	struct tm tm;
 	gettimeofday(&tv, 0);
 	gmtime_r(&tv.tv_sec, &tm);
 	
-	Path result = get_outputdir() + format("%s%s_%08d.%06d-%08d.fits", base.c_str(), name.c_str(), tv.tv_sec, tv.tv_usec, count);
+	Path result = get_outputdir() + format("%s%s_%08d.%06d-%08d%s", base.c_str(), name.c_str(), tv.tv_sec, tv.tv_usec, count, ext.c_str());
 	
 	return result;
 }
@@ -606,9 +1060,7 @@ uint8_t *Camera::get_thumbnail(Connection *conn = NULL) {
 	yoff = (res.y - step * 31) / 2;
 	
 	{
-		//! @todo Speed issue: Image is locked here, might block camera thread.
-		pthread::mutexholder h(&cam_mutex);
-		frame_t *f = get_last_frame();
+		frame_t *f = acquire_last_frame();
 		if(f) {
 			if(depth <= 8) {
 				uint8_t *in = (uint8_t *)f->image;
@@ -622,6 +1074,7 @@ uint8_t *Camera::get_thumbnail(Connection *conn = NULL) {
 						*out++ = in[res.x * (yoff + y * step) + xoff + x * step] >> (depth - 8);
 			}
 		}
+		release_frame(f);
 	}
 	
 	if (conn) {
@@ -662,9 +1115,12 @@ void Camera::grab(Connection *conn, int x1, int y1, int x2, int y2, int scale =
 //		lookup[i] = 128 + pow(i - maxval / 2, 7.0 / (depth - 1));
 	
 	{
-		//! @todo locks frame when sending over network?
-		pthread::mutexholder h(&cam_mutex);
-		frame_t *f = get_frame(count);
+		// Hold the frame instead of cam_mutex while sending over the network
+		frame_t *f;
+		{
+			pthread::mutexholder h(&gui_mutex);
+			f = acquire_next_frame(gui_cursor);
+		}
 		if(!f)
 			return conn->write("error :Could not grab image");
 		
@@ -673,8 +1129,18 @@ void Camera::grab(Connection *conn, int x1, int y1, int x2, int y2, int scale =
 		if(f->tv.tv_sec)
 			extra += format(" timestamp %li.%06li", f->tv.tv_sec, f->tv.tv_usec);
 		
-		extra += format(" avg %lf rms %lf", f->avg, f->rms);
-		extra += format(" min %d max %d", f->min, f->max);
+		// proc_thr may not have processed this frame yet, or may still be busy
+		// with it: use its statistics only when done, else compute our own.
+		if (do_proc && !__atomic_load_n(&f->proc, __ATOMIC_ACQUIRE)) {
+			frame_t stats;
+			stats.image = f->image;
+			calculate_stats(&stats);
+			extra += format(" avg %lf rms %lf", stats.avg, stats.rms);
+			extra += format(" min %d max %d", stats.min, stats.max);
+		} else {
+			extra += format(" avg %lf rms %lf", f->avg, f->rms);
+			extra += format(" min %d max %d", f->min, f->max);
+		}
 		
 		// zero copy if possible
 		if(!do_df && scale == 1 && x1 == 0 && x2 == (int)res.x && y1 == 0 && y2 == (int)res.y) {
@@ -685,8 +1151,10 @@ void Camera::grab(Connection *conn, int x1, int y1, int x2, int y2, int scale =
 		
 		buffer = malloc(size + size/8 + 128);
 		
-		if(!buffer)
+		if(!buffer) {
+			release_frame(f);
 			return conn->write("error :Out of memory");
+		}
 		
 		{
 			if(depth <= 8) {
@@ -720,7 +1188,7 @@ void Camera::grab(Connection *conn, int x1, int y1, int x2, int y2, int scale =
 		free(buffer);
 		
 finish:
-		;
+		release_frame(f);
 	}
 }
 
@@ -826,7 +1294,7 @@ bool Camera::accumburst(uint32_t *accum, size_t bcount) {
 	
 	//! @todo Check this code
 	while(rx < bcount) {
-		frame_t *f = get_next_frame(true);
+		frame_t *f = acquire_next_frame(true);
 		if(!f)
 			return false;
 		
@@ -839,6 +1307,7 @@ bool Camera::accumburst(uint32_t *accum, size_t bcount) {
 			for(size_t i = 0; i < (size_t) res.x * res.y; i++)
 				accum[i] += image[i];
 		}
+		release_frame(f);
 		
 		rx++;
 	}
@@ -22,6 +22,8 @@
 #define HAVE_CAM_H
 
 #include <fstream>
+#include <vector>
+#include <map>
 #include <stdint.h>
 #include <limits.h>
 #include <fitsio.h>
@@ -30,6 +32,8 @@
 #include "config.h"
 #include "io.h"
 #include "path++.h"
+#include "barrier.h"
+#include "rawrec.h"
 
 #include "devices.h"
 
@@ -45,7 +49,8 @@ const string cam_type = "cam";
  (i.e. from a GUI), this is done with 'netio' in a seperate thread and is 
  initiated from the Device class. The other part is hardware I/O which is done
  by a seperate thread through the 'cam_handler' method in the 'camthr' thread. A
- third thread 'proc_thr' handles processing of the image data in 'cam_proc()'.
+ third thread 'proc_thr' handles processing of the image data in 'cam_proc()',
+ a fourth thread 'store_thr' writes frames to disk in 'store_proc()'.
  
  Graphically:
  
@@ -53,6 +58,7 @@ const string cam_type = "cam";
  Device --- netio --        --- netio (on_message/on_connect)
       \---- main --- Camera --- cam_thr (cam_handler) -----
 												  +---- proc_thr (cam_proc) -------
+												  +---- store_thr (store_proc) -----
 													\----	main (returns after init) -
  </tt>
  
@@ -60,14 +66,104 @@ const string cam_type = "cam";
  \li cam_thr runs standalone, gets input from variables (configuration), 
 		provides hooks through sigc++ slots.
  \li proc_thr runs some processing over the captured frames from cam_thr if 
-		necessary, responds to cam_cond() broadcasts
+		necessary, as any other consumer of the frame ring (see \ref cam_ring)
+ \li store_thr writes frames to FITS files in the background (see \ref cam_store)
  \li main thread calls camera functions to read out data/settings, can hook up 
 		to slots to get 'instantaneous' feedback from cam_thr.
  
  \section cam_cap Capture process
  
  \li cam_thr captures frame (needs to be implemented in derived classes in cam_handler()), calls cam_queue()
- \li cam_queue() locks cam_mut
+ \li cam_queue() stores the frame in the ring buffer and publishes it to all waiting consumers at once
+ \li proc_thr picks up the last frame for statistics
+ \li store_thr picks up every frame to store (see Camera::nstore)
+
+ \section cam_ring Frame ring
+ 
+ The ring buffer is lock-free with a single producer (cam_thr) and any
+ number of consumers. Every frame record carries a sequence number 
+ (frame_t::seq), the id of the frame it holds. cam_queue() fills a record, 
+ stores its sequence number, points the ring at it and then increments
+ Camera::count and Camera::published. Consumers wait on 
+ Camera::published, spinning for Camera::spin_ns before sleeping on a 
+ futex, so a frame reaches the wavefront sensor as soon as the driver 
+ queues it, independent of statistics in proc_thr or storage in store_thr. 
+ 
+ To hold a frame, a consumer increments frame_t::refs and then checks 
+ frame_t::seq. cam_queue() marks a record busy before it checks refs to 
+ recycle it, such that either the producer sees the reference or the 
+ consumer sees the record has been recycled (and gets NULL). cam_mutex only
+ protects camera settings.
+
+ \section cam_pool Frame pool
+
+ The ring buffer of Camera::nframes frames is backed by a pool of
+ Camera::nframes + Camera::nspare frame records. A consumer that needs a
+ frame for some time calls acquire_next_frame() or acquire_last_frame(),
+ which increments frame_t::refs, and release_frame() when done. cam_queue()
+ never overwrites a frame with references: it moves the frame out of the ring
+ and stores the new frame in a free spare record instead. The held frame
+ returns to the pool once released. If all spare records are held, the new
+ frame is dropped (see Camera::ndropped) instead of corrupting a frame in 
+ use. A slow grab by a GUI or a FITS write by store_thr therefore neither
+ blocks nor corrupts the frames used by the wavefront sensor. 
+ 
+ get_next_frame() and get_last_frame() return frames without a reference,
+ these are only valid until the ring wraps around.
+ 
+ \section cam_cursor Consumer cursors
+ 
+ Every consumer that reads frames continuously gets its own named cursor 
+ with add_cursor(), e.g. "wfs" for the control loop, "proc" for proc_thr, 
+ "store" for store_thr (CURSOR_EVERY), 
+ "gui" for grab and "calib" for calibration. acquire_next_frame(cursor_t *)
+ returns the next frame for that cursor only, following its policy:
+ 
+ \li Camera::CURSOR_LATEST: the newest frame not yet seen by this cursor,
+		frames published in between are counted in cursor_t::skipped
+ \li Camera::CURSOR_EVERY: every frame in order, frames overwritten in the
+		ring before they were read are counted in cursor_t::overrun
+ 
+ cursor_t::lag is the number of newer frames that were already published
+ when a frame was acquired. With skipped and overrun both zero, the consumer
+ processed every frame. A cursor must be used by one thread at a time. The
+ counters are available with 'get cursors', the policy can be set with
+ 'set cursor' or the configuration key cursor_<name>.
+ 
+ get_next_frame() and acquire_next_frame(bool) without cursor always wait
+ for a frame that was not yet published when called.
+ 
+ cam_queue() returns the data pointer of the record it overwrote, which the 
+ driver may reuse or free. Drivers that do not manage buffers themselves use
+ cam_get_buf() to get a free buffer owned by Camera, fill it, and queue it
+ with cam_queue_buf(), which recycles the buffers returned by cam_queue().
+ 
+ \section cam_store Frame storage
+ 
+ 'store <n>' stores the next n frames (-1 for unlimited, 0 to stop). The
+ frames are written by store_thr, which reads every frame through the 
+ "store" cursor and holds it only while writing it. Acquisition never waits 
+ for the disk: if storage falls behind by more than Camera::nframes frames,
+ the frames missed are counted as overrun of the "store" cursor.
+ 
+ Frames are appended to a 3-D FITS cube (width x height x frames) with the
+ common header cards written once. A binary table extension 'FRAMES' holds 
+ the id (FRAMEID) and timestamp (TIMESTAMP, seconds since 1970) of every 
+ frame. A new file is started when the file would exceed Camera::store_maxsize,
+ or when the resolution or depth changes. With store_compress, every frame 
+ is written as its own Rice tile-compressed image extension instead of a 
+ plane of the cube, followed by the same 'FRAMES' table.
+ 
+ 'store raw <n>' records frames in the raw format of rawrec.h instead, for
+ high frame rates where writing FITS cannot keep up. The .raw file is
+ preallocated for Camera::raw_maxsize and memory-mapped, such that every 
+ frame costs one memcpy() and the kernel writes back in large sequential 
+ chunks (flushed asynchronously every Camera::RAW_SYNC bytes). A compact 
+ .idx file holds the header and the id, timestamp and depth of every frame. 
+ A new recording is started when the file is full or the frame size changes.
+ Convert recordings with foam-raw2fits. For drop-free capture, nframes 
+ should cover the longest stall of the disk: at 1 kHz, 1000 frames buffer 
+ one second.
  
  \section cam_netio Network IO
  
@@ -81,8 +177,11 @@ const string cam_type = "cam";
  \li grab <x1> <y1> <x2> <y2> <scale> [darkflat]: grab an image cropped from (x1,y1) to (x2,y2) and scaled down by factor scale. Darkflat is optional.
  \li dark [n]: grab n darkframes, otherwise take the default <ndark>
  \li flat [n]: grab n flatframes, otherwise take the default <nflat>
+ \li store <n>: store the next n frames, -1 for unlimited, 0 to stop (see \ref cam_store)
+ \li store raw <n>: as store, but record raw frames with an index file (see \ref cam_store)
  
  Valid set properties:
+ \li cursor <name> <latest|every>: set the policy of a consumer cursor (see \ref cam_cursor)
  \li exposure
  \li interval
  \li gain
@@ -96,12 +195,20 @@ const string cam_type = "cam";
  \li width
  \li depth
  \li height
+ \li dropped: frames dropped because the frame pool was exhausted (see \ref cam_pool)
+ \li cursors: for each cursor: name, policy, frames, skipped, overrun, lag, maxlag (see \ref cam_cursor)
  
  \section cam_cfg Configuration parameters
  
  The Camera class supports the following configuration parameters, with 
  defaults between brackets:
- - nframes (8): Camera::nframes
+ - nframes (32): Camera::nframes
+ - nspare (4): Camera::nspare
+ - spin (0): Camera::spin_ns, time to spin for a new frame before sleeping [us]
+ - cursor_<name> (latest): policy of consumer cursor <name>, 'latest' or 'every'
+ - store_maxsize (1024): Camera::store_maxsize [MB]
+ - store_compress (false): Camera::store_compress
+ - raw_maxsize (4096): Camera::raw_maxsize [MB]
  - ndark (10): Camera::ndark
  - nflat (10): Camera::nflat
  - interval (1.0): Camera::interval
@@ -130,6 +237,9 @@ class Camera: public foam::Device {
 	// Wfs is a friend class because it needs more access to the camera (also mutexes etc)
 	friend class Wfs;
 public:
+	static const size_t FRAME_BUSY = (size_t) -1;	//!< frame_t::seq of a record being written
+	static const size_t FRAME_NONE = (size_t) -2;	//!< frame_t::seq of a record never written
+	
 	typedef enum {
 		SHUTTER_CLOSED = 0,
 		SHUTTER_OPEN,
@@ -175,7 +285,11 @@ public:
 		size_t npixels;				//!< Number of pixels in frame
 		struct timeval tv;		//!< Frame creation timestamp (as close as possible)
 		
-		bool proc;						//!< Was the frame processed?
+		bool proc;						//!< Was the frame processed? Set by proc_thr (atomic, release) after calculate_stats()
+		
+		size_t seq;						//!< Id of the frame in this record, Camera::FRAME_BUSY while being written (see \ref cam_ring)
+		int refs;							//!< Number of consumers holding this frame (see Camera::acquire_next_frame())
+		bool inring;					//!< Is this record in the ring buffer (or a spare)?
 		
 		frame() {
 			data = 0;
@@ -183,6 +297,9 @@ public:
 			id = 0;
 			size = 0;
 			proc = false;
+			seq = FRAME_NONE;
+			refs = 0;
+			inring = false;
 			avg = 0;
 			rms = 0;
 			min = INT_MAX;
@@ -195,14 +312,67 @@ public:
 		int max;
 	} frame_t;
 	
+	typedef enum {
+		CURSOR_LATEST = 0,					//!< Newest frame not yet seen, skip older ones
+		CURSOR_EVERY								//!< Every frame in order
+	} cursor_policy_t;
+	
+	string policy2str(const cursor_policy_t p) const { return p == CURSOR_EVERY ? "every" : "latest"; }
+	
+	//!< Position and statistics of one frame consumer (see \ref cam_cursor)
+	typedef struct cursor {
+		string name;								//!< Consumer name
+		cursor_policy_t policy;			//!< Which frame to return next
+		size_t next;								//!< First frame id not seen yet
+		size_t nframes;							//!< Frames acquired
+		size_t skipped;							//!< Frames skipped (CURSOR_LATEST)
+		size_t overrun;							//!< Frames lost before they were read (CURSOR_EVERY)
+		size_t lag;									//!< Newer frames already published at the last acquire
+		size_t maxlag;							//!< Maximum of lag
+		
+		cursor(const string &name, const cursor_policy_t policy, const size_t next): 
+		name(name), policy(policy), next(next), nframes(0), skipped(0), overrun(0), lag(0), maxlag(0) { }
+	} cursor_t;
+	
 protected:
 	pthread::thread cam_thr;			//!< Camera hardware thread.
-	pthread::mutex cam_mutex;			//!< Mutex used to limit access to frame data
-	pthread::cond cam_cond;				//!< Cond used to signal threads about new frames
+	pthread::mutex cam_mutex;			//!< Mutex used to limit access to camera settings
+	SpinCounter published;				//!< Number of frames published (modulo 2^32), consumers wait on this
+	int64_t spin_ns;							//!< Spin this long waiting for a new frame before sleeping
 	
 	pthread::thread proc_thr;			//!< Processing thread (only camera stuff)
-	pthread::mutex proc_mutex;		//!< Cond/mutexpair used by cam_thr to notify proc_thr
-	pthread::cond	proc_cond;			//!< Cond/mutexpair used by cam_thr to notify proc_thr
+	volatile bool proc_stop;			//!< Stop proc_thr
+	cursor_t *proc_cursor;				//!< Cursor of proc_thr ("proc")
+	
+	pthread::thread store_thr;		//!< Background FITS writer (see \ref cam_store)
+	cursor_t *store_cursor;				//!< Cursor of store_thr ("store")
+	fitsfile *store_fptr;					//!< File being written by store_thr, or NULL
+	Path store_path;							//!< Name of Camera::store_fptr
+	coord_t store_res;						//!< Resolution of frames in Camera::store_fptr
+	int store_depth;							//!< Depth of frames in Camera::store_fptr
+	size_t store_nmax;						//!< Frames per file, from Camera::store_maxsize
+	std::vector<LONGLONG> store_ids;	//!< Frame ids in Camera::store_fptr
+	std::vector<double> store_times;	//!< Frame timestamps in Camera::store_fptr
+	double store_maxsize;					//!< Maximum file size [MB]
+	bool store_compress;					//!< Write Rice-compressed frames instead of a cube
+	volatile bool store_raw;			//!< Record raw frames instead of FITS (see \ref cam_store)
+	
+	static const size_t RAW_SYNC = 64 << 20; //!< Flush the raw recording after this many bytes
+	int raw_fd;										//!< Raw recording being written by store_thr, or -1
+	uint8_t *raw_map;							//!< Mapping of Camera::raw_fd
+	size_t raw_mapsize;						//!< Size of Camera::raw_map [bytes]
+	size_t raw_n;									//!< Frames in Camera::raw_fd
+	size_t raw_nmax;							//!< Frames that fit in Camera::raw_map
+	size_t raw_synced;						//!< Bytes of Camera::raw_map flushed so far
+	FILE *raw_idx;								//!< Index of Camera::raw_fd
+	Path raw_path;								//!< Name of Camera::raw_fd
+	rawrec_hdr_t raw_hdr;					//!< Header of Camera::raw_idx
+	double raw_maxsize;						//!< Size of a raw recording [MB]
+	
+	pthread::mutex cursor_mutex;	//!< Protects Camera::cursors (not the cursors themselves)
+	std::map<string, cursor_t *> cursors; //!< Consumer cursors by name
+	pthread::mutex gui_mutex;			//!< Serializes use of Camera::gui_cursor by network threads
+	cursor_t *gui_cursor;					//!< Cursor for grab() ("gui")
 	
 	pthread::cond mode_cond;			//!< Camera::mode change notification
 	pthread::mutex mode_mutex;		//!< Camera::mode change notification
@@ -225,6 +395,9 @@ protected:
 	virtual void do_restart()=0;
 
 	void *cam_queue(void *const data, void *const image, struct timeval *const tv = 0); //!< Store frame in buffer, returns oldest frame if buffer is full
+	void *cam_get_buf();															//!< Get a free image buffer owned by Camera (cam_thr only)
+	void cam_queue_buf(void *const buf, struct timeval *const tv = 0); //!< Queue buffer from cam_get_buf(), recycle the returned one (cam_thr only)
+	void cam_put_buf(void *const buf);								//!< Return an unused buffer from cam_get_buf() (cam_thr only)
 	void cam_proc();																	//!< Process frames (if necessary)
 
 	void calculate_stats(frame *const frame) const;		//!< Calculate rms and such
@@ -232,9 +405,17 @@ protected:
 	bool accumsave(uint32_t *accum, string accumname, double thisexp); //!< Store accumulation burst
 //	void statistics(Connection *conn, size_t bcount);	//!< Post back statistics
 	
-	Path makename(const string &base) const;					//!< Make filename from outputdir and filenamebase
+	Path makename(const string &base, const string &ext=".fits") const; //!< Make filename from outputdir and filenamebase
 	Path makename() const { return makename(filenamebase); }
-	int store_frame(const frame_t *const frame) const;	//!< Store frame to disk
+	int fits_add_header(fitsfile *fptr) const;				//!< Write common header cards (camera settings, FITS properties)
+	
+	void store_proc();																//!< Write frames in the background (store_thr)
+	int store_append(const frame_t *const frame);			//!< Append frame to the current file, open one if necessary
+	int store_open(const frame_t *const frame);				//!< Start a new file for frames like this one
+	int store_close();																//!< Write frame table and close the current file
+	int raw_append(const frame_t *const frame);				//!< Append frame to the raw recording, open one if necessary
+	int raw_open(const frame_t *const frame);					//!< Start a new raw recording for frames like this one
+	int raw_close();																	//!< Finish the index and close the raw recording
 	
 	uint8_t *get_thumbnail(Connection *conn);					//!< Get 32x32x8 thumnail
 	void grab(Connection *conn, int x1, int y1, int x2, int y2, int scale, bool do_df);
@@ -244,9 +425,16 @@ protected:
 	
 	bool do_proc;									//!< Do frame-processing or not?
 	
-	frame_t *frames;							//!< Frame ringbuffer
+	frame_t *frames;							//!< Frame pool (Camera::npool records)
+	size_t *ring;									//!< Ringbuffer, index of the record in Camera::frames for frame id % nframes
 	size_t nframes;								//!< Ringbuffer size
+	size_t nspare;								//!< Spare records for frames held by consumers
+	size_t npool;									//!< Size of Camera::frames, nframes + nspare
 	size_t count;									//!< Total number of frames captured
+	size_t ndropped;							//!< Number of frames dropped because all spare records were held
+	
+	std::map<void *, size_t> bufs;	//!< Buffers allocated by cam_get_buf() and their size
+	std::vector<void *> buf_free;	//!< Free buffers from Camera::bufs
 	size_t timeouts;							//!< Number of timeouts that occurred
 	
 	//! @todo incorporate dark/flat into struct or class?
@@ -304,14 +492,54 @@ public:
 	int get_depth() const { return depth; }
 	size_t get_maxval() const { return (1 << depth); }
 	
-	frame_t *get_next_frame(const bool wait=true);
-	frame_t *get_last_frame() const;
+	frame_t *get_next_frame(const bool wait=true);	//!< Next frame, without reference
+	frame_t *get_last_frame() const;								//!< Last frame, without reference
+	
+	/*! @brief Get the next frame and hold it until release_frame()
+	 
+	 Same as get_next_frame(), but the frame is not recycled by cam_queue() 
+	 until it is released (see \ref cam_pool).
+	 
+	 @param [in] wait Wait for a new frame if none is available
+	 @return Frame, or NULL if not available
+	 */
+	frame_t *acquire_next_frame(const bool wait=true);
+	
+	/*! @brief Get the next frame for a consumer cursor and hold it until release_frame()
+	 
+	 The frame returned depends on the policy of the cursor, frames skipped or
+	 lost are counted in the cursor (see \ref cam_cursor).
+	 
+	 @param [in] *cur Cursor from add_cursor()
+	 @param [in] wait Wait for a new frame if none is available
+	 @return Frame, or NULL if not available
+	 */
+	frame_t *acquire_next_frame(cursor_t *const cur, const bool wait=true);
+	frame_t *acquire_last_frame();									//!< Last frame, hold until release_frame()
+	void release_frame(frame_t *const frame);				//!< Release a frame from acquire_next_frame() or acquire_last_frame()
 protected:
-	//! @todo Not allowed to call this from outside, cam_mutex needs to be locked outside this function
 	frame_t *get_frame(const size_t id, const bool wait=true);
+	frame_t *acquire_frame(const size_t id, const bool wait=true); //!< Like get_frame() with a reference
+	bool wait_frame(const size_t id, const bool wait);	//!< Wait until frame id is published, false if not available
+	bool frame_claim(const size_t r);								//!< Claim record r for cam_queue(), false if held by a consumer
 public:
 	size_t get_count() const { return count; }
 	size_t get_bufsize() const { return nframes; }
+	size_t get_dropped() const { return ndropped; }
+	
+	/*! @brief Get the consumer cursor called name, add it if it does not exist
+	 
+	 A new cursor starts at the next frame published. The policy can be 
+	 overridden with the configuration key cursor_<name>.
+	 
+	 @param [in] name Consumer name
+	 @param [in] policy Default policy
+	 @return Cursor, valid for the lifetime of the camera
+	 */
+	cursor_t *add_cursor(const string &name, const cursor_policy_t policy=CURSOR_LATEST);
+	void sync_cursor(cursor_t *const cur);					//!< Skip all frames published so far, e.g. after moving a WFC
+	int set_cursor(const string &name, const string &policy); //!< Set cursor policy ('latest' or 'every')
+	string get_cursors();													//!< Cursor statistics for 'get cursors'
 	
 	void set_proc_frames(const bool b=true) { do_proc = b; }
 	bool get_proc_frames() const { return do_proc; }
@@ -321,7 +549,7 @@ public:
 	virtual void on_message(Connection*, string);
 	
 	double set_exposure(const double value);
-	int set_store(const int value);
+	int set_store(const int value, const bool raw=false);
 	double set_interval(const double value);
 	double set_gain(const double value);
 	double set_offset(const double value);
@@ -59,7 +59,7 @@ DummyCamera::~DummyCamera() {
 	io.msg(IO_DEB2, "DummyCamera::~DummyCamera()");
 	
 	// Delete frames in buffer
-	for (size_t f=0; f<nframes; f++) {
+	for (size_t f=0; f<npool; f++) {
 		free((uint16_t *) frames[f].data);
 	}
 	
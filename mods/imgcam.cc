@@ -26,6 +26,7 @@
 #include <math.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "utils.h"
 #include "config.h"
@@ -39,7 +40,7 @@ using namespace std;
 
 ImgCamera::ImgCamera(Io &io, foamctrl *const ptc, const string name, const string port, Path const &conffile, const bool online):
 Camera(io, ptc, name, imgcam_type, port, conffile, online),
-noise(10.0), img(NULL), frame(NULL)
+noise(10.0), img(NULL)
 {
 	io.msg(IO_DEB2, "ImgCamera::ImgCamera()");
 	// Register network commands with base device:
@@ -63,8 +64,6 @@ noise(10.0), img(NULL), frame(NULL)
 	// format, it is cast to uint16_t.
 	depth = 16;
 	
-	frame = (uint16_t *) malloc(res.x * res.y * depth/8);
-	
 	update();
 	
 	io.msg(IO_INFO, "ImgCamera: init success, got %dx%dx%d frame, noise=%g, intv=%g, exp=%g.", 
@@ -76,7 +75,6 @@ noise(10.0), img(NULL), frame(NULL)
 ImgCamera::~ImgCamera() {
 	io.msg(IO_DEB2, "ImgCamera::~ImgCamera()");
 	delete img;
-	free(frame);
 }
 
 void ImgCamera::update() {
@@ -86,7 +84,8 @@ void ImgCamera::update() {
 	
 	gettimeofday(&now, 0);
 	
-	uint16_t *p = frame;
+	// Fill a free buffer, frames held by consumers are not overwritten
+	uint16_t *p = (uint16_t *) cam_get_buf();
 
 	// Only process frame if necessary...
 	if (noise != 0 || exposure != 0) {
@@ -102,10 +101,11 @@ void ImgCamera::update() {
 				p[y*res.x + x] = (uint16_t)(value * mul) & mul;
 			}
 		}
+	} else {
+		memset(p, 0, res.x * res.y * depth/8);
 	}
 	
-  cam_queue(frame, frame, &now);
-	//void *old = cam_queue(frame, frame, &now);
+	cam_queue_buf(p, &now);
 	
 	if (interval > 0) {
 		// Make sure each update() takes at minimum interval seconds:
@@ -63,7 +63,6 @@ class ImgCamera: public Camera {
 private:
 	double noise;												//!< Simulated noise intensity (rand() * noise + img * exposure)
 	ImgData *img;												//!< ImgData utils are used to load frames
-	uint16_t *frame;										//!< Source image is stored here
 	
 public:
 	ImgCamera(Io &io, foamctrl *const ptc, const string name, const string port, Path const &conffile, const bool online=true);
@@ -19,6 +19,7 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <math.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_vector.h>
@@ -46,11 +47,19 @@ using namespace std;
 
 Shwfs::Shwfs(Io &io, foamctrl *const ptc, const string name, const string port, Path const &conffile, Camera &wfscam, const bool online):
 Wfs(io, ptc, name, shwfs_type, port, conffile, wfscam, online),
-shifts(io, 1), 
-shift_vec(NULL), ref_vec(NULL), tot_shift_vec(NULL),
+shifts(io, cfg.getstring("shift_workers", "1") == "auto" ? 0 : cfg.getint("shift_workers", 1)), 
+mvm(io, cfg.getstring("mvm_threads", "1") == "auto" ? 0 : cfg.getint("mvm_threads", 1)),
+mvm_calib(io, 1),
+shift_vec(NULL), ref_vec(NULL), tot_shift_vec(NULL), spot_stats(NULL), do_spotstats(false), recon_fused(false), rec_prec(Mvm::PREC_F32), rec_sparse(0), rec_sparse_maxerr(0.01), fold_actmap(false), svd_threads(0), svd_gsl(false), svd_dump(true), svd_check(true), calib_settle(0.1), calib_settle_tol(2.0), calib_nframes(4), dither_delay(1), dither_tol(0.02), dither_mincyc(3), dither_maxcyc(100), svd_stage("idle"), svd_frac(0), rec_serial(0), meas_next(0),
 method(Shift::COG), maxshift(32, 32)
 {
 	io.msg(IO_DEB2, "Shwfs::Shwfs()");
+	for (int b=0; b<2; b++) {
+		meas_shift[b] = meas_stats[b] = NULL;
+		meas_handle[b] = 0;
+		meas_busy[b] = false;
+	}
+	
 	add_cmd("mla generate");
 	add_cmd("mla find");
 	add_cmd("mla store");
@@ -68,6 +77,26 @@ method(Shift::COG), maxshift(32, 32)
 
 	add_cmd("get shifts");
 	
+	add_cmd("set method");
+	add_cmd("get method");
+	add_cmd("set corr_ref");
+	add_cmd("get corr_ref");
+	add_cmd("set spotstats");
+	add_cmd("get spotstats");
+	add_cmd("set recon_fused");
+	add_cmd("get recon_fused");
+	add_cmd("set rec_prec");
+	add_cmd("get rec_prec");
+	add_cmd("set rec_sparse");
+	add_cmd("get rec_sparse");
+	add_cmd("set fold_actmap");
+	add_cmd("get fold_actmap");
+	add_cmd("rec store");
+	add_cmd("rec use");
+	add_cmd("get rec_presets");
+	add_cmd("get svd_progress");
+	add_cmd("get dither");
+	
 	//! @todo Move microlens array configuration to separate class
 	mlacfg.reserve(128);
 	
@@ -102,6 +131,55 @@ method(Shift::COG), maxshift(32, 32)
 	
 	shift_mini = cfg.getdouble("shift_mini", 100);
 	
+	// Shift calculation method
+	set_method(cfg.getstring("method", "cog"));
+	shifts.set_corr_interp(cfg.getstring("corr_interp", "parabolic") == "gaussian" ? Shift::INTERP_GAUSSIAN : Shift::INTERP_PARABOLIC);
+	string refstr = cfg.getstring("corr_ref", "mean");
+	shifts.set_corr_ref(refstr == "mean" ? -1 : atoi(refstr.c_str()));
+	shifts.set_cog_sigma(cfg.getdouble("cog_sigma", 0));
+	shifts.set_cog_window(cfg.getint("cog_window", 8));
+	shifts.set_cog_niter(cfg.getint("cog_niter", 3));
+	
+	// Spot metrics
+	do_spotstats = cfg.getbool("spotstats", false);
+	recon_fused = cfg.getbool("recon_fused", false);
+	set_rec_prec(cfg.getstring("rec_prec", "f32"));
+	rec_sparse_maxerr = cfg.getdouble("rec_sparse_maxerr", 0.01);
+	set_rec_sparse(cfg.getstring("rec_sparse", "0"));
+	fold_actmap = cfg.getbool("fold_actmap", false);
+	svd_threads = cfg.getstring("svd_threads", "auto") == "auto" ? 0 : cfg.getint("svd_threads", 0);
+	svd_gsl = (cfg.getstring("svd_method", "jacobi") == "gsl");
+	svd_dump = cfg.getbool("svd_dump", true);
+	svd_check = cfg.getbool("svd_check", true);
+	calib_settle = cfg.getdouble("calib_settle", 0.1);
+	calib_settle_tol = cfg.getdouble("calib_settle_tol", 2.0);
+	calib_nframes = cfg.getint("calib_nframes", 4);
+	dither_delay = cfg.getint("dither_delay", 1);
+	dither_tol = cfg.getdouble("dither_tol", 0.02);
+	dither_mincyc = cfg.getint("dither_mincyc", 3);
+	dither_maxcyc = cfg.getint("dither_maxcyc", 100);
+	shifts.set_satlevel(cfg.getint("satlevel", cam.get_maxval()-1));
+	
+	// Shift worker pool tuning
+	shifts.set_spin(cfg.getint("shift_spin", 50));
+	shifts.set_chunk(cfg.getint("shift_chunk", 0));
+	if (cfg.exists("shift_cpus")) {
+		std::vector<int> cpus = Shift::parse_cpus(cfg.getstring("shift_cpus"));
+		if (cpus.empty())
+			io.msg(IO_WARN, "Shwfs::Shwfs() could not parse shift_cpus '%s', not pinning workers.", cfg.getstring("shift_cpus").c_str());
+		else
+			shifts.set_affinity(cpus);
+	}
+	if (cfg.exists("shift_prio"))
+		shifts.set_priority(cfg.getint("shift_prio"));
+	if (cfg.exists("mvm_cpus")) {
+		std::vector<int> cpus = Shift::parse_cpus(cfg.getstring("mvm_cpus"));
+		if (cpus.empty())
+			io.msg(IO_WARN, "Shwfs::Shwfs() could not parse mvm_cpus '%s', not pinning workers.", cfg.getstring("mvm_cpus").c_str());
+		else
+			mvm.set_affinity(cpus);
+	}
+	
 	// Generate MLA grid
 	gen_mla_grid(mlacfg, cam.get_res(), sisize, sipitch, xoff, disp, shape, overlap);
 	
@@ -111,10 +189,23 @@ method(Shift::COG), maxshift(32, 32)
 
 Shwfs::~Shwfs() {
 	io.msg(IO_DEB2, "Shwfs::~Shwfs()");
+	// Workers might still be writing to the measurement buffers
+	shifts.wait();
+	dither_join();
 	
 	gsl_vector_float_free(shift_vec);
 	gsl_vector_float_free(ref_vec);
 	gsl_vector_float_free(tot_shift_vec);
+	gsl_vector_float_free(spot_stats);
+	for (int b=0; b<2; b++) {
+		gsl_vector_float_free(meas_shift[b]);
+		gsl_vector_float_free(meas_stats[b]);
+	}
+	
+	for (std::map<std::string, gsl_matrix_float *>::iterator am=actmaps.begin(); am != actmaps.end(); ++am)
+		gsl_matrix_float_free(am->second);
+	for (std::map<std::string, rec_slot *>::iterator rs=recslots.begin(); rs != recslots.end(); ++rs)
+		delete rs->second;
 
 	std::map<std::string, infdata_t>::iterator it;
 	for (it=calib.begin(); it != calib.end(); it++ ) {
@@ -131,6 +222,8 @@ Shwfs::~Shwfs() {
 		gsl_matrix_float_free(curdat.meas.infmat_f);
 		
 		gsl_matrix_float_free(curdat.actmat.mat);
+		for (std::map<std::string, gsl_matrix_float *>::iterator p=curdat.actmat.presets.begin(); p != curdat.actmat.presets.end(); ++p)
+			gsl_matrix_float_free(p->second);
 		gsl_matrix_free(curdat.actmat.mat_dbl);
 		gsl_matrix_free(curdat.actmat.U);
 		gsl_vector_free(curdat.actmat.s);
@@ -144,7 +237,26 @@ void Shwfs::on_message(Connection *const conn, string line) {
 	string command = popword(line);
 	bool parsed = true;
 	
-	if (command == "mla") {
+	if (command == "rec") {
+		string what = popword(line);
+		string wfcname = popword(line);
+		string name = popword(line);
+		
+		if (what == "store") {						// rec store <wfc> <name>
+			conn->addtag("rec");
+			if (store_rec(wfcname, name))
+				conn->write("ok rec store " + wfcname + " " + name);
+			else
+				conn->write("error rec store :Unknown or uncalibrated WFC");
+		} else if (what == "use") {				// rec use <wfc> <name>
+			conn->addtag("rec");
+			if (use_rec(wfcname, name))
+				net_broadcast("ok rec use " + wfcname + " " + name, "rec");
+			else
+				conn->write("error rec use :Unknown WFC or preset");
+		} else
+			parsed = false;
+	} else if (command == "mla") {
 		string what = popword(line);
 
 		if (what == "generate") {					// mla generate
@@ -207,12 +319,51 @@ void Shwfs::on_message(Connection *const conn, string line) {
 		
 		if (what == "shifts") {						// get shifts
 			conn->write("ok shifts " + get_shifts_str());
+		} else if (what == "spotstats") {	// get spotstats
+			conn->addtag("spotstats");
+			conn->write("ok spotstats " + get_spotstats_str());
+		} else if (what == "recon_fused") {	// get recon_fused
+			conn->addtag("recon_fused");
+			conn->write(format("ok recon_fused %d", recon_fused));
+		} else if (what == "rec_prec") {	// get rec_prec
+			conn->addtag("rec_prec");
+			conn->write("ok rec_prec " + get_rec_prec());
+		} else if (what == "rec_sparse") {	// get rec_sparse
+			conn->addtag("rec_sparse");
+			conn->write("ok rec_sparse " + get_rec_sparse());
+		} else if (what == "rec_presets") {	// get rec_presets <wfc>
+			string wfcname = popword(line);
+			string list;
+			pthread::mutexholder lock(&calib_mutex);
+			if (calib.find(wfcname) != calib.end())
+				for (std::map<std::string, gsl_matrix_float *>::iterator p=calib[wfcname].actmat.presets.begin(); p != calib[wfcname].actmat.presets.end(); ++p)
+					list += " " + p->first;
+			conn->write(format("ok rec_presets %s %zu", wfcname.c_str(), calib.find(wfcname) != calib.end() ? calib[wfcname].actmat.presets.size() : 0) + list);
+		} else if (what == "svd_progress") {	// get svd_progress
+			conn->addtag("svd_progress");
+			conn->write(format("ok svd_progress %s %.3f", svd_stage, svd_frac));
+		} else if (what == "dither") {	// get dither
+			static const char *names[] = {"idle", "armed", "running", "stop"};
+			conn->addtag("dither");
+			conn->write(format("ok dither %s %d %.4f", names[__atomic_load_n(&dither.state, __ATOMIC_SEQ_CST)], dither.ncyc, dither.change));
+		} else if (what == "fold_actmap") {	// get fold_actmap
+			conn->addtag("fold_actmap");
+			conn->write(format("ok fold_actmap %d", fold_actmap));
 		} else if (what == "maxshift") {	// get maxshift
 			conn->addtag("maxshift");
 			conn->write(format("ok maxshift %f %f", maxshift.x, maxshift.y));
 		} else if (what == "shift_mini") {				// get shift_mini
 			conn->addtag("shift_mini");
 			conn->write(format("ok shift_mini %g", shift_mini));
+		} else if (what == "method") {		// get method
+			conn->addtag("method");
+			conn->write("ok method " + get_method());
+		} else if (what == "corr_ref") {	// get corr_ref
+			conn->addtag("corr_ref");
+			if (shifts.get_corr_ref() < 0)
+				conn->write("ok corr_ref mean");
+			else
+				conn->write(format("ok corr_ref %d", shifts.get_corr_ref()));
 		} else 
 			parsed = false;
 	} else if (command == "set") {
@@ -234,6 +385,42 @@ void Shwfs::on_message(Connection *const conn, string line) {
 				conn->write(format("error set maxshift :Maximum shift should be positive, was %f %f", 
 													 maxshift.x, maxshift.y));
 			}
+		} else if (what == "method") {		// set method <cog|cog_weight|cog_window|cog_iter|corr>
+			conn->addtag("method");
+			if (set_method(popword(line)))
+				net_broadcast("ok method " + get_method(), "method");
+			else
+				conn->write("error set method :Unknown or unavailable method");
+		} else if (what == "spotstats") {	// set spotstats <0|1>
+			conn->addtag("spotstats");
+			do_spotstats = popbool(line);
+			net_broadcast(format("ok spotstats %d", do_spotstats), "spotstats");
+		} else if (what == "recon_fused") {	// set recon_fused <0|1>
+			conn->addtag("recon_fused");
+			recon_fused = popbool(line);
+			net_broadcast(format("ok recon_fused %d", recon_fused), "recon_fused");
+		} else if (what == "rec_prec") {	// set rec_prec <f32|f16|i16>
+			conn->addtag("rec_prec");
+			if (set_rec_prec(popword(line)))
+				net_broadcast("ok rec_prec " + get_rec_prec(), "rec_prec");
+			else
+				conn->write("error set rec_prec :Unknown precision");
+		} else if (what == "rec_sparse") {	// set rec_sparse <threshold|auto>
+			conn->addtag("rec_sparse");
+			if (set_rec_sparse(popword(line)))
+				net_broadcast("ok rec_sparse " + get_rec_sparse(), "rec_sparse");
+			else
+				conn->write("error set rec_sparse :Invalid threshold");
+		} else if (what == "fold_actmap") {	// set fold_actmap <0|1>
+			conn->addtag("fold_actmap");
+			set_fold_actmap(popbool(line));
+			net_broadcast(format("ok fold_actmap %d", fold_actmap), "fold_actmap");
+		} else if (what == "corr_ref") {	// set corr_ref <mean|idx>
+			conn->addtag("corr_ref");
+			string ref = popword(line);
+			// Reference is captured from the next frame
+			shifts.set_corr_ref(ref == "mean" ? -1 : atoi(ref.c_str()));
+			net_broadcast("ok corr_ref " + ref, "corr_ref");
 		} else 
 			parsed = false;
 	} else {
@@ -245,29 +432,319 @@ void Shwfs::on_message(Connection *const conn, string line) {
 		Wfs::on_message(conn, orig);
 }
 
+bool Shwfs::set_method(const string meth) {
+	if (meth == "cog") {
+		method = Shift::COG;
+	} else if (meth == "cog_weight") {
+		method = Shift::COG_WEIGHT;
+	} else if (meth == "cog_window") {
+		method = Shift::COG_WINDOW;
+	} else if (meth == "cog_iter") {
+		method = Shift::COG_ITER;
+	} else if (meth == "corr") {
+		if (!Shift::have_corr()) {
+			io.msg(IO_ERR, "Shwfs::set_method() method 'corr' needs FFTW, keeping '%s'", get_method().c_str());
+			return false;
+		}
+		method = Shift::CORR;
+	} else {
+		io.msg(IO_ERR, "Shwfs::set_method() unknown method '%s'", meth.c_str());
+		return false;
+	}
+	io.msg(IO_XNFO, "Shwfs::set_method() using '%s'", meth.c_str());
+	return true;
+}
+
+bool Shwfs::set_rec_prec(const string prec) {
+	int p;
+	for (p=0; p<Mvm::NPREC; p++)
+		if (prec == Mvm::prec_str((Mvm::prec_t) p))
+			break;
+	if (p == Mvm::NPREC) {
+		io.msg(IO_ERR, "Shwfs::set_rec_prec() unknown precision '%s'", prec.c_str());
+		return false;
+	}
+	rec_prec = (Mvm::prec_t) p;
+	io.msg(IO_XNFO, "Shwfs::set_rec_prec() using '%s'", prec.c_str());
+	
+	// Convert existing reconstructors
+	pthread::mutexholder lock(&calib_mutex);
+	for (std::map<std::string, infdata_t>::iterator it=calib.begin(); it != calib.end(); ++it)
+		if (it->second.init && it->second.actmat.mat)
+			build_rec(it->first);
+	return true;
+}
+
+bool Shwfs::set_rec_sparse(const string thresh) {
+	if (thresh == "auto") {
+		rec_sparse = -1;
+	} else {
+		char *end;
+		const double th = strtod(thresh.c_str(), &end);
+		if (thresh.empty() || *end || th < 0 || th >= 1) {
+			io.msg(IO_ERR, "Shwfs::set_rec_sparse() invalid threshold '%s'", thresh.c_str());
+			return false;
+		}
+		rec_sparse = th;
+	}
+	io.msg(IO_XNFO, "Shwfs::set_rec_sparse() using '%s'", get_rec_sparse().c_str());
+	
+	pthread::mutexholder lock(&calib_mutex);
+	for (std::map<std::string, infdata_t>::iterator it=calib.begin(); it != calib.end(); ++it)
+		if (it->second.init && it->second.actmat.mat)
+			build_rec(it->first);
+	return true;
+}
+
+void Shwfs::set_fold_actmap(const bool fold) {
+	pthread::mutexholder lock(&calib_mutex);
+	fold_actmap = fold;
+	for (std::map<std::string, infdata_t>::iterator it=calib.begin(); it != calib.end(); ++it)
+		if (it->second.init && it->second.actmat.mat)
+			build_rec(it->first);
+}
+
+void Shwfs::svd_progress(const char *stage, const double frac) {
+	svd_stage = stage;
+	svd_frac = frac;
+	net_broadcast(format("ok svd_progress %s %.3f", stage, frac), "svd_progress");
+}
+
+void Shwfs::set_actmap(const string &wfcname, const gsl_matrix_float *actmap) {
+	pthread::mutexholder lock(&calib_mutex);
+	if (actmaps.find(wfcname) != actmaps.end()) {
+		gsl_matrix_float_free(actmaps[wfcname]);
+		actmaps.erase(wfcname);
+	}
+	if (actmap) {
+		actmaps[wfcname] = gsl_matrix_float_alloc(actmap->size1, actmap->size2);
+		gsl_matrix_float_memcpy(actmaps[wfcname], actmap);
+	}
+	
+	if (calib.find(wfcname) != calib.end() && calib[wfcname].init && calib[wfcname].actmat.mat)
+		build_rec(wfcname);
+}
+
+bool Shwfs::have_fold(rechandle_t h) {
+	int phase;
+	reconstructor_t *r = rec_acquire(h, phase);
+	const bool ret = r && r->fold;
+	rec_release(h, phase);
+	return ret;
+}
+
+Shwfs::rechandle_t Shwfs::get_rec_handle(const string &wfcname) {
+	pthread::mutexholder lock(&recslot_mutex);
+	std::map<std::string, rec_slot *>::iterator it = recslots.find(wfcname);
+	if (it != recslots.end())
+		return it->second;
+	return recslots[wfcname] = new rec_slot;
+}
+
+void Shwfs::publish_rec(const string &wfcname, reconstructor_t *r) {
+	rechandle_t h = get_rec_handle(wfcname);
+	pthread::mutexholder lock(&h->publish_mutex);
+	r->serial = __atomic_add_fetch(&rec_serial, 1, __ATOMIC_SEQ_CST);
+	
+	// New readers get r. Readers that may still hold the old pointer all 
+	// registered in the current phase: flip it and wait for them.
+	reconstructor_t *old = __atomic_exchange_n(&h->cur, r, __ATOMIC_SEQ_CST);
+	const int phase = __atomic_load_n(&h->phase, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&h->phase, 1 - phase, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&h->readers[phase], __ATOMIC_SEQ_CST) > 0)
+		usleep(100);
+	delete old;
+	
+	io.msg(IO_XNFO, "Shwfs::publish_rec() reconstructor %d active for '%s'", r->serial, wfcname.c_str());
+}
+
+bool Shwfs::store_rec(const string &wfcname, const string &name) {
+	pthread::mutexholder lock(&calib_mutex);
+	if (calib.find(wfcname) == calib.end() || !calib[wfcname].init || name.empty())
+		return false;
+	
+	std::map<std::string, gsl_matrix_float *> &presets = calib[wfcname].actmat.presets;
+	gsl_matrix_float *mat = calib[wfcname].actmat.mat;
+	if (presets.find(name) != presets.end())
+		gsl_matrix_float_free(presets[name]);
+	presets[name] = gsl_matrix_float_alloc(mat->size1, mat->size2);
+	gsl_matrix_float_memcpy(presets[name], mat);
+	io.msg(IO_INFO, "Shwfs::store_rec() stored actuation matrix for '%s' as '%s'", wfcname.c_str(), name.c_str());
+	return true;
+}
+
+bool Shwfs::use_rec(const string &wfcname, const string &name) {
+	pthread::mutexholder lock(&calib_mutex);
+	if (calib.find(wfcname) == calib.end() || !calib[wfcname].init)
+		return false;
+	std::map<std::string, gsl_matrix_float *> &presets = calib[wfcname].actmat.presets;
+	if (presets.find(name) == presets.end())
+		return false;
+	
+	gsl_matrix_float_memcpy(calib[wfcname].actmat.mat, presets[name]);
+	build_rec(wfcname);
+	io.msg(IO_INFO, "Shwfs::use_rec() using actuation matrix '%s' for '%s'", name.c_str(), wfcname.c_str());
+	return true;
+}
+
+string Shwfs::get_method() const {
+	switch (method) {
+		case Shift::CORR: return "corr";
+		case Shift::COG_WEIGHT: return "cog_weight";
+		case Shift::COG_WINDOW: return "cog_window";
+		case Shift::COG_ITER: return "cog_iter";
+		case Shift::COG:
+		default: return "cog";
+	}
+}
+
 Wfs::wf_info_t* Shwfs::measure(Camera::frame_t *frame) {
+	Shift::handle_t h;
+	if (!measure_start(frame, &h))
+		return NULL;
+	return measure_finish(h);
+}
+
+bool Shwfs::measure_start(Camera::frame_t *frame, Shift::handle_t *h, const Shift::recon_t *recon) {
 	if (!get_calib()) {
-		io.msg(IO_WARN, "Shwfs::measure() device not calibrated, should not be.");
+		io.msg(IO_WARN, "Shwfs::measure_start() device not calibrated, should not be.");
 		calibrate();
 	}
 	
 	if (!frame) {
-		io.msg(IO_WARN, "Shwfs::measure() *frame not available? Auto-acquiring...");
+		io.msg(IO_WARN, "Shwfs::measure_start() *frame not available? Auto-acquiring...");
 		frame = cam.get_last_frame();
 	}
 	
-	// Calculate shifts
-	if (cam.get_depth() == 16) {
-		shifts.calc_shifts((uint16_t *) frame->image, cam.get_res(), mlacfg, maxshift, shift_vec, method, true, shift_mini);
+	// Subimage layout is registered in calibrate(), but the camera resolution might have changed since
+	const coord_t res = cam.get_res();
+	if (shifts.get_layout().res.x != res.x || shifts.get_layout().res.y != res.y)
+		shifts.set_layout(mlacfg, res);
+	
+	// Take the next buffer, finish its previous job if that was never collected
+	const int b = meas_next;
+	if (meas_busy[b]) {
+		io.msg(IO_DEB1, "Shwfs::measure_start() measurement buffer %d still in use, dropping result.", b);
+		shifts.wait(meas_handle[b]);
+		meas_busy[b] = false;
+	}
+	
+	// Calculate shifts, and spot metrics in the same pass if requested
+	gsl_vector_float *stats = do_spotstats ? meas_stats[b] : NULL;
+	if (cam.get_depth() == 32) {
+		*h = shifts.submit((uint32_t *) frame->image, maxshift, meas_shift[b], method, shift_mini, stats, recon);
+	}
+	else if (cam.get_depth() == 16) {
+		*h = shifts.submit((uint16_t *) frame->image, maxshift, meas_shift[b], method, shift_mini, stats, recon);
 	}
 	else if (cam.get_depth() == 8) {
-		shifts.calc_shifts((uint8_t *) frame->image, cam.get_res(), mlacfg, maxshift, shift_vec, method, true, shift_mini);
+		*h = shifts.submit((uint8_t *) frame->image, maxshift, meas_shift[b], method, shift_mini, stats, recon);
 	}
 	else {
-		io.msg(IO_ERR, "Shwfs::measure() unknown camera datatype");
+		io.msg(IO_ERR, "Shwfs::measure_start() unknown camera datatype");
+		return false;
+	}
+	if (*h < 0)
+		return false;
+	
+	meas_handle[b] = *h;
+	meas_busy[b] = true;
+	meas_next = (b+1) % 2;
+	return true;
+}
+
+bool Shwfs::measure_batch(const vector<Camera::frame_t *> &frames, gsl_matrix_float *shiftmat) {
+	if (!get_calib()) {
+		io.msg(IO_WARN, "Shwfs::measure_batch() device not calibrated, should not be.");
+		calibrate();
+	}
+	
+	const coord_t res = cam.get_res();
+	if (shifts.get_layout().res.x != res.x || shifts.get_layout().res.y != res.y)
+		shifts.set_layout(mlacfg, res);
+	
+	vector<const void *> imgs(frames.size());
+	for (size_t k=0; k<frames.size(); k++)
+		imgs[k] = frames[k]->image;
+	if (imgs.empty())
+		return true;
+	
+	bool ret;
+	if (cam.get_depth() == 32)
+		ret = shifts.calc_shifts_batch((const uint32_t *const *) &imgs[0], imgs.size(), maxshift, shiftmat, method, shift_mini);
+	else if (cam.get_depth() == 16)
+		ret = shifts.calc_shifts_batch((const uint16_t *const *) &imgs[0], imgs.size(), maxshift, shiftmat, method, shift_mini);
+	else if (cam.get_depth() == 8)
+		ret = shifts.calc_shifts_batch((const uint8_t *const *) &imgs[0], imgs.size(), maxshift, shiftmat, method, shift_mini);
+	else {
+		io.msg(IO_ERR, "Shwfs::measure_batch() unknown camera datatype");
+		return false;
+	}
+	if (!ret)
+		return false;
+	
+	// Subtract reference from each frame, as measure() does
+	for (size_t k=0; k<frames.size(); k++) {
+		gsl_vector_float_view row = gsl_matrix_float_subrow(shiftmat, k, 0, ref_vec->size);
+		gsl_vector_float_sub(&row.vector, ref_vec);
+	}
+	return true;
+}
+
+Wfs::wf_info_t* Shwfs::measure_ctrlcmd(Camera::frame_t *frame, rechandle_t rh, gsl_vector_float *act) {
+	int phase;
+	reconstructor_t *r = rec_acquire(rh, phase);
+	if (!recon_fused || !act || !r || !r->rec_t || r->rec_sp) {
+		rec_release(rh, phase);
+		wf_info_t *m = measure(frame);
+		if (m && comp_ctrlcmd(rh, m->wfamp, act))
+			io.msg(IO_WARN, "Shwfs::measure_ctrlcmd() comp_ctrlcmd() failed");
+		return m;
+	}
+	
+	// Shift workers subtract ref_vec and reconstruct their subimages right away
+	Shift::recon_t recon;
+	recon.mvm = &mvm;
+	recon.rec = r->rec_t;
+	recon.ref = ref_vec;
+	recon.act = act;
+	
+	Shift::handle_t h;
+	wf_info_t *m = NULL;
+	if (measure_start(frame, &h, &recon))
+		m = measure_finish(h);
+	rec_release(rh, phase);
+	return m;
+}
+
+Wfs::wf_info_t* Shwfs::measure_ctrlcmd_fold(Camera::frame_t *frame, rechandle_t rh, gsl_vector_float *fold) {
+	wf_info_t *m = measure(frame);
+	if (m && comp_ctrlcmd_fold(rh, m->wfamp, fold))
+		io.msg(IO_WARN, "Shwfs::measure_ctrlcmd_fold() comp_ctrlcmd_fold() failed");
+	return m;
+}
+
+Wfs::wf_info_t* Shwfs::measure_finish(const Shift::handle_t h) {
+	int b;
+	for (b=0; b<2; b++)
+		if (meas_busy[b] && meas_handle[b] == h)
+			break;
+	if (b == 2) {
+		io.msg(IO_ERR, "Shwfs::measure_finish() no measurement in progress with handle %d", h);
 		return NULL;
 	}
 	
+	shifts.wait(h);
+	meas_busy[b] = false;
+	
+	gsl_vector_float_memcpy(shift_vec, meas_shift[b]);
+	if (do_spotstats) {
+		gsl_vector_float_memcpy(spot_stats, meas_stats[b]);
+		wf.spotstats = spot_stats;
+	}
+	else
+		wf.spotstats = NULL;
+	
 	// Convert shifts to basisfunction
 	gsl_vector_float_sub(shift_vec, ref_vec);
 	
@@ -319,6 +796,8 @@ void Shwfs::init_infmat(const string &wfcname, const size_t nact, const vector <
 		
 		// Free() .actmat matrices
 		gsl_matrix_float_free(calib[wfcname].actmat.mat);
+		for (std::map<std::string, gsl_matrix_float *>::iterator p=calib[wfcname].actmat.presets.begin(); p != calib[wfcname].actmat.presets.end(); ++p)
+			gsl_matrix_float_free(p->second);
 		gsl_matrix_free(calib[wfcname].actmat.mat_dbl);
 		gsl_matrix_free(calib[wfcname].actmat.U);
 		gsl_vector_free(calib[wfcname].actmat.s);
@@ -352,6 +831,8 @@ void Shwfs::init_infmat(const string &wfcname, const size_t nact, const vector <
 	calib[wfcname].actmat.Sigma = gsl_matrix_calloc(nact, nact);
 	calib[wfcname].actmat.V = gsl_matrix_calloc(nact, nact);
 	
+	// Zero reconstructor until calibrated
+	build_rec(wfcname);
 	calib[wfcname].init = true;
 }
 	
@@ -372,6 +853,34 @@ int Shwfs::build_infmat(string wfcname, Camera::frame_t *frame, int actid, int a
 	return (int) m->wfamp->size;
 }
 
+int Shwfs::build_infmat(string wfcname, const vector<Camera::frame_t *> &frames, int actid, int actposid) {
+	if (!calib[wfcname].init) {
+		io.msg(IO_WARN, "Shwfs::build_infmat(): Call Shwfs::init_infmat() first.");
+		return 0;
+	}
+	if (frames.empty())
+		return 0;
+	
+	// Measure shifts of all frames in one batch
+	gsl_matrix_float *batch = gsl_matrix_float_alloc(frames.size(), shift_vec->size);
+	if (!measure_batch(frames, batch)) {
+		gsl_matrix_float_free(batch);
+		return 0;
+	}
+	
+	// Store mean over frames in measmat
+	gsl_matrix_float *measmat = calib[wfcname].meas.measmat[actposid];
+	for (size_t i=0; i<batch->size2; i++) {
+		double sum = 0;
+		for (size_t k=0; k<batch->size1; k++)
+			sum += gsl_matrix_float_get(batch, k, i);
+		gsl_matrix_float_set(measmat, i, actid, sum / batch->size1);
+	}
+	
+	gsl_matrix_float_free(batch);
+	return (int) shift_vec->size;
+}
+
 int Shwfs::calc_infmat(const string &wfcname) {
 	if (!calib[wfcname].init) {
 		io.msg(IO_WARN, "Shwfs::calc_infmat(): Call Shwfs::init_infmat() first.");
@@ -438,6 +947,11 @@ int Shwfs::calc_infmat(const string &wfcname) {
 }
 
 int Shwfs::update_actmat(const string &wfcname, const double singval) {
+	pthread::mutexholder lock(&calib_mutex);
+	return _update_actmat(wfcname, singval);
+}
+
+int Shwfs::_update_actmat(const string &wfcname, const double singval) {
 	io.msg(IO_XNFO, "Shwfs::update_actmat(): updating for wfc '%s' with singval cutoff %g.",
 				 wfcname.c_str(), singval);
 
@@ -529,61 +1043,136 @@ int Shwfs::update_actmat(const string &wfcname, const double singval) {
 
 	// Calculate explicit pseudo-inverse matrix of infmat, store in mat_dbl. The
 	// pseudo-inverse is given by actmat = V . Sigma . U^T
-	// Allocate memory for operations
-	gsl_matrix *workmat = gsl_matrix_calloc(mat->size1, mat->size2);
-	
-	// First calculate workmat = (Sigma . U^T)
-	gsl_blas_dgemm (CblasNoTrans, CblasTrans, 1.0, Sigma, U, 0.0, workmat);
-	// Then calculate mat_dbl = (V . workmat)
-	gsl_blas_dgemm (CblasNoTrans, CblasNoTrans, 1.0, V, workmat, 0.0, mat_dbl);
-	
-	// Free temporary matrix
-	gsl_matrix_free(workmat);
+	if (svd_gsl) {
+		// Allocate memory for operations
+		gsl_matrix *workmat = gsl_matrix_calloc(mat->size1, mat->size2);
+		
+		// First calculate workmat = (Sigma . U^T)
+		gsl_blas_dgemm (CblasNoTrans, CblasTrans, 1.0, Sigma, U, 0.0, workmat);
+		// Then calculate mat_dbl = (V . workmat)
+		gsl_blas_dgemm (CblasNoTrans, CblasNoTrans, 1.0, V, workmat, 0.0, mat_dbl);
+		
+		// Free temporary matrix
+		gsl_matrix_free(workmat);
+	} else {
+		// Same product, skipping the modes cut off in Sigma
+		Pinv pinv(io, svd_threads);
+		pinv.pinv(U, s, V, use_nmodes, mat_dbl);
+	}
 
 	// Copy mat_dbl (double) to newmat (float)
 	for (size_t i=0; i<newmat->size1; i++)
 		for (size_t j=0; j<newmat->size2; j++)
 			gsl_matrix_float_set(newmat, i, j, gsl_matrix_get(mat_dbl, i, j));
 	
-	// Wait a bit for calculations using mat to finish, then swap pointers
-	//! @todo This should be handled with mutexes or something?
-	usleep(100000); // = 0.1e6
-	
-	// Swap matrix mat & newmat. 'mat' should point to 'newmat', old 'mat' contents
-	// should be free'd
+	// Swap matrix mat & newmat, free the old 'mat'. The loop does not use mat 
+	// but the reconstructor published by build_rec(), see \ref shwfs_rechandle
 	gsl_matrix_float *oldmat = calib[wfcname].actmat.mat;
 	
-	fprintf(stderr, "oldmat (%d x %d):\n", (int) oldmat->size1, (int) oldmat->size2);
-	for (size_t i=0; i<oldmat->size1; i++) {
-		for (size_t j=0; j<oldmat->size2; j++) {
-			fprintf(stderr, "%g, ", gsl_matrix_float_get(oldmat, i, j));
+	// Swap matrices! (The matrices are not printed anymore, at 1000 actuators 
+	// that takes longer than calculating them; see calc_actmat() for CSV.)
+	calib[wfcname].actmat.mat = newmat;
+	build_rec(wfcname);
+
+	gsl_matrix_float_free(oldmat);
+
+	return 0;
+}
+
+void Shwfs::build_rec(const string &wfcname) {
+	gsl_matrix_float *mat = calib[wfcname].actmat.mat;
+	
+	// The reconstructor includes the -1 of comp_ctrlcmd(). It is built aside
+	// and published when complete, see \ref shwfs_rechandle
+	reconstructor_t *r = new reconstructor_t;
+	r->rec = new Mvm::matrix_t(mat, -1.0, false, rec_prec);
+	r->rec_t = new Mvm::matrix_t(mat, -1.0, true, rec_prec);
+	
+	double err, maxerr;
+	if (rec_prec != Mvm::PREC_F32) {
+		const Mvm::matrix_t &rec = *r->rec;
+		err = rec_error(wfcname, &rec, NULL, maxerr);
+		io.msg(IO_INFO, "Shwfs::build_rec() %s reconstructor for '%s' (%.1f MB, f32: %.1f MB): relative rms error %.3g, max error %.3g vs. f32", 
+					 Mvm::prec_str(rec_prec), wfcname.c_str(), rec.bytes() / 1048576.0, rec.prows * rec.stride * sizeof(float) / 1048576.0, 
+					 err, maxerr);
+	}
+	
+	// Sparse copy, with the given threshold or the largest one within rec_sparse_maxerr
+	Mvm::sparse_t *sp = NULL;
+	if (rec_sparse > 0) {
+		sp = new Mvm::sparse_t(mat, rec_sparse, -1.0);
+		err = rec_error(wfcname, NULL, sp, maxerr);
+	} else if (rec_sparse < 0) {
+		const double thresh[] = {0.1, 0.03, 0.01, 0.003, 0.001, 0.0};
+		for (size_t t=0; t<sizeof thresh / sizeof *thresh; t++) {
+			delete sp;
+			sp = new Mvm::sparse_t(mat, thresh[t], -1.0);
+			err = rec_error(wfcname, NULL, sp, maxerr);
+			if (err <= rec_sparse_maxerr)
+				break;
 		}
-		fprintf(stderr, "\n");
 	}
+	r->rec_sp = sp;
 	
-	// Swap matrices!
-	calib[wfcname].actmat.mat = newmat;
-	mat = newmat;
+	if (sp) {
+		io.msg(IO_INFO, "Shwfs::build_rec() sparse reconstructor for '%s': threshold %g, fill %.3f (%.1f MB): relative rms error %.3g, max error %.3g vs. dense", 
+					 wfcname.c_str(), sp->thresh, sp->fill(), sp->bytes() / 1048576.0, err, maxerr);
+		if (sp->fill() > 0.5)
+			io.msg(IO_WARN, "Shwfs::build_rec() sparse reconstructor for '%s' has fill %.2f, dense is likely faster", wfcname.c_str(), sp->fill());
+	}
 	
-	fprintf(stderr, "mat (%d x %d):\n", (int) mat->size1, (int) mat->size2);
-	for (size_t i=0; i<mat->size1; i++) {
-		for (size_t j=0; j<mat->size2; j++) {
-			fprintf(stderr, "%g, ", gsl_matrix_float_get(mat, i, j));
+	// Folded reconstructor [actmap . -mat; -mat], see Wfc::update_control_fold()
+	Mvm::matrix_t *fold = NULL;
+	std::map<std::string, gsl_matrix_float *>::iterator am = actmaps.find(wfcname);
+	if (fold_actmap && am != actmaps.end()) {
+		gsl_matrix_float *actmap = am->second;
+		if (actmap->size2 != mat->size1) {
+			io.msg(IO_WARN, "Shwfs::build_rec() actuator mapping for '%s' is %zu x %zu, expected %zu columns, not folding", 
+						 wfcname.c_str(), actmap->size1, actmap->size2, mat->size1);
+		} else {
+			gsl_matrix_float *stack = gsl_matrix_float_alloc(actmap->size1 + mat->size1, mat->size2);
+			gsl_matrix_float_view top = gsl_matrix_float_submatrix(stack, 0, 0, actmap->size1, mat->size2);
+			gsl_matrix_float_view bottom = gsl_matrix_float_submatrix(stack, actmap->size1, 0, mat->size1, mat->size2);
+			gsl_blas_sgemm(CblasNoTrans, CblasNoTrans, 1.0, actmap, mat, 0.0, &top.matrix);
+			gsl_matrix_float_memcpy(&bottom.matrix, mat);
+			fold = new Mvm::matrix_t(stack, -1.0, false, rec_prec);
+			gsl_matrix_float_free(stack);
+			io.msg(IO_INFO, "Shwfs::build_rec() folded reconstructor for '%s': %zu x %zu (%zu actuators, %zu modes)", 
+						 wfcname.c_str(), fold->rows, fold->cols, actmap->size1, mat->size1);
 		}
-		fprintf(stderr, "\n");
 	}
+	r->fold = fold;
+	
+	publish_rec(wfcname, r);
+}
 
-//	fprintf(stderr, "newmat (%d x %d):\n", (int) newmat->size1, (int) newmat->size2);
-//	for (size_t i=0; i<newmat->size1; i++) {
-//		for (size_t j=0; j<newmat->size2; j++) {
-//			fprintf(stderr, "%g, ", gsl_matrix_float_get(newmat, i, j));
-//		}
-//		fprintf(stderr, "\n");
-//	}
-
-	gsl_matrix_float_free(oldmat);
-
-	return 0;
+double Shwfs::rec_error(const string &wfcname, const Mvm::matrix_t *rec, const Mvm::sparse_t *sp, double &maxerr) {
+	gsl_matrix_float *mat = calib[wfcname].actmat.mat;
+	gsl_matrix_float *infmat_f = calib[wfcname].meas.infmat_f;
+	gsl_vector_float *ref = gsl_vector_float_alloc(mat->size1);
+	gsl_vector_float *act = gsl_vector_float_alloc(mat->size1);
+	
+	// Reconstruct each influence vector with both paths, compare
+	double err2=0, ref2=0;
+	maxerr = 0;
+	for (size_t a=0; a<infmat_f->size2; a++) {
+		gsl_vector_float_view x = gsl_matrix_float_column(infmat_f, a);
+		gsl_blas_sgemv(CblasNoTrans, -1.0, mat, &x.vector, 0.0, ref);
+		if (rec)
+			mvm_calib.apply(*rec, &x.vector, act);
+		else
+			mvm_calib.apply(*sp, &x.vector, act);
+		for (size_t i=0; i<act->size; i++) {
+			const double d = gsl_vector_float_get(act, i) - gsl_vector_float_get(ref, i);
+			err2 += d*d;
+			ref2 += pow(gsl_vector_float_get(ref, i), 2);
+			maxerr = fmax(maxerr, fabs(d));
+		}
+	}
+	gsl_vector_float_free(ref);
+	gsl_vector_float_free(act);
+	
+	return ref2 > 0 ? sqrt(err2 / ref2) : 0.0;
 }
 
 int Shwfs::calc_actmat(const string &wfcname, const double singval, const bool check_svd) {
@@ -612,18 +1201,25 @@ int Shwfs::calc_actmat(const string &wfcname, const double singval, const bool c
 	gsl_vector *s = calib[wfcname].actmat.s;
 	gsl_matrix *V = calib[wfcname].actmat.V;
 	
-	// Copy input matrix to U (which will be overwritten by gsl_linalg_SV_decomp())
-	gsl_matrix_memcpy(U, infmat);
-	
-	// Singular value decompose infmat (stored in U) into U, V and s. workvec is
-	// temporary memory required for this operation
-	gsl_vector *workvec = gsl_vector_calloc(s->size);
-	gsl_linalg_SV_decomp(U, V, s, workvec);
-	
-	gsl_vector_free(workvec);
+	// Singular value decompose infmat into U, V and s
+	if (svd_gsl) {
+		// Copy input matrix to U (which will be overwritten by 
+		// gsl_linalg_SV_decomp()). workvec is temporary memory required for this
+		gsl_matrix_memcpy(U, infmat);
+		gsl_vector *workvec = gsl_vector_calloc(s->size);
+		gsl_linalg_SV_decomp(U, V, s, workvec);
+		gsl_vector_free(workvec);
+	} else {
+		Pinv pinv(io, svd_threads);
+		pinv.set_progress(sigc::mem_fun(*this, &Shwfs::svd_progress));
+		if (pinv.svd(infmat, U, s, V) < 0) {
+			io.msg(IO_ERR, "Shwfs::calc_actmat(): SVD failed.");
+			return -1;
+		}
+	}
 
 	// Given the SVD components and 'sinval', calculate the new actuation matrix
-	update_actmat(wfcname, singval);
+	_update_actmat(wfcname, singval);
 	
 	// Make matrix aliases (must be *after* update_actmat(), which updates memory)
 	gsl_matrix *mat_dbl = calib[wfcname].actmat.mat_dbl;
@@ -632,31 +1228,33 @@ int Shwfs::calc_actmat(const string &wfcname, const double singval, const bool c
 	// Store decomposition to disk
 	Path outf; FILE *fd;
 	
-	outf = mkfname(wfcname + format("_singval_%zu.csv", s->size));
-	fd = fopen(outf.c_str(), "w+");
-	gsl_vector_fprintf (fd, s, "%.12g");
-	fclose(fd);
+	if (svd_dump) {
+		outf = mkfname(wfcname + format("_singval_%zu.csv", s->size));
+		fd = fopen(outf.c_str(), "w+");
+		gsl_vector_fprintf (fd, s, "%.12g");
+		fclose(fd);
 	
-	outf = mkfname(wfcname + format("_U_%zu_%zu.csv", U->size1, U->size2));
-	fd = fopen(outf.c_str(), "w+");
-	gsl_matrix_fprintf (fd, U, "%.12g");
-	fclose(fd);
+		outf = mkfname(wfcname + format("_U_%zu_%zu.csv", U->size1, U->size2));
+		fd = fopen(outf.c_str(), "w+");
+		gsl_matrix_fprintf (fd, U, "%.12g");
+		fclose(fd);
 	
-	outf = mkfname(wfcname + format("_V_%zu_%zu.csv", V->size1, V->size2));
-	fd = fopen(outf.c_str(), "w+");
-	gsl_matrix_fprintf (fd, V, "%.12g");
-	fclose(fd);
+		outf = mkfname(wfcname + format("_V_%zu_%zu.csv", V->size1, V->size2));
+		fd = fopen(outf.c_str(), "w+");
+		gsl_matrix_fprintf (fd, V, "%.12g");
+		fclose(fd);
 	
-	outf = mkfname(wfcname + format("_Sigma_%zu_%zu.csv", Sigma->size1, Sigma->size2));
-	fd = fopen(outf.c_str(), "w+");
-	gsl_matrix_fprintf (fd, Sigma, "%.12g");
-	fclose(fd);
+		outf = mkfname(wfcname + format("_Sigma_%zu_%zu.csv", Sigma->size1, Sigma->size2));
+		fd = fopen(outf.c_str(), "w+");
+		gsl_matrix_fprintf (fd, Sigma, "%.12g");
+		fclose(fd);
 	
-	// Store psuedo-inverse matrix to disk
-	outf = mkfname(wfcname + format("_actmat_%zu_%zu.csv", mat->size1, mat->size2));
-	fd = fopen(outf.c_str(), "w+");
-	gsl_matrix_float_fprintf (fd, mat, "%.12g");
-	fclose(fd);
+		// Store psuedo-inverse matrix to disk
+		outf = mkfname(wfcname + format("_actmat_%zu_%zu.csv", mat->size1, mat->size2));
+		fd = fopen(outf.c_str(), "w+");
+		gsl_matrix_float_fprintf (fd, mat, "%.12g");
+		fclose(fd);
+	}
 	
 	if (check_svd) {
 		// Test inversion, calculate (actmat . infmat should be ~identity):
@@ -723,6 +1321,7 @@ int Shwfs::calc_actmat(const string &wfcname, const double singval, const bool c
 }
 
 string Shwfs::get_singval_str(const string &wfcname) const {
+	pthread::mutexholder lock(&calib_mutex);
 	if (calib.find(wfcname) == calib.end())
 		return "0";
 
@@ -739,6 +1338,7 @@ string Shwfs::get_singval_str(const string &wfcname) const {
 }
 
 double Shwfs::get_svd_cond(const string &wfcname) const {
+	pthread::mutexholder lock(&calib_mutex);
 	if (calib.find(wfcname) == calib.end())
 		return -1;
 
@@ -746,6 +1346,7 @@ double Shwfs::get_svd_cond(const string &wfcname) const {
 }
 
 int Shwfs::get_svd_modeuse(const string &wfcname) const {
+	pthread::mutexholder lock(&calib_mutex);
 	if (calib.find(wfcname) == calib.end())
 		return -1;
 	
@@ -753,6 +1354,7 @@ int Shwfs::get_svd_modeuse(const string &wfcname) const {
 }
 
 double Shwfs::get_svd_singuse(const string &wfcname) const {
+	pthread::mutexholder lock(&calib_mutex);
 	if (calib.find(wfcname) == calib.end())
 		return -1;
 	
@@ -771,23 +1373,48 @@ string Shwfs::get_refvec_str() const {
 	return refvec_str;
 }
 
-int Shwfs::comp_ctrlcmd(const string &wfcname, const gsl_vector_float *shift, gsl_vector_float *act) {
+int Shwfs::comp_ctrlcmd(rechandle_t h, const gsl_vector_float *shift, gsl_vector_float *act) {
 	//! @todo comp_ctrlcmd() does not know whether the matrix calib[wfcname].actmat.mat is proper or not. Need better calibration tracking, not at device level but at the top level of the program perhaps.
 	if (!act)
 		return 1;
-	if (calib.find(wfcname) == calib.end())
-		return 1;
 	if (!get_calib())
 		calibrate();
 	
+	int phase;
+	reconstructor_t *r = rec_acquire(h, phase);
+	if (!r) {
+		rec_release(h, phase);
+		return 1;
+	}
+	
 	// Compute vector. We apply -1 here because the matrix is the pseudo inverse
 	// of infmat, while it should be of -infmat. Alternative explanation: we 
 	// need to *correct* the shifts measured, not reproduce them
 	// int gsl_blas_sgemv (CBLAS_TRANSPOSE_t TransA, float alpha, const gsl_matrix_float * A, const gsl_vector_float * x, float beta, gsl_vector_float * y)
 	// act = -1.0 * op(mat) shift + 0.0 * act
-	gsl_blas_sgemv(CblasNoTrans, -1.0, calib[wfcname].actmat.mat, shift, 0.0, act);
+	// The Mvm reconstructors are stored as -mat, see build_rec()
+	bool ok;
+	if (r->rec_sp)
+		ok = mvm.apply(*r->rec_sp, shift, act);
+	else
+		ok = mvm.apply(*r->rec, shift, act);
+	rec_release(h, phase);
 
-	return 0;
+	return ok ? 0 : 1;
+}
+
+int Shwfs::comp_ctrlcmd_fold(rechandle_t h, const gsl_vector_float *shift, gsl_vector_float *fold) {
+	if (!fold)
+		return 1;
+	if (!get_calib())
+		calibrate();
+	
+	// fold = [actmap . -mat; -mat] . shift, see build_rec()
+	int phase;
+	reconstructor_t *r = rec_acquire(h, phase);
+	const bool ok = r && r->fold && mvm.apply(*r->fold, shift, fold);
+	rec_release(h, phase);
+	return ok ? 0 : 1;
 }
 
 int Shwfs::comp_shift(const string &wfcname, const gsl_vector_float *act, gsl_vector_float *shift) {
@@ -884,6 +1511,11 @@ void Shwfs::store_reference() {
 }
 
 int Shwfs::calibrate() {
+	// Register (new) subimage layout with the shift calculation workers. This
+	// waits for all jobs, so pending measurements are dropped.
+	shifts.set_layout(mlacfg, cam.get_res());
+	meas_busy[0] = meas_busy[1] = false;
+	
 	if (mlacfg.size() <= 0) {
 		io.msg(IO_XNFO, "Shwfs::calibrate(): cannot calibrate without subapertures defined.");
 		// Always set modes to the number of subaps, also if 0
@@ -897,6 +1529,16 @@ int Shwfs::calibrate() {
 	ref_vec = gsl_vector_float_calloc(mlacfg.size() * 2);
 	gsl_vector_float_free(tot_shift_vec);
 	tot_shift_vec = gsl_vector_float_calloc(mlacfg.size() * 2);
+	gsl_vector_float_free(spot_stats);
+	spot_stats = gsl_vector_float_calloc(mlacfg.size() * Shift::NSTAT);
+	for (int b=0; b<2; b++) {
+		gsl_vector_float_free(meas_shift[b]);
+		meas_shift[b] = gsl_vector_float_calloc(mlacfg.size() * 2);
+		gsl_vector_float_free(meas_stats[b]);
+		meas_stats[b] = gsl_vector_float_calloc(mlacfg.size() * Shift::NSTAT);
+		// Place the buffers close to the workers writing them
+		shifts.first_touch(meas_shift[b], meas_stats[b]);
+	}
 	
 	switch (wf.basis) {
 		case SENSOR:
@@ -927,65 +1569,500 @@ int Shwfs::calibrate() {
 	return 0;
 }
 
+double Shwfs::calib_slopes(Camera::frame_t *frame, gsl_matrix_float *slopes, const gsl_matrix_float *prev) {
+	vector<Camera::frame_t *> one(1, frame);
+	if (!measure_batch(one, slopes))
+		return -1;
+	if (!prev)
+		return 0;
+	
+	double d2 = 0;
+	for (size_t i=0; i<slopes->size2; i++) {
+		const double d = gsl_matrix_float_get(slopes, 0, i) - gsl_matrix_float_get(prev, 0, i);
+		d2 += d*d;
+	}
+	return d2;
+}
+
+int Shwfs::calib_run(Wfc *wfc, Camera *cam, const gsl_matrix_float *acts, gsl_matrix_float *means) {
+	const size_t nact = wfc->get_nact(), nstep = acts->size1;
+	const size_t nframes = calib_nframes < 1 ? 1 : calib_nframes;
+	if (acts->size2 != nact || means->size1 != nstep || means->size2 != shift_vec->size) {
+		io.msg(IO_ERR, "Shwfs::calib_run(): matrix size mismatch!");
+		return -1;
+	}
+	
+	// Actuate around the shape of the WFC *before* calibrating, do not reset()
+	// to 'flat': if reset() gives a bad shape, an offset set before 
+	// calibration should stay in place.
+	vector <float> base(nact);
+	for (size_t j=0; j<nact; j++)
+		base[j] = wfc->get_control_act(j);
+	
+	// Frames of one step are copied, such that they can be centroided while 
+	// the camera ring buffer advances and the WFC moves to the next step
+	vector<Camera::frame_t> copies(nframes);
+	vector<Camera::frame_t *> batch(nframes);
+	for (size_t k=0; k<nframes; k++)
+		batch[k] = &copies[k];
+	gsl_matrix_float *shiftmat = gsl_matrix_float_alloc(nframes, shift_vec->size);
+	gsl_matrix_float *cur = gsl_matrix_float_alloc(1, shift_vec->size);
+	gsl_matrix_float *prev = gsl_matrix_float_alloc(1, shift_vec->size);
+	
+	// Noise floor: mean squared difference of consecutive frames at rest
+	double noise2 = 0;
+	const double tol2 = calib_settle_tol * calib_settle_tol;
+	Camera::cursor_t *cur_frame = cam->add_cursor("calib");
+	Camera::frame_t *frame;
+	if (calib_settle_tol > 0) {
+		cam->sync_cursor(cur_frame);
+		frame = cam->acquire_next_frame(cur_frame);
+		calib_slopes(frame, prev, NULL);
+		cam->release_frame(frame);
+		for (int k=0; k<CALIB_NNOISE; k++) {
+			frame = cam->acquire_next_frame(cur_frame);
+			noise2 += calib_slopes(frame, cur, prev);
+			cam->release_frame(frame);
+			std::swap(cur, prev);
+		}
+		noise2 /= CALIB_NNOISE;
+	}
+	
+	int ret = 0;
+	bool pending = false;
+	size_t nsettle = 0, nslow = 0;
+	const int64_t t0 = mono_ns();
+	for (size_t s=0; s<=nstep; s++) {
+		if (s < nstep) {
+			if (ptc->mode != AO_MODE_CAL) {	// Abort if mode is not 'calib' anymore
+				ret = 1;
+				break;
+			}
+			for (size_t j=0; j<nact; j++)
+				wfc->set_control_act(base[j] + gsl_matrix_float_get(acts, s, j), j);
+			wfc->actuate();
+		}
+		
+		// Centroid the frames of the previous step while the WFC moves
+		if (pending) {
+			if (!measure_batch(batch, shiftmat)) {
+				ret = -1;
+				break;
+			}
+			for (size_t i=0; i<shiftmat->size2; i++) {
+				double sum = 0;
+				for (size_t k=0; k<nframes; k++)
+					sum += gsl_matrix_float_get(shiftmat, k, i);
+				gsl_matrix_float_set(means, s-1, i, sum / nframes);
+			}
+			pending = false;
+		}
+		if (s == nstep)
+			break;
+		
+		// Wait until consecutive frames agree within the noise, at most 
+		// calib_settle seconds. Without detection, wait calib_settle and
+		// take the next frame. Frames are held until copied (see \ref cam_pool).
+		if (calib_settle_tol > 0) {
+			const int64_t until = mono_ns() + (int64_t) (calib_settle * 1E9);
+			cam->sync_cursor(cur_frame);
+			frame = cam->acquire_next_frame(cur_frame);
+			calib_slopes(frame, prev, NULL);
+			while (true) {
+				cam->release_frame(frame);
+				frame = cam->acquire_next_frame(cur_frame);
+				nsettle++;
+				if (calib_slopes(frame, cur, prev) <= tol2 * noise2)
+					break;
+				if (mono_ns() > until) {
+					nslow++;
+					break;
+				}
+				std::swap(cur, prev);
+			}
+		} else {
+			usleep(calib_settle * 1E6);
+			cam->sync_cursor(cur_frame);
+			frame = cam->acquire_next_frame(cur_frame);
+		}
+		
+		// The settled frame is the first of this step
+		for (size_t k=0; k<nframes; k++) {
+			if (k > 0)
+				frame = cam->acquire_next_frame(cur_frame);
+			if (copies[k].size != frame->size) {
+				free(copies[k].image);
+				copies[k].image = malloc(frame->size);
+			}
+			memcpy(copies[k].image, frame->image, frame->size);
+			copies[k].size = frame->size;
+			copies[k].res = frame->res;
+			copies[k].depth = frame->depth;
+			copies[k].id = frame->id;
+			cam->release_frame(frame);
+		}
+		pending = true;
+	}
+	
+	// Restore the original shape
+	for (size_t j=0; j<nact; j++)
+		wfc->set_control_act(base[j], j);
+	wfc->actuate();
+	
+	io.msg(IO_INFO, "Shwfs::calib_run(): %zu steps in %.2f s, %zu frames/step, %.1f frames/step to settle, %zu not settled, noise %.3g rms.",
+				 nstep, (mono_ns() - t0) * 1E-9, nframes, nstep ? (double) nsettle / nstep : 0.0, nslow, sqrt(noise2 / (2 * shift_vec->size)));
+	
+	for (size_t k=0; k<nframes; k++)
+		free(copies[k].image);
+	gsl_matrix_float_free(shiftmat);
+	gsl_matrix_float_free(cur);
+	gsl_matrix_float_free(prev);
+	return ret;
+}
+
 int Shwfs::calib_influence(Wfc *wfc, Camera *cam, const vector <float> &actpos, const double sval_cutoff) {
-	double wfc_response = 0.1;
-	double thisact = 0;
+	const size_t nact = wfc->get_nact(), npos = actpos.size();
 	
 	// Check sanity
-	if (wfc->get_nact() > (int) (2*mlacfg.size())) {
+	if (nact > 2*mlacfg.size()) {
 		io.msg(IO_ERR, "Shwfs::calib_influence(): # actuators > 2 * # subapertures, underdetermind system, abort!");
 		net_broadcast("error mla # actuators > 2 * # subapertures, underdetermind system, abort!");
 		return -1;
 	}
 	
 	io.msg(IO_XNFO, "Shwfs::calib_influence() init.");
-	init_infmat(wfc->getname(), wfc->get_nact(), actpos);
+	pthread::mutexholder lock(&calib_mutex);
+	init_infmat(wfc->getname(), nact, actpos);
+	
+	// Poke each actuator to each position in turn
+	gsl_matrix_float *acts = gsl_matrix_float_calloc(nact * npos, nact);
+	gsl_matrix_float *means = gsl_matrix_float_alloc(nact * npos, shift_vec->size);
+	for (size_t actid=0; actid<nact; actid++)
+		for (size_t posid=0; posid<npos; posid++)
+			gsl_matrix_float_set(acts, actid*npos + posid, actid, actpos[posid]);
 	
 	io.msg(IO_XNFO, "Shwfs::calib_influence() Start camera...");
 	cam->set_mode(Camera::RUNNING);
 	
-	// Loop over all actuators, actuate according to actpos
 	io.msg(IO_XNFO, "Shwfs::calib_influence() Start calibration loop...");
-	for (int actid = 0; actid < wfc->get_nact(); actid++) {	// Loop over actuators
-		// Get current actuation signal for this actuator;
-		thisact = wfc->get_control_act(actid);
-		for (int posid = 0; posid < (int) actpos.size(); posid++) {	// Loop over actuator voltages
-			if (ptc->mode != AO_MODE_CAL)	// Abort if mode is not 'calib' anymore
-				goto influence_break;
-			
-			// Set actuator 'actid' to 'thisact + actpos[p]', measure, wait until WFC is done
-			wfc->set_control_act(thisact + actpos.at(posid), actid);
-			wfc->actuate();
-			usleep(wfc_response * 1E6);
-			
-			// Store frame, and add to analysis results
-			Camera::frame_t *frame = cam->get_next_frame(true);
-			build_infmat(wfc->getname(), frame, actid, posid);
-		}
+	int ret = calib_run(wfc, cam, acts, means);
+	
+	if (ret == 0) {
+		io.msg(IO_XNFO, "Shwfs::calib_influence() Process data...");
+		for (size_t actid=0; actid<nact; actid++)
+			for (size_t posid=0; posid<npos; posid++)
+				for (size_t i=0; i<means->size2; i++)
+					gsl_matrix_float_set(calib[wfc->getname()].meas.measmat[posid], i, actid, 
+															 gsl_matrix_float_get(means, actid*npos + posid, i));
 		
-		// Reset this actuator to its original position
-		wfc->set_control_act(thisact, actid);
-		// Do not set the mirror back to 'flat' (or whatever reset() does) here: 
-		// use the shape of the mirror as set *before* calibrating the influence 
-		// matrix.
-		// If reset() gives a bad mirror shape, than we need to add some offset
-		// before we can calculate a proper influence matrix. Setting the mirror
-		// back with reset() would negate this offset every time.
-	}
+		// Calculate the final influence function
+		calc_infmat(wfc->getname());
 		
-	io.msg(IO_XNFO, "Shwfs::calib_influence() Process data...");
-	// Calculate the final influence function
-	calc_infmat(wfc->getname());
+		// Calculate forward matrix
+		calc_actmat(wfc->getname(), sval_cutoff, svd_check);
+	}
+	
+	gsl_matrix_float_free(acts);
+	gsl_matrix_float_free(means);
 	
-	// Calculate forward matrix
-	calc_actmat(wfc->getname(), sval_cutoff);
+	// Restore seeing
+	cam->set_mode(Camera::WAITING);
+	return ret < 0 ? -1 : 0;
+}
+
+int Shwfs::hadamard_npat(const size_t nact) {
+	// Column 0 (all ones) is not used, such that all columns sum to zero
+	int npat = 1;
+	while (npat < (int) nact+1)
+		npat *= 2;
+	return npat;
+}
 
-influence_break:
+int Shwfs::calib_hadamard(Wfc *wfc, Camera *cam, const float amp, const double sval_cutoff) {
+	const size_t nact = wfc->get_nact();
+	const int npat = hadamard_npat(nact);
+	
+	// Check sanity
+	if (nact > 2*mlacfg.size()) {
+		io.msg(IO_ERR, "Shwfs::calib_hadamard(): # actuators > 2 * # subapertures, underdetermind system, abort!");
+		net_broadcast("error mla # actuators > 2 * # subapertures, underdetermind system, abort!");
+		return -1;
+	}
+	if (amp == 0) {
+		io.msg(IO_ERR, "Shwfs::calib_hadamard(): amplitude cannot be zero!");
+		return -1;
+	}
+	
+	io.msg(IO_XNFO, "Shwfs::calib_hadamard() init, %zu actuators, %d patterns.", nact, npat);
+	pthread::mutexholder lock(&calib_mutex);
+	vector <float> actpos;
+	actpos.push_back(-amp);
+	actpos.push_back(amp);
+	init_infmat(wfc->getname(), nact, actpos);
+	
+	gsl_matrix_float *acts = gsl_matrix_float_alloc(npat, nact);
+	gsl_matrix_float *means = gsl_matrix_float_alloc(npat, shift_vec->size);
+	for (int pat=0; pat<npat; pat++)
+		for (size_t j=0; j<nact; j++)
+			gsl_matrix_float_set(acts, pat, j, hadamard_sign(pat, j) * amp);
+	
+	io.msg(IO_XNFO, "Shwfs::calib_hadamard() Start camera...");
+	cam->set_mode(Camera::RUNNING);
+	
+	io.msg(IO_XNFO, "Shwfs::calib_hadamard() Start calibration loop...");
+	int ret = calib_run(wfc, cam, acts, means);
+	
+	if (ret == 0) {
+		io.msg(IO_XNFO, "Shwfs::calib_hadamard() Process data...");
+		// Decode: column j is sum_pat H(pat, j+1) p_pat / N = amp D_j. Store as 
+		// measurements at -amp and +amp around zero, such that calc_infmat() 
+		// gives D.
+		gsl_matrix_float *dec = calib[wfc->getname()].meas.measmat[1];
+		for (int pat=0; pat<npat; pat++) {
+			const float *sign = gsl_matrix_float_const_ptr(acts, pat, 0);
+			for (size_t i=0; i<means->size2; i++) {
+				const float p = gsl_matrix_float_get(means, pat, i) / npat;
+				float *row = gsl_matrix_float_ptr(dec, i, 0);
+				for (size_t j=0; j<nact; j++)
+					row[j] += sign[j] * p;
+			}
+		}
+		gsl_matrix_float_memcpy(calib[wfc->getname()].meas.measmat[0], dec);
+		gsl_matrix_float_scale(calib[wfc->getname()].meas.measmat[0], -1.0);
+		
+		calc_infmat(wfc->getname());
+		calc_actmat(wfc->getname(), sval_cutoff, svd_check);
+	}
+	
+	gsl_matrix_float_free(acts);
+	gsl_matrix_float_free(means);
+	
 	// Restore seeing
 	cam->set_mode(Camera::WAITING);
+	return ret < 0 ? -1 : 0;
+}
+
+int Shwfs::dither_start(Wfc *wfc, const float amp, const double singval) {
+	const string wfcname = wfc->getname();
+	if (__atomic_load_n(&dither.state, __ATOMIC_SEQ_CST) != DITHER_IDLE) {
+		io.msg(IO_WARN, "Shwfs::dither_start(): dither calibration already running.");
+		return -1;
+	}
+	
+	// The worker of a previous run might still be decoding. Join it before
+	// locking, it may be waiting for calib_mutex itself.
+	dither_join();
+	
+	pthread::mutexholder lock(&calib_mutex);
+	if (calib.find(wfcname) == calib.end() || !calib[wfcname].init || calib[wfcname].nact != (size_t) wfc->get_nact()) {
+		io.msg(IO_ERR, "Shwfs::dither_start(): no influence matrix for '%s', calibrate first!", wfcname.c_str());
+		return -1;
+	}
+	if (amp == 0) {
+		io.msg(IO_ERR, "Shwfs::dither_start(): amplitude cannot be zero!");
+		return -1;
+	}
+	
+	dither.wfc = wfc;
+	dither.wfcname = wfcname;
+	dither.nact = wfc->get_nact();
+	dither.nmeas = calib[wfcname].nmeas;
+	dither.amp = amp;
+	dither.singval = singval;
+	dither.npat = hadamard_npat(dither.nact);
+	dither.frame = 0;
+	dither.vec = gsl_vector_float_calloc(dither.nact);
+	for (int b=0; b<2; b++) {
+		dither.acc[b] = gsl_matrix_float_calloc(dither.npat, dither.nmeas);
+		dither.acc_ncyc[b] = 0;
+	}
+	dither.cur = 0;
+	dither.req = DITHER_REQ_NONE;
+	dither.done = 0;
+	dither.total = gsl_matrix_calloc(dither.npat, dither.nmeas);
+	dither.work = gsl_matrix_alloc(dither.npat, dither.nmeas);
+	dither.est = gsl_matrix_calloc(dither.nmeas, dither.nact);
+	dither.est_prev = gsl_matrix_calloc(dither.nmeas, dither.nact);
+	dither.ncyc = 0;
+	dither.change = 1;
+	
+	dither.thr.create(sigc::mem_fun(*this, &Shwfs::dither_worker));
+	dither.running = true;
+	
+	io.msg(IO_INFO, "Shwfs::dither_start(): dithering '%s' with %d patterns of amplitude %g.", wfcname.c_str(), dither.npat, amp);
+	__atomic_store_n(&dither.state, DITHER_ARMED, __ATOMIC_SEQ_CST);
 	return 0;
 }
 
+void Shwfs::dither_stop() {
+	// Not dithering yet: nothing to remove, the worker is joined by the next
+	// dither_start(). Otherwise the loop removes the dither.
+	if (__sync_bool_compare_and_swap(&dither.state, DITHER_ARMED, DITHER_IDLE) ||
+			__sync_bool_compare_and_swap(&dither.state, DITHER_RUNNING, DITHER_STOP))
+		io.msg(IO_INFO, "Shwfs::dither_stop(): stopping dither calibration.");
+}
+
+void Shwfs::dither_finish(Wfc *wfc) {
+	if (__atomic_load_n(&dither.state, __ATOMIC_SEQ_CST) == DITHER_IDLE || wfc != dither.wfc)
+		return;
+	
+	// Stop the worker unless it is done, but do not wait for it here
+	if (!__atomic_load_n(&dither.done, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&dither.req, DITHER_REQ_STOP, __ATOMIC_SEQ_CST);
+		dither.futex.wake(&dither.req);
+	}
+	wfc->set_dither(NULL);
+	__atomic_store_n(&dither.state, DITHER_IDLE, __ATOMIC_SEQ_CST);
+	io.msg(IO_INFO, "Shwfs::dither_finish(): dither stopped after %zu frames.", dither.frame);
+}
+
+int Shwfs::dither_step(Wfc *wfc, const gsl_vector_float *slopes, const bool fold) {
+	const int state = __atomic_load_n(&dither.state, __ATOMIC_SEQ_CST);
+	if (state == DITHER_IDLE || wfc != dither.wfc)
+		return 0;
+	if (state == DITHER_STOP || __atomic_load_n(&dither.done, __ATOMIC_SEQ_CST)) {
+		dither_finish(wfc);
+		return 0;
+	}
+	if (state == DITHER_ARMED && !__sync_bool_compare_and_swap(&dither.state, DITHER_ARMED, DITHER_RUNNING))
+		return 0;
+	
+	// Modal error from this frame, see Wfc::ctrl_params.fold
+	gsl_vector_float *err = wfc->ctrlparams.err;
+	gsl_vector_float_view errfold = gsl_vector_float_subvector(wfc->ctrlparams.fold, wfc->get_actmap() ? wfc->get_real_nact() : 0, dither.nact);
+	if (fold)
+		err = &errfold.vector;
+	
+	const size_t k = dither.frame++;
+	if (k >= (size_t) dither_delay) {
+		// These slopes respond to the pattern set dither_delay frames ago
+		const int pat = (k - dither_delay) % dither.npat;
+		gsl_vector_float_view row = gsl_matrix_float_row(dither.acc[dither.cur], pat);
+		gsl_vector_float_add(&row.vector, slopes);
+		
+		// The error holds -dither (comp_ctrlcmd() negates), do not integrate it
+		for (size_t j=0; j<dither.nact; j++)
+			*gsl_vector_float_ptr(err, j) += dither.amp * hadamard_sign(pat, j);
+		
+		// Hand a complete cycle to the worker if it is idle, else keep adding
+		if (pat == dither.npat-1) {
+			dither.acc_ncyc[dither.cur]++;
+			if (__sync_bool_compare_and_swap(&dither.req, DITHER_REQ_NONE, dither.cur)) {
+				dither.futex.wake(&dither.req);
+				dither.cur ^= 1;
+			}
+		}
+	}
+	
+	// Dither for the next actuation
+	const int pat = k % dither.npat;
+	for (size_t j=0; j<dither.nact; j++)
+		gsl_vector_float_set(dither.vec, j, dither.amp * hadamard_sign(pat, j));
+	wfc->set_dither(dither.vec);
+	return 1;
+}
+
+void Shwfs::dither_worker() {
+	const int npat = dither.npat;
+	const size_t nmeas = dither.nmeas, nact = dither.nact;
+	
+	while (true) {
+		int b;
+		while ((b = __atomic_load_n(&dither.req, __ATOMIC_SEQ_CST)) == DITHER_REQ_NONE)
+			dither.futex.wait(&dither.req, DITHER_REQ_NONE);
+		if (b == DITHER_REQ_STOP)
+			break;
+		
+		// Add the cycle(s) to the total and return the buffer to the loop
+		for (int pat=0; pat<npat; pat++) {
+			float *src = gsl_matrix_float_ptr(dither.acc[b], pat, 0);
+			double *dst = gsl_matrix_ptr(dither.total, pat, 0);
+			for (size_t i=0; i<nmeas; i++) {
+				dst[i] += src[i];
+				src[i] = 0;
+			}
+		}
+		dither.ncyc += dither.acc_ncyc[b];
+		dither.acc_ncyc[b] = 0;
+		if (!__sync_bool_compare_and_swap(&dither.req, b, DITHER_REQ_NONE))
+			break;
+		
+		// Decode with an in-place fast Walsh-Hadamard transform over the 
+		// patterns: row j+1 becomes sum_k H(k, j+1) p_k
+		gsl_matrix_memcpy(dither.work, dither.total);
+		for (int len=1; len<npat; len *= 2) {
+			for (int blk=0; blk<npat; blk += 2*len) {
+				for (int pat=blk; pat<blk+len; pat++) {
+					double *x = gsl_matrix_ptr(dither.work, pat, 0);
+					double *y = gsl_matrix_ptr(dither.work, pat+len, 0);
+					for (size_t i=0; i<nmeas; i++) {
+						const double a = x[i], d = y[i];
+						x[i] = a + d;
+						y[i] = a - d;
+					}
+				}
+			}
+		}
+		
+		const double norm = 1.0 / ((double) dither.amp * npat * dither.ncyc);
+		double diff2 = 0, est2 = 0;
+		for (size_t j=0; j<nact; j++) {
+			const double *col = gsl_matrix_const_ptr(dither.work, j+1, 0);
+			for (size_t i=0; i<nmeas; i++) {
+				const double v = col[i] * norm;
+				const double d = v - gsl_matrix_get(dither.est_prev, i, j);
+				gsl_matrix_set(dither.est, i, j, v);
+				diff2 += d*d;
+				est2 += v*v;
+			}
+		}
+		std::swap(dither.est, dither.est_prev);
+		dither.change = est2 > 0 ? sqrt(diff2 / est2) : 1;
+		net_broadcast(format("ok dither %d %.4f", dither.ncyc, dither.change), "dither");
+		io.msg(IO_XNFO, "Shwfs::dither_worker(): %d cycles, change %.4f.", dither.ncyc, dither.change);
+		
+		if ((dither.ncyc < dither_mincyc || dither.change >= dither_tol) && dither.ncyc < dither_maxcyc)
+			continue;
+		if (__atomic_load_n(&dither.req, __ATOMIC_SEQ_CST) == DITHER_REQ_STOP)
+			break;
+		
+		// Converged: use as influence matrix and publish the new reconstructor
+		io.msg(IO_INFO, "Shwfs::dither_worker(): converged after %d cycles (change %.4f), updating reconstructor.", dither.ncyc, dither.change);
+		pthread::mutexholder lock(&calib_mutex);
+		gsl_matrix *infmat = calib[dither.wfcname].meas.infmat;
+		gsl_matrix_memcpy(infmat, dither.est_prev);
+		for (size_t i=0; i<infmat->size1; i++)
+			for (size_t j=0; j<infmat->size2; j++)
+				gsl_matrix_float_set(calib[dither.wfcname].meas.infmat_f, i, j, gsl_matrix_get(infmat, i, j));
+		calc_actmat(dither.wfcname, dither.singval, false);
+		
+		net_broadcast(format("ok dither done %d %.4f", dither.ncyc, dither.change), "dither");
+		__atomic_store_n(&dither.done, 1, __ATOMIC_SEQ_CST);
+		break;
+	}
+}
+
+void Shwfs::dither_join() {
+	if (dither.running) {
+		__atomic_store_n(&dither.req, DITHER_REQ_STOP, __ATOMIC_SEQ_CST);
+		dither.futex.wake(&dither.req);
+		dither.thr.join();
+		dither.running = false;
+	}
+	
+	gsl_vector_float_free(dither.vec);
+	dither.vec = NULL;
+	for (int b=0; b<2; b++) {
+		gsl_matrix_float_free(dither.acc[b]);
+		dither.acc[b] = NULL;
+	}
+	gsl_matrix_free(dither.total);
+	gsl_matrix_free(dither.work);
+	gsl_matrix_free(dither.est);
+	gsl_matrix_free(dither.est_prev);
+	dither.total = dither.work = dither.est = dither.est_prev = NULL;
+}
+
 int Shwfs::calib_zero(Wfc *wfc, Camera *cam) {
 //	The zero calibration should be independent of the wavefront corrector
 //	shape, so we do no reset() here it as it might have some interesting shape.
@@ -995,11 +2072,12 @@ int Shwfs::calib_zero(Wfc *wfc, Camera *cam) {
 	
 	io.msg(IO_XNFO, "Shwfs::calib_zero() Measure reference...");
 	// Get next frame (wait for it)
-	Camera::frame_t *frame = cam->get_next_frame(true);
+	Camera::frame_t *frame = cam->acquire_next_frame(true);
 	
 	io.msg(IO_XNFO, "Shwfs::calib_zero() Process data...");
 	// Set this frame as reference
 	set_reference(frame);
+	cam->release_frame(frame);
 	store_reference();
 	
 	// Pause camera
@@ -1135,7 +2213,7 @@ int Shwfs::find_mla_grid(std::vector<vector_t> &mlacfg, const coord_t size, cons
 	set_calib(false);
 
 	// Store current camera count, get last frame
-	Camera::frame_t *f = cam.get_last_frame();
+	Camera::frame_t *f = cam.acquire_last_frame();
 	void *image=NULL;
 	size_t imsize=0;
 	
@@ -1150,6 +2228,7 @@ int Shwfs::find_mla_grid(std::vector<vector_t> &mlacfg, const coord_t size, cons
 		if (!image)
 			throw format("Shwfs::find_mla_grid() Could not allocate memory (size=%zu)!", imsize);
 		memcpy(image, f->image, imsize);
+		cam.release_frame(f);
 	}
 	
 	// Set outer band to zero so we don't find subapertures there. Loop over all 
@@ -1369,6 +2448,23 @@ int Shwfs::set_mla_str(string mla_str) {
 	return (int) mlacfg.size();
 }
 
+string Shwfs::get_spotstats_str() const {
+	if (!spot_stats)
+		return "0";
+	
+	string ret = format("%d ", (int) spot_stats->size/Shift::NSTAT);
+	for (size_t idx=0; idx<spot_stats->size/Shift::NSTAT; idx++) {
+		ret += format("%d %g %g %g %g ", 
+									(int) idx, 
+									gsl_vector_float_get(spot_stats, idx*Shift::NSTAT + Shift::STAT_FLUX),
+									gsl_vector_float_get(spot_stats, idx*Shift::NSTAT + Shift::STAT_PEAK),
+									gsl_vector_float_get(spot_stats, idx*Shift::NSTAT + Shift::STAT_NSAT),
+									gsl_vector_float_get(spot_stats, idx*Shift::NSTAT + Shift::STAT_WIDTH));
+	}
+	
+	return ret;
+}
+
 string Shwfs::get_shifts_str() const {
 	io.msg(IO_DEB2, "Shwfs::get_shifts_str()");
 	string ret;
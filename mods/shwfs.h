@@ -31,6 +31,8 @@
 #include "io.h"
 #include "wfs.h"
 #include "shift.h"
+#include "mvm.h"
+#include "pinv.h"
 
 using namespace std;
 
@@ -111,8 +113,58 @@ const string shwfs_type = "shwfs";
  with [act_amp] the amplitude for each mode and [singval] the singular value 
  cut-off to use (see below).
  
- Measuring the influence matrix takes n_modes * 2 frames, plus a brief delay 
- between each actuation.
+ Measuring the influence matrix takes n_modes * 2 * calib_nframes frames, 
+ plus the time for the WFC to settle after each actuation (see below).
+ 
+ \subsection shwfs_calib_oper_hadamard Hadamard influence matrix
+ 
+ The 'hadamard' calibration measures the same influence matrix, but moves all
+ actuators at once:
+\verbatim
+ hadamard [act_amp] [singval]
+\endverbatim
+ Pattern k sets actuator j to +act_amp or -act_amp with the sign of element 
+ (k, j+1) of a Sylvester Hadamard matrix of order N, the smallest power of 
+ two larger than n_modes. Columns j+1 are balanced: every actuator is 
+ pushed in exactly N/2 patterns and pulled in the others. Row 0 of the 
+ matrix is all ones, so pattern 0 is a common push of all actuators to 
+ +act_amp, a full-stroke piston step at the start of every cycle; patterns 
+ k >= 1 push half of the actuators and pull the other half. The columns are
+ orthogonal and sum to zero, so the influence of actuator j is
+ \verbatim
+ D_j = sum_k H(k, j+1) p_k / (N act_amp),
+ \endverbatim
+ with p_k the measurement for pattern k. The unpoked wavefront cancels, and 
+ every column of D averages N steps instead of two. This takes N steps 
+ instead of n_modes * 2 (128 instead of 194 for 97 actuators), for the same 
+ amplitude per actuator and a noise that is sqrt(N/2) times lower. The better
+ noise allows a lower act_amp, or a shorter calib_settle. Note that the 
+ total stroke of a pattern is larger than a single poke: if the WFC clips, 
+ reduce act_amp.
+ 
+ \subsection shwfs_calib_oper_pipeline Calibration pipeline
+ 
+ Both 'influence' and 'hadamard' calibration run the same sequence in 
+ calib_run() for every WFC shape (step):
+ 
+ 1. actuate the WFC for step k,
+ 2. centroid the frames of step k-1 in one batch (measure_batch()) while 
+    the WFC moves,
+ 3. take frames until two consecutive slope vectors differ by less than 
+    calib_settle_tol times the noise floor, or until calib_settle seconds 
+    have passed,
+ 4. copy the settled frame and the next calib_nframes-1 frames, which are
+    averaged in step 2 of the next iteration.
+ 
+ The noise floor is the rms difference of CALIB_NNOISE pairs of consecutive
+ frames before the first step. Frames are read through the camera cursor 
+ "calib" (see \ref cam_cursor), which skips all frames taken before the WFC
+ moved and otherwise returns consecutive frames. Instead of a fixed 100 ms per step, a step 
+ thus takes as many frames as the WFC needs, and the noise in the influence
+ matrix decreases with sqrt(calib_nframes). calib_run() logs the total time,
+ the frames needed to settle, and the noise. Set calib_settle_tol=0 and 
+ calib_nframes=1 for the fixed delay and single frame of previous versions,
+ e.g. to compare.
  
  \subsection shwfs_calib_oper_svd (Re-)calculate SVD
  
@@ -127,6 +179,14 @@ const string shwfs_type = "shwfs";
  - if **singval** < 0: drop this many modes from the SVD. i.e. if you have 100 modes, and the param is 10, use only 90 modes for correcting.
  - if **singval** > 1: use this many modes from the SVD
  - if 0 < **singval** 1 <: use this much singular value in the SVD. 0.7 should be quite stable but not very accurate, 0.99 should be very accurate but less stable.
+ 
+ The SVD and pseudo-inverse are computed by Pinv on svd_threads threads 
+ (see \ref pinv_algo), which takes seconds instead of minutes for 1000 
+ actuators. Progress is broadcast as 'ok svd_progress \<stage\> 
+ \<fraction\>'. The 'svd' mode runs directly from the network thread, so 
+ it can be used in closed loop: the new reconstructor is published when 
+ done (see \ref shwfs_rechandle). For large systems, consider svd_dump=0, 
+ as writing U and V as CSV takes longer than computing them.
 
  \subsection shwfs_calib_oper_iterative Iterative calibration
  
@@ -198,6 +258,60 @@ for this_dof in all_dof:
  overdetermined for robust operations, we use a pseudo-inversion to get the 
  actuation matrix. In our case we use a singular value decomposition.
 
+ \section shwfs_dither Online dither calibration
+ 
+ The influence matrix drifts with the optical alignment. Instead of 
+ stopping the loop for a 'influence' calibration, 'calib dither [amp] 
+ [singval]' measures it in closed loop. dither_step(), called by the loop 
+ after reconstruction, adds the Hadamard patterns of \ref 
+ shwfs_calib_oper_hadamard with amplitude amp to the WFC (Wfc::set_dither()), 
+ one pattern per frame, and demodulates the slopes:
+ 
+ - the slopes of frame k respond to pattern (k - dither_delay) mod N, and 
+   are added to the running sum of that pattern (O(n_slopes) per frame),
+ - the same pattern is added to the reconstructed error, such that the 
+   loop does not integrate the dither away,
+ - after each cycle of N frames, the sums are handed to a worker thread, 
+   which decodes D = sum_k H(k, j+1) p_k / (N amp n_cycles) with a fast 
+   Walsh-Hadamard transform.
+ 
+ Atmospheric residuals and noise are not correlated with the patterns and 
+ average out. When the relative change of D between cycles drops below 
+ dither_tol (after at least dither_mincyc cycles, or at dither_maxcyc), the 
+ worker stores D as the influence matrix, runs calc_actmat() with singval, 
+ which publishes the new reconstructor (see \ref shwfs_rechandle), and the 
+ dither stops. The worker holds Shwfs::calib_mutex meanwhile, as do all 
+ other functions that change the calibration or the actuation matrices 
+ (calibration, 'rec' and 'set rec_*' commands), such that these never run 
+ concurrently. 'calib dither stop' aborts without changing the 
+ reconstructor, as does leaving closed loop. Progress is broadcast as 
+ 'ok dither \<cycles\> \<change\>'.
+ 
+ amp should be small compared to the residual wavefront, the cost is a 
+ slightly worse correction during calibration. The WFC must be calibrated
+ with 'influence' or 'hadamard' once, to reconstruct at all.
+ 
+ \section shwfs_rechandle Reconstructor handles
+ 
+ The matrices used at runtime (Mvm copies of the actuation matrix, see 
+ build_rec()) are kept in a Shwfs::reconstructor object per WFC. The loop 
+ resolves a handle once with get_rec_handle() and passes it to 
+ comp_ctrlcmd() or measure_ctrlcmd() every frame, avoiding lookups by WFC 
+ name. 
+ 
+ Calibration (e.g. 'svd' with a new singular value cutoff) builds a new 
+ reconstructor next to the active one and publishes it with publish_rec(),
+ which swaps the active pointer atomically. Readers register in one of two 
+ counters while they use the reconstructor. publish_rec() flips the counter
+ new readers use, and waits for the old counter to drain before freeing 
+ the previous reconstructor. A reader that registered in a counter after 
+ the flip sees the phase changed and registers again in the new one. The 
+ loop thus never waits or sees a partial matrix, and the next frame uses 
+ the new matrix.
+ 
+ Actuation matrices can be stored as presets under a name ('rec store') and
+ published again later ('rec use'), e.g. for different seeing conditions.
+ 
  \section shwfs_netio Network IO
  
  Valid commends include:
@@ -215,6 +329,19 @@ for this_dof in all_dof:
  - get/set maxshift: Shwfs::maxshift
  
  - get shifts: return measured shift vectors
+ - get/set method \<cog|cog_weight|cog_window|cog_iter|corr\>: Shwfs::method
+ - get/set corr_ref \<mean|idx\>: reference for method 'corr', mean of all subimages or subimage idx. Captured from the next frame.
+ - get spotstats: return spot metrics (flux, peak, saturated pixels, width) per subaperture from the last measurement
+ - set spotstats \<0|1\>: toggle spot metrics calculation (Shwfs::do_spotstats)
+ - get/set recon_fused \<0|1\>: reconstruct while centroiding in measure_ctrlcmd() (Shwfs::recon_fused)
+ - get/set rec_prec \<f32|f16|i16\>: reconstructor storage precision (Shwfs::rec_prec)
+ - get/set rec_sparse \<threshold|auto\>: sparse reconstructor threshold, 0 for dense (Shwfs::rec_sparse)
+ - get/set fold_actmap \<0|1\>: build reconstructors folded with the WFC actuator mapping (Shwfs::fold_actmap)
+ - rec store \<wfc\> \<name\>: store the current actuation matrix for wfc as preset name (store_rec())
+ - rec use \<wfc\> \<name\>: publish preset name as reconstructor for wfc (use_rec())
+ - get rec_presets \<wfc\>: list presets stored for wfc
+ - get svd_progress: stage and fraction done of the current SVD calculation (see \ref pinv_progress)
+ - get dither: state, cycles and relative change of the online dither calibration (see \ref shwfs_dither)
  
  \section shwfs_cfg Configuration parameters
  
@@ -226,6 +353,37 @@ for this_dof in all_dof:
  - shape: Shwfs::shape
  - simaxr: Shwfs::simaxr
  - simini_f: Shwfs::simini_f
+ - method: shift calculation method, 'cog', 'cog_weight', 'cog_window', 'cog_iter' or 'corr' (Shwfs::method, see \ref shift_cogmodes)
+ - cog_sigma: width of the Gaussian weight for 'cog_weight' in pixels, 0 for a quarter of the subimage size (Shift::set_cog_sigma())
+ - cog_window: window size for 'cog_window', final window size for 'cog_iter' (Shift::set_cog_window())
+ - cog_niter: number of passes for 'cog_iter' (Shift::set_cog_niter())
+ - spotstats: calculate spot metrics during measurement (Shwfs::do_spotstats, default false)
+ - recon_fused: reconstruct in the Shift workers during centroiding (Shwfs::recon_fused, see \ref shift_recon, default false)
+ - satlevel: saturation level for spot metrics (Shift::set_satlevel(), default camera maximum)
+ - corr_ref: reference for method 'corr', 'mean' or a subimage index (Shift::set_corr_ref())
+ - corr_interp: subpixel interpolation for method 'corr', 'parabolic' or 'gaussian'
+ - shift_spin: time workers spin before sleeping in microseconds (Shift::set_spin())
+ - shift_chunk: subimages claimed per job by Shift workers, 0 for auto (Shift::set_chunk())
+ - shift_workers: number of Shift worker threads, or 'auto' for the number of available CPUs minus one (Shift::auto_workers(), default 1)
+ - shift_cpus: CPUs to pin Shift workers to, e.g. '2,3,6-9' (Shift::set_affinity())
+ - shift_prio: SCHED_FIFO priority for Shift workers, 0 for default scheduling (Shift::set_priority())
+ - mvm_threads: number of threads for the reconstruction matrix-vector product, including the loop thread, or 'auto' for all available CPUs (Mvm, default 1)
+ - mvm_cpus: CPUs to pin the Mvm worker threads to, e.g. '4-7' (Mvm::set_affinity())
+ - rec_prec: reconstructor storage precision, 'f32', 'f16' or 'i16' (Shwfs::rec_prec, see \ref mvm_prec, default 'f32')
+ - rec_sparse: relative threshold for a sparse reconstructor in comp_ctrlcmd(), 0 for dense or 'auto' (Shwfs::rec_sparse, see \ref mvm_sparse, default 0)
+ - rec_sparse_maxerr: maximum relative rms reconstruction error for rec_sparse 'auto' (Shwfs::rec_sparse_maxerr, default 0.01)
+ - fold_actmap: build reconstructors folded with the WFC actuator mapping for measure_ctrlcmd_fold() (Shwfs::fold_actmap, see \ref wfc_fold, default false)
+ - svd_method: 'jacobi' for the multi-threaded Pinv or 'gsl' for gsl_linalg_SV_decomp() (Shwfs::svd_gsl, default 'jacobi')
+ - svd_threads: number of Pinv threads, or 'auto' for all available CPUs (Shwfs::svd_threads, default 'auto'). Use fewer than the CPUs not used by the loop to recalculate in closed loop without jitter.
+ - svd_dump: store the SVD components and actuation matrix as CSV in calc_actmat() (Shwfs::svd_dump, default true)
+ - svd_check: check the inversion for consistency after an influence calibration (Shwfs::svd_check, default true)
+ - calib_settle: maximum time to wait for the WFC after each actuation in influence and hadamard calibration, in seconds (Shwfs::calib_settle, default 0.1)
+ - calib_settle_tol: the WFC has settled when two consecutive frames differ by less than this times the noise, 0 to always wait calib_settle (Shwfs::calib_settle_tol, default 2)
+ - calib_nframes: frames averaged per calibration step (Shwfs::calib_nframes, default 4)
+ - dither_delay: frames between setting a dither and measuring its slopes (Shwfs::dither_delay, default 1)
+ - dither_tol: dither calibration converged when the relative change of the influence matrix per cycle is below this (Shwfs::dither_tol, default 0.02)
+ - dither_mincyc: minimum number of dither cycles (Shwfs::dither_mincyc, default 3)
+ - dither_maxcyc: maximum number of dither cycles, use the estimate so far after this (Shwfs::dither_maxcyc, default 100)
  
  */
 class Shwfs: public Wfs {
@@ -243,13 +401,151 @@ public:
 		CAL_PINHOLE
 	} wfs_cal_t;												//!< Different calibration methods
 	
+	typedef enum {
+		DITHER_IDLE=0,										//!< No dither calibration
+		DITHER_ARMED,											//!< Started, waiting for the loop
+		DITHER_RUNNING,										//!< Dithering in the loop
+		DITHER_STOP,											//!< Stop requested, the loop removes the dither
+	} dither_state_t;										//!< State of the online dither calibration
+	
+	/*! @brief Runtime reconstructors for one WFC, see \ref shwfs_rechandle */
+	class reconstructor {
+	public:
+		reconstructor(): rec(NULL), rec_t(NULL), rec_sp(NULL), fold(NULL), serial(0) { }
+		~reconstructor() { delete rec; delete rec_t; delete rec_sp; delete fold; }
+		Mvm::matrix_t *rec;								//!< Reconstructor -actmat.mat in Mvm layout, used by comp_ctrlcmd()
+		Mvm::matrix_t *rec_t;							//!< Transpose of rec, used by measure_ctrlcmd() with recon_fused
+		Mvm::sparse_t *rec_sp;						//!< Sparse copy of rec if rec_sparse is set, used by comp_ctrlcmd() instead of rec
+		Mvm::matrix_t *fold;							//!< Folded reconstructor [actmap . rec; rec] if fold_actmap is set (size (real_nact + nact, nmeas)), see \ref wfc_fold
+		int serial;												//!< Sequence number of this reconstructor, set by publish_rec()
+	private:
+		reconstructor(const reconstructor &);	//!< Not copyable
+		reconstructor &operator=(const reconstructor &);
+	};
+	typedef reconstructor reconstructor_t;
+	
+	/*! @brief Active reconstructor of one WFC and its readers, see \ref shwfs_rechandle */
+	class rec_slot {
+	public:
+		rec_slot(): cur(NULL), phase(0) { readers[0] = readers[1] = 0; }
+		~rec_slot() { delete cur; }
+		reconstructor_t *cur;							//!< Active reconstructor (atomic)
+		int phase;												//!< Reader counter used by new readers (0 or 1, atomic)
+		int readers[2];										//!< Number of readers registered per phase (atomic)
+		pthread::mutex publish_mutex;			//!< Serialises publish_rec()
+	};
+	typedef rec_slot *rechandle_t;			//!< Reconstructor handle, see get_rec_handle()
+	
 	std::vector<vector_t> mlacfg;				//!< Microlens array configuration. Each element is a vector with the lower-left corner and upper-right corner of the subimage. Same order as shift_vec.
 	
 private:
 	Shift shifts;												//!< Shift computation class. Does the heavy lifting.
+	Mvm mvm;														//!< Matrix-vector engine for reconstruction (comp_ctrlcmd())
+	Mvm mvm_calib;											//!< Single-threaded matrix-vector engine for calibration (rec_error()), as mvm is not reentrant
 	gsl_vector_float *shift_vec;				//!< SHWFS shift vector. Shift for subimage N are elements N*2+0 and N*2+1. Same order as mlacfg @todo Make this a ring buffer
 	gsl_vector_float *ref_vec;					//!< SHWFS reference shift vector. Use this as 'zero' value
 	gsl_vector_float *tot_shift_vec;		//!< Total SHWFS shift being corrected, as calculated from the WFC control vector.
+	gsl_vector_float *spot_stats;				//!< Spot metrics for each subimage, Shift::NSTAT elements per subimage (see Shift::stat_t). Same order as mlacfg
+	bool do_spotstats;									//!< Calculate spot metrics in measure() (Shwfs::spot_stats)
+	bool recon_fused;										//!< Reconstruct in the Shift workers in measure_ctrlcmd() (see \ref shift_recon)
+	Mvm::prec_t rec_prec;								//!< Storage precision of the reconstructors used by comp_ctrlcmd() and measure_ctrlcmd()
+	double rec_sparse;									//!< Relative threshold for the sparse reconstructor, 0 for dense, -1 for auto (see build_rec())
+	double rec_sparse_maxerr;						//!< Maximum relative rms error of the sparse reconstructor for automatic thresholding
+	bool fold_actmap;										//!< Build folded reconstructors (actmat.fold) for WFCs with an actuator mapping
+	int svd_threads;										//!< Pinv threads for calc_actmat() and update_actmat(), 0 for all available CPUs
+	bool svd_gsl;												//!< Use gsl_linalg_SV_decomp() and gsl_blas_dgemm() instead of Pinv
+	bool svd_dump;											//!< Store SVD components and actuation matrix as CSV in calc_actmat()
+	bool svd_check;											//!< Check the inversion in calc_actmat() after calib_influence()
+	double calib_settle;								//!< Time for the WFC to settle after each actuation during calibration, maximum if calib_settle_tol > 0 (s)
+	double calib_settle_tol;						//!< Settled if consecutive frames differ by less than this times the noise, 0 to always wait calib_settle
+	size_t calib_nframes;								//!< Frames averaged per calibration step
+	enum { CALIB_NNOISE=4 };						//!< Frame differences used for the noise floor in calib_run()
+	int dither_delay;										//!< Frames between setting a dither and measuring it
+	double dither_tol;									//!< Relative change of the dither estimate per cycle for convergence
+	int dither_mincyc;									//!< Minimum number of dither cycles
+	int dither_maxcyc;									//!< Maximum number of dither cycles
+	
+	enum { DITHER_REQ_NONE=-1, DITHER_REQ_STOP=2 }; //!< Values of dither_t::req besides a buffer index
+	/*! @brief State of the online dither calibration, see \ref shwfs_dither */
+	struct dither_t {
+		dither_t(): state(DITHER_IDLE), wfc(NULL), nact(0), nmeas(0), amp(0), singval(0), npat(0), frame(0), vec(NULL), cur(0), req(DITHER_REQ_NONE), running(false), done(0), total(NULL), work(NULL), est(NULL), est_prev(NULL), ncyc(0), change(1) { acc[0] = acc[1] = NULL; acc_ncyc[0] = acc_ncyc[1] = 0; }
+		volatile int state;								//!< Shwfs::dither_state_t
+		Wfc *wfc;													//!< WFC being dithered
+		string wfcname;										//!< Name of wfc
+		size_t nact;											//!< Number of WFC modes
+		size_t nmeas;											//!< Number of slopes
+		float amp;												//!< Dither amplitude
+		double singval;										//!< Singular value cutoff for the new reconstructor
+		int npat;													//!< Number of patterns per cycle
+		size_t frame;											//!< Frames dithered
+		gsl_vector_float *vec;						//!< Current dither (nact)
+		gsl_matrix_float *acc[2];					//!< Slope sums per pattern (npat x nmeas), filled by the loop and handed to the worker
+		int acc_ncyc[2];									//!< Cycles in acc
+		int cur;													//!< acc buffer used by the loop
+		volatile int req;									//!< acc buffer handed to the worker, or Shwfs::DITHER_REQ_NONE or DITHER_REQ_STOP (futex word)
+		Futex futex;											//!< Wakes the worker on req
+		pthread::thread thr;							//!< Worker thread, see dither_worker()
+		bool running;											//!< thr was started and not joined
+		volatile int done;								//!< Worker published the new reconstructor
+		gsl_matrix *total;								//!< Slope sums of all cycles (npat x nmeas, worker only)
+		gsl_matrix *work;									//!< Transform workspace (npat x nmeas, worker only)
+		gsl_matrix *est;									//!< Influence estimate (nmeas x nact, worker only)
+		gsl_matrix *est_prev;							//!< Previous influence estimate (nmeas x nact, worker only)
+		int ncyc;													//!< Cycles in total
+		double change;										//!< Relative change of the last estimate
+	} dither;
+	void dither_worker();								//!< Decode and check the dither sums after each cycle, see \ref shwfs_dither
+	void dither_join();									//!< Stop and join the dither worker, free its memory
+	int _update_actmat(const string &wfcname, const double singval); //!< update_actmat() with Shwfs::calib_mutex held
+	
+	/*! @brief Measure the slopes for a sequence of WFC shapes, see \ref shwfs_calib_oper_pipeline
+	 
+	 Row s of acts is added to the current WFC shape for step s. Afterwards, 
+	 the original shape is restored.
+	 
+	 @param [in] *wfc Wavefront corrector to actuate
+	 @param [in] *cam Camera to measure with (should be running)
+	 @param [in] *acts Actuation offsets (nstep x nact)
+	 @param [out] *means Mean slopes of each step (nstep x shift_vec->size)
+	 @return 0 on success, 1 if aborted because the mode is not calibration anymore, -1 on error
+	 */
+	int calib_run(Wfc *wfc, Camera *cam, const gsl_matrix_float *acts, gsl_matrix_float *means);
+	/*! @brief Measure the slopes of one frame into row 0 of slopes, return the squared distance to row 0 of prev (0 if prev is NULL, -1 on error) */
+	double calib_slopes(Camera::frame_t *frame, gsl_matrix_float *slopes, const gsl_matrix_float *prev);
+	const char *svd_stage;							//!< Stage of the current SVD calculation (see \ref pinv_progress)
+	double svd_frac;										//!< Fraction of svd_stage done
+	void svd_progress(const char *stage, const double frac); //!< Pinv progress callback, broadcasts progress
+	std::map<std::string, gsl_matrix_float *> actmaps; //!< Actuator mapping of each WFC (copy of Wfc::get_actmap()), see set_actmap()
+	std::map<std::string, rec_slot *> recslots; //!< Reconstructor slot of each WFC, see get_rec_handle()
+	pthread::mutex recslot_mutex;				//!< Protects recslots
+	mutable pthread::mutex calib_mutex;	//!< Serialises access to Shwfs::calib and the actuation matrices, see \ref shwfs_dither
+	int rec_serial;											//!< Number of reconstructors published
+	
+	/*! @brief Register as reader of the active reconstructor of h
+	 
+	 @param [in] h Reconstructor handle
+	 @param [out] &phase Reader counter used, pass to rec_release()
+	 @return Active reconstructor (may be NULL), valid until rec_release()
+	 */
+	reconstructor_t *rec_acquire(rechandle_t h, int &phase) {
+		// Only count as reader once the phase is still current after 
+		// registering, otherwise publish_rec() may already have waited for 
+		// this counter and freed what we would load.
+		while (true) {
+			phase = __atomic_load_n(&h->phase, __ATOMIC_SEQ_CST);
+			__atomic_add_fetch(&h->readers[phase], 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&h->phase, __ATOMIC_SEQ_CST) == phase)
+				return __atomic_load_n(&h->cur, __ATOMIC_SEQ_CST);
+			__atomic_sub_fetch(&h->readers[phase], 1, __ATOMIC_SEQ_CST);
+		}
+	}
+	void rec_release(rechandle_t h, const int phase) { __atomic_sub_fetch(&h->readers[phase], 1, __ATOMIC_SEQ_CST); } //!< Unregister reader, see rec_acquire()
+	
+	gsl_vector_float *meas_shift[2];		//!< Double-buffered shift vectors for measure_start()
+	gsl_vector_float *meas_stats[2];		//!< Double-buffered spot metrics for measure_start()
+	Shift::handle_t meas_handle[2];			//!< Handle of the job using each buffer
+	bool meas_busy[2];									//!< Buffer is in use by a job not yet finished with measure_finish()
+	int meas_next;											//!< Next buffer to use
 	
 	typedef struct infdata {
 		infdata(): init(false), nact(0), nmeas(0) {  }
@@ -267,7 +563,8 @@ private:
 		
 		struct _actmat {
 			_actmat(): mat(NULL), mat_dbl(NULL), U(NULL), s(NULL), Sigma(NULL), V(NULL) { }
-			gsl_matrix_float *mat;					//!< Actuation matrix = V . Sigma^-1 . U^T (size (nact, nmeas))
+			gsl_matrix_float *mat;					//!< Actuation matrix = V . Sigma^-1 . U^T (size (nact, nmeas)). Not used by the loop, see build_rec()
+			std::map<std::string, gsl_matrix_float *> presets; //!< Stored actuation matrices, see store_rec()
 			gsl_matrix *mat_dbl;						//!< Actuation matrix, as double (size (nact, nmeas))
 			gsl_matrix *U;									//!< SVD matrix U of infmat (size (nmeas, nact))
 			gsl_vector *s;									//!< SVD vector s of infmat (size (nact, 1))
@@ -343,7 +640,79 @@ private:
 	 */
 	string get_shifts_str() const;
 	
+	/*! @brief Represent spot metrics as a string
+	 
+	 \verbatim
+	   <N> [idx flux0 peak0 nsat0 width0 [idx flux1 peak1 nsat1 width1 [...]]]
+	 \endverbatim
+	 
+	 See Shift::stat_t for the meaning of the metrics.
+	 */
+	string get_spotstats_str() const;
+	
 public:
+	/*! @brief Set shift calculation method (Shwfs::method)
+	 
+	 @param [in] meth 'cog' (Center of Gravity), 'cog_weight', 'cog_window', 'cog_iter' (CoG variants) or 'corr' (FFT cross-correlation, needs FFTW)
+	 @return true if successful
+	 */
+	bool set_method(const string meth);
+	string get_method() const;			//!< Get shift calculation method as string
+	/*! @brief Set storage precision of the reconstructors (Shwfs::rec_prec), rebuild them if calibrated
+	 
+	 @param [in] prec 'f32', 'f16' or 'i16' (see \ref mvm_prec)
+	 @return true if successful
+	 */
+	bool set_rec_prec(const string prec);
+	string get_rec_prec() const { return Mvm::prec_str(rec_prec); } //!< Get reconstructor storage precision as string
+	/*! @brief Set sparse reconstructor threshold (Shwfs::rec_sparse), rebuild the reconstructors if calibrated
+	 
+	 @param [in] thresh Relative threshold (see Mvm::sparse), '0' for a dense reconstructor or 'auto'
+	 @return true if successful
+	 */
+	bool set_rec_sparse(const string thresh);
+	string get_rec_sparse() const { return rec_sparse < 0 ? "auto" : format("%g", rec_sparse); } //!< Get sparse reconstructor threshold as string
+	/*! @brief Enable or disable folded reconstructors (Shwfs::fold_actmap), rebuild them if calibrated */
+	void set_fold_actmap(const bool fold);
+	
+	/*! @brief Set the actuator mapping of a WFC, used for the folded reconstructor
+	 
+	 The matrix is copied, pass NULL to remove it. The folded reconstructor is
+	 rebuilt if the WFC is calibrated. See \ref wfc_fold.
+	 
+	 @param [in] wfcname Name of the WFC
+	 @param [in] *actmap Actuator mapping (real_nact, nact), e.g. Wfc::get_actmap()
+	 */
+	void set_actmap(const string &wfcname, const gsl_matrix_float *actmap);
+	/*! @brief Is a folded reconstructor available for handle h? */
+	bool have_fold(rechandle_t h);
+	
+	/*! @brief Get the reconstructor handle of a WFC
+	 
+	 The handle stays valid for the lifetime of this Shwfs, also if wfcname is
+	 not calibrated yet or is recalibrated. See \ref shwfs_rechandle.
+	 
+	 @param [in] wfcname Name of the WFC
+	 @return Handle to use with comp_ctrlcmd() and measure_ctrlcmd()
+	 */
+	rechandle_t get_rec_handle(const string &wfcname);
+	
+	/*! @brief Make r the active reconstructor of wfcname
+	 
+	 Swaps the active pointer atomically, waits until no reader uses the 
+	 previous reconstructor and frees it. Takes ownership of r. Do not call 
+	 from the thread that uses the handle.
+	 
+	 @param [in] wfcname Name of the WFC
+	 @param [in] *r New reconstructor
+	 */
+	void publish_rec(const string &wfcname, reconstructor_t *r);
+	
+	/*! @brief Store a copy of the current actuation matrix of wfcname as preset name */
+	bool store_rec(const string &wfcname, const string &name);
+	/*! @brief Make preset name the actuation matrix of wfcname, and publish it (see build_rec()) */
+	bool use_rec(const string &wfcname, const string &name);
+	
 	Shwfs(Io &io, foamctrl *const ptc, const string name, const string port, Path const &conffile, Camera &wfscam, const bool online=true);
 	~Shwfs();
 	
@@ -401,6 +770,45 @@ public:
 	 */
 	int calib_influence(Wfc *wfc, Camera *cam, const vector <float> &actpos, const double sval_cutoff);
 	
+	/*! @brief Calibrate influence function with Hadamard patterns on all actuators at once
+	 
+	 See \ref shwfs_calib_oper_hadamard. The decoded influence is stored as 
+	 if measured with calib_influence() at actuator positions -amp and +amp.
+	 
+	 @param [in] *wfc Wavefront corrector to calculate influence function for
+	 @param [in] *cam Camera to use for influence calculation
+	 @param [in] amp Actuation amplitude of each actuator in each pattern
+	 @param [in] sval_cutoff Singular value cutoff for calc_actmat()
+	 */
+	int calib_hadamard(Wfc *wfc, Camera *cam, const float amp, const double sval_cutoff);
+	static int hadamard_npat(const size_t nact); //!< Number of Hadamard patterns for nact actuators
+	static int hadamard_sign(const int pat, const size_t act) { return (__builtin_popcount(pat & (act+1)) & 1) ? -1 : 1; } //!< Sign of actuator act in pattern pat
+	
+	/*! @brief Start online dither calibration for *wfc in closed loop, see \ref shwfs_dither
+	 
+	 Returns right away, dithering starts at the next dither_step().
+	 
+	 @param [in] *wfc Wavefront corrector to recalibrate (must have an influence matrix)
+	 @param [in] amp Dither amplitude of each mode
+	 @param [in] singval Singular value cutoff for the new reconstructor
+	 @return 0 on success, -1 if already running or not calibrated
+	 */
+	int dither_start(Wfc *wfc, const float amp, const double singval);
+	void dither_stop();									//!< Abort dither calibration, the loop removes the dither at the next dither_step()
+	/*! @brief Demodulate the slopes of this frame and set the dither for the next actuation
+	 
+	 Call from the loop after reconstruction and before Wfc::update_control()
+	 or Wfc::update_control_fold(). Does nothing unless dither_start() was 
+	 called for this wfc.
+	 
+	 @param [in] *wfc Wavefront corrector the loop controls
+	 @param [in] *slopes Slopes measured in this frame (wf_info_t::wfamp)
+	 @param [in] fold Error was reconstructed in Wfc::ctrl_params.fold instead of err
+	 @return 1 while dithering, 0 otherwise
+	 */
+	int dither_step(Wfc *wfc, const gsl_vector_float *slopes, const bool fold);
+	void dither_finish(Wfc *wfc);				//!< Remove the dither from wfc and stop, call from the loop thread when leaving closed loop
+	
 	/*! @brief Calibrate influence function between this WFS and *wfc using *cam
 	 
 	 @param [in] *wfc Wavefront corrector to calculate influence function for
@@ -429,7 +837,22 @@ public:
 	 @param [out] *act Generalized actuator commands for wfcname (pre-allocated)
 	 @return 0 for ok, 1 for error
 	 */
-	int comp_ctrlcmd(const string &wfcname, const gsl_vector_float *shift, gsl_vector_float *act);
+	int comp_ctrlcmd(const string &wfcname, const gsl_vector_float *shift, gsl_vector_float *act) { return comp_ctrlcmd(get_rec_handle(wfcname), shift, act); }
+	/*! @brief As comp_ctrlcmd(), using a handle from get_rec_handle() */
+	int comp_ctrlcmd(rechandle_t h, const gsl_vector_float *shift, gsl_vector_float *act);
+	
+	/*! @brief Given a vector of shifts, compute the folded control vector
+	 
+	 As comp_ctrlcmd(), but computes the actuator increments and the modal 
+	 commands in one product with the folded reconstructor (see 
+	 \ref wfc_fold), for Wfc::update_control_fold().
+	 
+	 @param [in] h Reconstructor handle (get_rec_handle())
+	 @param [in] *shift Vector of measured shifts
+	 @param [out] *fold Folded commands (Wfc::ctrlparams.fold, pre-allocated)
+	 @return 0 for ok, 1 for error (e.g. no folded reconstructor)
+	 */
+	int comp_ctrlcmd_fold(rechandle_t h, const gsl_vector_float *shift, gsl_vector_float *fold);
 	
 	/*! @brief Given a control vector, calculate shifts
 	 
@@ -494,6 +917,8 @@ public:
 	 @param [in] actposid ID of the position the actuator was set to (in calib[].meas.actpos)
 	 */
 	int build_infmat(string wfcname, Camera::frame_t *frame, int actid, int actposid);
+	/*! @brief As build_infmat() above, using the mean of several frames (centroided in one batch, see measure_batch()) */
+	int build_infmat(string wfcname, const vector<Camera::frame_t *> &frames, int actid, int actposid);
 
 	/*! @brief After getting enough data with build_infmat, construct the influence matrix
 	 
@@ -512,6 +937,8 @@ public:
 	 @param [in] wfcname Name of the WFC this WFS is calibrated with
 	 @param [in] singval How much singular value/modes to include
 	 @param [in] check_svd Check SVD results for consistency
+	 
+	 Call with Shwfs::calib_mutex held.
 	 */	 
 	int calc_actmat(const string &wfcname, const double singval, const bool check_svd=true);
 	
@@ -527,6 +954,36 @@ public:
 	 */
 	int update_actmat(const string &wfcname, const double singval);
 	
+	/*! @brief (Re)build the runtime reconstructors from the actuation matrix
+	 
+	 Converts calib[wfcname].actmat.mat to Mvm layout (rec and rec_t) with 
+	 precision rec_prec in a new reconstructor, and publishes it with 
+	 publish_rec() (see \ref shwfs_rechandle). For reduced precision, the 
+	 reconstruction error relative to the float path is reported, using the
+	 columns of the influence matrix as test vectors.
+	 
+	 If rec_sparse is set, a sparse copy (rec_sp) is made with that threshold.
+	 With rec_sparse 'auto', thresholds from 0.1 down are tried until the 
+	 relative rms error is at most rec_sparse_maxerr. The fill ratio and 
+	 error are reported.
+	 
+	 With fold_actmap set and an actuator mapping known for wfcname (see 
+	 set_actmap()), the folded reconstructor fold is built as well.
+	 
+	 @param [in] wfcname Name of the WFC this WFS is calibrated with
+	 */
+	void build_rec(const string &wfcname);
+	
+	/*! @brief Relative rms and max error of a reconstructor against gsl_blas_sgemv() with -actmat.mat
+	 
+	 @param [in] wfcname Name of the WFC this WFS is calibrated with
+	 @param [in] *rec Dense reconstructor to test, or NULL
+	 @param [in] *sp Sparse reconstructor to test (if rec is NULL)
+	 @param [out] &maxerr Maximum absolute error
+	 @return Relative rms error over the columns of the influence matrix
+	 */
+	double rec_error(const string &wfcname, const Mvm::matrix_t *rec, const Mvm::sparse_t *sp, double &maxerr);
+	
 	/*! @brief Represent singular value array as string
 	 
 	 @return \<N\> \<s1\> \<s2\> ... \<sN\>
@@ -568,6 +1025,66 @@ public:
 	
 	void store_reference(); //!< Store reference vector to a .csv file in ptc->datadir
 	
+	/*! @brief Start measuring frame asynchronously
+	 
+	 This queues centroiding of frame with the Shift workers and returns 
+	 immediately, such that frame N+1 can be processed while the caller is 
+	 still working on the results of frame N (as returned by measure_finish()).
+	 Two measurements can be in flight. The frame data must remain valid until
+	 measure_finish() returns.
+	 
+	 @param [in] *frame Camera frame to process
+	 @param [out] *h Handle to pass to measure_finish()
+	 @param [in] *recon Also reconstruct the shifts while centroiding (see Shift::submit()), or NULL
+	 @return true if successful
+	 */
+	bool measure_start(Camera::frame_t *frame, Shift::handle_t *h, const Shift::recon_t *recon=NULL);
+	/*! @brief Finish measurement started with measure_start()
+	 
+	 Waits for the centroiding to complete, then processes the shifts as 
+	 measure() does. Shwfs::shift_vec and Wfs::wf are updated.
+	 
+	 @param [in] h Handle from measure_start()
+	 @return Wavefront information for this frame (Wfs::wf), NULL on error
+	 */
+	wf_info_t* measure_finish(const Shift::handle_t h);
+	/*! @brief Measure a batch of frames in one go (e.g. for calibration or offline reduction)
+	 
+	 All frames are centroided in a single Shift job (see Shift::calc_shifts_batch()),
+	 and the reference is subtracted as in measure(). Shwfs::shift_vec and 
+	 Wfs::wf are not updated.
+	 
+	 @param [in] frames Camera frames to process
+	 @param [out] *shifts Pre-allocated matrix, row k gets the shifts for frames[k] (at least frames.size() rows of 2 * number of subimages)
+	 @return true if successful
+	 */
+	bool measure_batch(const vector<Camera::frame_t *> &frames, gsl_matrix_float *shifts);
+	/*! @brief Measure frame and compute the control vector for wfcname
+	 
+	 Equivalent to measure() followed by comp_ctrlcmd(). If recon_fused is 
+	 set, the Shift workers reconstruct their subimages as soon as their 
+	 shifts are known (see \ref shift_recon), such that most of the 
+	 reconstruction is hidden in the centroiding time. A sparse reconstructor
+	 (rec_sparse) takes precedence over recon_fused.
+	 
+	 @param [in] *frame Camera frame to process
+	 @param [in] h Reconstructor handle (get_rec_handle()), or the name of the wavefront corrector
+	 @param [out] *act Generalized actuator commands for the WFC (pre-allocated)
+	 @return Wavefront information for this frame (Wfs::wf), NULL on error
+	 */
+	wf_info_t* measure_ctrlcmd(Camera::frame_t *frame, rechandle_t h, gsl_vector_float *act);
+	wf_info_t* measure_ctrlcmd(Camera::frame_t *frame, const string &wfcname, gsl_vector_float *act) { return measure_ctrlcmd(frame, get_rec_handle(wfcname), act); }
+	/*! @brief Measure frame and compute the folded control vector for wfcname
+	 
+	 Equivalent to measure() followed by comp_ctrlcmd_fold().
+	 
+	 @param [in] *frame Camera frame to process
+	 @param [in] h Reconstructor handle (get_rec_handle())
+	 @param [out] *fold Folded commands (Wfc::ctrlparams.fold, pre-allocated)
+	 @return Wavefront information for this frame (Wfs::wf), NULL on error
+	 */
+	wf_info_t* measure_ctrlcmd_fold(Camera::frame_t *frame, rechandle_t h, gsl_vector_float *fold);
+	
 	// From Wfs::
 	wf_info_t* measure(Camera::frame_t *frame=NULL);
 	virtual int calibrate();
@@ -48,7 +48,7 @@ Camera(io, ptc, name, simulcam_type, port, conffile, online),
 seeing(io, ptc, name + "-seeing", port, conffile),
 simwfcerr(_simwfcerr),
 simwfc(_simwfc),
-out_size(0), frame_out(NULL), frame_raw(NULL),
+frame_raw(NULL),
 telradius(1.0), telapt(NULL), telapt_fill(0.7),
 noisefac(0.0), noiseamp(0.0), mlafac(1.0), wfcerr_retain(0.7), wfcerr_act(NULL), 
 shwfs(io, ptc, name + "-shwfs", port, conffile, *this, false),
@@ -113,8 +113,6 @@ SimulCam::~SimulCam() {
 	gsl_matrix_free(frame_raw);
 	gsl_matrix_free(telapt);
 	gsl_vector_float_free(wfcerr_act);
-	
-	free(frame_out);
 }
 
 void SimulCam::on_message(Connection *const conn, string line) {
@@ -226,11 +224,6 @@ void SimulCam::setup() {
 	// Memory for wfcerror actuation
 	gsl_vector_float_free(wfcerr_act);
 	wfcerr_act = gsl_vector_float_calloc(simwfcerr.get_nact());
-	
-	// Output frame (arbitrary bitdepth)
-	free(frame_out);
-	out_size = frame_raw->size1 * frame_raw->size2 * conv_depth(depth);
-	frame_out = calloc(1, out_size);	
 }
 
 void SimulCam::gen_telapt(gsl_matrix *const apt, const double rad) const {
@@ -543,10 +536,10 @@ void SimulCam::cam_handler() {
 				simul_wfc(frame_raw);
 				simul_telescope(frame_raw);
 				simul_wfs(frame_raw);
+				// Capture in a free buffer, frames held by consumers are not overwritten
+				void *frame_out = cam_get_buf();
 				simul_capture(frame_raw, frame_out);
-				
-				//! @todo frame_raw/frame_out is the same memory each time, so this does not really queue a *new* image, it's the same memory.
-				cam_queue(frame_raw, frame_out);
+				cam_queue_buf(frame_out);
 				
 				usleep(interval * 1000000);
 				break;
@@ -561,9 +554,9 @@ void SimulCam::cam_handler() {
 				simul_wfc(frame_raw);
 				simul_telescope(frame_raw);
 				simul_wfs(frame_raw);
+				void *frame_out = cam_get_buf();
 				simul_capture(frame_raw, frame_out);
-				
-				cam_queue(frame_raw, frame_out);
+				cam_queue_buf(frame_out);
 				
 				usleep(interval * 1000000);
 
@@ -118,8 +118,6 @@ private:
 	SimulWfc &simwfcerr;								//!< This class simulates a wavefront corrector as a source of errors
 	SimulWfc &simwfc;										//!< This class simulates a wavefront corrector
 	
-	size_t out_size;										//!< Size of frame_out
-	void *frame_out;										//!< Frame to store simulated image
 	gsl_matrix *frame_raw;							//!< Raw frame used to calculate wavefront errors etc.
 
 	double telradius;										//!< Telescope radius (fraction of CCD)
@@ -37,6 +37,7 @@
 Wfc::Wfc(Io &io, foamctrl *const ptc, const string name, const string type, const string port, Path const & conffile, const bool online):
 Device(io, ptc, name, wfc_type + "." + type, port, conffile, online),
 real_nact(0), virt_nact(0), actmap_mat(NULL),
+fold_sync(false), fold_count(0), fold_resync(1000),
 have_waffle(false),
 offset_str("0"), maxact(1.0) {
 	io.msg(IO_DEB2, "Wfc::Wfc()");
@@ -50,6 +51,8 @@ offset_str("0"), maxact(1.0) {
 		actmap_f = cfg.getstring("actmapfile", "");
 		io.msg(IO_DEB1, "Wfc::Wfc(): Got actmap file: %s", actmap_f.c_str());
 		
+		fold_resync = cfg.getint("fold_resync", 1000);
+		
 	} catch (std::runtime_error &e) {
 		io.msg(IO_ERR | IO_FATAL, "Wfc: problem with configuration file: %s", e.what());
 	} catch (...) { 
@@ -93,6 +96,8 @@ Wfc::~Wfc() {
 	gsl_vector_float_free(ctrlparams.err);
 	gsl_vector_float_free(ctrlparams.prev);
 	gsl_vector_float_free(ctrlparams.pid_int);
+	gsl_vector_float_free(ctrlparams.fold);
+	gsl_vector_float_free(ctrlparams.dither);
 	
 	// Work vector (same size as target, virt_nact)
 	gsl_vector_float_free(workvec);
@@ -159,6 +164,8 @@ int Wfc::ctrl_apply_actmap() {
 
 	// Compute workvec += offset, which gives workvec = ctrlparams.target + offset
 	gsl_blas_saxpy(1.0, ctrlparams.offset, workvec);
+	if (ctrlparams.dither_on)
+		gsl_blas_saxpy(1.0, ctrlparams.dither, workvec);
 	
 	// Compute ctrl_vec = actmat . workvec
 	if (actmap_mat)
@@ -166,14 +173,14 @@ int Wfc::ctrl_apply_actmap() {
 	else
 		gsl_blas_scopy(workvec, ctrlparams.ctrl_vec);
 	
+	fold_sync = true;
+	fold_count = 0;
 	return 0;
 }
 
-int Wfc::update_control(const gsl_vector_float *const error, const gain_t g, const float retain) {
+bool Wfc::ctrl_update_target(const gsl_vector_float *const error, const gain_t g, const float retain) {
 	// gsl_blas_saxpy(alpha, x, y): compute the sum y = \alpha x + y for the vectors x and y.
 	// gsl_blas_sscal(alpha, x): rescale the vector x by the multiplicative factor alpha. 
-	if (!get_calib())
-		calibrate();
 	
 	// Copy error to our memory (ctrlparams.err), unless it is the same memory
 	if (error != ctrlparams.err)
@@ -198,9 +205,13 @@ int Wfc::update_control(const gsl_vector_float *const error, const gain_t g, con
 	
 	//! @todo Move this somewhere deeper, clamping should always happen?
 	// Clamp WFC control values if requested
+	bool clamped = false;
 	for (size_t actid=0; actid<ctrlparams.target->size; actid++) {
 		float thisact = gsl_vector_float_get(ctrlparams.target, actid);
-		gsl_vector_float_set(ctrlparams.target, actid, clamp(thisact, -maxact, maxact));
+		if (thisact < -maxact || thisact > maxact) {
+			gsl_vector_float_set(ctrlparams.target, actid, clamp(thisact, -maxact, maxact));
+			clamped = true;
+		}
 	}
 	
 	//! @todo Extend update_control() with (P)ID control
@@ -223,9 +234,38 @@ int Wfc::update_control(const gsl_vector_float *const error, const gain_t g, con
 	}
 #endif
 	
+	return clamped;
+}
+
+int Wfc::update_control(const gsl_vector_float *const error, const gain_t g, const float retain) {
+	if (!get_calib())
+		calibrate();
+	
+	ctrl_update_target(error, g, retain);
 	return ctrl_apply_actmap();
 }
 
+int Wfc::update_control_fold(const gsl_vector_float *const fold, const gain_t g, const float retain) {
+	if (!get_calib())
+		calibrate();
+	
+	if (!actmap_mat)
+		return update_control(fold, g, retain);
+	
+	// fold = [actmap . err, err]
+	gsl_vector_float_const_view dctrl = gsl_vector_float_const_subvector(fold, 0, real_nact);
+	gsl_vector_float_const_view error = gsl_vector_float_const_subvector(fold, real_nact, virt_nact);
+	const bool clamped = ctrl_update_target(&error.vector, g, retain);
+	
+	// Fall back to the full mapping if the increment does not apply (see \ref wfc_fold)
+	if (clamped || retain != 1.0 || !fold_sync || ++fold_count >= fold_resync)
+		return ctrl_apply_actmap();
+	
+	// ctrl_vec += g.p * actmap . err
+	gsl_blas_saxpy(g.p, &dctrl.vector, ctrlparams.ctrl_vec);
+	return 0;
+}
+
 int Wfc::set_control(const gsl_vector_float *const newctrl) {
 	if (!get_calib())
 		calibrate();
@@ -272,6 +312,7 @@ int Wfc::set_wafflepattern(const float val) {
 	
 	// Set all to zero first
 	gsl_vector_float_set_zero(ctrlparams.ctrl_vec);
+	fold_sync = false;
 	
 	// Set 'even' actuators to +val, set 'odd' actuators to -val:
     //! @todo Check bounds here, waffle_even.at(idx) can be higher than ctrl_vec length 
@@ -297,6 +338,17 @@ int Wfc::set_randompattern(const float maxval) {
 	return ctrl_apply_actmap();
 }
 
+int Wfc::set_dither(const gsl_vector_float *const dither) {
+	if (!get_calib())
+		calibrate();
+	
+	if (dither)
+		gsl_blas_scopy(dither, ctrlparams.dither);
+	ctrlparams.dither_on = (dither != NULL);
+	fold_sync = false;
+	return 0;
+}
+
 int Wfc::calibrate() {
 	// Check if we have an actuation map
 	if (actmap_mat == NULL)
@@ -327,6 +379,16 @@ int Wfc::calibrate() {
 	gsl_vector_float_free(workvec);
 	workvec = gsl_vector_float_calloc(virt_nact);
 	
+	// Folded reconstruction (see \ref wfc_fold)
+	gsl_vector_float_free(ctrlparams.fold);
+	ctrlparams.fold = gsl_vector_float_calloc(actmap_mat ? real_nact + virt_nact : virt_nact);
+	fold_sync = false;
+	
+	// Dither for online calibration
+	gsl_vector_float_free(ctrlparams.dither);
+	ctrlparams.dither = gsl_vector_float_calloc(virt_nact);
+	ctrlparams.dither_on = false;
+	
 	set_calib(true);
 	return 0;
 }
@@ -336,6 +398,7 @@ int Wfc::reset() {
 		calibrate();
 
 	gsl_vector_float_set_zero(ctrlparams.ctrl_vec);
+	fold_sync = false;
 	
 	actuate();
 	return 0;
@@ -441,6 +504,7 @@ void Wfc::on_message(Connection *const conn, string line) {
 				gsl_vector_float_set(ctrlparams.offset, actid, thisoff);
 				offset_str += format(" %.3g", thisoff);
 			}
+			fold_sync = false;
 			net_broadcast(format("ok offset %s", offset_str.c_str()));
 		} else
 			parsed = false;
@@ -481,6 +545,7 @@ void Wfc::on_message(Connection *const conn, string line) {
 				actval = popdouble(line);
 				gsl_vector_float_set(ctrlparams.target, acti, actval);
 			}
+			fold_sync = false;
 			actuate();
 			conn->write(format("ok act vec"));
 		} else
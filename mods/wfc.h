@@ -78,6 +78,25 @@ const string wfc_type = "wfc";
  the modes based on variance, and depending on the normalisation of the
  mapping matrix, this might not be the same order.
  
+ \section wfc_fold Folded actuator mapping
+ 
+ With an actuator mapping, the loop needs two matrix-vector products: the
+ reconstruction to modes, and the mapping to actuators in 
+ ctrl_apply_actmap(). As both are linear, a WFS can precompute the product 
+ of the actuator mapping and its reconstructor (see Shwfs::set_actmap()), 
+ and deliver both the actuator increments actmap . err (real_nact) and the 
+ modal error err (virt_nact) in one pass, stacked in ctrlparams.fold. 
+ update_control_fold() then updates the modal target exactly as 
+ update_control(), and adds gain.p times the increments to ctrl_vec instead
+ of mapping the full target again.
+ 
+ This is equivalent as long as ctrl_vec = actmap . (target + offset) holds
+ before the update. The slow path (ctrl_apply_actmap()) is used instead if 
+ any mode is clamped to maxact, if retain is not 1, if ctrl_vec or offset 
+ were changed otherwise since the last mapping (e.g. 'set offset',
+ set_wafflepattern() or set_dither()), and every fold_resync updates to 
+ remove rounding drift.
+ 
  \section wfc_cmds WFC control commands
  
  The WFC can be driven in various ways. The following commands obey the 
@@ -117,6 +136,9 @@ const string wfc_type = "wfc";
  - actmapfile: FITS file containing a matrix with an actuation map. This 
  should be <virt_nact> by <real_nact>. If present, all WFC commands will use 
  this mapping, see \ref wfc_actmap.
+ - fold_resync: number of update_control_fold() calls between full 
+ mappings of the control vector (Wfc::fold_resync, see \ref wfc_fold, 
+ default 1000).
 
  */
 class Wfc: public foam::Device {
@@ -130,6 +152,16 @@ protected:
 	gsl_matrix_float *actmap_mat;				//!< Actuator mapping matrix, from actuation modes (i.e Zernike) to WFC actuators
 	int ctrl_apply_actmap();						//!< Apply actuation mapping matrix, if necessary.
 	
+	bool fold_sync;											//!< ctrl_vec = actmap . (target + offset) holds, see \ref wfc_fold
+	int fold_count;											//!< Number of update_control_fold() calls since the last full mapping
+	int fold_resync;										//!< Maximum number of update_control_fold() calls between full mappings
+	
+	/*! @brief Update ctrlparams.target with error, gain and retain, clamp to maxact
+	 
+	 @return true if any mode was clamped
+	 */
+	bool ctrl_update_target(const gsl_vector_float *const err, const gain_t g, const float retain);
+	
 	string str_waffle_even;							//!< String representation of even actuators. Should be *real* actuators
 	string str_waffle_odd;							//!< String representation of odd actuators. Should be *real* actuators
 	vector<int> waffle_even;						//!< 'Even' actuators for waffle pattern. Should be *real* actuators, not virtual
@@ -146,7 +178,7 @@ protected:
 public:
 	// Common Wfc settings
 	typedef struct wfc_ctrl {
-		wfc_ctrl(): ctrl_vec(NULL), target(NULL), err(NULL), prev(NULL), gain(1,0,0), pid_int(NULL) { }
+		wfc_ctrl(): ctrl_vec(NULL), offset(NULL), target(NULL), err(NULL), prev(NULL), gain(1,0,0), pid_int(NULL), fold(NULL), dither(NULL), dither_on(false) { }
 		gsl_vector_float *ctrl_vec;				//!< Control vector sent to the WFC (size real_nact).
 
 		gsl_vector_float *offset;					//!< Offset added to all control modes (size virt_nact)
@@ -157,12 +189,17 @@ public:
 		gain_t gain;											//!< Operating gain for this device
 		gsl_vector_float *pid_int;				//!< Integral part of the PID gain
 		float i_ran[2];										//!< Range for individual pid_int elements
+		gsl_vector_float *fold;						//!< Folded reconstruction: actmap . err followed by err (size real_nact + virt_nact, or virt_nact without actmap), see \ref wfc_fold
+		gsl_vector_float *dither;					//!< Dither added to target + offset when dither_on, not integrated (size virt_nact), see set_dither()
+		bool dither_on;										//!< Add dither in ctrl_apply_actmap()
 	} wfc_ctrl_t;
 	
 	wfc_ctrl_t ctrlparams;
 	
 	int get_nact() const { return virt_nact; } //!< Return the number of actuators in use by the WFC
 	void set_nact(const int val) { virt_nact = val; }
+	int get_real_nact() const { return real_nact; } //!< Return the number of hardware actuators
+	const gsl_matrix_float *get_actmap() const { return actmap_mat; } //!< Return the actuator mapping matrix (real_nact, virt_nact), or NULL
 
 	void set_gain(const double p, const double i, const double d) { ctrlparams.gain.p = p; ctrlparams.gain.i = i; ctrlparams.gain.d = d; } //!< Set PID gain for WFC control
 	
@@ -179,6 +216,18 @@ public:
 	 */
 	int update_control(const gsl_vector_float *const err) { return update_control(err, ctrlparams.gain); }
 	
+	/*! @brief Update WFC control from a folded reconstruction
+	 
+	 Equivalent to update_control() with the modal error stored in fold, but 
+	 without mapping the full control vector (see \ref wfc_fold).
+	 
+	 @param [in] fold actmap . err followed by err (as ctrlparams.fold)
+	 @param [in] g Gain for update
+	 @param [in] retain Factor of old control vector to keep (default: 1.0)
+	 */
+	int update_control_fold(const gsl_vector_float *const fold, const gain_t g, const float retain=1.0);
+	int update_control_fold(const gsl_vector_float *const fold) { return update_control_fold(fold, ctrlparams.gain); }
+	
 	/*! @brief Set WFC control, ignoring current signal
 	 
 	 @param [in] newctrl New control target for WFC
@@ -217,6 +266,16 @@ public:
 	 @param [in] maxval Range of random values to set on actuators
 	 */
 	int set_randompattern(const float maxval);
+	
+	/*! @brief Add a dither to the modes at the next update, without changing the target
+	 
+	 The dither is added to target + offset in every mapping until the next 
+	 call, for online calibration (see Shwfs::dither_step()). Forces the full 
+	 mapping in update_control_fold().
+	 
+	 @param [in] *dither Dither for each mode (virt_nact), or NULL to stop dithering
+	 */
+	int set_dither(const gsl_vector_float *const dither);
 
 	// To be implemented by derived classes:
 	virtual int actuate(const bool block=false) = 0; //!< Send actuation signal to hardware
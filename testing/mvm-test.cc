@@ -0,0 +1,261 @@
+/*
+ mvm-test.cc -- test and benchmark Mvm against gsl_blas_sgemv()
+
+ This file is part of FOAM.
+
+ FOAM is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ FOAM is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FOAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_blas.h>
+
+#include "io.h"
+#include "barrier.h"
+#include "mvm.h"
+
+using namespace std;
+
+// Compare all kernels with gsl_blas_sgemv() for a rows x cols matrix, and
+// report the time per product if bench > 0 (number of repetitions). For 
+// 16-bit storage, compare with the product of the stored (rounded) matrix,
+// and check the rounding error against the float product.
+static int test_mvm(Io &io, Mvm &mvm, const size_t rows, const size_t cols, const int bench, const Mvm::prec_t prec=Mvm::PREC_F32) {
+	int nerr = 0;
+	gsl_matrix_float *mat = gsl_matrix_float_alloc(rows, cols);
+	gsl_vector_float *x = gsl_vector_float_alloc(cols);
+	gsl_vector_float *ref = gsl_vector_float_alloc(rows);
+	gsl_vector_float *y = gsl_vector_float_alloc(rows);
+
+	for (size_t i=0; i<rows; i++)
+		for (size_t j=0; j<cols; j++)
+			gsl_matrix_float_set(mat, i, j, (float) (drand48() - 0.5));
+	for (size_t j=0; j<cols; j++)
+		gsl_vector_float_set(x, j, (float) (drand48() - 0.5));
+
+	// As Shwfs::comp_ctrlcmd(): y = -1 * mat . x
+	gsl_blas_sgemv(CblasNoTrans, -1.0, mat, x, 0.0, ref);
+	Mvm::matrix_t A(mat, -1.0, false, prec);
+
+	// Product of the stored matrix, and its deviation from the float product
+	vector<double> qref(rows);
+	double qerr = 0, rms = 0;
+	for (size_t i=0; i<rows; i++) {
+		for (size_t j=0; j<cols; j++)
+			qref[i] += (double) A.get(i, j) * gsl_vector_float_get(x, j);
+		qerr += pow(qref[i] - gsl_vector_float_get(ref, i), 2);
+		rms += pow(gsl_vector_float_get(ref, i), 2);
+	}
+	const double maxqerr[Mvm::NPREC] = {1e-5, 1e-3, 1e-4};
+	if (rms > 0 && sqrt(qerr / rms) > maxqerr[prec]) {
+		io.msg(IO_ERR, "%s storage: %zu x %zu: relative error %g > %g", Mvm::prec_str(prec), rows, cols, sqrt(qerr / rms), maxqerr[prec]);
+		nerr++;
+	}
+
+	int64_t t0 = mono_ns();
+	for (int b=0; b<bench; b++)
+		gsl_blas_sgemv(CblasNoTrans, -1.0, mat, x, 0.0, ref);
+	if (bench)
+		io.msg(IO_INFO, "%5zu x %5zu gsl_blas_sgemv: %8.1f us", rows, cols, (mono_ns() - t0) / 1e3 / bench);
+
+	for (int s=Mvm::SIMD_NONE; s<=Mvm::SIMD_AVX512; s++) {
+		if (!mvm.set_simd((Mvm::simd_t) s))
+			continue;
+		gsl_vector_float_set_all(y, 1e9);
+		mvm.apply(A, x, y);
+		// Different summation order, error grows with sqrt(cols)
+		const double tol = 1e-5 * sqrt((double) cols);
+		for (size_t i=0; i<rows; i++) {
+			if (fabs(gsl_vector_float_get(y, i) - qref[i]) > tol) {
+				io.msg(IO_ERR, "%s kernel (%s): %zu x %zu: row %zu: %g != %g", Mvm::simd_str((Mvm::simd_t) s), Mvm::prec_str(prec), rows, cols, i, gsl_vector_float_get(y, i), qref[i]);
+				nerr++;
+			}
+		}
+
+		t0 = mono_ns();
+		for (int b=0; b<bench; b++)
+			mvm.apply(A, x, y);
+		if (bench)
+			io.msg(IO_INFO, "%5zu x %5zu Mvm %-6s %s (%d thr): %8.1f us", rows, cols, Mvm::simd_str((Mvm::simd_t) s), Mvm::prec_str(prec), mvm.get_nthread(), (mono_ns() - t0) / 1e3 / bench);
+	}
+	mvm.set_simd(Mvm::SIMD_AUTO);
+
+	// Size mismatch is rejected
+	if (mvm.apply(A, ref, y) && rows != cols) {
+		io.msg(IO_ERR, "Mvm::apply() accepted x of size %zu for %zu columns", ref->size, cols);
+		nerr++;
+	}
+
+	gsl_matrix_float_free(mat);
+	gsl_vector_float_free(x);
+	gsl_vector_float_free(ref);
+	gsl_vector_float_free(y);
+	return nerr;
+}
+
+// Sparse products of a matrix with localized rows (Gaussian around the 
+// diagonal plus a small noise floor): all kernels against the product of the
+// stored matrix, and the error of the thresholded matrix against the dense 
+// product. Report timing of dense and sparse products if bench > 0.
+static int test_sparse(Io &io, Mvm &mvm, const size_t rows, const size_t cols, const double thresh, const int bench) {
+	int nerr = 0;
+	gsl_matrix_float *mat = gsl_matrix_float_alloc(rows, cols);
+	gsl_vector_float *x = gsl_vector_float_alloc(cols);
+	gsl_vector_float *ref = gsl_vector_float_alloc(rows);
+	gsl_vector_float *y = gsl_vector_float_alloc(rows);
+
+	for (size_t i=0; i<rows; i++) {
+		for (size_t j=0; j<cols; j++) {
+			const double d = ((double) j / cols - (double) i / rows) / 0.02;
+			gsl_matrix_float_set(mat, i, j, (float) (exp(-d*d) + 1e-4 * (drand48() - 0.5)));
+		}
+	}
+	for (size_t j=0; j<cols; j++)
+		gsl_vector_float_set(x, j, (float) (drand48() - 0.5));
+
+	gsl_blas_sgemv(CblasNoTrans, -1.0, mat, x, 0.0, ref);
+	Mvm::matrix_t D(mat, -1.0);
+	Mvm::sparse_t A(mat, thresh, -1.0);
+
+	// Without threshold, only all-zero blocks may be dropped
+	if (thresh == 0) {
+		for (size_t i=0; i<rows; i++)
+			for (size_t j=0; j<cols; j++)
+				if (A.get(i, j) != -gsl_matrix_float_get(mat, i, j)) {
+					io.msg(IO_ERR, "sparse %zu x %zu: element (%zu, %zu) %g != %g", rows, cols, i, j, A.get(i, j), -gsl_matrix_float_get(mat, i, j));
+					nerr++;
+					i = rows;
+					break;
+				}
+	}
+
+	vector<double> qref(rows);
+	double qerr = 0, rms = 0;
+	for (size_t i=0; i<rows; i++) {
+		for (size_t j=0; j<cols; j++)
+			qref[i] += (double) A.get(i, j) * gsl_vector_float_get(x, j);
+		qerr += pow(qref[i] - gsl_vector_float_get(ref, i), 2);
+		rms += pow(gsl_vector_float_get(ref, i), 2);
+	}
+	io.msg(IO_INFO, "sparse %zu x %zu: threshold %g: fill %.3f, relative error %.3g", rows, cols, thresh, A.fill(), sqrt(qerr / rms));
+	if (sqrt(qerr / rms) > 10 * thresh + 1e-5) {
+		io.msg(IO_ERR, "sparse %zu x %zu: relative error %g too large for threshold %g", rows, cols, sqrt(qerr / rms), thresh);
+		nerr++;
+	}
+	if (thresh > 0 && A.fill() > 0.5) {
+		io.msg(IO_ERR, "sparse %zu x %zu: fill %g, expected < 0.5", rows, cols, A.fill());
+		nerr++;
+	}
+
+	for (int s=Mvm::SIMD_NONE; s<=Mvm::SIMD_AVX512; s++) {
+		if (!mvm.set_simd((Mvm::simd_t) s))
+			continue;
+		gsl_vector_float_set_all(y, 1e9);
+		mvm.apply(A, x, y);
+		const double tol = 1e-5 * sqrt((double) cols);
+		for (size_t i=0; i<rows; i++) {
+			if (fabs(gsl_vector_float_get(y, i) - qref[i]) > tol) {
+				io.msg(IO_ERR, "%s sparse kernel: %zu x %zu: row %zu: %g != %g", Mvm::simd_str((Mvm::simd_t) s), rows, cols, i, gsl_vector_float_get(y, i), qref[i]);
+				nerr++;
+			}
+		}
+
+		int64_t t0 = mono_ns();
+		for (int b=0; b<bench; b++)
+			mvm.apply(D, x, y);
+		const double tdense = (mono_ns() - t0) / 1e3;
+		t0 = mono_ns();
+		for (int b=0; b<bench; b++)
+			mvm.apply(A, x, y);
+		if (bench)
+			io.msg(IO_INFO, "%5zu x %5zu Mvm %-6s (%d thr): dense %8.1f us, sparse %8.1f us", rows, cols, Mvm::simd_str((Mvm::simd_t) s), mvm.get_nthread(), tdense / bench, (mono_ns() - t0) / 1e3 / bench);
+	}
+	mvm.set_simd(Mvm::SIMD_AUTO);
+
+	gsl_matrix_float_free(mat);
+	gsl_vector_float_free(x);
+	gsl_vector_float_free(ref);
+	gsl_vector_float_free(y);
+	return nerr;
+}
+
+// Half precision conversion: exact for representable values, rounding to 
+// nearest even, subnormals, overflow
+static int test_half(Io &io) {
+	int nerr = 0;
+	const float vals[] = {0.0f, 1.0f, -2.5f, 65504.0f, 6.103515625e-05f, 5.9604644775390625e-08f, 1.0f + 1.0f/1024};
+	for (size_t i=0; i<sizeof vals / sizeof *vals; i++) {
+		if (Mvm::half2float(Mvm::float2half(vals[i])) != vals[i]) {
+			io.msg(IO_ERR, "half: %g -> %g", vals[i], Mvm::half2float(Mvm::float2half(vals[i])));
+			nerr++;
+		}
+	}
+	// 1 + 2^-11 is halfway between 1 and the next half, rounds to even (1)
+	if (Mvm::float2half(1.0f + 1.0f/2048) != 0x3c00 || Mvm::float2half(1.0f + 3.0f/2048) != 0x3c02) {
+		io.msg(IO_ERR, "half: round to nearest even failed");
+		nerr++;
+	}
+	if (Mvm::float2half(1e6f) != 0x7c00 || Mvm::float2half(-1e-9f) != 0x8000) {
+		io.msg(IO_ERR, "half: overflow or underflow failed");
+		nerr++;
+	}
+	// All halfs survive the round trip
+	for (uint32_t h=0; h<0x7c00; h++) {
+		if (Mvm::float2half(Mvm::half2float((uint16_t) h)) != h) {
+			io.msg(IO_ERR, "half: round trip 0x%04x -> 0x%04x", h, Mvm::float2half(Mvm::half2float((uint16_t) h)));
+			nerr++;
+			break;
+		}
+	}
+	return nerr;
+}
+
+int main(int argc, char **) {
+	Io io(3);
+	int nerr = 0;
+	// Run benchmark with any argument
+	const int bench = argc > 1 ? 200 : 0;
+
+	io.msg(IO_INFO, "Best MVM kernel on this CPU: %s", Mvm::simd_str(Mvm::detect_simd()));
+	nerr += test_half(io);
+
+	srand48(1);
+	const int nthr[2] = {1, 3};
+	for (int t=0; t<2; t++) {
+		Mvm mvm(io, nthr[t]);
+		// Sizes not matching the padding, small (single thread) and large
+		nerr += test_mvm(io, mvm, 1, 1, 0);
+		nerr += test_mvm(io, mvm, 37, 130, bench);
+		nerr += test_mvm(io, mvm, 97, 2*144, bench);
+		nerr += test_mvm(io, mvm, 1021, 2*1600+6, bench);
+		nerr += test_mvm(io, mvm, 3000, 2*3000, bench / 10);
+		for (int p=Mvm::PREC_F16; p<Mvm::NPREC; p++) {
+			nerr += test_mvm(io, mvm, 37, 130, 0, (Mvm::prec_t) p);
+			nerr += test_mvm(io, mvm, 1021, 2*1600+6, bench, (Mvm::prec_t) p);
+		}
+		nerr += test_sparse(io, mvm, 37, 130, 0, 0);
+		nerr += test_sparse(io, mvm, 97, 2*144, 1e-3, 0);
+		nerr += test_sparse(io, mvm, 1021, 2*1600+6, 1e-3, bench);
+	}
+
+	if (nerr) {
+		io.msg(IO_ERR, "Mvm: %d errors", nerr);
+		return 1;
+	}
+	io.msg(IO_INFO, "Mvm: all ok");
+	return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ pinv-test.cc -- test and benchmark Pinv against gsl_linalg_SV_decomp()
+
+ This file is part of FOAM.
+
+ FOAM is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ FOAM is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FOAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_linalg.h>
+
+#include "io.h"
+#include "barrier.h"
+#include "pinv.h"
+
+using namespace std;
+
+// Apply reflection (I - 2 v v^T) for unit vector v to the rows (left) or
+// columns (right) of A
+static void reflect(gsl_matrix *A, const vector<double> &v, const bool left) {
+	const size_t len = left ? A->size1 : A->size2, other = left ? A->size2 : A->size1;
+	for (size_t k=0; k<other; k++) {
+		double d = 0;
+		for (size_t i=0; i<len; i++)
+			d += v[i] * (left ? gsl_matrix_get(A, i, k) : gsl_matrix_get(A, k, i));
+		for (size_t i=0; i<len; i++) {
+			double *e = left ? gsl_matrix_ptr(A, i, k) : gsl_matrix_ptr(A, k, i);
+			*e -= 2 * d * v[i];
+		}
+	}
+}
+
+static vector<double> unitvec(const size_t n) {
+	vector<double> v(n);
+	double norm = 0;
+	for (size_t i=0; i<n; i++) {
+		v[i] = drand48() - 0.5;
+		norm += v[i] * v[i];
+	}
+	for (size_t i=0; i<n; i++)
+		v[i] /= sqrt(norm);
+	return v;
+}
+
+// Decompose an m x n matrix with known singular values (spanning 'cond',
+// the last 'nzero' are zero) and check s, orthogonality of U and V, U S V^T
+// = A and the pseudo-inverse. Compare the time with gsl_linalg_SV_decomp()
+// if bench.
+static int test_svd(Io &io, Pinv &pinv, const size_t m, const size_t n, const double cond, const size_t nzero, const bool bench) {
+	int nerr = 0;
+	gsl_matrix *A = gsl_matrix_calloc(m, n);
+	gsl_matrix *U = gsl_matrix_alloc(m, n);
+	gsl_vector *s = gsl_vector_alloc(n);
+	gsl_matrix *V = gsl_matrix_alloc(n, n);
+	gsl_matrix *X = gsl_matrix_alloc(n, m);
+
+	// A = H1 H2 [S; 0] H3 H4, singular values S geometrically from 1 to 1/cond
+	vector<double> s0(n, 0.0);
+	for (size_t j=0; j+nzero<n; j++) {
+		s0[j] = pow(cond, -(double) j / std::max(n - nzero - 1, (size_t) 1));
+		gsl_matrix_set(A, j, j, s0[j]);
+	}
+	reflect(A, unitvec(m), true);
+	reflect(A, unitvec(m), true);
+	reflect(A, unitvec(n), false);
+	reflect(A, unitvec(n), false);
+
+	double t0 = mono_ns() * 1e-9;
+	int ret = pinv.svd(A, U, s, V);
+	const double t_pinv = mono_ns() * 1e-9 - t0;
+	if (ret) {
+		io.msg(IO_ERR, "svd %zu x %zu: Pinv::svd() returned %d", m, n, ret);
+		nerr++;
+	}
+
+	// Singular values, relative to the largest
+	double serr = 0;
+	for (size_t j=0; j<n; j++)
+		serr = std::max(serr, fabs(gsl_vector_get(s, j) - s0[j]));
+
+	// U^T U = I, V^T V = I (for nonzero s)
+	double uerr = 0, verr = 0;
+	for (size_t a=0; a<n; a++) {
+		for (size_t b=a; b<n; b++) {
+			double du = 0, dv = 0;
+			for (size_t i=0; i<m; i++)
+				du += gsl_matrix_get(U, i, a) * gsl_matrix_get(U, i, b);
+			for (size_t i=0; i<n; i++)
+				dv += gsl_matrix_get(V, i, a) * gsl_matrix_get(V, i, b);
+			uerr = std::max(uerr, fabs(du - (a == b)));
+			if (b < n - nzero)
+				verr = std::max(verr, fabs(dv - (a == b)));
+		}
+	}
+
+	// U S V^T = A
+	double aerr = 0;
+	for (size_t i=0; i<m; i++) {
+		for (size_t j=0; j<n; j++) {
+			double d = 0;
+			for (size_t k=0; k<n; k++)
+				d += gsl_matrix_get(U, i, k) * gsl_vector_get(s, k) * gsl_matrix_get(V, j, k);
+			aerr = std::max(aerr, fabs(d - gsl_matrix_get(A, i, j)));
+		}
+	}
+
+	// X A = I on the range of A: check with the nonzero modes only
+	t0 = mono_ns() * 1e-9;
+	pinv.pinv(U, s, V, n - nzero, X);
+	const double t_x = mono_ns() * 1e-9 - t0;
+	double xerr = 0;
+	if (nzero == 0) {
+		for (size_t i=0; i<n; i++) {
+			for (size_t j=0; j<n; j++) {
+				double d = 0;
+				for (size_t k=0; k<m; k++)
+					d += gsl_matrix_get(X, i, k) * gsl_matrix_get(A, k, j);
+				xerr = std::max(xerr, fabs(d - (i == j)));
+			}
+		}
+	}
+
+	io.msg(IO_INFO, "svd %zu x %zu (cond %g, %zu zero): %d sweeps, err s %.2g, U %.2g, V %.2g, USV^T %.2g, pinv %.2g",
+				 m, n, cond, nzero, pinv.get_sweeps(), serr, uerr, verr, aerr, xerr);
+	if (serr > 1e-12 || uerr > 1e-10 || verr > 1e-10 || aerr > 1e-12 || xerr > 1e-12 * cond * m) {
+		io.msg(IO_ERR, "svd %zu x %zu: error too large", m, n);
+		nerr++;
+	}
+
+	if (bench) {
+		// Reference: GSL Golub-Kahan on one thread, as Shwfs::calc_actmat() did
+		gsl_matrix *Ug = gsl_matrix_alloc(m, n);
+		gsl_vector *work = gsl_vector_alloc(n);
+		gsl_matrix_memcpy(Ug, A);
+		t0 = mono_ns() * 1e-9;
+		gsl_linalg_SV_decomp(Ug, V, s, work);
+		const double t_gsl = mono_ns() * 1e-9 - t0;
+		io.msg(IO_INFO, "svd %zu x %zu: Pinv %d threads: %.3f s (+ %.3f s pinv), GSL: %.3f s, speedup %.1f",
+					 m, n, pinv.get_nthread(), t_pinv, t_x, t_gsl, t_gsl / t_pinv);
+		gsl_matrix_free(Ug);
+		gsl_vector_free(work);
+	}
+
+	gsl_matrix_free(A);
+	gsl_matrix_free(U);
+	gsl_vector_free(s);
+	gsl_matrix_free(V);
+	gsl_matrix_free(X);
+	return nerr;
+}
+
+int main(int argc, char **) {
+	Io io(3);
+	int nerr = 0;
+	// Run benchmark with any argument
+	const bool bench = argc > 1;
+
+	srand48(1);
+	const int nthr[2] = {1, 3};
+	for (int t=0; t<2; t++) {
+		Pinv pinv(io, nthr[t]);
+		// Small and odd sizes, rank deficient, and typical influence matrices
+		nerr += test_svd(io, pinv, 1, 1, 1, 0, false);
+		nerr += test_svd(io, pinv, 5, 5, 1e3, 0, false);
+		nerr += test_svd(io, pinv, 130, 37, 1e4, 0, bench);
+		nerr += test_svd(io, pinv, 130, 37, 1e2, 3, false);
+		nerr += test_svd(io, pinv, 2*144, 97, 1e6, 0, bench);
+		nerr += test_svd(io, pinv, 2*500, 301, 1e4, 0, bench);
+		if (bench) {
+			nerr += test_svd(io, pinv, 2*1000, 500, 1e4, 0, bench);
+			nerr += test_svd(io, pinv, 2*2000, 1000, 1e4, 0, bench);
+		}
+	}
+
+	if (nerr) {
+		io.msg(IO_ERR, "Pinv: %d errors", nerr);
+		return 1;
+	}
+	io.msg(IO_INFO, "Pinv: all ok");
+	return 0;
+}
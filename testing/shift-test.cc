@@ -0,0 +1,552 @@
+/*
+ shift-test.cc -- test Shift CoG kernels and methods
+
+ This file is part of FOAM.
+
+ FOAM is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ FOAM is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FOAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+
+#include "io.h"
+#include "types.h"
+#include "utils.h"
+#include "shift.h"
+
+using namespace std;
+
+// Reference CoG calculation in double precision, as in the original scalar code
+template <typename T> static void ref_cog(const T *img, const coord_t &res, const vector_t &crop, const fcoord_t maxshift, float *v, const T mini) {
+	double sx=0, sy=0, sum=0;
+	for (int j=crop.ly; j<crop.ty; j++) {
+		for (int i=crop.lx; i<crop.tx; i++) {
+			T p = img[j*res.x + i];
+			if (p < mini)
+				continue;
+			const double f = p-mini;
+			sx += f * i;
+			sy += f * j;
+			sum += f;
+		}
+	}
+	if (sum <= 0) {
+		v[0] = v[1] = 0.0;
+		return;
+	}
+	v[0] = clamp((float) (sx/sum - crop.lx - (crop.tx - crop.lx)/2), -maxshift.x, maxshift.x);
+	v[1] = clamp((float) (sy/sum - crop.ly - (crop.ty - crop.ly)/2), -maxshift.y, maxshift.y);
+}
+
+template <typename T> static int test_kernels(Io &io, Shift &shifts, const T maxval) {
+	const coord_t res(300, 300);
+	const fcoord_t maxshift(100, 100);
+	int nerr = 0;
+
+	vector<T> img(res.x * res.y);
+	for (size_t i=0; i<img.size(); i++)
+		img[i] = (T) (drand48() * maxval);
+
+	// Crop fields of varying (odd) sizes, including one wider than the SIMD block
+	vector<vector_t> crops;
+	for (int n=0; n<40; n++) {
+		int w = 1 + (int) (drand48() * 47), h = 1 + (int) (drand48() * 47);
+		int lx = (int) (drand48() * (res.x - w)), ly = (int) (drand48() * (res.y - h));
+		crops.push_back(vector_t(lx, ly, lx+w, ly+h));
+	}
+	crops.push_back(vector_t(0, 0, res.x, 20));
+	crops.push_back(vector_t(10, 10, 10, 10));
+	// Fixed-width kernels, including one taller than the row block
+	for (int w=8; w<=32; w+=8) {
+		crops.push_back(vector_t(3*w, 40, 4*w, 40+w));
+		crops.push_back(vector_t(5*w, 100, 6*w, 100+w/2+1));
+	}
+	crops.push_back(vector_t(200, 0, 216, res.y));
+
+	gsl_vector_float *ref = gsl_vector_float_calloc(crops.size()*2);
+	gsl_vector_float *out = gsl_vector_float_calloc(crops.size()*2);
+
+	T minis[3] = {0, (T) (maxval/4), (T) (maxval/2)};
+	for (int m=0; m<3; m++) {
+		shifts.set_simd(Shift::SIMD_NONE);
+		shifts.calc_shifts(&img[0], res, crops, maxshift, ref, Shift::COG, true, minis[m]);
+
+		// Scalar kernel versus double precision reference
+		for (size_t c=0; c<crops.size(); c++) {
+			float v[2];
+			ref_cog(&img[0], res, crops[c], maxshift, v, minis[m]);
+			for (int k=0; k<2; k++) {
+				if (fabs(v[k] - gsl_vector_float_get(ref, c*2+k)) > 1e-4) {
+					io.msg(IO_ERR, "scalar kernel (%zu bit): crop %zu, mini %g: %g != %g", sizeof(T)*8, c, (double) minis[m], gsl_vector_float_get(ref, c*2+k), v[k]);
+					nerr++;
+				}
+			}
+		}
+
+		// SIMD kernels versus scalar kernel: should be bit-exact
+		for (int s=Shift::SIMD_SSE4; s<=Shift::SIMD_AVX512; s++) {
+			if (!shifts.set_simd((Shift::simd_t) s))
+				continue;
+			gsl_vector_float_set_all(out, -1.0);
+			shifts.set_layout(crops, res);
+			shifts.calc_shifts(&img[0], maxshift, out, Shift::COG, true, minis[m]);
+			for (size_t i=0; i<out->size; i++) {
+				if (gsl_vector_float_get(out, i) != gsl_vector_float_get(ref, i)) {
+					io.msg(IO_ERR, "%s kernel (%zu bit): element %zu, mini %g: %g != %g", Shift::simd_str((Shift::simd_t) s), sizeof(T)*8, i, (double) minis[m], gsl_vector_float_get(out, i), gsl_vector_float_get(ref, i));
+					nerr++;
+				}
+			}
+		}
+	}
+
+	// A crop field outside the image is refused, and the old layout is kept
+	vector<vector_t> bad(1, vector_t(res.x - 4, 0, res.x + 4, 8));
+	if (shifts.set_layout(bad, res) != -1 || shifts.calc_shifts(&img[0], res, bad, maxshift, out) ||
+			shifts.get_layout().n != (int) crops.size()) {
+		io.msg(IO_ERR, "Shift: crop field outside image accepted");
+		nerr++;
+	}
+	
+	// Spot metrics: shifts should be identical, metrics as calculated directly
+	gsl_vector_float *stats = gsl_vector_float_calloc(crops.size()*Shift::NSTAT);
+	shifts.set_layout(crops, res);
+	shifts.set_satlevel(maxval - 10);
+	gsl_vector_float_set_all(out, -1.0);
+	shifts.calc_shifts(&img[0], maxshift, out, Shift::COG, true, minis[2], stats);
+	for (size_t c=0; c<crops.size(); c++) {
+		double sum=0;
+		T peak=0;
+		int nsat=0;
+		for (int j=crops[c].ly; j<crops[c].ty; j++) {
+			for (int i=crops[c].lx; i<crops[c].tx; i++) {
+				T p = img[j*res.x + i];
+				peak = max(peak, p);
+				nsat += (p >= maxval - 10);
+				if (p >= minis[2])
+					sum += p - minis[2];
+			}
+		}
+		double expect[3] = {sum, (double) peak, (double) nsat};
+		for (int k=0; k<3; k++) {
+			if (fabs(gsl_vector_float_get(stats, c*Shift::NSTAT + k) - expect[k]) > 1e-6 * expect[k]) {
+				io.msg(IO_ERR, "spot metric %d: crop %zu: %g != %g", k, c, gsl_vector_float_get(stats, c*Shift::NSTAT + k), expect[k]);
+				nerr++;
+			}
+		}
+		for (int k=0; k<2; k++) {
+			if (gsl_vector_float_get(out, c*2+k) != gsl_vector_float_get(ref, c*2+k)) {
+				io.msg(IO_ERR, "spot metrics: crop %zu: shift %g != %g", c, gsl_vector_float_get(out, c*2+k), gsl_vector_float_get(ref, c*2+k));
+				nerr++;
+			}
+		}
+	}
+	shifts.set_satlevel(0);
+	gsl_vector_float_free(stats);
+	
+	// Asynchronous calculation and explicit job chunk sizes should give the same result
+	shifts.set_layout(crops, res);
+	int chunks[3] = {0, 1, 7};
+	for (int c=0; c<3; c++) {
+		shifts.set_chunk(chunks[c]);
+		gsl_vector_float_set_all(out, -1.0);
+		shifts.calc_shifts(&img[0], maxshift, out, Shift::COG, false, minis[2]);
+		shifts.wait();
+		for (size_t i=0; i<out->size; i++) {
+			if (gsl_vector_float_get(out, i) != gsl_vector_float_get(ref, i)) {
+				io.msg(IO_ERR, "async (chunk %d): element %zu: %g != %g", chunks[c], i, gsl_vector_float_get(out, i), gsl_vector_float_get(ref, i));
+				nerr++;
+			}
+		}
+	}
+	shifts.set_chunk(0);
+	
+	// Several jobs in flight with separate buffers, the second image is the 
+	// first mirrored such that the results differ
+	vector<T> img2(img.rbegin(), img.rend());
+	vector<gsl_vector_float *> outs;
+	vector<Shift::handle_t> handles;
+	for (int j=0; j<2*Shift::NSLOT; j++) {
+		outs.push_back(gsl_vector_float_calloc(crops.size()*2));
+		handles.push_back(shifts.submit(j%2 ? &img2[0] : &img[0], maxshift, outs[j], Shift::COG, minis[2]));
+	}
+	gsl_vector_float *ref2 = gsl_vector_float_calloc(crops.size()*2);
+	shifts.calc_shifts(&img2[0], maxshift, ref2, Shift::COG, true, minis[2]);
+	for (int j=0; j<2*Shift::NSLOT; j++) {
+		shifts.wait(handles[j]);
+		if (!shifts.done(handles[j])) {
+			io.msg(IO_ERR, "async: job %d not done after wait()", j);
+			nerr++;
+		}
+		for (size_t i=0; i<out->size; i++) {
+			if (gsl_vector_float_get(outs[j], i) != gsl_vector_float_get(j%2 ? ref2 : ref, i)) {
+				io.msg(IO_ERR, "async (job %d): element %zu: %g != %g", j, i, gsl_vector_float_get(outs[j], i), gsl_vector_float_get(j%2 ? ref2 : ref, i));
+				nerr++;
+			}
+		}
+		gsl_vector_float_free(outs[j]);
+	}
+	
+	// Batch of frames: each row as calculated for a single frame
+	const int nframes = 5;
+	vector<const T *> frames;
+	for (int k=0; k<nframes; k++)
+		frames.push_back(k%2 ? &img2[0] : &img[0]);
+	gsl_matrix_float *bshifts = gsl_matrix_float_calloc(nframes, crops.size()*2);
+	gsl_matrix_float *bstats = gsl_matrix_float_calloc(nframes, crops.size()*Shift::NSTAT);
+	gsl_vector_float *stats1 = gsl_vector_float_calloc(crops.size()*Shift::NSTAT);
+	shifts.calc_shifts(&img2[0], maxshift, ref2, Shift::COG, true, minis[2], stats1);
+	for (int c=0; c<3; c++) {
+		shifts.set_chunk(chunks[c]);
+		gsl_matrix_float_set_all(bshifts, -1.0);
+		if (!shifts.calc_shifts_batch(&frames[0], nframes, maxshift, bshifts, Shift::COG, minis[2], bstats)) {
+			io.msg(IO_ERR, "batch: calc_shifts_batch() failed");
+			nerr++;
+		}
+		for (int k=0; k<nframes; k++) {
+			for (size_t i=0; i<out->size; i++) {
+				if (gsl_matrix_float_get(bshifts, k, i) != gsl_vector_float_get(k%2 ? ref2 : ref, i)) {
+					io.msg(IO_ERR, "batch (chunk %d): frame %d, element %zu: %g != %g", chunks[c], k, i, gsl_matrix_float_get(bshifts, k, i), gsl_vector_float_get(k%2 ? ref2 : ref, i));
+					nerr++;
+				}
+			}
+			for (size_t i=0; k%2 && i<stats1->size; i++) {
+				if (gsl_matrix_float_get(bstats, k, i) != gsl_vector_float_get(stats1, i)) {
+					io.msg(IO_ERR, "batch (chunk %d): frame %d, metric %zu: %g != %g", chunks[c], k, i, gsl_matrix_float_get(bstats, k, i), gsl_vector_float_get(stats1, i));
+					nerr++;
+				}
+			}
+		}
+	}
+	shifts.set_chunk(0);
+	// Output too small for the layout
+	if (shifts.submit_batch(&frames[0], nframes+1, maxshift, bshifts) != -1) {
+		io.msg(IO_ERR, "batch: accepted %d frames for a %zu row matrix", nframes+1, bshifts->size1);
+		nerr++;
+	}
+	gsl_vector_float_free(stats1);
+	gsl_matrix_float_free(bstats);
+	gsl_matrix_float_free(bshifts);
+	gsl_vector_float_free(ref2);
+
+	gsl_vector_float_free(ref);
+	gsl_vector_float_free(out);
+	return nerr;
+}
+
+// CoG variants: Gaussian spots with known offsets in 16x16 subimages on a 
+// constant background
+static int test_cogmodes(Io &io, Shift &shifts) {
+	const coord_t res(128, 32);
+	const fcoord_t maxshift(8, 8);
+	const int nsi = 8;
+	const uint16_t bg = 100;
+	int nerr = 0;
+	
+	vector<uint16_t> img(res.x * res.y, bg);
+	vector<vector_t> crops;
+	float off[nsi][2];
+	for (int n=0; n<nsi; n++) {
+		off[n][0] = (float) (drand48() * 4 - 2);
+		off[n][1] = (float) (drand48() * 4 - 2);
+		crops.push_back(vector_t(n*16, 8, n*16+16, 24));
+		for (int y=0; y<16; y++) {
+			for (int x=0; x<16; x++) {
+				double r2 = pow(x - 8 - off[n][0], 2) + pow(y - 8 - off[n][1], 2);
+				img[(8+y)*res.x + n*16+x] += (uint16_t) (10000 * exp(-r2 / (2*1.5*1.5)));
+			}
+		}
+	}
+	
+	gsl_vector_float *out = gsl_vector_float_calloc(nsi*2);
+	shifts.set_layout(crops, res);
+	shifts.set_cog_window(8);
+	shifts.set_cog_niter(3);
+	
+	// Windowed CoG follows the spot, so the second frame is centered on it
+	Shift::method_t meths[3] = {Shift::COG_WINDOW, Shift::COG_WINDOW, Shift::COG_ITER};
+	for (int m=0; m<3; m++) {
+		shifts.calc_shifts(&img[0], maxshift, out, meths[m], true, bg);
+		if (m == 0)
+			continue;
+		for (int n=0; n<nsi; n++) {
+			for (int k=0; k<2; k++) {
+				if (fabs(gsl_vector_float_get(out, n*2+k) - off[n][k]) > 0.05) {
+					io.msg(IO_ERR, "cog method %d: subimage %d: %g != %g", meths[m], n, gsl_vector_float_get(out, n*2+k), off[n][k]);
+					nerr++;
+				}
+			}
+		}
+	}
+	
+	// Second-moment width should match the spot sigma
+	gsl_vector_float *stats = gsl_vector_float_calloc(nsi*Shift::NSTAT);
+	shifts.calc_shifts(&img[0], maxshift, out, Shift::COG, true, bg, stats);
+	for (int n=0; n<nsi; n++) {
+		if (fabs(gsl_vector_float_get(stats, n*Shift::NSTAT + Shift::STAT_WIDTH) - 1.5) > 0.05) {
+			io.msg(IO_ERR, "spot width: subimage %d: %g != 1.5", n, gsl_vector_float_get(stats, n*Shift::NSTAT + Shift::STAT_WIDTH));
+			nerr++;
+		}
+	}
+	gsl_vector_float_free(stats);
+	
+	// Weighted CoG versus direct calculation
+	const double sigma = 3.0;
+	shifts.set_cog_sigma(sigma);
+	shifts.calc_shifts(&img[0], maxshift, out, Shift::COG_WEIGHT, true, bg);
+	for (int n=0; n<nsi; n++) {
+		double sx=0, sy=0, sum=0;
+		for (int y=0; y<16; y++) {
+			for (int x=0; x<16; x++) {
+				double f = (img[(8+y)*res.x + n*16+x] - bg) * exp(-(pow(x - 8, 2) + pow(y - 8, 2)) / (2*sigma*sigma));
+				sx += f*x;
+				sy += f*y;
+				sum += f;
+			}
+		}
+		const double ref[2] = {sx/sum - 8, sy/sum - 8};
+		for (int k=0; k<2; k++) {
+			if (fabs(gsl_vector_float_get(out, n*2+k) - ref[k]) > 1e-3) {
+				io.msg(IO_ERR, "cog method %d: subimage %d: %g != %g", Shift::COG_WEIGHT, n, gsl_vector_float_get(out, n*2+k), ref[k]);
+				nerr++;
+			}
+		}
+	}
+	shifts.set_cog_sigma(0);
+	
+	gsl_vector_float_free(out);
+	return nerr;
+}
+
+// Worker sizing and pinning: pinned workers should give the same results
+static int test_topology(Io &io, Shift &ref) {
+	int nerr = 0;
+	
+	int expect[5] = {0, 2, 3, 4, 7};
+	vector<int> cpus = Shift::parse_cpus("0,2-4 7");
+	if (cpus.size() != 5 || !equal(cpus.begin(), cpus.end(), expect)) {
+		io.msg(IO_ERR, "parse_cpus(): wrong CPU list (%zu CPUs)", cpus.size());
+		nerr++;
+	}
+	if (!Shift::parse_cpus("1,x").empty() || !Shift::parse_cpus("3-1").empty()) {
+		io.msg(IO_ERR, "parse_cpus(): invalid list accepted");
+		nerr++;
+	}
+	
+	Shift shifts(io, 0);
+	if (shifts.get_nworker() != Shift::auto_workers()) {
+		io.msg(IO_ERR, "auto workers: %d != %d", shifts.get_nworker(), Shift::auto_workers());
+		nerr++;
+	}
+#ifdef __linux__
+	if (!shifts.set_affinity(vector<int>(1, 0))) {
+		io.msg(IO_ERR, "set_affinity(0) failed");
+		nerr++;
+	}
+#endif
+	
+	const coord_t res(64, 64);
+	vector<uint8_t> img(res.x * res.y);
+	for (size_t i=0; i<img.size(); i++)
+		img[i] = (uint8_t) (drand48() * 255);
+	vector<vector_t> crops;
+	for (int n=0; n<16; n++)
+		crops.push_back(vector_t((n%4)*16, (n/4)*16, (n%4)*16+16, (n/4)*16+16));
+	
+	gsl_vector_float *out = gsl_vector_float_alloc(crops.size()*2);
+	gsl_vector_float *refout = gsl_vector_float_calloc(crops.size()*2);
+	gsl_vector_float_set_all(out, -1.0);
+	shifts.set_layout(crops, res);
+	shifts.first_touch(out);
+	for (size_t i=0; i<out->size; i++) {
+		if (gsl_vector_float_get(out, i) != 0.0) {
+			io.msg(IO_ERR, "first_touch(): element %zu not zeroed", i);
+			nerr++;
+		}
+	}
+	
+	ref.set_layout(crops, res);
+	ref.calc_shifts(&img[0], fcoord_t(8, 8), refout);
+	shifts.calc_shifts(&img[0], fcoord_t(8, 8), out);
+	for (size_t i=0; i<out->size; i++) {
+		if (gsl_vector_float_get(out, i) != gsl_vector_float_get(refout, i)) {
+			io.msg(IO_ERR, "pinned: element %zu: %g != %g", i, gsl_vector_float_get(out, i), gsl_vector_float_get(refout, i));
+			nerr++;
+		}
+	}
+	
+	gsl_vector_float_free(out);
+	gsl_vector_float_free(refout);
+	return nerr;
+}
+
+// Fused reconstruction: act = -mat . (shifts - ref) computed by the workers
+// should match the product computed afterwards, with several jobs in flight
+static int test_recon(Io &io, Shift &shifts) {
+	const coord_t res(96, 96);
+	const size_t nsi = 36, nact = 37, nframes = 3;
+	int nerr = 0;
+	
+	vector<vector_t> crops;
+	for (size_t n=0; n<nsi; n++)
+		crops.push_back(vector_t((n%6)*16, (n/6)*16, (n%6)*16+16, (n/6)*16+16));
+	shifts.set_layout(crops, res);
+	
+	vector<uint8_t> img[nframes];
+	gsl_vector_float *out[nframes], *act[nframes];
+	for (size_t k=0; k<nframes; k++) {
+		img[k].resize(res.x * res.y);
+		for (size_t i=0; i<img[k].size(); i++)
+			img[k][i] = (uint8_t) (drand48() * 255);
+		out[k] = gsl_vector_float_calloc(nsi*2);
+		act[k] = gsl_vector_float_calloc(nact);
+	}
+	gsl_matrix_float *mat = gsl_matrix_float_alloc(nact, nsi*2);
+	for (size_t i=0; i<nact; i++)
+		for (size_t j=0; j<nsi*2; j++)
+			gsl_matrix_float_set(mat, i, j, (float) (drand48() - 0.5));
+	gsl_vector_float *ref = gsl_vector_float_alloc(nsi*2);
+	for (size_t j=0; j<nsi*2; j++)
+		gsl_vector_float_set(ref, j, (float) (drand48() - 0.5));
+	
+	Mvm mvm(io);
+	
+	const int chunks[Mvm::NPREC] = {1, 0, 3};
+	for (int c=0; c<Mvm::NPREC; c++) {
+		shifts.set_chunk(chunks[c]);
+		// Also reduced precision storage, compared with the stored matrix
+		const Mvm::prec_t prec = (Mvm::prec_t) c;
+		Mvm::matrix_t rec_t(mat, -1.0, true, prec);
+		for (int s=Mvm::SIMD_NONE; s<=Mvm::SIMD_AVX512; s++) {
+			if (!mvm.set_simd((Mvm::simd_t) s))
+				continue;
+			Shift::handle_t h[nframes];
+			for (size_t k=0; k<nframes; k++) {
+				Shift::recon_t recon;
+				recon.mvm = &mvm;
+				recon.rec = &rec_t;
+				recon.ref = ref;
+				recon.act = act[k];
+				gsl_vector_float_set_all(act[k], 1e9);
+				h[k] = shifts.submit(&img[k][0], fcoord_t(8, 8), out[k], Shift::COG, (uint8_t) 0, NULL, &recon);
+			}
+			for (size_t k=0; k<nframes; k++) {
+				shifts.wait(h[k]);
+				for (size_t i=0; i<nact; i++) {
+					double sum = 0;
+					for (size_t j=0; j<nsi*2; j++)
+						sum += rec_t.get(j, i) * (gsl_vector_float_get(out[k], j) - gsl_vector_float_get(ref, j));
+					if (fabs(gsl_vector_float_get(act[k], i) - sum) > 1e-4) {
+						io.msg(IO_ERR, "recon (chunk %d, %s, %s): frame %zu, act %zu: %g != %g", chunks[c], Mvm::simd_str((Mvm::simd_t) s), Mvm::prec_str(prec), k, i, gsl_vector_float_get(act[k], i), sum);
+						nerr++;
+					}
+				}
+			}
+		}
+	}
+	shifts.set_chunk(0);
+	
+	// Reconstructor not matching the layout is rejected
+	Mvm::matrix_t bad(mat, -1.0);
+	Shift::recon_t recon;
+	recon.mvm = &mvm;
+	recon.rec = &bad;
+	recon.act = act[0];
+	if (shifts.submit(&img[0][0], fcoord_t(8, 8), out[0], Shift::COG, (uint8_t) 0, NULL, &recon) != -1) {
+		io.msg(IO_ERR, "recon: accepted %zu x %zu reconstructor for %zu subimages", bad.rows, bad.cols, nsi);
+		nerr++;
+	}
+	
+	for (size_t k=0; k<nframes; k++) {
+		gsl_vector_float_free(out[k]);
+		gsl_vector_float_free(act[k]);
+	}
+	gsl_matrix_float_free(mat);
+	gsl_vector_float_free(ref);
+	return nerr;
+}
+
+#ifdef HAVE_FFTW
+// Cross-correlation: Gaussian spots with known offsets in 16x16 subimages, 
+// using the first (unshifted) subimage as reference.
+static int test_corr(Io &io, Shift &shifts, const Shift::interp_t interp) {
+	const coord_t res(128, 32);
+	const fcoord_t maxshift(8, 8);
+	const int nsi = 8;
+	int nerr = 0;
+	
+	vector<uint16_t> img(res.x * res.y, 0);
+	vector<vector_t> crops;
+	float off[nsi][2];
+	for (int n=0; n<nsi; n++) {
+		off[n][0] = n ? (float) (drand48() * 4 - 2) : 0;
+		off[n][1] = n ? (float) (drand48() * 4 - 2) : 0;
+		crops.push_back(vector_t(n*16, 8, n*16+16, 24));
+		for (int y=0; y<16; y++) {
+			for (int x=0; x<16; x++) {
+				double r2 = pow(x - 8 - off[n][0], 2) + pow(y - 8 - off[n][1], 2);
+				img[(8+y)*res.x + n*16+x] = (uint16_t) (10000 * exp(-r2 / (2*2.0*2.0)));
+			}
+		}
+	}
+	
+	gsl_vector_float *out = gsl_vector_float_calloc(nsi*2);
+	shifts.set_layout(crops, res);
+	shifts.set_corr_ref(0);
+	shifts.set_corr_interp(interp);
+	shifts.calc_shifts(&img[0], maxshift, out, Shift::CORR);
+	
+	for (int n=0; n<nsi; n++) {
+		for (int k=0; k<2; k++) {
+			if (fabs(gsl_vector_float_get(out, n*2+k) - off[n][k]) > 0.15) {
+				io.msg(IO_ERR, "corr (interp %d): subimage %d: %g != %g", interp, n, gsl_vector_float_get(out, n*2+k), off[n][k]);
+				nerr++;
+			}
+		}
+	}
+	gsl_vector_float_free(out);
+	return nerr;
+}
+#endif
+
+int main() {
+	Io io(3);
+	Shift shifts(io, 2);
+	int nerr = 0;
+
+	io.msg(IO_INFO, "Best CoG kernel on this CPU: %s", Shift::simd_str(Shift::detect_simd()));
+
+	srand48(1);
+	nerr += test_kernels<uint8_t>(io, shifts, 255);
+	nerr += test_kernels<uint16_t>(io, shifts, 65535);
+	nerr += test_kernels<uint32_t>(io, shifts, 4000000000U);
+	nerr += test_cogmodes(io, shifts);
+	nerr += test_topology(io, shifts);
+	nerr += test_recon(io, shifts);
+#ifdef HAVE_FFTW
+	nerr += test_corr(io, shifts, Shift::INTERP_PARABOLIC);
+	nerr += test_corr(io, shifts, Shift::INTERP_GAUSSIAN);
+#endif
+
+	if (nerr) {
+		io.msg(IO_ERR, "Shift CoG kernels: %d errors", nerr);
+		return 1;
+	}
+	io.msg(IO_INFO, "Shift CoG kernels: all ok");
+	return 0;
+}